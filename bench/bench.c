@@ -0,0 +1,552 @@
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "machine.h"
+#include "bus.h"
+#include "mmu.h"
+#include "decode.h"
+#include "block.h"
+#include "fpu.h"
+#include "lockstep.h"
+#include "trap.h"
+#include "rv64.h"
+
+/* Micro-benchmarks for the execution engines. Each one is a small RV64
+   program that loops forever; the harness runs it for a fixed number of
+   instructions and reports how fast that went.
+
+   usage: r5-bench [-e exec32|dcache|block] [-n instructions] [-H thp] [-c] [name...]
+
+   Without -n every benchmark runs for its own default count. -H thp puts
+   guest RAM in transparent huge pages, to compare the host TLB misses
+   with base pages.
+
+   -c checks the engines instead of timing them (make check): every
+   benchmark runs for CHECK_COUNT instructions on the reference, whose
+   registers then have to add up to the benchmark's checksum, and in
+   lockstep with it (see lockstep.h) on the decoded cache and on the block
+   engine. The exit status tells whether all of that held. */
+
+#define CODE_BASE       RAM_BASE
+#define DATA_BASE       (RAM_BASE + 0x1000000)
+#define STACK_TOP       (RAM_BASE + 0x800000)
+
+#define STREAM_BYTES    (4 * 1024 * 1024)
+#define CHASE_NODES     (256 * 1024)
+#define CHASE_STRIDE    64
+
+/* The page tables and user pages of the paging benchmark */
+#define PAGING_BASE     (RAM_BASE + 0x4000000)
+#define PAGING_ROOT(i)  (PAGING_BASE + 0x1000 * (i))
+#define PAGING_MID(i)   (PAGING_BASE + 0x2000 + 0x1000 * (i))
+#define PAGING_LEAF(i)  (PAGING_BASE + 0x4000 + 0x1000 * (i))
+#define PAGING_USER(i)  (PAGING_BASE + 0x10000 + 0x1000 * (i))
+#define PAGING_VA       0x40000000
+
+#define CHECK_COUNT     4000000
+#define CHECK_INTERVAL  100000
+
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*build)(Asm *a);
+    void (*setup)(Machine *m);
+    uint64_t count;     // default number of instructions to run
+    uint64_t checksum;  // of the registers after CHECK_COUNT instructions
+} Bench;
+
+/* Dependent ALU operations, no memory and one branch per iteration */
+static void build_alu(Asm *a) {
+    li(a, A0, 1);
+    li(a, A1, 0x9e3779b9);
+    int loop = here(a);
+    add(a, A0, A0, A1);
+    xor(a, A1, A1, A0);
+    slli(a, A2, A0, 7);
+    srli(a, A3, A1, 3);
+    or(a, A0, A0, A3);
+    sub(a, A1, A1, A2);
+    addiw(a, A4, A0, 17);
+    sltu(a, A5, A4, A1);
+    add(a, A0, A0, A5);
+    andi(a, A6, A0, 0xff);
+    addw(a, A1, A1, A6);
+    j(a, loop);
+}
+
+/* A multiplicative hash folded with its high half, and a modular reduction
+   by a changing divisor */
+static void build_muldiv(Asm *a) {
+    li(a, A0, 1);
+    li(a, A1, 0x9e3779b97f4a7c15);
+    li(a, A2, 1000003);
+    int loop = here(a);
+    mul(a, A3, A0, A1);
+    mulhu(a, A4, A0, A1);
+    xor(a, A0, A3, A4);
+    remu(a, A5, A0, A2);
+    divu(a, A6, A0, A2);
+    add(a, A2, A2, A5);
+    addi(a, A2, A2, 1);
+    xor(a, A0, A0, A6);
+    j(a, loop);
+}
+
+/* Collatz sequences: short basic blocks and data-dependent branches */
+static void build_branchy(Asm *a) {
+    li(a, S1, 27);
+    li(a, T1, 1);
+    int outer = here(a);
+    mv(a, T0, S1);
+    int inner = here(a);
+    int done = forward(a);
+    andi(a, T2, T0, 1);
+    int even = forward(a);
+    slli(a, T3, T0, 1);
+    add(a, T0, T0, T3);
+    addi(a, T0, T0, 1);
+    j(a, inner);
+    patch_branch(a, even, 0, T2, ZERO);         // beqz t2, even
+    srli(a, T0, T0, 1);
+    j(a, inner);
+    patch_branch(a, done, 0, T0, T1);           // beq t0, t1, done
+    addi(a, S1, S1, 1);
+    j(a, outer);
+}
+
+/* Sums one buffer while copying it to another, 8 bytes at a time */
+static void build_stream(Asm *a) {
+    li(a, S0, DATA_BASE);
+    li(a, S1, DATA_BASE + STREAM_BYTES);
+    li(a, S2, STREAM_BYTES / 8);
+    int outer = here(a);
+    mv(a, T0, S0);
+    mv(a, T1, S1);
+    mv(a, T2, S2);
+    int inner = here(a);
+    ld(a, T3, T0, 0);
+    add(a, A0, A0, T3);
+    sd(a, T3, T1, 0);
+    addi(a, T0, T0, 8);
+    addi(a, T1, T1, 8);
+    addi(a, T2, T2, -1);
+    bne(a, T2, ZERO, inner);
+    j(a, outer);
+}
+
+/* A plain memcpy loop over the same buffers; it runs as host copies */
+static void build_copy(Asm *a) {
+    li(a, S0, DATA_BASE);
+    li(a, S1, DATA_BASE + STREAM_BYTES);
+    int outer = here(a);
+    mv(a, T0, S0);
+    mv(a, T1, S1);
+    int inner = here(a);
+    ld(a, T3, T0, 0);
+    sd(a, T3, T1, 0);
+    addi(a, T0, T0, 8);
+    addi(a, T1, T1, 8);
+    bne(a, T0, S1, inner);
+    j(a, outer);
+}
+
+/* A byte-wise memset loop with a down counter */
+static void build_fill(Asm *a) {
+    li(a, S0, DATA_BASE);
+    li(a, S1, STREAM_BYTES);
+    li(a, A0, 0x5a);
+    int outer = here(a);
+    mv(a, T0, S0);
+    mv(a, T1, S1);
+    int inner = here(a);
+    sb(a, A0, T0, 0);
+    addi(a, T1, T1, -1);
+    addi(a, T0, T0, 1);
+    bne(a, T1, ZERO, inner);
+    j(a, outer);
+}
+
+/* Follows a random cycle of pointers spread over 16 MiB, so nearly every
+   load misses the host caches and many miss the guest TLB */
+static void build_chase(Asm *a) {
+    li(a, T0, DATA_BASE);
+    int loop = here(a);
+    for(int i = 0; i < 8; i++) {
+        ld(a, T0, T0, 0);
+    }
+    j(a, loop);
+}
+
+static void setup_chase(Machine *m) {
+    uint32_t *order = malloc(CHASE_NODES * sizeof(uint32_t));
+    for(uint32_t i = 0; i < CHASE_NODES; i++) {
+        order[i] = i;
+    }
+    srand(1);
+    for(uint32_t i = CHASE_NODES - 1; i > 0; i--) {
+        uint32_t k = rand() % (i + 1), t = order[i];
+        order[i] = order[k];
+        order[k] = t;
+    }
+    for(uint32_t i = 0; i < CHASE_NODES; i++) {
+        uint64_t next = DATA_BASE + (uint64_t)order[(i + 1) % CHASE_NODES] * CHASE_STRIDE;
+        store64(m, DATA_BASE + (uint64_t)order[i] * CHASE_STRIDE, next);
+    }
+    free(order);
+}
+
+/* Recursive Fibonacci: calls, returns and stack traffic */
+static void build_calls(Asm *a) {
+    li(a, SP, STACK_TOP);
+    int main = here(a);
+    li(a, A0, 20);
+    int call = forward(a);
+    j(a, main);
+
+    int fib = here(a);
+    patch_jal(a, call, RA);
+    li(a, T0, 2);
+    int base = forward(a);
+    addi(a, SP, SP, -16);
+    sd(a, RA, SP, 8);
+    sd(a, A0, SP, 0);
+    addi(a, A0, A0, -1);
+    jal(a, RA, fib);
+    ld(a, T1, SP, 0);
+    sd(a, A0, SP, 0);
+    addi(a, A0, T1, -2);
+    jal(a, RA, fib);
+    ld(a, T1, SP, 0);
+    add(a, A0, A0, T1);
+    ld(a, RA, SP, 8);
+    addi(a, SP, SP, 16);
+    patch_branch(a, base, 4, A0, T0);           // blt a0, t0, base
+    ret(a);
+}
+
+/* A user-mode loop making a system call every ~200 instructions, which
+   machine mode returns from right away: the cost of changing privilege */
+static void build_syscall(Asm *a) {
+    int setup = forward(a);
+
+    int handler = here(a);
+    csrr(a, T0, 0x341);                         // mepc
+    addi(a, T0, T0, 4);
+    csrw(a, 0x341, T0);
+    mret(a);
+
+    int user = here(a);
+    li(a, T1, 48);
+    int inner = here(a);
+    addi(a, A0, A0, 1);
+    xor(a, A1, A1, A0);
+    addi(a, T1, T1, -1);
+    bne(a, T1, ZERO, inner);
+    ecall(a);
+    j(a, user);
+
+    /* mret with MPP clear drops to user mode */
+    patch_jal(a, setup, ZERO);
+    li(a, T0, CODE_BASE + 4 * handler);
+    csrw(a, 0x305, T0);                         // mtvec
+    li(a, T0, CODE_BASE + 4 * user);
+    csrw(a, 0x341, T0);
+    csrw(a, 0x300, ZERO);                       // mstatus
+    mret(a);
+}
+
+/* The same mix of ALU operations and stack accesses as the others, all
+   compressed */
+static void build_rvc(Asm *a) {
+    li(a, SP, STACK_TOP);
+    li(a, S0, 1);
+    li(a, S1, 0x9e3779b9);
+    int loop = here(a);
+    c_pair(a, c_add(S0, S1), c_slli(S1, 5));
+    c_pair(a, c_xor(S1, S0), c_addi(S0, 7));
+    c_pair(a, c_sdsp(S0, 8), c_mv(A0, S1));
+    c_pair(a, c_ldsp(A1, 8), c_add(A0, A1));
+    c_pair(a, c_xor(S1, A0), c_addi(A1, -3));
+    c_pair(a, c_sdsp(A1, 16), c_ldsp(A2, 16));
+    c_pair(a, c_add(S0, A2), c_mv(A3, S0));
+    j(a, loop);
+}
+
+/* User code at PAGING_VA that counts down and makes a system call with a0
+   telling which page it is */
+static void build_paging_user(Machine *m, int page) {
+    Asm a = {0};
+    li(&a, A0, page + 1);
+    li(&a, T1, 20);
+    int loop = here(&a);
+    addi(&a, T1, T1, -1);
+    bne(&a, T1, ZERO, loop);
+    ecall(&a);
+    for(int i = 0; i < a.n; i++) {
+        store32(m, PAGING_USER(page) + 4 * i, a.code[i]);
+    }
+}
+
+#define PTE(addr, flags)    ((uint64_t)(addr) >> 12 << 10 | (flags))
+#define PTE_TABLE           0x01
+#define PTE_USER_RX         0x5b    // V, R, X, U and A
+#define PTE_KERNEL_RWX      0xcf    // V, R, W, X, A and D
+
+/* Two Sv39 address spaces both mapping their own user page at PAGING_VA,
+   and the RAM of machine mode at its physical address */
+static void setup_paging(Machine *m) {
+    for(int i = 0; i < 2; i++) {
+        store64(m, PAGING_ROOT(i) + 8 * (PAGING_VA >> 30), PTE(PAGING_MID(i), PTE_TABLE));
+        store64(m, PAGING_ROOT(i) + 8 * (RAM_BASE >> 30), PTE(RAM_BASE, PTE_KERNEL_RWX));
+        store64(m, PAGING_MID(i), PTE(PAGING_LEAF(i), PTE_TABLE));
+        store64(m, PAGING_LEAF(i), PTE(PAGING_USER(i), PTE_USER_RX));
+    }
+    for(int i = 0; i < 3; i++) {
+        build_paging_user(m, i);
+    }
+}
+
+/* The system calls of user code switching from one address space to the
+   other, with the page of the first moved between two physical pages every
+   eighth call and SFENCE.VMA making that seen: what a kernel switching
+   between processes does */
+static void build_paging(Asm *a) {
+    int setup = forward(a);
+
+    int handler = here(a);
+    add(a, S0, S0, A0);
+    addi(a, S1, S1, 1);
+    andi(a, T0, S1, 1);
+    int odd = forward(a);
+    csrw(a, 0x180, S2);                         // satp
+    int moved = forward(a);
+    patch_branch(a, odd, 1, T0, ZERO);          // bnez t0, odd
+    csrw(a, 0x180, S3);
+    patch_jal(a, moved, ZERO);
+    andi(a, T0, S1, 7);
+    int keep = forward(a);
+    xor(a, S4, S4, S5);
+    sd(a, S4, S6, 0);
+    sfence_vma(a);
+    patch_branch(a, keep, 1, T0, ZERO);         // bnez t0, keep
+    li(a, T0, PAGING_VA);
+    csrw(a, 0x341, T0);                         // mepc
+    mret(a);
+
+    patch_jal(a, setup, ZERO);
+    li(a, T0, CODE_BASE + 4 * handler);
+    csrw(a, 0x305, T0);                         // mtvec
+    li(a, S2, 8ULL << 60 | PAGING_ROOT(0) >> 12);
+    li(a, S3, 8ULL << 60 | 1ULL << 44 | PAGING_ROOT(1) >> 12);
+    li(a, S4, PTE(PAGING_USER(0), PTE_USER_RX));
+    li(a, S5, PTE(PAGING_USER(0), PTE_USER_RX) ^ PTE(PAGING_USER(2), PTE_USER_RX));
+    li(a, S6, PAGING_LEAF(0));
+    csrw(a, 0x180, S2);
+    li(a, T0, PAGING_VA);
+    csrw(a, 0x341, T0);
+    csrw(a, 0x300, ZERO);                       // mstatus
+    mret(a);
+}
+
+static const Bench benches[] = {
+    {"alu", "dependent integer ALU operations", build_alu, NULL, 500000000, 0x31fc8fb0bbdaf220},
+    {"muldiv", "multiply-xorshift hashing and division", build_muldiv, NULL, 200000000, 0x946f1fa454819cc5},
+    {"branchy", "Collatz sequences, unpredictable branches", build_branchy, NULL, 200000000, 0xd3082b0f1ca5c606},
+    {"stream", "4 MiB load/store streaming", build_stream, NULL, 200000000, 0xc19ce668228f2bde},
+    {"copy", "4 MiB memcpy loop", build_copy, NULL, 2000000000, 0x7e30db8e16c4c200},
+    {"fill", "4 MiB byte memset loop", build_fill, NULL, 2000000000, 0x2fe23e826d654d22},
+    {"chase", "pointer chasing over 16 MiB", build_chase, setup_chase, 10000000, 0x5aa24c950941cc00},
+    {"calls", "recursive fib(20)", build_calls, NULL, 200000000, 0x956bf75c817e4a4c},
+    {"syscall", "user-mode loop with an ecall every 200 instructions", build_syscall, NULL, 200000000, 0xdb4f6d19c9f3d9cc},
+    {"rvc", "compressed ALU operations and stack accesses", build_rvc, NULL, 500000000, 0x6529fc6d60762012},
+    {"paging", "two address spaces switched every ecall, SFENCE.VMA", build_paging, setup_paging, 50000000, 0xb03d4b74f3bed018},
+};
+
+#define NUM_BENCHES     (int)(sizeof(benches) / sizeof(benches[0]))
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The reference interpreter, taking traps the way the engines do, until
+   `count` more instructions have retired */
+static void run_exec32(CPU *cpu, uint64_t count) {
+    uint64_t end = cpu->instret + count;
+    fpu_enter(cpu);
+    while(cpu->instret < end) {
+        uint32_t insn;
+        if(!mmu_fetch_insn(cpu, cpu->pc, &insn)) {
+            trap_take(cpu, cpu->pc);
+        } else {
+            exec_insn(insn, cpu);
+            if(cpu->trap_pending) {
+                trap_take(cpu, cpu->pc);
+            } else {
+                cpu->instret++;
+            }
+        }
+        if(atomic_load_explicit(&cpu->exit_request, memory_order_relaxed)) {
+            cpu_exit_request(cpu);
+        }
+    }
+    fpu_leave(cpu);
+}
+
+/* Puts the benchmark's program into RAM and starts the hart on it */
+static void load(const Bench *bench, Machine *m) {
+    Asm a = {0};
+    bench->build(&a);
+    for(int i = 0; i < a.n; i++) {
+        store32(m, CODE_BASE + 4 * i, a.code[i]);
+    }
+    if(bench->setup) {
+        bench->setup(m);
+    }
+    CPU *cpu = &m->harts[0];
+    cpu_reset(cpu);
+    cpu->pc = CODE_BASE;
+}
+
+static double run(const Bench *bench, Machine *m, const char *engine, uint64_t count, uint64_t *retired) {
+
+    load(bench, m);
+    CPU *cpu = &m->harts[0];
+
+    double start = now();
+    if(!strcmp(engine, "exec32")) {
+        run_exec32(cpu, count);
+    } else if(!strcmp(engine, "dcache")) {
+        dcache_run(cpu, count);
+    } else {
+        block_run(cpu, count);
+    }
+    double elapsed = now() - start;
+
+    *retired = cpu->instret;
+    return elapsed;
+
+}
+
+static uint64_t checksum(const CPU *cpu) {
+    uint64_t sum = 0;
+    for(int i = 1; i < 32; i++) {
+        sum = sum * 31 + cpu->regs[i];
+    }
+    return sum;
+}
+
+/* Machines for lockstep, which both start out with the benchmark loaded */
+static const MachineConfig check_config = {.ram_size = RAM_SIZE_DEFAULT, .num_harts = 1, .manual_time = true};
+
+static bool check(const Bench *bench) {
+
+    Machine *m = machine_create(&check_config);
+    if(!m) {
+        fprintf(stderr, "can't allocate guest RAM\n");
+        return false;
+    }
+    load(bench, m);
+    run_exec32(&m->harts[0], CHECK_COUNT);
+    uint64_t sum = checksum(&m->harts[0]);
+    machine_destroy(m);
+    bool ok = sum == bench->checksum;
+    if(!ok) {
+        printf("%-10s checksum 0x%016" PRIx64 ", expected 0x%016" PRIx64 "\n", bench->name, sum, bench->checksum);
+    }
+
+    static const struct { int engine; const char *name; } engines[] = {
+        {LOCKSTEP_DCACHE, "dcache"},
+        {LOCKSTEP_BLOCK, "block"},
+    };
+    for(int i = 0; i < 2; i++) {
+        Machine *ref = NULL;
+        if(!(m = machine_create(&check_config)) || !(ref = machine_create(&check_config))) {
+            fprintf(stderr, "can't allocate guest RAM\n");
+            return false;
+        }
+        load(bench, m);
+        load(bench, ref);
+        bool same = lockstep_run(m, ref, engines[i].engine, CHECK_COUNT, CHECK_INTERVAL);
+        if(!same) {
+            printf("%-10s %s differs from the reference\n", bench->name, engines[i].name);
+        }
+        ok &= same;
+        machine_destroy(m);
+        machine_destroy(ref);
+    }
+    return ok;
+
+}
+
+int main(int argc, char **argv) {
+
+    const char *engine = "block";
+    uint64_t count = 0;
+    int first = 1, ram_pages = BUS_PAGES_SMALL;
+    bool checking = false;
+
+    for(; first < argc && argv[first][0] == '-'; first++) {
+        if(!strcmp(argv[first], "-c")) {
+            checking = true;
+            continue;
+        }
+        if(first + 1 == argc) {
+            fprintf(stderr, "%s needs an argument\n", argv[first]);
+            return 1;
+        }
+        const char *option = argv[first++], *value = argv[first];
+        if(!strcmp(option, "-e")) {
+            engine = value;
+        } else if(!strcmp(option, "-n")) {
+            count = strtoull(value, NULL, 0);
+        } else if(!strcmp(option, "-H") && !strcmp(value, "thp")) {
+            ram_pages = BUS_PAGES_THP;
+        } else {
+            fprintf(stderr, "unknown option %s\n", option);
+            return 1;
+        }
+    }
+    if(strcmp(engine, "exec32") && strcmp(engine, "dcache") && strcmp(engine, "block")) {
+        fprintf(stderr, "unknown engine %s\n", engine);
+        return 1;
+    }
+
+    /* The benchmarks are timed one after the other on its single hart */
+    Machine *machine = NULL;
+    if(!checking && !(machine = machine_create(&(MachineConfig){.ram_size = RAM_SIZE_DEFAULT, .num_harts = 1, .ram_pages = ram_pages}))) {
+        fprintf(stderr, "can't allocate guest RAM\n");
+        return 1;
+    }
+
+    if(!checking) {
+        printf("engine: %s\n\n", engine);
+        printf("%-10s %12s %10s %10s  %s\n", "benchmark", "instructions", "seconds", "MIPS", "");
+    }
+    int failed = 0;
+    for(int i = 0; i < NUM_BENCHES; i++) {
+        bool selected = first == argc;
+        for(int k = first; k < argc; k++) {
+            selected |= !strcmp(argv[k], benches[i].name);
+        }
+        if(!selected) {
+            continue;
+        }
+        if(checking) {
+            bool ok = check(&benches[i]);
+            printf("%-10s %s\n", benches[i].name, ok ? "ok" : "FAILED");
+            failed += !ok;
+            continue;
+        }
+        uint64_t retired;
+        double elapsed = run(&benches[i], machine, engine, count ? count : benches[i].count, &retired);
+        printf("%-10s %12" PRIu64 " %10.3f %10.1f  %s\n", benches[i].name, retired, elapsed, retired / elapsed / 1e6, benches[i].description);
+    }
+    return failed != 0;
+
+}
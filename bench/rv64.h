@@ -0,0 +1,175 @@
+#ifndef __RV64_H
+#define __RV64_H
+
+#include <stdint.h>
+
+/* A tiny assembler for writing benchmark programs without a RISC-V
+   toolchain. Branch and jump targets are instruction indices into the
+   buffer; forward references are emitted as placeholders and patched once
+   the target is known. */
+
+enum {
+    ZERO, RA, SP, GP, TP, T0, T1, T2, S0, S1, A0, A1, A2, A3, A4, A5,
+    A6, A7, S2, S3, S4, S5, S6, S7, S8, S9, S10, S11, T3, T4, T5, T6
+};
+
+#define ASM_MAX_INSNS   256
+
+typedef struct {
+    uint32_t code[ASM_MAX_INSNS];
+    int n;
+} Asm;
+
+static inline uint32_t rv_r(int funct7, int rs2, int rs1, int funct3, int rd, int opcode) {
+    return (uint32_t)funct7 << 25 | (uint32_t)rs2 << 20 | (uint32_t)rs1 << 15 | (uint32_t)funct3 << 12 | (uint32_t)rd << 7 | opcode;
+}
+
+static inline uint32_t rv_i(int32_t imm, int rs1, int funct3, int rd, int opcode) {
+    return ((uint32_t)imm & 0xfff) << 20 | (uint32_t)rs1 << 15 | (uint32_t)funct3 << 12 | (uint32_t)rd << 7 | opcode;
+}
+
+static inline uint32_t rv_s(int32_t imm, int rs2, int rs1, int funct3, int opcode) {
+    uint32_t u = imm;
+    return ((u >> 5) & 0x7f) << 25 | (uint32_t)rs2 << 20 | (uint32_t)rs1 << 15 | (uint32_t)funct3 << 12 | (u & 0x1f) << 7 | opcode;
+}
+
+static inline uint32_t rv_b(int32_t offset, int rs2, int rs1, int funct3) {
+    uint32_t u = offset;
+    return ((u >> 12) & 1) << 31 | ((u >> 5) & 0x3f) << 25 | (uint32_t)rs2 << 20 | (uint32_t)rs1 << 15 |
+           (uint32_t)funct3 << 12 | ((u >> 1) & 0xf) << 8 | ((u >> 11) & 1) << 7 | 0x63;
+}
+
+static inline uint32_t rv_j(int32_t offset, int rd) {
+    uint32_t u = offset;
+    return ((u >> 20) & 1) << 31 | ((u >> 1) & 0x3ff) << 21 | ((u >> 11) & 1) << 20 | ((u >> 12) & 0xff) << 12 | (uint32_t)rd << 7 | 0x6f;
+}
+
+static inline int emit(Asm *a, uint32_t insn) {
+    a->code[a->n] = insn;
+    return a->n++;
+}
+
+static inline int here(Asm *a) {
+    return a->n;
+}
+
+#define ALU_I(name, funct3) \
+    static inline void name(Asm *a, int rd, int rs1, int32_t imm) { emit(a, rv_i(imm, rs1, funct3, rd, 0x13)); }
+#define ALU_R(name, funct7, funct3, opcode) \
+    static inline void name(Asm *a, int rd, int rs1, int rs2) { emit(a, rv_r(funct7, rs2, rs1, funct3, rd, opcode)); }
+#define LOAD(name, funct3) \
+    static inline void name(Asm *a, int rd, int rs1, int32_t imm) { emit(a, rv_i(imm, rs1, funct3, rd, 0x03)); }
+#define STORE(name, funct3) \
+    static inline void name(Asm *a, int rs2, int rs1, int32_t imm) { emit(a, rv_s(imm, rs2, rs1, funct3, 0x23)); }
+
+ALU_I(addi, 0)
+ALU_I(slti, 2)
+ALU_I(sltiu, 3)
+ALU_I(xori, 4)
+ALU_I(ori, 6)
+ALU_I(andi, 7)
+ALU_R(add, 0x00, 0, 0x33)
+ALU_R(sub, 0x20, 0, 0x33)
+ALU_R(sll, 0x00, 1, 0x33)
+ALU_R(sltu, 0x00, 3, 0x33)
+ALU_R(xor, 0x00, 4, 0x33)
+ALU_R(srl, 0x00, 5, 0x33)
+ALU_R(or, 0x00, 6, 0x33)
+ALU_R(and, 0x00, 7, 0x33)
+ALU_R(addw, 0x00, 0, 0x3b)
+ALU_R(mul, 0x01, 0, 0x33)
+ALU_R(mulhu, 0x01, 3, 0x33)
+ALU_R(divu, 0x01, 5, 0x33)
+ALU_R(remu, 0x01, 7, 0x33)
+LOAD(lw, 2)
+LOAD(ld, 3)
+LOAD(lbu, 4)
+STORE(sb, 0)
+STORE(sw, 2)
+STORE(sd, 3)
+
+#undef ALU_I
+#undef ALU_R
+#undef LOAD
+#undef STORE
+
+static inline void slli(Asm *a, int rd, int rs1, int shamt) { emit(a, rv_i(shamt, rs1, 1, rd, 0x13)); }
+static inline void srli(Asm *a, int rd, int rs1, int shamt) { emit(a, rv_i(shamt, rs1, 5, rd, 0x13)); }
+static inline void srai(Asm *a, int rd, int rs1, int shamt) { emit(a, rv_i(shamt | 0x400, rs1, 5, rd, 0x13)); }
+static inline void addiw(Asm *a, int rd, int rs1, int32_t imm) { emit(a, rv_i(imm, rs1, 0, rd, 0x1b)); }
+static inline void lui(Asm *a, int rd, int32_t imm20) { emit(a, (uint32_t)imm20 << 12 | (uint32_t)rd << 7 | 0x37); }
+static inline void mv(Asm *a, int rd, int rs) { addi(a, rd, rs, 0); }
+
+/* Loads any 64-bit constant, the same way assemblers expand li */
+static inline void li(Asm *a, int rd, int64_t value) {
+    if(value == (int32_t)value) {
+        int32_t lo = (int32_t)((uint32_t)value << 20) >> 20;
+        int32_t hi = (int32_t)(((uint32_t)value - (uint32_t)lo) >> 12);
+        if(hi) {
+            lui(a, rd, hi & 0xfffff);
+            addiw(a, rd, rd, lo);
+        } else {
+            addi(a, rd, ZERO, lo);
+        }
+        return;
+    }
+    int64_t lo = (int64_t)((uint64_t)value << 52) >> 52;
+    li(a, rd, (int64_t)((uint64_t)value - (uint64_t)lo) >> 12);
+    slli(a, rd, rd, 12);
+    if(lo) {
+        addi(a, rd, rd, lo);
+    }
+}
+
+#define BRANCH(name, funct3) \
+    static inline void name(Asm *a, int rs1, int rs2, int target) { \
+        emit(a, rv_b((target - a->n) * 4, rs2, rs1, funct3)); \
+    }
+
+BRANCH(beq, 0)
+BRANCH(bne, 1)
+BRANCH(blt, 4)
+BRANCH(bge, 5)
+BRANCH(bltu, 6)
+BRANCH(bgeu, 7)
+
+#undef BRANCH
+
+static inline void jal(Asm *a, int rd, int target) { emit(a, rv_j((target - a->n) * 4, rd)); }
+static inline void j(Asm *a, int target) { jal(a, ZERO, target); }
+static inline void jalr(Asm *a, int rd, int rs1, int32_t imm) { emit(a, rv_i(imm, rs1, 0, rd, 0x67)); }
+static inline void ret(Asm *a) { jalr(a, ZERO, RA, 0); }
+
+/* Compressed instructions go in pairs, one 32-bit slot holding the one
+   that runs first in its low half. Only the forms the benchmarks use are
+   here; the registers of c.xor are x8-x15. */
+static inline uint16_t c_addi(int rd, int32_t imm) { return (uint16_t)(((uint32_t)imm & 0x20) << 7 | rd << 7 | ((uint32_t)imm & 0x1f) << 2 | 0x1); }
+static inline uint16_t c_slli(int rd, int shamt) { return (uint16_t)((shamt & 0x20) << 7 | rd << 7 | (shamt & 0x1f) << 2 | 0x2); }
+static inline uint16_t c_mv(int rd, int rs2) { return (uint16_t)(0x8002 | rd << 7 | rs2 << 2); }
+static inline uint16_t c_add(int rd, int rs2) { return (uint16_t)(0x9002 | rd << 7 | rs2 << 2); }
+static inline uint16_t c_xor(int rd, int rs2) { return (uint16_t)(0x8c21 | (rd & 7) << 7 | (rs2 & 7) << 2); }
+static inline uint16_t c_ldsp(int rd, int offset) { return (uint16_t)(0x6002 | (offset & 0x20) << 7 | rd << 7 | (offset & 0x18) << 2 | (offset & 0x1c0) >> 4); }
+static inline uint16_t c_sdsp(int rs2, int offset) { return (uint16_t)(0xe002 | (offset & 0x38) << 7 | (offset & 0x1c0) << 1 | rs2 << 2); }
+static inline void c_pair(Asm *a, uint16_t first, uint16_t second) { emit(a, (uint32_t)second << 16 | first); }
+
+/* CSR accesses and the privileged instructions the benchmarks need */
+static inline void csrw(Asm *a, int csr, int rs1) { emit(a, rv_i(csr, rs1, 1, ZERO, 0x73)); }
+static inline void csrr(Asm *a, int rd, int csr) { emit(a, rv_i(csr, ZERO, 2, rd, 0x73)); }
+static inline void ecall(Asm *a) { emit(a, 0x00000073); }
+static inline void mret(Asm *a) { emit(a, 0x30200073); }
+static inline void sfence_vma(Asm *a) { emit(a, 0x12000073); }
+
+/* Forward references: emit a placeholder, then point it at here() */
+static inline int forward(Asm *a) {
+    return emit(a, 0);
+}
+
+static inline void patch_branch(Asm *a, int at, int funct3, int rs1, int rs2) {
+    a->code[at] = rv_b((a->n - at) * 4, rs2, rs1, funct3);
+}
+
+static inline void patch_jal(Asm *a, int at, int rd) {
+    a->code[at] = rv_j((a->n - at) * 4, rd);
+}
+
+#endif
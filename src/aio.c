@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "aio.h"
+
+struct Aio {
+    bool uring;
+    pthread_mutex_t lock;
+    pthread_cond_t work, idle;
+    int inflight;
+    bool stopping;
+    int num_threads;
+    pthread_t threads[AIO_THREADS];
+
+    /* Thread pool: requests waiting for a thread */
+    AioRequest *head, *tail;
+
+    /* io_uring: the rings shared with the kernel, reaped by threads[0] */
+    int ring_fd;
+    uint8_t *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    _Atomic unsigned *sq_head, *sq_tail, *cq_head, *cq_tail;
+    unsigned *sq_array, sq_mask, cq_mask, sq_entries;
+    struct io_uring_cqe *cqes;
+};
+
+/* Called by whichever thread finished `req` */
+static void finish(Aio *aio, AioRequest *req, int64_t result) {
+    req->done(req, result);
+    pthread_mutex_lock(&aio->lock);
+    if(--aio->inflight == 0) {
+        pthread_cond_broadcast(&aio->idle);
+    }
+    pthread_mutex_unlock(&aio->lock);
+}
+
+/* ---- Thread pool ---- */
+
+/* Short transfers are retried with what is left until the end of the file */
+static int64_t perform(const AioRequest *req) {
+    if(req->op == AIO_FLUSH) {
+        return fdatasync(req->fd) == 0 ? 0 : -errno;
+    }
+    struct iovec iov[AIO_MAX_IOV];
+    memcpy(iov, req->iov, req->iovcnt * sizeof(*iov));
+    int first = 0;
+    int64_t total = 0;
+    while(first < req->iovcnt) {
+        ssize_t n = req->op == AIO_READ ? preadv(req->fd, iov + first, req->iovcnt - first, req->offset + total)
+                                        : pwritev(req->fd, iov + first, req->iovcnt - first, req->offset + total);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return n < 0 ? -errno : total;
+        }
+        total += n;
+        for(; first < req->iovcnt && (size_t)n >= iov[first].iov_len; first++) {
+            n -= iov[first].iov_len;
+        }
+        if(n) {
+            iov[first].iov_base = (uint8_t *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    return total;
+}
+
+static void *pool_thread(void *arg) {
+    Aio *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    for(;;) {
+        while(!aio->head && !aio->stopping) {
+            pthread_cond_wait(&aio->work, &aio->lock);
+        }
+        AioRequest *req = aio->head;
+        if(!req) {
+            break;
+        }
+        aio->head = req->next;
+        pthread_mutex_unlock(&aio->lock);
+        finish(aio, req, perform(req));
+        pthread_mutex_lock(&aio->lock);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+/* ---- io_uring ---- */
+
+static int uring_enter(Aio *aio, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, aio->ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static bool uring_setup(Aio *aio) {
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    aio->ring_fd = syscall(__NR_io_uring_setup, AIO_MAX_REQUESTS, &params);
+    if(aio->ring_fd < 0) {
+        return false;
+    }
+
+    aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single) {
+        aio->sq_ring_size = aio->cq_ring_size = aio->sq_ring_size > aio->cq_ring_size ? aio->sq_ring_size : aio->cq_ring_size;
+    }
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQ_RING);
+    aio->cq_ring = single ? aio->sq_ring : mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_CQ_RING);
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+    if(aio->sq_ring == MAP_FAILED || aio->cq_ring == MAP_FAILED || aio->sqes == MAP_FAILED) {
+        if(aio->sq_ring != MAP_FAILED) {
+            munmap(aio->sq_ring, aio->sq_ring_size);
+        }
+        if(!single && aio->cq_ring != MAP_FAILED) {
+            munmap(aio->cq_ring, aio->cq_ring_size);
+        }
+        if(aio->sqes != MAP_FAILED) {
+            munmap(aio->sqes, aio->sqes_size);
+        }
+        close(aio->ring_fd);
+        return false;
+    }
+
+    aio->sq_head = (_Atomic unsigned *)(aio->sq_ring + params.sq_off.head);
+    aio->sq_tail = (_Atomic unsigned *)(aio->sq_ring + params.sq_off.tail);
+    aio->sq_array = (unsigned *)(aio->sq_ring + params.sq_off.array);
+    aio->sq_mask = *(unsigned *)(aio->sq_ring + params.sq_off.ring_mask);
+    aio->sq_entries = params.sq_entries;
+    aio->cq_head = (_Atomic unsigned *)(aio->cq_ring + params.cq_off.head);
+    aio->cq_tail = (_Atomic unsigned *)(aio->cq_ring + params.cq_off.tail);
+    aio->cq_mask = *(unsigned *)(aio->cq_ring + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)(aio->cq_ring + params.cq_off.cqes);
+    return true;
+
+}
+
+static void uring_teardown(Aio *aio) {
+    munmap(aio->sqes, aio->sqes_size);
+    if(aio->cq_ring != aio->sq_ring) {
+        munmap(aio->cq_ring, aio->cq_ring_size);
+    }
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    close(aio->ring_fd);
+}
+
+/* Queues one entry and hands everything queued to the kernel. Called with
+   the lock held; a NULL request is a no-op that wakes the reaper. */
+static bool uring_push(Aio *aio, AioRequest *req) {
+    unsigned tail = atomic_load_explicit(aio->sq_tail, memory_order_relaxed);
+    if(tail - atomic_load_explicit(aio->sq_head, memory_order_acquire) >= aio->sq_entries) {
+        return false;
+    }
+    unsigned index = tail & aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if(!req) {
+        sqe->opcode = IORING_OP_NOP;
+    } else {
+        sqe->opcode = req->op == AIO_READ ? IORING_OP_READV : req->op == AIO_WRITE ? IORING_OP_WRITEV : IORING_OP_FSYNC;
+        sqe->fd = req->fd;
+        sqe->off = req->offset;
+        if(req->op == AIO_FLUSH) {
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        } else {
+            sqe->addr = (uintptr_t)req->iov;
+            sqe->len = req->iovcnt;
+        }
+        sqe->user_data = (uintptr_t)req;
+    }
+    aio->sq_array[index] = index;
+    atomic_store_explicit(aio->sq_tail, tail + 1, memory_order_release);
+
+    /* Whatever the kernel doesn't take now goes with the next submission */
+    unsigned queued = tail + 1 - atomic_load_explicit(aio->sq_head, memory_order_acquire);
+    while(uring_enter(aio, queued, 0, 0) < 0 && errno == EINTR) {
+    }
+    return true;
+}
+
+static void *uring_thread(void *arg) {
+    Aio *aio = arg;
+    for(;;) {
+        unsigned head = atomic_load_explicit(aio->cq_head, memory_order_relaxed);
+        if(head == atomic_load_explicit(aio->cq_tail, memory_order_acquire)) {
+            pthread_mutex_lock(&aio->lock);
+            bool done = aio->stopping && aio->inflight == 0;
+            pthread_mutex_unlock(&aio->lock);
+            if(done) {
+                break;
+            }
+            uring_enter(aio, 0, 1, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+        struct io_uring_cqe *cqe = &aio->cqes[head & aio->cq_mask];
+        AioRequest *req = (AioRequest *)(uintptr_t)cqe->user_data;
+        int64_t result = cqe->res;
+        atomic_store_explicit(aio->cq_head, head + 1, memory_order_release);
+        if(req) {
+            finish(aio, req, result);
+        }
+    }
+    return NULL;
+}
+
+/* ---- Interface ---- */
+
+Aio *aio_create(void) {
+
+    Aio *aio = calloc(1, sizeof(Aio));
+    if(!aio) {
+        return NULL;
+    }
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->idle, NULL);
+
+    aio->uring = uring_setup(aio);
+    int wanted = aio->uring ? 1 : AIO_THREADS;
+    while(aio->num_threads < wanted &&
+          pthread_create(&aio->threads[aio->num_threads], NULL, aio->uring ? uring_thread : pool_thread, aio) == 0) {
+        aio->num_threads++;
+    }
+    if(aio->num_threads == 0) {
+        if(aio->uring) {
+            uring_teardown(aio);
+        }
+        free(aio);
+        return NULL;
+    }
+    return aio;
+
+}
+
+void aio_destroy(Aio *aio) {
+
+    pthread_mutex_lock(&aio->lock);
+    while(aio->inflight) {
+        pthread_cond_wait(&aio->idle, &aio->lock);
+    }
+    aio->stopping = true;
+    if(aio->uring) {
+        uring_push(aio, NULL);
+    }
+    pthread_cond_broadcast(&aio->work);
+    pthread_mutex_unlock(&aio->lock);
+
+    for(int i = 0; i < aio->num_threads; i++) {
+        pthread_join(aio->threads[i], NULL);
+    }
+    if(aio->uring) {
+        uring_teardown(aio);
+    }
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->work);
+    pthread_cond_destroy(&aio->idle);
+    free(aio);
+
+}
+
+const char *aio_backend(const Aio *aio) {
+    return aio->uring ? "io_uring" : "threads";
+}
+
+bool aio_submit(Aio *aio, AioRequest *req) {
+
+    if(req->iovcnt > AIO_MAX_IOV) {
+        return false;
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    bool ok = !aio->stopping && aio->inflight < AIO_MAX_REQUESTS;
+    if(ok && aio->uring) {
+        ok = uring_push(aio, req);
+    } else if(ok) {
+        req->next = NULL;
+        if(aio->head) {
+            aio->tail->next = req;
+        } else {
+            aio->head = req;
+        }
+        aio->tail = req;
+        pthread_cond_signal(&aio->work);
+    }
+    if(ok) {
+        aio->inflight++;
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return ok;
+
+}
@@ -0,0 +1,53 @@
+#ifndef __AIO_H
+#define __AIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Asynchronous file I/O for devices. Requests go to the kernel through
+   io_uring, or to a pool of threads doing plain preadv()/pwritev() where
+   io_uring isn't available, as in many containers. Submitting never waits
+   for the I/O itself; completions are reported on a thread owned by the
+   backend. */
+
+#define AIO_READ            0
+#define AIO_WRITE           1
+#define AIO_FLUSH           2
+
+/* Pool threads per Aio when io_uring is unavailable */
+#define AIO_THREADS         4
+
+/* Largest number of requests in flight at once, and of buffers in one */
+#define AIO_MAX_REQUESTS    256
+#define AIO_MAX_IOV         128
+
+typedef struct AioRequest AioRequest;
+
+/* `result` is the number of bytes transferred, or a negative errno. Called
+   on a backend thread, and may submit more requests. */
+typedef void (*AioDone)(AioRequest *req, int64_t result);
+
+struct AioRequest {
+    int op, fd;
+    uint64_t offset;
+    struct iovec *iov;
+    int iovcnt;
+    AioDone done;
+    AioRequest *next;       // owned by the backend while in flight
+};
+
+typedef struct Aio Aio;
+
+Aio *aio_create(void);
+
+/* Waits for every request in flight before freeing the backend */
+void aio_destroy(Aio *aio);
+
+/* "io_uring" or "threads" */
+const char *aio_backend(const Aio *aio);
+
+/* Fails only if the backend is gone or full */
+bool aio_submit(Aio *aio, AioRequest *req);
+
+#endif
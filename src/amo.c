@@ -0,0 +1,97 @@
+#include "amo.h"
+#include "mmu.h"
+
+/* AMOs are performed with host atomics on the translated host address, so
+   harts never need a lock to agree on memory. Every access is sequentially
+   consistent regardless of the aq and rl bits; on x86 the locked
+   instructions are full barriers anyway. */
+#define ORDER   __ATOMIC_SEQ_CST
+
+#define DEFINE_RMW(name, type, stype) \
+    static type name(type *p, type value, int op) { \
+        switch(op) { \
+            case AMO_SWAP: return __atomic_exchange_n(p, value, ORDER); \
+            case AMO_ADD: return __atomic_fetch_add(p, value, ORDER); \
+            case AMO_XOR: return __atomic_fetch_xor(p, value, ORDER); \
+            case AMO_AND: return __atomic_fetch_and(p, value, ORDER); \
+            case AMO_OR: return __atomic_fetch_or(p, value, ORDER); \
+        } \
+        /* No host instruction for min and max */ \
+        type old = __atomic_load_n(p, __ATOMIC_RELAXED), new; \
+        do { \
+            switch(op) { \
+                case AMO_MIN: new = (stype)old < (stype)value ? old : value; break; \
+                case AMO_MAX: new = (stype)old > (stype)value ? old : value; break; \
+                case AMO_MINU: new = old < value ? old : value; break; \
+                default: new = old > value ? old : value; break; \
+            } \
+        } while(!__atomic_compare_exchange_n(p, &old, new, true, ORDER, __ATOMIC_RELAXED)); \
+        return old; \
+    }
+
+DEFINE_RMW(rmw32, uint32_t, int32_t)
+DEFINE_RMW(rmw64, uint64_t, int64_t)
+
+uint64_t amo_rmw(CPU *cpu, uint64_t vaddr, uint64_t value, int op, int size) {
+    MMU_TRACE(cpu, vaddr, size, TRACE_ATOMIC);
+    uint8_t *host = mmu_atomic(cpu, vaddr, size, ACCESS_WRITE);
+    if(!host) {
+        mmu_atomic_fault(cpu, vaddr, size, ACCESS_WRITE);
+        return 0;
+    }
+    uint64_t old = size == 4 ? (uint64_t)(int32_t)rmw32((uint32_t *)host, value, op) : rmw64((uint64_t *)host, value, op);
+    dcache_invalidate(cpu->machine, host - cpu->machine->ram, size);
+    return old;
+}
+
+/* Reservations are a host address and the value LR saw there instead of an
+   entry in some shared table: SC is a compare-and-swap against that value.
+   This can't tell a location that was changed and changed back from one
+   that was never written, which only makes SC succeed where real hardware
+   might have failed it spuriously, and LR/SC sequences can't observe the
+   difference. */
+uint64_t amo_lr(CPU *cpu, uint64_t vaddr, int size) {
+    MMU_TRACE(cpu, vaddr, size, TRACE_ATOMIC);
+    uint8_t *host = mmu_atomic(cpu, vaddr, size, ACCESS_READ);
+    if(!host) {
+        cpu->reservation = NULL;
+        mmu_atomic_fault(cpu, vaddr, size, ACCESS_READ);
+        return 0;
+    }
+    uint64_t value = size == 4 ? (uint64_t)(int32_t)__atomic_load_n((uint32_t *)host, ORDER) : __atomic_load_n((uint64_t *)host, ORDER);
+    cpu->reservation = host;
+    cpu->reservation_value = value;
+    return value;
+}
+
+uint64_t amo_sc(CPU *cpu, uint64_t vaddr, uint64_t value, int size) {
+
+    MMU_TRACE(cpu, vaddr, size, TRACE_ATOMIC);
+    uint8_t *host = mmu_atomic(cpu, vaddr, size, ACCESS_WRITE);
+    uint8_t *reserved = cpu->reservation;
+
+    /* Any SC gives up the reservation, whether it succeeds or not */
+    cpu->reservation = NULL;
+    if(!host) {
+        mmu_atomic_fault(cpu, vaddr, size, ACCESS_WRITE);
+        return 1;
+    }
+    if(host != reserved) {
+        return 1;
+    }
+
+    bool stored;
+    if(size == 4) {
+        uint32_t expected = cpu->reservation_value;
+        stored = __atomic_compare_exchange_n((uint32_t *)host, &expected, (uint32_t)value, false, ORDER, ORDER);
+    } else {
+        uint64_t expected = cpu->reservation_value;
+        stored = __atomic_compare_exchange_n((uint64_t *)host, &expected, value, false, ORDER, ORDER);
+    }
+    if(!stored) {
+        return 1;
+    }
+    dcache_invalidate(cpu->machine, host - cpu->machine->ram, size);
+    return 0;
+
+}
@@ -0,0 +1,29 @@
+#ifndef __AMO_H
+#define __AMO_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+/* AMO operations, numbered by funct5 */
+#define AMO_ADD             0x00
+#define AMO_SWAP            0x01
+#define AMO_LR              0x02
+#define AMO_SC              0x03
+#define AMO_XOR             0x04
+#define AMO_OR              0x08
+#define AMO_AND             0x0c
+#define AMO_MIN             0x10
+#define AMO_MAX             0x14
+#define AMO_MINU            0x18
+#define AMO_MAXU            0x1c
+
+/* All of these operate on 4 or 8 bytes and return what was in memory,
+   sign-extended, as the value for rd. One that faults raises the exception
+   instead, and what it returns must not be written to rd. */
+uint64_t amo_rmw(CPU *cpu, uint64_t vaddr, uint64_t value, int op, int size);
+uint64_t amo_lr(CPU *cpu, uint64_t vaddr, int size);
+
+/* Returns 0 if the store happened and 1 if it didn't */
+uint64_t amo_sc(CPU *cpu, uint64_t vaddr, uint64_t value, int size);
+
+#endif
@@ -0,0 +1,323 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block.h"
+#include "insn.h"
+#include "jit.h"
+#include "mmu.h"
+#include "smp.h"
+#include "amo.h"
+#include "vector.h"
+#include "fpu.h"
+#include "muldiv.h"
+#include "profile.h"
+#include "coverage.h"
+#include "trace.h"
+#include "trap.h"
+
+/* Threaded dispatch relies on the labels-as-values extension of GCC/Clang */
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* Every host thread running harts has its own blocks and translated code,
+   so nothing on the execution path needs a lock. Blocks can't be freed
+   while one of them is executing, so invalidation only marks the cache and
+   the owning thread flushes it at its next block boundary.
+
+   A cache holds the blocks of one machine, whose caches are all listed so
+   that stores to code can reach every one of them. A thread that goes on
+   to run another machine's harts starts a new cache. `machine` is cleared
+   when the machine is destroyed under the owner's nose, which is why the
+   owner goes by the ID. */
+typedef struct BlockCache BlockCache;
+struct BlockCache {
+    Block *hash[1 << BLOCK_HASH_BITS];
+    Block *list;
+    uint32_t num_blocks;
+    atomic_bool flush_pending;
+    _Atomic uint64_t epoch;     // moved on by block_revalidate_*()
+    uint64_t machine_id;
+    Machine *machine;
+    BlockCache *next;
+#ifdef TRACE
+    bool traced;        // which instance of block_run.inc built the blocks
+#endif
+};
+
+static _Thread_local BlockCache *cache;
+
+/* Guards every machine's list of caches and the caches' machines */
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const bool ends_block[DOP_COUNT] = {
+#define OP(name, ...)
+#define BRANCH(name, cond) [DOP_##name] = true,
+#include "ops.inc"
+#undef OP
+#undef BRANCH
+    [DOP_JALR] = true,
+    [DOP_EXEC32] = true,
+    [DOP_BREAK] = true
+};
+
+static inline uint64_t block_hash_index(uint64_t pc) {
+    return (pc >> 2) & ((1 << BLOCK_HASH_BITS) - 1);
+}
+
+static BlockCache *block_cache(Machine *m) {
+    if(cache && cache->machine_id != m->id) {
+        block_thread_exit();
+    }
+    if(!cache && (cache = calloc(1, sizeof(BlockCache)))) {
+        cache->machine_id = m->id;
+        cache->machine = m;
+        pthread_mutex_lock(&caches_lock);
+        cache->next = m->caches;
+        m->caches = cache;
+        m->num_caches++;
+        pthread_mutex_unlock(&caches_lock);
+    }
+    return cache;
+}
+
+void block_invalidate_all(Machine *m) {
+    pthread_mutex_lock(&caches_lock);
+    for(BlockCache *c = m->caches; c; c = c->next) {
+        atomic_store_explicit(&c->flush_pending, true, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&caches_lock);
+}
+
+void block_revalidate_all(Machine *m) {
+    pthread_mutex_lock(&caches_lock);
+    for(BlockCache *c = m->caches; c; c = c->next) {
+        atomic_fetch_add_explicit(&c->epoch, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&caches_lock);
+}
+
+void block_release(Machine *m) {
+    if(cache && cache->machine == m) {
+        block_thread_exit();
+    }
+    pthread_mutex_lock(&caches_lock);
+    for(BlockCache *c = m->caches; c; c = c->next) {
+        c->machine = NULL;
+    }
+    m->caches = NULL;
+    pthread_mutex_unlock(&caches_lock);
+}
+
+void block_invalidate_local(void) {
+    if(cache) {
+        atomic_store_explicit(&cache->flush_pending, true, memory_order_relaxed);
+    }
+}
+
+void block_revalidate_local(void) {
+    if(cache) {
+        atomic_fetch_add_explicit(&cache->epoch, 1, memory_order_relaxed);
+    }
+}
+
+/* `m` is the cache's machine, or NULL if it may be gone already */
+static void block_free_all(Machine *m) {
+    Block *b = cache->list, *next;
+    while(b) {
+        next = b->list_next;
+        free(b);
+        b = next;
+    }
+    cache->list = NULL;
+    cache->num_blocks = 0;
+    memset(cache->hash, 0, sizeof(cache->hash));
+
+    /* Other threads' blocks may still rely on the flags. With several
+       caches they are only cleared by the stores that trigger a flush. */
+    if(m && m->num_caches == 1) {
+        dcache_clear_flags(m, DF_IN_BLOCK);
+    }
+    jit_reset();
+    atomic_store_explicit(&cache->flush_pending, false, memory_order_relaxed);
+}
+
+void block_thread_exit(void) {
+    if(!cache) {
+        return;
+    }
+    block_free_all(NULL);
+    jit_free();
+
+    pthread_mutex_lock(&caches_lock);
+    Machine *m = cache->machine;
+    if(m) {
+        BlockCache **c = &m->caches;
+        while(*c != cache) {
+            c = &(*c)->next;
+        }
+        *c = cache->next;
+        m->num_caches--;
+    }
+    pthread_mutex_unlock(&caches_lock);
+
+    free(cache);
+    cache = NULL;
+}
+
+/* Copies the run of decoded instructions starting at `pc` into a new block.
+   The block ends at the first conditional branch, indirect jump or
+   instruction left to exec32(); direct jumps are followed into their target,
+   so one block may span several basic blocks. A breakpoint ends it in front
+   of the instruction that has it, which is then left out of the count.
+   Fetched through the page tables, a block stays within the page of its
+   first instruction, so that checking where that one is checks them all.
+
+   `labels` lives in an instance of block_run.inc; cloning this function
+   with the table propagated into it would reference those labels from
+   another function, which LTO can't link. Bulk loops aren't matched for
+   `traced` harts, as they would go around the tracing. */
+__attribute__((noclone))
+static Block *block_build(CPU *cpu, uint64_t pc, uint64_t context, const void *const *labels, bool traced) {
+
+    BlockInsn insns[BLOCK_MAX_INSNS + 1];
+    uint32_t count = 0, length = 0;
+    uint64_t cur = pc;
+
+    while(length < BLOCK_MAX_INSNS) {
+        if(context && ((cur ^ pc) & ~(uint64_t)(PAGE_SIZE - 1))) {
+            break;
+        }
+        DecodedInsn *d = dcache_fetch(cpu, cur);
+        if(!d || (context && (cur & (PAGE_SIZE - 1)) + d->length > PAGE_SIZE)) {
+            break;
+        }
+        /* Harts of other machines may be building blocks from the slot at
+           the same time, so the flags and the handler, which may be reset
+           under it, stay out of the copy */
+        if(!(__atomic_load_n(&d->flags, __ATOMIC_RELAXED) & DF_IN_BLOCK)) {
+            __atomic_fetch_or(&d->flags, DF_IN_BLOCK, __ATOMIC_RELAXED);
+        }
+        insns[length].label = labels[d->op];
+        insns[length].d = (DecodedInsn){NULL, d->imm, d->raw, d->op, d->rd, d->rs1, d->rs2, 0, d->length};
+        insns[length].pc_off = cur - pc;
+        length++;
+        if(d->op == DOP_BREAK) {
+            break;
+        }
+        count++;
+        if(ends_block[d->op]) {
+            break;
+        }
+        cur += (d->op == DOP_J || d->op == DOP_JAL) ? d->imm : d->length;
+    }
+
+    if(length == 0) {
+        return NULL;
+    }
+
+    if(!ends_block[insns[length - 1].d.op]) {
+        insns[length].label = labels[BLOCK_END];
+        insns[length].d.op = BLOCK_END;
+        insns[length].pc_off = cur - pc;
+        length++;
+    }
+
+    Block *b = malloc(sizeof(Block) + length * sizeof(BlockInsn));
+    if(!b) {
+        return NULL;
+    }
+    b->pc = pc;
+    b->context = context;
+    b->epoch = atomic_load_explicit(&cache->epoch, memory_order_relaxed);
+    b->host = mmu_fetch(cpu, pc);
+    b->link[0] = b->link[1] = NULL;
+    b->jit = NULL;
+    b->hits = 0;
+    b->count = count;
+    b->length = length;
+    b->bulk.kind = BULK_NONE;
+    if(!traced && cpu->machine->num_harts == 1 && count) {
+        /* The host copies give no single-copy atomicity for the elements,
+           which only another hart could tell */
+        bulk_match(insns, count, &b->bulk);
+    }
+#ifdef COVERAGE
+    b->coverage_id = coverage_id(pc);
+#endif
+    memcpy(b->insns, insns, length * sizeof(BlockInsn));
+
+    uint64_t index = block_hash_index(pc);
+    b->hash_next = cache->hash[index];
+    cache->hash[index] = b;
+    b->list_next = cache->list;
+    cache->list = b;
+    if(++cache->num_blocks == BLOCK_CACHE_MAX) {
+        block_invalidate_local();
+    }
+    return b;
+
+}
+
+#ifdef PROFILE
+static void profile_block(const Block *b, uint64_t instret) {
+    for(uint32_t i = 0; i < b->count; i++) {
+        profile_insn(b->insns[i].d.raw, 1);
+    }
+    profile_sample(b->pc, instret, instret + b->count);
+}
+#endif
+
+/* Blocks are looked up by virtual address, so a block is only found again
+   in the context it was fetched in. The same code then has a block for each
+   privilege level and address space that runs it, but switching between
+   them needn't discard any. After SFENCE.VMA a block is checked to still be
+   where the page tables put it. One that isn't is kept, as the page may well
+   be mapped there again, and a block is built for what is there now. */
+static Block *block_get(CPU *cpu, uint64_t pc, const void *const *labels, bool traced) {
+    uint64_t context = mmu_fetch_context(cpu);
+    uint64_t epoch = atomic_load_explicit(&cache->epoch, memory_order_relaxed);
+    for(Block *b = cache->hash[block_hash_index(pc)]; b; b = b->hash_next) {
+        if(b->pc == pc && b->context == context) {
+            if(b->epoch != epoch) {
+                if(context && mmu_fetch(cpu, pc) != b->host) {
+                    continue;
+                }
+                b->epoch = epoch;
+            }
+            return b;
+        }
+    }
+    return block_build(cpu, pc, context, labels, traced);
+}
+
+/* Traced blocks leave their loads and stores to the threaded code, since
+   the inline TLB lookups of translated code would go around the tracing */
+static inline bool block_accesses_memory(const Block *b) {
+    for(uint32_t i = 0; i < b->count; i++) {
+        if(b->insns[i].d.op >= DOP_LB && b->insns[i].d.op <= DOP_SD) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#define RUN_NAME    run
+#define RUN_TRACED  0
+#include "block_run.inc"
+
+#ifdef TRACE
+#define RUN_NAME    run_traced
+#define RUN_TRACED  1
+#include "block_run.inc"
+#endif
+
+void block_run(CPU *cpu, uint64_t count) {
+    fpu_enter(cpu);
+#ifdef TRACE
+    if(cpu->trace) {
+        run_traced(cpu, count);
+    } else
+#endif
+    run(cpu, count);
+    fpu_leave(cpu);
+}
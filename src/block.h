@@ -0,0 +1,81 @@
+#ifndef __BLOCK_H
+#define __BLOCK_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "decode.h"
+#include "bulk.h"
+
+#define BLOCK_MAX_INSNS     64
+#define BLOCK_HASH_BITS     14
+
+/* Blocks a thread builds before it frees them all and starts over, since
+   changes of address space no longer discard any */
+#define BLOCK_CACHE_MAX     (1 << 15)
+
+/* The label of the synthetic instruction terminating a block that ran into
+   BLOCK_MAX_INSNS or the end of RAM */
+#define BLOCK_END           DOP_COUNT
+
+struct BlockInsn {
+    const void *label;
+    DecodedInsn d;
+    int32_t pc_off;     // address of the instruction relative to the block
+};
+
+/* Translated code returns the next PC and which of the block's exits was
+   taken, so the dispatch loop can keep chaining blocks. */
+typedef struct {
+    uint64_t pc;
+    uint64_t exit;
+} JitResult;
+
+/* The exit of translated code leaving the block at an instruction that
+   raised a trap. pc is then the instruction's index in insns, which has
+   everything else needed to take it. */
+#define JIT_EXIT_TRAP       2
+
+typedef JitResult (*JitFn)(CPU *cpu);
+
+typedef struct Block Block;
+struct Block {
+    uint64_t pc;
+    uint64_t context;   // mmu_fetch_context() it was fetched in
+    uint64_t epoch;     // when its translation was last known to hold
+    const uint8_t *host;    // its first instruction in RAM
+    Block *hash_next, *list_next;
+    Block *link[2];     // chained successors of the taken/fall-through exits
+    JitFn jit;          // host code, once the block is hot
+    uint32_t hits;
+    uint32_t count;     // number of guest instructions
+    uint32_t length;    // number of entries in insns
+    BulkLoop bulk;      // what to run on the host instead, if anything
+#ifdef COVERAGE
+    uint32_t coverage_id;
+#endif
+    BlockInsn insns[];
+};
+
+/* Runs at least `count` instructions, stopping at the first block boundary
+   after that, or at the first one after the hart is asked to stop */
+void block_run(CPU *cpu, uint64_t count);
+
+/* Discards the calling thread's blocks only; enough when what changed is
+   private to the hart */
+void block_invalidate_local(void);
+
+/* Has the blocks fetched through the page tables translated again before
+   they next run, and any whose first instruction moved built anew. The
+   local form is for the calling thread's blocks, after SFENCE.VMA; the
+   other for every thread's, when RAM or the harts are put back. */
+void block_revalidate_local(void);
+void block_revalidate_all(Machine *m);
+
+/* Frees the calling thread's blocks and translated code */
+void block_thread_exit(void);
+
+/* Lets go of every thread's cache for a machine that is being destroyed.
+   Other threads free theirs when they next run harts, or exit. */
+void block_release(Machine *m);
+
+#endif
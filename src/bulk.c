@@ -0,0 +1,228 @@
+#include <string.h>
+#include "bulk.h"
+#include "block.h"
+#include "mmu.h"
+
+/* Element size of a load or store, 0 for anything else */
+static int access_size(uint8_t op) {
+    switch(op) {
+        case DOP_LB: case DOP_LBU: case DOP_SB: return 1;
+        case DOP_LH: case DOP_LHU: case DOP_SH: return 2;
+        case DOP_LW: case DOP_LWU: case DOP_SW: return 4;
+        case DOP_LD: case DOP_SD: return 8;
+        default: return 0;
+    }
+}
+
+static bool is_load(uint8_t op) {
+    return op == DOP_LB || op == DOP_LBU || op == DOP_LH || op == DOP_LHU ||
+           op == DOP_LW || op == DOP_LWU || op == DOP_LD;
+}
+
+static int64_t increment(const BulkLoop *loop, uint8_t reg) {
+    for(int i = 0; i < loop->num_incs; i++) {
+        if(loop->inc_reg[i] == reg) {
+            return loop->inc[i];
+        }
+    }
+    return 0;
+}
+
+static bool add_increment(BulkLoop *loop, uint8_t reg, int64_t imm) {
+    for(int i = 0; i < loop->num_incs; i++) {
+        if(loop->inc_reg[i] == reg) {
+            loop->inc[i] += imm;
+            return true;
+        }
+    }
+    if(loop->num_incs == BULK_MAX_INCS) {
+        return false;
+    }
+    loop->inc_reg[loop->num_incs] = reg;
+    loop->inc[loop->num_incs++] = imm;
+    return true;
+}
+
+static bool match(const BlockInsn *insns, uint32_t count, BulkLoop *loop) {
+
+    const DecodedInsn *branch = &insns[count - 1].d;
+    if((branch->op != DOP_BNE && branch->op != DOP_BLTU) || insns[count - 1].pc_off + branch->imm != 0) {
+        return false;
+    }
+
+    const DecodedInsn *load = NULL, *store = NULL;
+    int64_t load_off = 0, store_off = 0;
+    for(uint32_t i = 0; i < count - 1; i++) {
+        const DecodedInsn *d = &insns[i].d;
+        if(d->op == DOP_ADDI && d->rd == d->rs1 && d->rd != 0) {
+            if(!add_increment(loop, d->rd, d->imm)) {
+                return false;
+            }
+        } else if(is_load(d->op) && !load && !store && d->rd != 0) {
+            load = d;
+            load_off = d->imm + increment(loop, d->rs1);
+        } else if(access_size(d->op) && !is_load(d->op) && !store) {
+            store = d;
+            store_off = d->imm + increment(loop, d->rs1);
+        } else {
+            return false;
+        }
+    }
+    if(!store) {
+        return false;
+    }
+
+    loop->size = access_size(store->op);
+    loop->dst = store->rs1;
+    loop->dst_off = store_off;
+    if(load) {
+        /* The loaded register must only carry the element across */
+        if(access_size(load->op) != loop->size || store->rs2 != load->rd || increment(loop, load->rd) ||
+           load->rd == load->rs1 || load->rd == store->rs1 || load->rd == branch->rs1 || load->rd == branch->rs2) {
+            return false;
+        }
+        loop->kind = BULK_COPY;
+        loop->src = load->rs1;
+        loop->src_off = load_off;
+        if(increment(loop, loop->src) != loop->size) {
+            return false;
+        }
+    } else {
+        loop->kind = BULK_FILL;
+        loop->value = store->rs2;
+        if(increment(loop, loop->value)) {
+            return false;
+        }
+    }
+    if(increment(loop, loop->dst) != loop->size) {
+        return false;
+    }
+
+    loop->cond = branch->op;
+    if(increment(loop, branch->rs1) && !increment(loop, branch->rs2)) {
+        loop->var = branch->rs1;
+        loop->bound = branch->rs2;
+    } else if(branch->op == DOP_BNE && increment(loop, branch->rs2) && !increment(loop, branch->rs1)) {
+        loop->var = branch->rs2;
+        loop->bound = branch->rs1;
+    } else {
+        return false;
+    }
+    loop->step = increment(loop, loop->var);
+    return loop->cond == DOP_BNE || loop->step > 0;
+
+}
+
+void bulk_match(const BlockInsn *insns, uint32_t count, BulkLoop *loop) {
+    memset(loop, 0, sizeof(*loop));
+    if(!match(insns, count, loop)) {
+        loop->kind = BULK_NONE;
+    }
+}
+
+/* Number of iterations left before the loop exits, counting the one about
+   to start, or 0 if it would only end by wrapping around */
+static uint64_t iterations(const CPU *cpu, const BulkLoop *loop) {
+    uint64_t var = cpu->regs[loop->var], bound = cpu->regs[loop->bound];
+    uint64_t distance = bound - var;
+    if(loop->cond == DOP_BLTU) {
+        /* var only grows; it stops at the first value not below bound */
+        return var < bound ? (distance - 1) / loop->step + 1 : 1;
+    }
+    /* bne exits when var hits bound exactly; a loop that would have to wrap
+       around to get there isn't a memcpy */
+    uint64_t step = loop->step > 0 ? (uint64_t)loop->step : -(uint64_t)loop->step;
+    if(loop->step < 0) {
+        distance = -distance;
+    }
+    return distance % step ? 0 : distance / step;
+}
+
+static void fill(uint8_t *host, uint64_t value, int size, uint64_t n) {
+    switch(size) {
+        case 1:
+            memset(host, (uint8_t)value, n);
+            break;
+        case 2:
+            for(uint64_t i = 0; i < n; i++) {
+                uint16_t v = value;
+                memcpy(host + 2 * i, &v, 2);
+            }
+            break;
+        case 4:
+            for(uint64_t i = 0; i < n; i++) {
+                uint32_t v = value;
+                memcpy(host + 4 * i, &v, 4);
+            }
+            break;
+        default:
+            for(uint64_t i = 0; i < n; i++) {
+                memcpy(host + 8 * i, &value, 8);
+            }
+            break;
+    }
+}
+
+uint64_t bulk_run(CPU *cpu, const BulkLoop *loop, uint64_t max) {
+
+    uint64_t n = iterations(cpu, loop);
+    if(n < 2) {
+        return 0;
+    }
+    if(n - 1 < max) {
+        max = n - 1;
+    }
+
+    int size = loop->size;
+    uint64_t src = cpu->regs[loop->src] + loop->src_off;
+    uint64_t dst = cpu->regs[loop->dst] + loop->dst_off;
+    uint64_t value = cpu->regs[loop->value];
+    if((src | dst) & (size - 1)) {
+        /* Misaligned elements take the slow path one by one anyway */
+        return 0;
+    }
+
+    /* Translate once per page, like the TLB fast path would, and copy up to
+       the nearer of the two page ends in one go. Aligned elements never
+       cross a page. */
+    uint64_t done = 0;
+    while(done < max) {
+        uint64_t room = PAGE_SIZE - (dst & (PAGE_SIZE - 1));
+        uint8_t *from = NULL, *to;
+        if(loop->kind == BULK_COPY) {
+            if(!(from = mmu_atomic(cpu, src, 1, ACCESS_READ))) {
+                break;
+            }
+            uint64_t src_room = PAGE_SIZE - (src & (PAGE_SIZE - 1));
+            room = src_room < room ? src_room : room;
+        }
+        if(!(to = mmu_atomic(cpu, dst, 1, ACCESS_WRITE))) {
+            break;
+        }
+        uint64_t elements = room / size;
+        if(elements > max - done) {
+            elements = max - done;
+        }
+        uint64_t bytes = elements * size;
+        if(loop->kind == BULK_COPY) {
+            /* Copying forward element by element reads what it just wrote
+               when the destination starts inside the source */
+            if(to > from && to < from + bytes) {
+                break;
+            }
+            memmove(to, from, bytes);
+        } else {
+            fill(to, value, size, elements);
+        }
+        dcache_invalidate(cpu->machine, to - cpu->machine->ram, bytes);
+        src += bytes;
+        dst += bytes;
+        done += elements;
+    }
+
+    for(int i = 0; i < loop->num_incs; i++) {
+        cpu->regs[loop->inc_reg[i]] += done * loop->inc[i];
+    }
+    return done;
+
+}
@@ -0,0 +1,57 @@
+#ifndef __BULK_H
+#define __BULK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/* Guest memcpy and memset loops, recognized when a block is built and then
+   run as host bulk copies. A loop qualifies when it is a single block that
+   branches back to its own start and, apart from the branch, consists of
+   nothing but
+
+       copy:  l{b,h,w,d}[u] t, off(src)    fill:  s{b,h,w,d} v, off(dst)
+              s{b,h,w,d} t, off(dst)
+              addi src, src, size
+              addi dst, dst, size
+
+   plus an optional counter `addi cnt, cnt, step`, in any order. The loop
+   condition must be `bne var, bound` or `bltu var, bound`, where var is one
+   of the incremented registers and bound is left alone. */
+
+#define BULK_NONE       0
+#define BULK_COPY       1
+#define BULK_FILL       2
+
+/* At most src, dst and a counter are incremented */
+#define BULK_MAX_INCS   3
+
+typedef struct {
+    uint8_t kind;
+    uint8_t size;               // bytes per element
+    uint8_t src, dst, value;    // value is the register stored by a fill
+    uint8_t var, bound, cond;   // loop condition, cond is DOP_BNE or DOP_BLTU
+    uint8_t num_incs;
+    uint8_t inc_reg[BULK_MAX_INCS];
+    int64_t inc[BULK_MAX_INCS];
+    int64_t step;               // increment of var
+    int64_t src_off, dst_off;   // element addresses relative to the registers
+                                // at the top of the loop
+} BulkLoop;
+
+typedef struct BlockInsn BlockInsn;
+
+/* Fills in `loop` if the `count` instructions of a block form a loop as
+   described above; otherwise sets its kind to BULK_NONE. */
+void bulk_match(const BlockInsn *insns, uint32_t count, BulkLoop *loop);
+
+/* Runs up to `max` iterations of the loop from the top, always leaving the
+   last one to the caller so that it exits the loop the normal way. Returns
+   the number of iterations done, with the registers updated to match.
+
+   It stops early at anything the bulk path doesn't handle, like MMIO, a page
+   fault or an overlap that a forward copy would smear, and the remaining
+   iterations then run on the normal path. */
+uint64_t bulk_run(CPU *cpu, const BulkLoop *loop, uint64_t max);
+
+#endif
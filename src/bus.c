@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <linux/mman.h>
+#include "bus.h"
+#include "numa.h"
+
+#define THP_SIZE            (2 * 1024 * 1024)
+
+static inline uint64_t ram_mapped_size(uint64_t size, uint64_t page_size) {
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+/* RAM is reserved up front but only backed by host memory as the guest
+   touches it. Transparent huge pages need the mapping aligned to them. */
+static uint8_t *map_ram(uint64_t size, int pages) {
+
+    if(pages == BUS_PAGES_2M || pages == BUS_PAGES_1G) {
+        int flags = MAP_HUGETLB | (pages == BUS_PAGES_2M ? MAP_HUGE_2MB : MAP_HUGE_1GB);
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+        return mem == MAP_FAILED ? NULL : mem;
+    }
+
+    uint64_t slack = pages == BUS_PAGES_THP ? THP_SIZE : 0;
+    uint8_t *mem = mmap(NULL, size + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED) {
+        return NULL;
+    }
+    if(slack) {
+        uint8_t *aligned = (uint8_t *)(((uintptr_t)mem + THP_SIZE - 1) & ~(uintptr_t)(THP_SIZE - 1));
+        if(aligned > mem) {
+            munmap(mem, aligned - mem);
+        }
+        if(aligned + size < mem + size + slack) {
+            munmap(aligned + size, mem + size + slack - (aligned + size));
+        }
+        mem = aligned;
+        madvise(mem, size, MADV_HUGEPAGE);
+    }
+    return mem;
+
+}
+
+bool bus_init(Machine *m, const MachineConfig *config) {
+
+    static const uint64_t page_sizes[] = {BUS_DIRTY_SIZE, THP_SIZE, 2ull << 20, 1ull << 30};
+    int pages = config->ram_pages;
+    uint64_t size = config->ram_size;
+    uint8_t *mem = map_ram(ram_mapped_size(size, page_sizes[pages]), pages);
+    if(!mem && pages > BUS_PAGES_THP) {
+        pages = BUS_PAGES_THP;
+        mem = map_ram(ram_mapped_size(size, THP_SIZE), pages);
+    }
+    if(!mem) {
+        return false;
+    }
+    m->ram = mem;
+    m->ram_size = size;
+    m->ram_pages = pages;
+    m->ram_page_size = page_sizes[pages];
+    m->numa_nodes = config->numa_nodes;
+    pthread_mutex_init(&m->dirty_lock, NULL);
+    if(m->numa_nodes && !numa_bind(mem, ram_mapped_size(size, m->ram_page_size), m->numa_nodes)) {
+        return false;
+    }
+    return dcache_init(m, size);
+
+}
+
+void bus_free(Machine *m) {
+    dcache_free(m);
+    if(m->ram) {
+        munmap(m->ram, ram_mapped_size(m->ram_size, m->ram_page_size));
+        pthread_mutex_destroy(&m->dirty_lock);
+    }
+    if(m->ram_page_state) {
+        munmap(m->ram_shadow, m->ram_size);
+        free(m->dirty_pages);
+        free((void *)m->ram_page_state);
+    }
+}
+
+uint64_t bus_page_size(const Machine *m, uint64_t *huge_bytes) {
+
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if(!f) {
+        return 0;
+    }
+
+    /* Loading an image can split RAM into several mappings */
+    uintptr_t start = (uintptr_t)m->ram, end = start + m->ram_size;
+    uint64_t page_size = 0, kib;
+    bool in_ram = false;
+    char line[256];
+    *huge_bytes = 0;
+    while(fgets(line, sizeof(line), f)) {
+        uintptr_t first, last;
+        if(sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &first, &last) == 2) {
+            in_ram = first < end && last > start;
+        } else if(!in_ram) {
+            continue;
+        } else if(sscanf(line, "KernelPageSize: %" SCNu64 " kB", &kib) == 1) {
+            page_size = kib << 10 > page_size ? kib << 10 : page_size;
+        } else if(sscanf(line, "AnonHugePages: %" SCNu64 " kB", &kib) == 1 ||
+                  sscanf(line, "Private_Hugetlb: %" SCNu64 " kB", &kib) == 1) {
+            *huge_bytes += kib << 10;
+        }
+    }
+    fclose(f);
+
+    /* Transparent huge pages keep the base page size as the kernel's */
+    if(*huge_bytes && page_size < THP_SIZE) {
+        page_size = THP_SIZE;
+    }
+    return page_size;
+
+}
+
+bool bus_track_begin(Machine *m) {
+    uint64_t pages = m->ram_size >> BUS_DIRTY_SHIFT;
+    if(m->ram_page_state) {
+        memset((uint8_t *)m->ram_page_state, 0, pages);
+        m->num_dirty = 0;
+        return true;
+    }
+    uint8_t *shadow = mmap(NULL, m->ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    uint32_t *dirty_pages = calloc(pages, sizeof(*dirty_pages));
+    _Atomic uint8_t *state = calloc(pages, 1);
+    if(shadow == MAP_FAILED || !dirty_pages || !state) {
+        free(dirty_pages);
+        free((void *)state);
+        if(shadow != MAP_FAILED) {
+            munmap(shadow, m->ram_size);
+        }
+        return false;
+    }
+    m->ram_shadow = shadow;
+    m->dirty_pages = dirty_pages;
+    m->ram_page_state = state;
+    return true;
+}
+
+/* The first write to a page is serialized so that no hart can store to it
+   before its original contents are saved */
+void bus_note_write_slow(Machine *m, uint64_t page) {
+    pthread_mutex_lock(&m->dirty_lock);
+    uint8_t state = atomic_load_explicit(&m->ram_page_state[page], memory_order_relaxed);
+    if(!(state & BUS_PAGE_DIRTY)) {
+        if(!(state & BUS_PAGE_SAVED)) {
+            memcpy(m->ram_shadow + (page << BUS_DIRTY_SHIFT), m->ram + (page << BUS_DIRTY_SHIFT), BUS_DIRTY_SIZE);
+        }
+        m->dirty_pages[m->num_dirty++] = page;
+        atomic_store_explicit(&m->ram_page_state[page], BUS_PAGE_SAVED | BUS_PAGE_DIRTY, memory_order_release);
+    }
+    pthread_mutex_unlock(&m->dirty_lock);
+}
+
+uint64_t bus_track_reset(Machine *m) {
+    for(uint64_t i = 0; i < m->num_dirty; i++) {
+        /* Only the words that changed can have stale decoded instructions,
+           so code sharing a page with data keeps its translations */
+        uint64_t offset = (uint64_t)m->dirty_pages[i] << BUS_DIRTY_SHIFT;
+        for(uint64_t end = offset + BUS_DIRTY_SIZE; offset < end; offset += 8) {
+            uint64_t original, current;
+            memcpy(&original, m->ram_shadow + offset, 8);
+            memcpy(&current, m->ram + offset, 8);
+            if(original != current) {
+                memcpy(m->ram + offset, &original, 8);
+                dcache_invalidate(m, offset, 8);
+            }
+        }
+        atomic_store_explicit(&m->ram_page_state[m->dirty_pages[i]], BUS_PAGE_SAVED, memory_order_relaxed);
+    }
+    uint64_t restored = m->num_dirty;
+    m->num_dirty = 0;
+    return restored;
+}
+
+static inline bool overlaps(uint64_t base_a, uint64_t size_a, uint64_t base_b, uint64_t size_b) {
+    return base_a < base_b + size_b && base_b < base_a + size_a;
+}
+
+static bool bus_add_region(Machine *m, BusRegion region) {
+
+    BusRegion *regions = m->regions;
+    int num_regions = m->num_regions;
+    if(num_regions == BUS_MAX_REGIONS || region.size == 0 || overlaps(region.base, region.size, RAM_BASE, m->ram_size)) {
+        return false;
+    }
+
+    int i = 0;
+    while(i < num_regions && regions[i].base < region.base) {
+        i++;
+    }
+    if((i > 0 && overlaps(region.base, region.size, regions[i - 1].base, regions[i - 1].size)) ||
+       (i < num_regions && overlaps(region.base, region.size, regions[i].base, regions[i].size))) {
+        return false;
+    }
+
+    memmove(&regions[i + 1], &regions[i], (num_regions - i) * sizeof(BusRegion));
+    regions[i] = region;
+    m->num_regions++;
+    __atomic_store_n(&m->last_region, NULL, __ATOMIC_RELAXED);
+    return true;
+
+}
+
+bool bus_register_mmio(Machine *m, uint64_t base, uint64_t size, MMIORead read, MMIOWrite write, void *opaque) {
+    return bus_add_region(m, (BusRegion){base, size, NULL, read, write, opaque});
+}
+
+bool bus_register_direct(Machine *m, uint64_t base, uint64_t size, uint8_t *host) {
+    if((base | size) & (BUS_DIRECT_ALIGN - 1)) {
+        return false;
+    }
+    return bus_add_region(m, (BusRegion){base, size, host, NULL, NULL, NULL});
+}
+
+static inline bool region_contains(const BusRegion *region, uint64_t addr, int size) {
+    return addr - region->base < region->size && region->size - (addr - region->base) >= (uint64_t)size;
+}
+
+/* The last region found is shared by all harts, which may run on different
+   threads. It is only written on a miss, so harts that keep to one device
+   just read it. */
+BusRegion *bus_find_region(Machine *m, uint64_t addr, int size) {
+
+    BusRegion *last_region = __atomic_load_n(&m->last_region, __ATOMIC_RELAXED), *regions = m->regions;
+    if(last_region && region_contains(last_region, addr, size)) {
+        return last_region;
+    }
+
+    /* Find the last region starting at or below addr */
+    int lo = 0, hi = m->num_regions;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(regions[mid].base <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if(lo > 0 && region_contains(&regions[lo - 1], addr, size)) {
+        __atomic_store_n(&m->last_region, &regions[lo - 1], __ATOMIC_RELAXED);
+        return &regions[lo - 1];
+    }
+    return NULL;
+
+}
+
+uint64_t bus_mmio_load(Machine *m, uint64_t addr, int size) {
+    BusRegion *region = bus_find_region(m, addr, size);
+    uint64_t value = 0;
+    if(!region) {
+        return 0;   // guest accesses raise an access fault instead; see mmu.c
+    }
+    if(region->host) {
+        memcpy(&value, region->host + (addr - region->base), size);
+    } else if(region->read) {
+        value = region->read(region->opaque, addr - region->base, size);
+    }
+    return value;
+}
+
+void bus_mmio_store(Machine *m, uint64_t addr, uint64_t value, int size) {
+    BusRegion *region = bus_find_region(m, addr, size);
+    if(!region) {
+        return;
+    }
+    if(region->host) {
+        memcpy(region->host + (addr - region->base), &value, size);
+    } else if(region->write) {
+        region->write(region->opaque, addr - region->base, value, size);
+    }
+}
@@ -1,16 +1,140 @@
 #ifndef __BUS_H
 #define __BUS_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include "machine.h"
+#include "decode.h"
 
-void store8(uint64_t addr, uint8_t value);
-void store16(uint64_t addr, uint16_t value);
-void store32(uint64_t addr, uint32_t value);
-void store64(uint64_t addr, uint32_t value);
+#define RAM_BASE            0x80000000
+#define RAM_SIZE_DEFAULT    (128 * 1024 * 1024)
 
-uint8_t load8(uint64_t addr);
-uint16_t load16(uint16_t addr);
-uint32_t load32(uint32_t addr);
-uint32_t load64(uint64_t addr);
+/* Direct regions are mapped into the TLB a page at a time */
+#define BUS_DIRECT_ALIGN    4096
 
-#endif
\ No newline at end of file
+/* Dirty tracking works on host pages of RAM */
+#define BUS_DIRTY_SHIFT     12
+#define BUS_DIRTY_SIZE      (1 << BUS_DIRTY_SHIFT)
+
+/* The bus of a machine: its RAM and the regions around it (see machine.h).
+   Every access goes to the machine it is given. */
+
+/* Host pages for RAM. Large guests miss in the host TLB a lot with base
+   pages, which huge pages avoid: transparent ones when the kernel can find
+   them, or reserved ones from hugetlbfs, which fall back to transparent
+   ones when there aren't enough. Base pages are the default, since only
+   they let images be mapped into RAM from their files (see loader.c). */
+#define BUS_PAGES_SMALL     0
+#define BUS_PAGES_THP       1
+#define BUS_PAGES_2M        2
+#define BUS_PAGES_1G        3
+
+/* Reserves the machine's RAM, with the config's pages and NUMA nodes, and
+   its decoded cache; bus_free() gives both back along with the dirty
+   tracking */
+bool bus_init(Machine *m, const MachineConfig *config);
+void bus_free(Machine *m);
+
+/* What backs RAM so far: the host page size, and how many bytes of RAM are
+   in pages larger than base pages, from /proc/self/smaps. Returns 0 if it
+   can't be read. */
+uint64_t bus_page_size(const Machine *m, uint64_t *huge_bytes);
+
+/* Dirty page tracking, for putting RAM back the way it was without copying
+   all of it. While tracking, every page keeps its original contents in a
+   shadow copy taken just before the first write to it, and the written
+   pages are listed so that a reset only copies those back.
+
+   bus_note_write() must come before anything writes to RAM directly.
+   Stores through the TLB only need it when a write tag is installed:
+   a page that isn't dirty never has one, so by flushing the TLBs, a reset
+   sends the next store to every page back through the slow path. */
+#define BUS_PAGE_SAVED      1   // the shadow copy holds the original
+#define BUS_PAGE_DIRTY      2   // written since the last reset
+
+/* Starts tracking, with the current contents of RAM as the original */
+bool bus_track_begin(Machine *m);
+
+/* Returns the number of pages copied back */
+uint64_t bus_track_reset(Machine *m);
+
+void bus_note_write_slow(Machine *m, uint64_t page);
+
+static inline void bus_note_write(Machine *m, uint64_t offset, uint64_t size) {
+    if(m->ram_page_state && size) {
+        for(uint64_t page = offset >> BUS_DIRTY_SHIFT; page <= (offset + size - 1) >> BUS_DIRTY_SHIFT; page++) {
+            if(!(atomic_load_explicit(&m->ram_page_state[page], memory_order_acquire) & BUS_PAGE_DIRTY)) {
+                bus_note_write_slow(m, page);
+            }
+        }
+    }
+}
+
+/* Both fail if the region overlaps RAM or another region */
+bool bus_register_mmio(Machine *m, uint64_t base, uint64_t size, MMIORead read, MMIOWrite write, void *opaque);
+bool bus_register_direct(Machine *m, uint64_t base, uint64_t size, uint8_t *host);
+
+/* Returns the region containing the whole access, or NULL */
+BusRegion *bus_find_region(Machine *m, uint64_t addr, int size);
+
+/* Accesses outside of RAM go here */
+uint64_t bus_mmio_load(Machine *m, uint64_t addr, int size);
+void bus_mmio_store(Machine *m, uint64_t addr, uint64_t value, int size);
+
+/* Returns the host address of the byte at `paddr` if it is in RAM */
+static inline uint8_t *bus_ram_ptr(Machine *m, uint64_t paddr) {
+    uint64_t offset = paddr - RAM_BASE;
+    return offset < m->ram_size ? m->ram + offset : (uint8_t *)0;
+}
+
+/* Like bus_ram_ptr(), but also accepts direct regions */
+static inline uint8_t *bus_direct_ptr(Machine *m, uint64_t paddr) {
+    uint8_t *host = bus_ram_ptr(m, paddr);
+    if(!host) {
+        BusRegion *region = bus_find_region(m, paddr, 1);
+        if(region && region->host) {
+            host = region->host + (paddr - region->base);
+        }
+    }
+    return host;
+}
+
+static inline bool bus_in_ram(Machine *m, uint64_t offset, int size) {
+    return offset < m->ram_size && m->ram_size - offset >= (uint64_t)size;
+}
+
+static inline uint64_t bus_load(Machine *m, uint64_t addr, int size) {
+    uint64_t offset = addr - RAM_BASE;
+    if(bus_in_ram(m, offset, size)) {
+        uint64_t value = 0;
+        memcpy(&value, m->ram + offset, size);
+        return value;
+    }
+    return bus_mmio_load(m, addr, size);
+}
+
+/* Stores to RAM throw away any decoded instructions covering them */
+static inline void bus_store(Machine *m, uint64_t addr, uint64_t value, int size) {
+    uint64_t offset = addr - RAM_BASE;
+    if(bus_in_ram(m, offset, size)) {
+        bus_note_write(m, offset, size);
+        memcpy(m->ram + offset, &value, size);
+        dcache_invalidate(m, offset, size);
+        return;
+    }
+    bus_mmio_store(m, addr, value, size);
+}
+
+static inline void store8(Machine *m, uint64_t addr, uint8_t value) { bus_store(m, addr, value, 1); }
+static inline void store16(Machine *m, uint64_t addr, uint16_t value) { bus_store(m, addr, value, 2); }
+static inline void store32(Machine *m, uint64_t addr, uint32_t value) { bus_store(m, addr, value, 4); }
+static inline void store64(Machine *m, uint64_t addr, uint64_t value) { bus_store(m, addr, value, 8); }
+
+static inline uint8_t load8(Machine *m, uint64_t addr) { return bus_load(m, addr, 1); }
+static inline uint16_t load16(Machine *m, uint64_t addr) { return bus_load(m, addr, 2); }
+static inline uint32_t load32(Machine *m, uint64_t addr) { return bus_load(m, addr, 4); }
+static inline uint64_t load64(Machine *m, uint64_t addr) { return bus_load(m, addr, 8); }
+
+#endif
@@ -0,0 +1,221 @@
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "clint.h"
+#include "bus.h"
+#include "csr.h"
+
+static uint64_t host_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * CLINT_FREQ + (uint64_t)ts.tv_nsec / (1000000000 / CLINT_FREQ);
+}
+
+static inline uint64_t now_ticks(Clint *clint) {
+    return clint->manual ? 0 : host_ticks();
+}
+
+/* Hart threads move mtime_offset and mtimecmp while the timer thread and
+   the other harts read them, so both are only accessed atomically */
+static inline int64_t mtime_offset(Clint *clint) {
+    return __atomic_load_n(&clint->mtime_offset, __ATOMIC_RELAXED);
+}
+
+uint64_t clint_mtimecmp(Clint *clint, int hart) {
+    return __atomic_load_n(&clint->mtimecmp[hart], __ATOMIC_RELAXED);
+}
+
+uint64_t clint_mtime(Clint *clint) {
+    return now_ticks(clint) + mtime_offset(clint);
+}
+
+static void to_timespec(Clint *clint, uint64_t mtime, struct timespec *ts) {
+    uint64_t ticks = mtime - mtime_offset(clint);
+    ts->tv_sec = ticks / CLINT_FREQ;
+    ts->tv_nsec = ticks % CLINT_FREQ * (1000000000 / CLINT_FREQ);
+}
+
+/* Has the timer thread look at the deadlines again */
+static void timer_changed(Clint *clint) {
+    pthread_mutex_lock(&clint->lock);
+    pthread_cond_signal(&clint->changed);
+    pthread_mutex_unlock(&clint->lock);
+}
+
+void clint_set_mtime(Clint *clint, uint64_t mtime) {
+    __atomic_store_n(&clint->mtime_offset, (int64_t)(mtime - now_ticks(clint)), __ATOMIC_RELAXED);
+    if(clint->manual) {
+        /* There is no timer thread to notice */
+        for(int i = 0; i < clint->num_harts; i++) {
+            smp_set_pending(&clint->harts[i], MIP_MTIP, mtime >= clint_mtimecmp(clint, i));
+        }
+    }
+    timer_changed(clint);
+}
+
+/* mtime is only ever worked out from the host clock, so nothing notices it
+   passing mtimecmp by itself. MTIP is brought up to date on a write to
+   mtimecmp, on a read of mip and in WFI, and the timer thread raises it for
+   harts that are busy running. */
+static void update_timer(Clint *clint, int hart) {
+    smp_set_pending(&clint->harts[hart], MIP_MTIP, clint_mtime(clint) >= clint_mtimecmp(clint, hart));
+}
+
+/* Sleeps until the earliest mtimecmp. Harts only see that MTIP was raised
+   at their next block boundary, as with any other interrupt. */
+static void *timer_thread(void *arg) {
+    Clint *clint = arg;
+    pthread_mutex_lock(&clint->lock);
+    while(!clint->stopping) {
+        uint64_t now = clint_mtime(clint), next = UINT64_MAX;
+        for(int i = 0; i < clint->num_harts; i++) {
+            uint64_t cmp = clint_mtimecmp(clint, i);
+            if(cmp <= now) {
+                update_timer(clint, i);
+            } else if(cmp < next) {
+                next = cmp;
+            }
+        }
+        if(next == UINT64_MAX) {
+            pthread_cond_wait(&clint->changed, &clint->lock);
+        } else {
+            struct timespec deadline;
+            to_timespec(clint, next, &deadline);
+            pthread_cond_timedwait(&clint->changed, &clint->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&clint->lock);
+    return NULL;
+}
+
+void clint_update_timer(CPU *cpu) {
+    if(cpu->clint) {
+        update_timer(cpu->clint, cpu->hartid);
+    }
+}
+
+void clint_wait(CPU *cpu) {
+    Clint *clint = cpu->clint;
+    for(;;) {
+        clint_update_timer(cpu);
+        if((atomic_load_explicit(&cpu->mip, memory_order_acquire) & cpu->mie) ||
+           (atomic_load_explicit(&cpu->exit_request, memory_order_relaxed) & EXIT_STOP) || (clint && clint->manual)) {
+            return;
+        }
+        /* Sleep until mtime reaches mtimecmp if that is the interrupt being
+           waited for, and until something else is raised otherwise */
+        struct timespec deadline, *timeout = NULL;
+        uint64_t cmp = clint ? clint_mtimecmp(clint, cpu->hartid) : UINT64_MAX;
+        if((cpu->mie & MIP_MTIP) && cmp != UINT64_MAX) {
+            to_timespec(clint, cmp, &deadline);
+            timeout = &deadline;
+        }
+        smp_park(cpu, timeout);
+    }
+}
+
+static uint64_t clint_read(void *opaque, uint64_t offset, int size) {
+
+    Clint *clint = opaque;
+    uint64_t value = 0;
+
+    if(offset < CLINT_MSIP + 4 * (uint64_t)clint->num_harts) {
+        CPU *cpu = &clint->harts[(offset - CLINT_MSIP) / 4];
+        value = !!(atomic_load_explicit(&cpu->mip, memory_order_acquire) & MIP_MSIP);
+    } else if(offset >= CLINT_MTIMECMP && offset < CLINT_MTIMECMP + 8 * (uint64_t)clint->num_harts) {
+        value = clint_mtimecmp(clint, (offset - CLINT_MTIMECMP) / 8) >> ((offset & 4) * 8);
+    } else if(offset >= CLINT_MTIME && offset < CLINT_MTIME + 8) {
+        value = clint_mtime(clint) >> ((offset & 4) * 8);
+    }
+
+    return size == 8 ? value : value & 0xffffffff;
+
+}
+
+/* Replaces the 32 or 64 bits at `offset` in a 64-bit register */
+static uint64_t merge(uint64_t old, uint64_t offset, uint64_t value, int size) {
+    if(size == 8) {
+        return value;
+    }
+    int shift = (offset & 4) * 8;
+    return (old & ~(0xffffffffULL << shift)) | ((value & 0xffffffff) << shift);
+}
+
+/* Under the lock, which also keeps two harts writing halves of the same
+   mtimecmp from losing one of them */
+static void set_mtimecmp(Clint *clint, int hart, uint64_t offset, uint64_t value, int size) {
+    pthread_mutex_lock(&clint->lock);
+    __atomic_store_n(&clint->mtimecmp[hart], merge(clint->mtimecmp[hart], offset, value, size), __ATOMIC_RELAXED);
+    pthread_cond_signal(&clint->changed);
+    pthread_mutex_unlock(&clint->lock);
+}
+
+void clint_set_mtimecmp(Clint *clint, int hart, uint64_t mtimecmp) {
+    set_mtimecmp(clint, hart, 0, mtimecmp, 8);
+}
+
+static void clint_write(void *opaque, uint64_t offset, uint64_t value, int size) {
+
+    Clint *clint = opaque;
+
+    if(offset < CLINT_MSIP + 4 * (uint64_t)clint->num_harts) {
+        /* Interprocessor interrupt */
+        smp_set_pending(&clint->harts[(offset - CLINT_MSIP) / 4], MIP_MSIP, value & 1);
+    } else if(offset >= CLINT_MTIMECMP && offset < CLINT_MTIMECMP + 8 * (uint64_t)clint->num_harts) {
+        int hart = (offset - CLINT_MTIMECMP) / 8;
+        set_mtimecmp(clint, hart, offset, value, size);
+        update_timer(clint, hart);
+        /* A hart in WFI has to sleep until the new deadline instead */
+        smp_kick(&clint->harts[hart]);
+    } else if(offset >= CLINT_MTIME && offset < CLINT_MTIME + 8) {
+        clint_set_mtime(clint, merge(clint_mtime(clint), offset, value, size));
+        for(int i = 0; i < clint->num_harts; i++) {
+            update_timer(clint, i);
+            smp_kick(&clint->harts[i]);
+        }
+    }
+
+}
+
+bool clint_init(Clint *clint, Machine *m, bool manual) {
+    CPU *harts = m->harts;
+    int num_harts = m->num_harts;
+    if(num_harts > SMP_MAX_HARTS) {
+        return false;
+    }
+    memset(clint, 0, sizeof(*clint));
+    clint->harts = harts;
+    clint->num_harts = num_harts;
+    memset(clint->mtimecmp, 0xff, sizeof(clint->mtimecmp));
+    clint->manual = manual;
+    clint->mtime_offset = -(int64_t)now_ticks(clint);
+    for(int i = 0; i < num_harts; i++) {
+        harts[i].clint = clint;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&clint->lock, NULL);
+    pthread_cond_init(&clint->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    if(!manual) {
+        if(pthread_create(&clint->timer, NULL, timer_thread, clint) != 0) {
+            return false;
+        }
+        clint->running = true;
+    }
+    return bus_register_mmio(m, CLINT_BASE, CLINT_SIZE, clint_read, clint_write, clint);
+}
+
+void clint_destroy(Clint *clint) {
+    if(clint->running) {
+        pthread_mutex_lock(&clint->lock);
+        clint->stopping = true;
+        pthread_cond_signal(&clint->changed);
+        pthread_mutex_unlock(&clint->lock);
+        pthread_join(clint->timer, NULL);
+        clint->running = false;
+    }
+}
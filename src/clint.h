@@ -0,0 +1,65 @@
+#ifndef __CLINT_H
+#define __CLINT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "smp.h"
+
+/* Core-local interruptor, with the register layout used by SiFive and QEMU's
+   virt machine */
+#define CLINT_BASE          0x2000000
+#define CLINT_SIZE          0x10000
+#define CLINT_MSIP          0x0
+#define CLINT_MTIMECMP      0x4000
+#define CLINT_MTIME         0xbff8
+
+/* mtime ticks per second */
+#define CLINT_FREQ          10000000
+
+typedef struct Clint {
+    CPU *harts;
+    int num_harts;
+    uint64_t mtimecmp[SMP_MAX_HARTS];
+    int64_t mtime_offset;   // guest mtime minus host time in ticks
+    bool manual;            // mtime only moves when set; host time is 0
+
+    /* Wakes the timer thread when a deadline moves, or when it is to stop */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t timer;
+    bool running, stopping;
+} Clint;
+
+struct Machine;
+
+/* Maps the CLINT for the machine's harts into its bus, and starts the
+   thread raising their timer interrupts. A `manual` clock stands still
+   unless clint_set_mtime() moves it, which then raises them instead, and
+   WFI doesn't wait for it; runs that have to be repeatable, to the
+   instruction, use one. */
+bool clint_init(Clint *clint, struct Machine *m, bool manual);
+
+/* Stops the timer thread, if there is one */
+void clint_destroy(Clint *clint);
+
+/* mtime follows the host's monotonic clock, unless it is manual */
+uint64_t clint_mtime(Clint *clint);
+void clint_set_mtime(Clint *clint, uint64_t mtime);
+
+/* For saving and restoring a machine: unlike a store by the hart, setting
+   mtimecmp leaves MTIP as it is */
+uint64_t clint_mtimecmp(Clint *clint, int hart);
+void clint_set_mtimecmp(Clint *clint, int hart, uint64_t mtimecmp);
+
+/* Sets MTIP if the hart's mtime has reached its mtimecmp, and clears it
+   otherwise. Does nothing for a hart without a CLINT. */
+void clint_update_timer(CPU *cpu);
+
+/* What WFI does: parks the hart's thread until an interrupt enabled in mie
+   is pending, sleeping on the host until mtimecmp when timer interrupts are
+   enabled, so that an idle hart costs no host time */
+void clint_wait(CPU *cpu);
+
+#endif
@@ -0,0 +1,34 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <sys/shm.h>
+#include "coverage.h"
+
+static uint8_t private_map[COVERAGE_MAP_SIZE];
+
+uint8_t *coverage_map = private_map;
+_Thread_local uint32_t coverage_prev;
+
+/* Defined by libFuzzer; lets it treat the map as a module's counters */
+extern void __sanitizer_cov_8bit_counters_init(uint8_t *start, uint8_t *stop) __attribute__((weak));
+
+void coverage_set_map(uint8_t *map) {
+    coverage_map = map ? map : private_map;
+}
+
+/* libFuzzer only picks up counters registered before it starts, and AFL's
+   fork server expects the map attached before the first execution, so this
+   runs before main() */
+__attribute__((constructor))
+static void coverage_init(void) {
+    const char *id = getenv("__AFL_SHM_ID");
+    if(id) {
+        void *map = shmat(atoi(id), NULL, 0);
+        if(map != (void *)-1) {
+            coverage_map = map;
+            return;
+        }
+    }
+    if(__sanitizer_cov_8bit_counters_init) {
+        __sanitizer_cov_8bit_counters_init(private_map, private_map + COVERAGE_MAP_SIZE);
+    }
+}
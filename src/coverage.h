@@ -0,0 +1,41 @@
+#ifndef __COVERAGE_H
+#define __COVERAGE_H
+
+#include <stdint.h>
+
+/* Edge coverage for coverage-guided fuzzers, only built with -DCOVERAGE
+   (make COVERAGE=1). Blocks end at every branch, indirect jump and
+   exception, so every control flow transfer the guest makes is an edge
+   between two blocks. Each block gets a random-looking ID once, when it is
+   built, and running it bumps the same counter AFL's instrumentation
+   would: map[id ^ (previous id >> 1)].
+
+   The map is found automatically: AFL's shared memory when __AFL_SHM_ID
+   is set, libFuzzer's inline 8-bit counters when linked into a libFuzzer
+   harness, and otherwise a private map that can be replaced. */
+#define COVERAGE_MAP_BITS   16
+#define COVERAGE_MAP_SIZE   (1 << COVERAGE_MAP_BITS)
+
+extern uint8_t *coverage_map;
+
+/* The previous block on this thread, i.e. this hart, already shifted */
+extern _Thread_local uint32_t coverage_prev;
+
+static inline uint32_t coverage_id(uint64_t pc) {
+    return (uint32_t)((pc >> 1) * 0x9e3779b97f4a7c15ULL >> (64 - COVERAGE_MAP_BITS));
+}
+
+static inline void coverage_block(uint32_t id) {
+    coverage_map[id ^ coverage_prev]++;
+    coverage_prev = id >> 1;
+}
+
+/* Makes the calling thread's next block the first of a new execution */
+static inline void coverage_restart(void) {
+    coverage_prev = 0;
+}
+
+/* Points coverage at a COVERAGE_MAP_SIZE byte map */
+void coverage_set_map(uint8_t *map);
+
+#endif
@@ -1,115 +1,48 @@
 #include <stdbool.h>
+#include <string.h>
 #include "cpu.h"
 #include "bus.h"
+#include "insn.h"
+#include "csr.h"
+#include "mmu.h"
+#include "block.h"
+#include "smp.h"
+#include "clint.h"
+#include "amo.h"
+#include "rvc.h"
+#include "vector.h"
+#include "fpu.h"
+#include "muldiv.h"
+#include "trap.h"
 
 // Extension defines
 #define EXT_M
 
-#define OP_LUI                      0x37
-#define OP_AUIPC                    0x17
-#define OP_JAL                      0x6f
-#define OP_JALR                     0x67
-#define OP_BRANCH                   0x63
-#define OP_LOAD                     0x3
-#define OP_STORE                    0x23
-#define OP_IMM                      0x13
-#define OP_IMM32                    0x1b
-#define OP_OP                       0x33
-#define OP_OP32                     0x3b
-#define OP_MISC_MEM                 0xf
-#define OP_SYSTEM                   0x73
-
-#define LOAD_FUNCT3_LB              0x0
-#define LOAD_FUNCT3_LH              0x1
-#define LOAD_FUNCT3_LW              0x2
-#define LOAD_FUNCT3_LBU             0x4
-#define LOAD_FUNCT3_LHU             0x5
-#define LOAD_FUNCT3_LWU             0x6
-#define LOAD_FUNCT3_LD              0x3
-
-#define STORE_FUNCT3_SB             0x0
-#define STORE_FUNCT3_SH             0x1
-#define STORE_FUNCT3_SW             0x2
-#define STORE_FUNCT3_SD             0x3
-
-#define BRANCH_FUNCT3_BEQ           0x0
-#define BRANCH_FUNCT3_BNE           0x1
-#define BRANCH_FUNCT3_BLT           0x4
-#define BRANCH_FUNCT3_BGE           0x5
-#define BRANCH_FUNCT3_BLTU          0x6
-#define BRANCH_FUNCT3_BGEU          0x7
-
-#define OP_IMM_FUNCT3_ADDI          0x0
-#define OP_IMM_FUNCT3_SLLI          0x1
-#define OP_IMM_FUNCT3_SLTI          0x2 
-#define OP_IMM_FUNCT3_SLTIU         0x3
-#define OP_IMM_FUNCT3_XORI          0x4
-#define OP_IMM_FUNCT3_SRLI_SRAI     0x5
-#define OP_IMM_FUNCT3_ORI           0x6
-#define OP_IMM_FUNCT3_ANDI          0x7
-
-#define OP_IMM32_FUNCT3_ADDIW       0x0
-#define OP_IMM32_FUNCT3_SLLIW       0x1
-#define OP_IMM32_FUNCT3_SRLIW_SRAIW 0x5
-
-#define OP_FUNCT3_ADD_SUB           0x0
-#define OP_FUNCT3_SLL               0x1
-#define OP_FUNCT3_SLT               0x2
-#define OP_FUNCT3_SLTU              0x3
-#define OP_FUNCT3_XOR               0x4
-#define OP_FUNCT3_SRL_SRA           0x5
-#define OP_FUNCT3_OR                0x6
-#define OP_FUNCT3_AND               0x7
-
-#define OP32_FUNCT3_ADDW_SUBW       0x0
-#define OP32_FUNCT3_SLLW            0x1
-#define OP32_FUNCT3_SRLW_SRAW       0x5
-
-#define MISC_MEM_FUNCT3_FENCE       0x0
-
-#define SYSTEM_FUNCT3_ECALL_EBREAK  0x0
-
-// Fence modes
-#define FENCE_MODE_NORMAL           0x0
-#define FENCE_MODE_TSO              0x8
-
-static inline bool address_misaligned(uint64_t addr) {
-    return addr & 0x3;
-}
-
-/* Immediate operands in instructions may be stored in one of five formats and
-   are always sign-extended, which we accomplish using struct bitfields. */
-static inline int64_t decode_immediate_I(uint32_t insn) {
-    struct { signed int x: 12; } s;
-    s.x = insn >> 20;
-    return s.x;
+void cpu_reset(CPU *cpu) {
+    struct Machine *machine = cpu->machine;
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->machine = machine;
+    cpu->priv = PL_MACHINE;
+    tlb_flush(cpu);
 }
 
-static inline int64_t decode_immediate_S(uint32_t insn) {
-    struct { signed int x: 12; } s;
-    s.x = (insn & 0xf80) >> 7 | (insn & 0xfe000000) >> 20;
-    return s.x;
-}
-
-static inline int64_t decode_immediate_B(uint32_t insn) {
-    struct { signed int x: 13; } s;
-    s.x = (insn & 0x80) << 4 | (insn & 0xf00) >> 7 | (insn & 0x7e000000) >> 20 | (insn & 0x80000000) >> 19;
-    return s.x;
-}
-
-static inline int64_t decode_immediate_U(uint32_t insn) {
-    struct { signed int x: 20; } s;
-    s.x = insn & 0xfffff000;
-    return s.x;
-}
-
-static inline int64_t decode_immediate_J(uint32_t insn) {
-    struct { signed int x: 20; } s;
-    s.x = (insn & 0xff000) | (insn & 0x100000) >> 9 | (insn & 0x7fe00000) >> 20 | (insn & 0x80000000) >> 11;
-    return s.x;
+bool cpu_exit_request(CPU *cpu) {
+    uint32_t request = atomic_exchange_explicit(&cpu->exit_request, 0, memory_order_acquire);
+    if(request & EXIT_BREAKPOINT) {
+        /* The debugger gets to see the hart at the breakpoint; interrupts
+           wait for it to resume */
+        atomic_fetch_or_explicit(&cpu->exit_request, request & EXIT_INTERRUPT, memory_order_relaxed);
+        return false;
+    }
+    if(request & EXIT_INTERRUPT) {
+        trap_interrupt(cpu);
+    }
+    return !(request & EXIT_STOP);
 }
 
-void exec32(uint32_t insn, CPU *cpu) {
+/* `length` is 2 when `insn` is the expansion of a compressed instruction;
+   it is what PC advances by and what links point past */
+static void execute(uint32_t insn, int length, CPU *cpu) {
 
     /* Lowest 6 bits are always the opcode, the other fields are speculatively
        decoded here */
@@ -120,7 +53,7 @@ void exec32(uint32_t insn, CPU *cpu) {
         rs2 = (insn >> 20) & 0x1f,
         funct7 = insn >> 25;
 
-    /* By default we increase PC by 4 to move to the next instruction, but we
+    /* By default we increase PC to move to the next instruction, but we
        shouldn't do this after a branch, so keep track of whether PC was 
        updated by the instruction. */
     bool pc_updated = false;
@@ -130,8 +63,10 @@ void exec32(uint32_t insn, CPU *cpu) {
     int64_t imm;
     uint32_t imm32;
     int shift, shift_type;
-    int fenceMode;
+    int size;
     bool should_branch;
+    uint64_t csr_value, csr_operand;
+    uint64_t value;
 
     switch(opcode) {
         case OP_LUI:
@@ -143,18 +78,20 @@ void exec32(uint32_t insn, CPU *cpu) {
         case OP_JAL:
             target = cpu->pc + decode_immediate_J(insn);
             if(address_misaligned(target)) {
-                break; // TODO: instruction misaligned
+                trap_raise(cpu, CAUSE_MISALIGNED_FETCH, target);
+                break;
             }
-            cpu->regs[rd] = cpu->pc + 4;
+            cpu->regs[rd] = cpu->pc + length;
             cpu->pc = target;
             pc_updated = true;
             break;
         case OP_JALR: 
-            target = (cpu->pc + decode_immediate_I(insn)) & ~(uint64_t)1;
+            target = (cpu->regs[rs1] + decode_immediate_I(insn)) & ~(uint64_t)1;
             if(address_misaligned(target)) {
-                break; // TODO: instruction misaligned
+                trap_raise(cpu, CAUSE_MISALIGNED_FETCH, target);
+                break;
             }
-            cpu->regs[rd] = cpu->pc + 4;
+            cpu->regs[rd] = cpu->pc + length;
             cpu->pc = target;
             pc_updated = true;
             break;
@@ -179,12 +116,13 @@ void exec32(uint32_t insn, CPU *cpu) {
                     should_branch = cpu->regs[rs1] >= cpu->regs[rs2];
                     break;
                 default:
-                    break; // TODO: illegal instruction
+                    goto illegal;
             }
             if(should_branch) {
                 target = cpu->pc + decode_immediate_B(insn);
                 if(address_misaligned(target)) {
-                    break; // TODO: instruction misaligned
+                    trap_raise(cpu, CAUSE_MISALIGNED_FETCH, target);
+                    break;
                 }
                 cpu->pc = target;
                 pc_updated = true;
@@ -194,47 +132,51 @@ void exec32(uint32_t insn, CPU *cpu) {
             target = cpu->regs[rs1] + decode_immediate_I(insn);
             switch(funct3) {
                 case LOAD_FUNCT3_LB:
-                    cpu->regs[rd] = (int8_t)load8(target);
+                    value = (int8_t)mmu_load(cpu, target, 1);
                     break;
                 case LOAD_FUNCT3_LH:
-                    cpu->regs[rd] = (int16_t)load16(target);
+                    value = (int16_t)mmu_load(cpu, target, 2);
                     break;
                 case LOAD_FUNCT3_LW:
-                    cpu->regs[rd] = (int32_t)load32(target);
+                    value = (int32_t)mmu_load(cpu, target, 4);
                     break;
                 case LOAD_FUNCT3_LBU:
-                    cpu->regs[rd] = load8(target);
+                    value = mmu_load(cpu, target, 1);
                     break;
                 case LOAD_FUNCT3_LHU:
-                    cpu->regs[rd] = load16(target);
+                    value = mmu_load(cpu, target, 2);
                     break;
                 case LOAD_FUNCT3_LWU:
-                    cpu->regs[rd] = load32(target);
+                    value = mmu_load(cpu, target, 4);
                     break;
                 case LOAD_FUNCT3_LD:
-                    cpu->regs[rd] = load64(target);
+                    value = mmu_load(cpu, target, 8);
                     break;
                 default:
-                    break; // TODO: illegal instruction
+                    goto illegal;
+            }
+            /* A faulting load leaves rd alone */
+            if(!cpu->trap_pending) {
+                cpu->regs[rd] = value;
             }
             break;
         case OP_STORE:
             target = cpu->regs[rs1] + decode_immediate_S(insn);
             switch(funct3) {
                 case STORE_FUNCT3_SB:
-                    store8(target, cpu->regs[rs2]);
+                    mmu_store(cpu, target, cpu->regs[rs2], 1);
                     break;
                 case STORE_FUNCT3_SH:
-                    store16(target, cpu->regs[rs2]);
+                    mmu_store(cpu, target, cpu->regs[rs2], 2);
                     break;
                 case STORE_FUNCT3_SW:
-                    store32(target, cpu->regs[rs2]);
+                    mmu_store(cpu, target, cpu->regs[rs2], 4);
                     break;
                 case STORE_FUNCT3_SD:
-                    store64(target, cpu->regs[rs2]);
+                    mmu_store(cpu, target, cpu->regs[rs2], 8);
                     break;
                 default:
-                    break; // TODO: illegal instruction
+                    goto illegal;
             }
             break;
         case OP_IMM:
@@ -262,21 +204,37 @@ void exec32(uint32_t insn, CPU *cpu) {
                     if((imm & 0xfc0) == 0)
                         cpu->regs[rd] = cpu->regs[rs1] << (imm & 0x3f); 
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP_IMM_FUNCT3_SRLI_SRAI:
                     shift = imm & 0x3f;
                     shift_type = imm & 0xfc0;
                     if(shift_type == 0) 
                         cpu->regs[rd] = cpu->regs[rs1] >> shift;
-                    else if(shift_type == 0x10)
+                    else if(shift_type == 0x400)
                         cpu->regs[rd] = (int64_t)cpu->regs[rs1] >> shift;
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
             }
             break;
         case OP_OP:
+#ifdef EXT_M
+            if(funct7 == FUNCT7_MULDIV) {
+                uint64_t a = cpu->regs[rs1], b = cpu->regs[rs2];
+                switch(funct3) {
+                    case MULDIV_FUNCT3_MUL: cpu->regs[rd] = a * b; break;
+                    case MULDIV_FUNCT3_MULH: cpu->regs[rd] = mul_high(a, b); break;
+                    case MULDIV_FUNCT3_MULHSU: cpu->regs[rd] = mul_high_su(a, b); break;
+                    case MULDIV_FUNCT3_MULHU: cpu->regs[rd] = mul_high_u(a, b); break;
+                    case MULDIV_FUNCT3_DIV: cpu->regs[rd] = div_signed(a, b); break;
+                    case MULDIV_FUNCT3_DIVU: cpu->regs[rd] = div_unsigned(a, b); break;
+                    case MULDIV_FUNCT3_REM: cpu->regs[rd] = rem_signed(a, b); break;
+                    case MULDIV_FUNCT3_REMU: cpu->regs[rd] = rem_unsigned(a, b); break;
+                }
+                break;
+            }
+#endif
             switch(funct3) {
                 case OP_FUNCT3_ADD_SUB:
                     if(funct7 == 0)
@@ -284,52 +242,52 @@ void exec32(uint32_t insn, CPU *cpu) {
                     else if(funct7 == 0x20)
                         cpu->regs[rd] = cpu->regs[rs1] - cpu->regs[rs2];
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP_FUNCT3_SLL:
                     if(funct7 == 0)
                         cpu->regs[rd] = cpu->regs[rs1] << (cpu->regs[rs2] & 0x3f);
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP_FUNCT3_SLT:
                     if(funct7 == 0)
                         cpu->regs[rd] = (int64_t)cpu->regs[rs1] < (int64_t)cpu->regs[rs2];
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP_FUNCT3_SLTU:
                     if(funct7 == 0)
                         cpu->regs[rd] = cpu->regs[rs1] < cpu->regs[rs2];
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP_FUNCT3_XOR:
                     if(funct7 == 0)
                         cpu->regs[rd] = cpu->regs[rs1] ^ cpu->regs[rs2];
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP_FUNCT3_SRL_SRA:
                     shift = cpu->regs[rs2] & 0x3f;
                     if(funct7 == 0)
                         cpu->regs[rd] = cpu->regs[rs1] >> shift;
                     else if(funct7 == 0x20)
-                        cpu->regs[rd] = cpu->regs[rs1] >> shift;
+                        cpu->regs[rd] = (int64_t)cpu->regs[rs1] >> shift;
                     else 
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP_FUNCT3_OR:
                     if(funct7 == 0)
                         cpu->regs[rd] = cpu->regs[rs1] | cpu->regs[rs2];
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP_FUNCT3_AND:
                     if(funct7 == 0)
                         cpu->regs[rd] = cpu->regs[rs1] & cpu->regs[rs2];
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
             }
             break;
@@ -343,23 +301,37 @@ void exec32(uint32_t insn, CPU *cpu) {
                     if((imm32 & 0xfe0) == 0)
                         cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] << (imm32 & 0x1f)); 
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP_IMM32_FUNCT3_SRLIW_SRAIW:
                     shift = imm32 & 0x1f;
                     shift_type = imm32 & 0xfe0;
                     if(shift_type == 0) 
                         cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] >> shift);
-                    else if(shift_type == 0x20)
+                    else if(shift_type == 0x400)
                         cpu->regs[rd] = (int32_t)cpu->regs[rs1] >> shift;
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 default:
-                    break; // TODO: illegal instruction
+                    goto illegal;
             }
             break;
         case OP_OP32:
+#ifdef EXT_M
+            if(funct7 == FUNCT7_MULDIV) {
+                uint64_t a = cpu->regs[rs1], b = cpu->regs[rs2];
+                switch(funct3) {
+                    case MULDIV_FUNCT3_MUL: cpu->regs[rd] = (int32_t)((uint32_t)a * (uint32_t)b); break;
+                    case MULDIV_FUNCT3_DIV: cpu->regs[rd] = div_signed32(a, b); break;
+                    case MULDIV_FUNCT3_DIVU: cpu->regs[rd] = div_unsigned32(a, b); break;
+                    case MULDIV_FUNCT3_REM: cpu->regs[rd] = rem_signed32(a, b); break;
+                    case MULDIV_FUNCT3_REMU: cpu->regs[rd] = rem_unsigned32(a, b); break;
+                    default: goto illegal;
+                }
+                break;
+            }
+#endif
             switch(funct3) {
                 case OP32_FUNCT3_ADDW_SUBW:
                     if(funct7 == 0)
@@ -367,13 +339,13 @@ void exec32(uint32_t insn, CPU *cpu) {
                     else if(funct7 == 0x20)
                         cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] - (uint32_t)cpu->regs[rs2]);
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP32_FUNCT3_SLLW:
                     if(funct7 == 0)
                         cpu->regs[rd] = (int32_t)((uint32_t)cpu->regs[rs1] << (cpu->regs[rs2] & 0x1f));
                     else
-                        break; // TODO: illegal instruction
+                        goto illegal;
                     break;
                 case OP32_FUNCT3_SRLW_SRAW:
                     shift = cpu->regs[rs2] & 0x1f;
@@ -382,44 +354,189 @@ void exec32(uint32_t insn, CPU *cpu) {
                     else if(funct7 == 0x20)
                         cpu->regs[rd] = (int32_t)cpu->regs[rs1] >> shift;
                     else 
-                        break; // TODO: illegal instruction
+                        goto illegal;
+                    break;
+                default:
+                    goto illegal;
+            }
+            break;
+        case OP_AMO:
+            if(funct3 != AMO_FUNCT3_W && funct3 != AMO_FUNCT3_D) {
+                goto illegal;
+            }
+            size = funct3 == AMO_FUNCT3_W ? 4 : 8;
+            switch(funct7 >> 2) {
+                case AMO_LR:
+                    if(rs2 != 0) {
+                        goto illegal;
+                    }
+                    value = amo_lr(cpu, cpu->regs[rs1], size);
+                    break;
+                case AMO_SC:
+                    value = amo_sc(cpu, cpu->regs[rs1], cpu->regs[rs2], size);
+                    break;
+                case AMO_SWAP:
+                case AMO_ADD:
+                case AMO_XOR:
+                case AMO_AND:
+                case AMO_OR:
+                case AMO_MIN:
+                case AMO_MAX:
+                case AMO_MINU:
+                case AMO_MAXU:
+                    value = amo_rmw(cpu, cpu->regs[rs1], cpu->regs[rs2], funct7 >> 2, size);
                     break;
                 default:
-                    break; // TODO: illegal instruction
+                    goto illegal;
+            }
+            if(!cpu->trap_pending) {
+                cpu->regs[rd] = value;
+            }
+            break;
+        case OP_LOAD_FP:
+        case OP_STORE_FP:
+        case OP_V:
+            /* Both raise their own exceptions */
+            if(vector_insn(insn)) {
+                vector_exec(cpu, insn);
+            } else if(!fpu_insn(insn)) {
+                goto illegal;
+            } else {
+                fpu_exec(cpu, insn);
             }
             break;
+        case OP_MADD:
+        case OP_MSUB:
+        case OP_NMSUB:
+        case OP_NMADD:
+        case OP_FP:
+            fpu_exec(cpu, insn);
+            break;
         case OP_MISC_MEM:
             switch(funct3) {
                 case MISC_MEM_FUNCT3_FENCE:
-                    /* Since our EEI only supports a single hart and all memory
-                       operations are immediately executed, FENCE is a no-op. */
+                    /* All memory operations are immediately executed, so a
+                       single hart needs nothing. With several harts, guest
+                       accesses are plain host accesses and RVWMO is mapped
+                       onto host fences. */
+                    if(cpu->machine->num_harts > 1) {
+                        if(fence_orders_store_load(insn)) {
+                            smp_fence_sc();
+                        } else {
+                            smp_fence();
+                        }
+                    }
+                    break;
+                case MISC_MEM_FUNCT3_FENCE_I:
+                    /* Stores already discard stale blocks on every hart,
+                       but one racing with this hart building a block can
+                       go unnoticed, so start over with fresh blocks */
+                    block_invalidate_local();
                     break;
                 default:
-                    break; // TODO: illegal instruction
+                    goto illegal;
             }
             break;
         case OP_SYSTEM:
             switch(funct3) {
                 case SYSTEM_FUNCT3_ECALL_EBREAK:
-                    
+                    if(rd != 0 || (rs1 != 0 && funct7 != SYSTEM_FUNCT7_SFENCE_VMA)) {
+                        goto illegal;
+                    }
+                    if(funct7 == SYSTEM_FUNCT7_SFENCE_VMA) {
+                        if(cpu->priv == PL_USER) {
+                            goto illegal;
+                        }
+                        /* Translations are only cached in the TLB and
+                           blocks, so flush everything regardless of the
+                           address and ASID operands */
+                        mmu_flush(cpu);
+                    } else if(insn >> 20 == SYSTEM_FUNCT12_WFI) {
+                        /* TW makes it trap right away rather than after
+                           some bounded time, which is allowed */
+                        if(cpu->priv == PL_USER || (cpu->priv < PL_MACHINE && (cpu->mstatus & MSTATUS_TW))) {
+                            goto illegal;
+                        }
+                        clint_wait(cpu);
+                    } else if(insn >> 20 == SYSTEM_FUNCT12_ECALL) {
+                        trap_raise(cpu, CAUSE_ECALL_U + cpu->priv, 0);
+                    } else if(insn >> 20 == SYSTEM_FUNCT12_EBREAK) {
+                        trap_raise(cpu, CAUSE_BREAKPOINT, cpu->pc);
+                    } else if(insn >> 20 == SYSTEM_FUNCT12_MRET || insn >> 20 == SYSTEM_FUNCT12_SRET) {
+                        int priv = insn >> 20 == SYSTEM_FUNCT12_MRET ? PL_MACHINE : PL_SUPERVISOR;
+                        if(cpu->priv < priv) {
+                            goto illegal;
+                        }
+                        trap_return(cpu, priv);
+                        pc_updated = true;
+                    } else {
+                        goto illegal;
+                    }
+                    break;
+                case SYSTEM_FUNCT3_CSRRW:
+                case SYSTEM_FUNCT3_CSRRS:
+                case SYSTEM_FUNCT3_CSRRC:
+                case SYSTEM_FUNCT3_CSRRWI:
+                case SYSTEM_FUNCT3_CSRRSI:
+                case SYSTEM_FUNCT3_CSRRCI:
+                    /* The immediate forms use rs1 as a 5-bit immediate.
+                       CSRRW doesn't read the CSR when rd is x0, and the
+                       others don't write it when rs1 is x0. */
+                    csr_operand = funct3 & 0x4 ? (uint64_t)rs1 : cpu->regs[rs1];
+                    csr_value = 0;
+                    if(((funct3 & 0x3) != SYSTEM_FUNCT3_CSRRW || rd != 0) && !csr_read(cpu, insn >> 20, &csr_value)) {
+                        goto illegal;
+                    }
+                    if((funct3 & 0x3) == SYSTEM_FUNCT3_CSRRS) {
+                        csr_operand |= csr_value;
+                    } else if((funct3 & 0x3) == SYSTEM_FUNCT3_CSRRC) {
+                        csr_operand = csr_value & ~csr_operand;
+                    }
+                    if(((funct3 & 0x3) == SYSTEM_FUNCT3_CSRRW || rs1 != 0) && !csr_write(cpu, insn >> 20, csr_operand)) {
+                        goto illegal;
+                    }
+                    cpu->regs[rd] = csr_value;
                     break;
                 default:
-                    break; // TODO: illegal instruction
+                    goto illegal;
             }
             break;
         default: 
-            break; // TODO: illegal instruction
+            goto illegal;
+    }
+
+    /* A trap leaves PC at the instruction that raised it */
+    if(cpu->trap_pending) {
+        return;
     }
 
     if(!pc_updated) {
-        cpu->pc += 4;
+        cpu->pc += length;
     }
 
     /* x0 must always be zero */
     cpu->regs[0] = 0;
+    return;
+
+illegal:
+    /* mtval may be zero instead of the instruction, which is what it is for
+       compressed ones: only their expansion is known here */
+    trap_raise(cpu, CAUSE_ILLEGAL_INSN, length == 4 ? insn : 0);
+
+}
+
+void exec32(uint32_t insn, CPU *cpu) {
+    execute(insn, 4, cpu);
+}
 
+void exec16(uint16_t insn, CPU *cpu) {
+    execute(rvc_expand(insn), 2, cpu);
 }
 
-int main(int argc, char **argv) {
-    return 0;
-}
\ No newline at end of file
+void exec_insn(uint32_t insn, CPU *cpu) {
+    if(insn_compressed(insn)) {
+        exec16(insn, cpu);
+    } else {
+        exec32(insn, cpu);
+    }
+}
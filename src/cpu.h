@@ -1,15 +1,111 @@
 #ifndef __CORE_H
 #define __CORE_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #define PL_USER         0x0
 #define PL_SUPERVISOR   0x1
 #define PL_MACHINE      0x3
 
+/* Software TLB: a direct-mapped cache from guest virtual pages to host
+   pointers. Each tag is the page address if the page may be accessed that
+   way, and TLB_INVALID otherwise. */
+#define TLB_BITS        8
+#define TLB_SIZE        (1 << TLB_BITS)
+#define TLB_INVALID     (~(uint64_t)0)
+
+/* Vector register length in bits, as wide as an AVX2 register */
+#define VLEN            256
+#define VLENB           (VLEN / 8)
+
+/* Reasons for a hart to leave straight-line execution at its next block
+   boundary, which other threads and devices set in exit_request */
+#define EXIT_INTERRUPT  0x1     // something became pending or enabled
+#define EXIT_STOP       0x2     // block_run() should return
+#define EXIT_BREAKPOINT 0x4     // the hart reached a breakpoint; PC is at it
+
+typedef struct {
+    uint64_t tag_read, tag_write, tag_exec;
+    uint64_t addend;    // host address = guest virtual address + addend
+} TLBEntry;
+
+struct Machine;
+struct Clint;
+struct TraceRing;
+
 typedef struct {
+    struct Machine *machine;    // everything outside the hart; see machine.h
+
     uint64_t regs[32];
     uint64_t pc;
+    int priv;
+    uint64_t hartid;
+
+    /* Retired instructions. Engines count them at block boundaries; exec32()
+       doesn't count the instruction it executes. */
+    uint64_t instret;
+
+    /* CSRs */
+    uint64_t mstatus;
+    uint64_t satp;
+    uint64_t mie;
+    _Atomic uint64_t mip;   // also set by other harts' threads through the CLINT
+    uint64_t cycle_offset;  // mcycle is instret plus this
+    uint32_t mcounteren, scounteren;
+    struct Clint *clint;    // source of the time CSR, if any
+
+    /* Trap CSRs of the two levels that handle traps; see trap.h */
+    uint64_t mtvec, mepc, mcause, mtval, mscratch;
+    uint64_t stvec, sepc, scause, stval, sscratch;
+    uint64_t medeleg, mideleg;
+
+    /* The exception raised by the instruction being executed, for the
+       engine to take */
+    bool trap_pending;
+    uint64_t trap_cause, trap_tval;
+
+    /* Set while the hart waits in WFI; see smp_park() */
+    _Atomic bool parked;
+    _Atomic uint32_t wakeups;
+
+    /* EXIT_* bits, only looked at between blocks so that nothing is
+       checked per instruction; see cpu_exit_request() */
+    _Atomic uint32_t exit_request;
+
+    /* Floating-point state; see fpu.h. Single-precision values are
+       NaN-boxed in the upper half. */
+    uint64_t fregs[32];
+    uint8_t frm, fflags;
+
+    /* Vector state; see vector.h */
+    uint64_t vl, vtype, vstart;
+    uint8_t vxrm, vxsat;
+    _Alignas(VLENB) uint8_t vregs[32][VLENB];
+
+    /* LR/SC reservation: the host address and the value LR loaded */
+    uint8_t *reservation;
+    uint64_t reservation_value;
+
+    /* Where the hart records its execution, if anywhere; see trace.h */
+    struct TraceRing *trace;
+
+    TLBEntry tlb[TLB_SIZE];
 } CPU;
 
-#endif
\ No newline at end of file
+/* Resets everything but the machine the hart belongs to */
+void cpu_reset(CPU *cpu);
+
+/* Called by the engines between blocks once exit_request is nonzero, to
+   deal with what was asked. Returns false if the hart is to stop. */
+bool cpu_exit_request(CPU *cpu);
+
+/* The reference interpreter. Compressed instructions are executed as their
+   32-bit expansion; exec_insn() takes either kind, told apart by the low two
+   bits as fetched. */
+void exec32(uint32_t insn, CPU *cpu);
+void exec16(uint16_t insn, CPU *cpu);
+void exec_insn(uint32_t insn, CPU *cpu);
+
+#endif
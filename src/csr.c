@@ -0,0 +1,286 @@
+#include "csr.h"
+#include "mmu.h"
+#include "clint.h"
+#include "fpu.h"
+
+/* Bits 9:8 of the CSR address give the lowest privilege level that can access
+   it, and CSRs with bits 11:10 set are read-only */
+static inline bool csr_accessible(CPU *cpu, int csr) {
+    return ((csr >> 8) & 0x3) <= cpu->priv;
+}
+
+/* The unprivileged counters are only visible below machine mode if every
+   more privileged level enables them */
+static inline bool counter_accessible(CPU *cpu, int csr) {
+    uint32_t bit = 1 << (csr - CSR_CYCLE);
+    return cpu->priv == PL_MACHINE ||
+           ((cpu->mcounteren & bit) && (cpu->priv == PL_SUPERVISOR || (cpu->scounteren & bit)));
+}
+
+/* SD is read-only and tells whether any extension state is dirty */
+static uint64_t read_mstatus(CPU *cpu) {
+    uint64_t status = cpu->mstatus;
+    if((status & MSTATUS_VS) == MSTATUS_VS_DIRTY || (status & MSTATUS_FS) == MSTATUS_FS_DIRTY) {
+        status |= MSTATUS_SD;
+    }
+    return status;
+}
+
+/* The vector CSRs are only there while the vector unit is on */
+static inline bool vector_enabled(CPU *cpu) {
+    return (cpu->mstatus & MSTATUS_VS) != MSTATUS_VS_OFF;
+}
+
+/* Likewise the floating-point CSRs and the FPU */
+static inline bool fpu_enabled(CPU *cpu) {
+    return (cpu->mstatus & MSTATUS_FS) != MSTATUS_FS_OFF;
+}
+
+bool csr_read(CPU *cpu, int csr, uint64_t *value) {
+
+    if(!csr_accessible(cpu, csr)) {
+        return false;
+    }
+
+    switch(csr) {
+        case CSR_SSTATUS:
+            *value = read_mstatus(cpu) & (SSTATUS_MASK | MSTATUS_SD);
+            return true;
+        case CSR_SATP:
+            *value = cpu->satp;
+            return true;
+        case CSR_MSTATUS:
+            *value = read_mstatus(cpu);
+            return true;
+        case CSR_MIE:
+            *value = cpu->mie;
+            return true;
+        case CSR_MIP:
+        case CSR_SIP:
+            clint_update_timer(cpu);
+            *value = atomic_load_explicit(&cpu->mip, memory_order_acquire) & (csr == CSR_SIP ? cpu->mideleg : ~(uint64_t)0);
+            return true;
+        case CSR_SIE:
+            *value = cpu->mie & cpu->mideleg;
+            return true;
+        case CSR_MISA:
+            *value = MISA_VALUE;
+            return true;
+        case CSR_MEDELEG: *value = cpu->medeleg; return true;
+        case CSR_MIDELEG: *value = cpu->mideleg; return true;
+        case CSR_MTVEC: *value = cpu->mtvec; return true;
+        case CSR_MSCRATCH: *value = cpu->mscratch; return true;
+        case CSR_MEPC: *value = cpu->mepc; return true;
+        case CSR_MCAUSE: *value = cpu->mcause; return true;
+        case CSR_MTVAL: *value = cpu->mtval; return true;
+        case CSR_STVEC: *value = cpu->stvec; return true;
+        case CSR_SSCRATCH: *value = cpu->sscratch; return true;
+        case CSR_SEPC: *value = cpu->sepc; return true;
+        case CSR_SCAUSE: *value = cpu->scause; return true;
+        case CSR_STVAL: *value = cpu->stval; return true;
+        case CSR_MHARTID:
+            *value = cpu->hartid;
+            return true;
+        case CSR_MCOUNTEREN:
+            *value = cpu->mcounteren;
+            return true;
+        case CSR_SCOUNTEREN:
+            *value = cpu->scounteren;
+            return true;
+        case CSR_CYCLE:
+        case CSR_TIME:
+        case CSR_INSTRET:
+            if(!counter_accessible(cpu, csr)) {
+                return false;
+            }
+            if(csr == CSR_TIME) {
+                /* Without a CLINT there is no timer to read */
+                if(!cpu->clint) {
+                    return false;
+                }
+                *value = clint_mtime(cpu->clint);
+                return true;
+            }
+            // fall through
+        case CSR_MCYCLE:
+        case CSR_MINSTRET:
+            /* One instruction per cycle */
+            *value = cpu->instret + (csr == CSR_CYCLE || csr == CSR_MCYCLE ? cpu->cycle_offset : 0);
+            return true;
+        case CSR_FFLAGS:
+        case CSR_FRM:
+        case CSR_FCSR:
+            if(!fpu_enabled(cpu)) {
+                return false;
+            }
+            /* The flags accrue on the host until someone looks */
+            fpu_sync_flags(cpu);
+            switch(csr) {
+                case CSR_FFLAGS: *value = cpu->fflags; break;
+                case CSR_FRM: *value = cpu->frm; break;
+                default: *value = cpu->frm << 5 | cpu->fflags; break;
+            }
+            return true;
+        case CSR_VSTART:
+        case CSR_VXSAT:
+        case CSR_VXRM:
+        case CSR_VCSR:
+        case CSR_VL:
+        case CSR_VTYPE:
+        case CSR_VLENB:
+            if(!vector_enabled(cpu)) {
+                return false;
+            }
+            switch(csr) {
+                case CSR_VSTART: *value = cpu->vstart; break;
+                case CSR_VXSAT: *value = cpu->vxsat; break;
+                case CSR_VXRM: *value = cpu->vxrm; break;
+                case CSR_VCSR: *value = cpu->vxrm << 1 | cpu->vxsat; break;
+                case CSR_VL: *value = cpu->vl; break;
+                case CSR_VTYPE: *value = cpu->vtype; break;
+                default: *value = VLENB; break;
+            }
+            return true;
+        default:
+            return false;
+    }
+
+}
+
+static void write_mstatus(CPU *cpu, uint64_t value, uint64_t mask) {
+    uint64_t old = cpu->mstatus;
+    cpu->mstatus = (old & ~mask) | (value & mask);
+    uint64_t changed = old ^ cpu->mstatus;
+    /* With MPRV set, MPP is the privilege loads and stores are translated
+       for */
+    if((changed & MSTATUS_MMU_BITS) || ((changed & MSTATUS_MPP) && ((old | cpu->mstatus) & MSTATUS_MPRV))) {
+        tlb_flush(cpu);
+    }
+}
+
+/* An interrupt that is already pending may have just been enabled. CSR
+   instructions end their block, so the hart looks right after this one. */
+static void request_interrupt_check(CPU *cpu) {
+    atomic_fetch_or_explicit(&cpu->exit_request, EXIT_INTERRUPT, memory_order_relaxed);
+}
+
+bool csr_write(CPU *cpu, int csr, uint64_t value) {
+
+    if(!csr_accessible(cpu, csr) || (csr >> 10) == 0x3) {
+        return false;
+    }
+
+    switch(csr) {
+        case CSR_SSTATUS:
+            write_mstatus(cpu, value, SSTATUS_MASK);
+            request_interrupt_check(cpu);
+            return true;
+        case CSR_SATP:
+            /* Writes selecting an unsupported mode have no effect */
+            switch(value >> SATP_MODE_SHIFT) {
+                case SATP_MODE_BARE:
+                case SATP_MODE_SV39:
+                case SATP_MODE_SV48:
+                    cpu->satp = value;
+                    tlb_flush(cpu);
+                    break;
+            }
+            return true;
+        case CSR_MSTATUS:
+            write_mstatus(cpu, value, MSTATUS_WRITABLE);
+            request_interrupt_check(cpu);
+            return true;
+        case CSR_MIE:
+            cpu->mie = value & MIE_WRITABLE;
+            request_interrupt_check(cpu);
+            return true;
+        case CSR_SIE:
+            cpu->mie = (cpu->mie & ~cpu->mideleg) | (value & cpu->mideleg);
+            request_interrupt_check(cpu);
+            return true;
+        case CSR_MISA:
+            /* Extensions can't be turned off */
+            return true;
+        case CSR_MEDELEG:
+            cpu->medeleg = value & MEDELEG_WRITABLE;
+            return true;
+        case CSR_MIDELEG:
+            cpu->mideleg = value & MIDELEG_WRITABLE;
+            request_interrupt_check(cpu);
+            return true;
+        case CSR_MTVEC:
+        case CSR_STVEC:
+            /* Modes other than direct and vectored are reserved */
+            if((value & 3) > TVEC_VECTORED) {
+                value &= ~(uint64_t)3;
+            }
+            *(csr == CSR_MTVEC ? &cpu->mtvec : &cpu->stvec) = value;
+            return true;
+        case CSR_MEPC: cpu->mepc = value & ~(uint64_t)1; return true;
+        case CSR_SEPC: cpu->sepc = value & ~(uint64_t)1; return true;
+        case CSR_MSCRATCH: cpu->mscratch = value; return true;
+        case CSR_MCAUSE: cpu->mcause = value; return true;
+        case CSR_MTVAL: cpu->mtval = value; return true;
+        case CSR_SSCRATCH: cpu->sscratch = value; return true;
+        case CSR_SCAUSE: cpu->scause = value; return true;
+        case CSR_STVAL: cpu->stval = value; return true;
+        case CSR_MCOUNTEREN:
+            cpu->mcounteren = value & (COUNTEREN_CY | COUNTEREN_TM | COUNTEREN_IR);
+            return true;
+        case CSR_SCOUNTEREN:
+            cpu->scounteren = value & (COUNTEREN_CY | COUNTEREN_TM | COUNTEREN_IR);
+            return true;
+        case CSR_MCYCLE:
+        case CSR_MINSTRET:
+            /* The write replaces the increment for this instruction, which
+               the engine still adds once it retires */
+            if(csr == CSR_MCYCLE) {
+                cpu->cycle_offset = value - cpu->instret - 1;
+            } else {
+                cpu->cycle_offset += cpu->instret - (value - 1);
+                cpu->instret = value - 1;
+            }
+            return true;
+        case CSR_MIP:
+        case CSR_SIP: {
+            /* Other harts may be setting MSIP at the same time. Supervisor
+               mode can only write its software interrupt, if delegated. */
+            uint64_t mask = csr == CSR_SIP ? MIP_SSIP & cpu->mideleg : MIP_WRITABLE;
+            atomic_fetch_or_explicit(&cpu->mip, value & mask, memory_order_relaxed);
+            atomic_fetch_and_explicit(&cpu->mip, value | ~mask, memory_order_relaxed);
+            request_interrupt_check(cpu);
+            return true;
+        }
+        case CSR_FFLAGS:
+        case CSR_FRM:
+        case CSR_FCSR:
+            if(!fpu_enabled(cpu)) {
+                return false;
+            }
+            switch(csr) {
+                case CSR_FFLAGS: fpu_set_flags(cpu, value); break;
+                case CSR_FRM: cpu->frm = value & 7; break;
+                default: cpu->frm = (value >> 5) & 7; fpu_set_flags(cpu, value); break;
+            }
+            cpu->mstatus |= MSTATUS_FS_DIRTY;
+            return true;
+        case CSR_VSTART:
+        case CSR_VXSAT:
+        case CSR_VXRM:
+        case CSR_VCSR:
+            if(!vector_enabled(cpu)) {
+                return false;
+            }
+            switch(csr) {
+                case CSR_VSTART: cpu->vstart = value & (VLEN - 1); break;
+                case CSR_VXSAT: cpu->vxsat = value & 1; break;
+                case CSR_VXRM: cpu->vxrm = value & 3; break;
+                default: cpu->vxrm = (value >> 1) & 3; cpu->vxsat = value & 1; break;
+            }
+            cpu->mstatus |= MSTATUS_VS_DIRTY;
+            return true;
+        default:
+            return false;
+    }
+
+}
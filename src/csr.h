@@ -0,0 +1,112 @@
+#ifndef __CSR_H
+#define __CSR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+
+#define CSR_FFLAGS          0x001
+#define CSR_FRM             0x002
+#define CSR_FCSR            0x003
+#define CSR_VSTART          0x008
+#define CSR_VXSAT           0x009
+#define CSR_VXRM            0x00a
+#define CSR_VCSR            0x00f
+#define CSR_SSTATUS         0x100
+#define CSR_SIE             0x104
+#define CSR_STVEC           0x105
+#define CSR_SCOUNTEREN      0x106
+#define CSR_SSCRATCH        0x140
+#define CSR_SEPC            0x141
+#define CSR_SCAUSE          0x142
+#define CSR_STVAL           0x143
+#define CSR_SIP             0x144
+#define CSR_SATP            0x180
+#define CSR_MSTATUS         0x300
+#define CSR_MISA            0x301
+#define CSR_MEDELEG         0x302
+#define CSR_MIDELEG         0x303
+#define CSR_MIE             0x304
+#define CSR_MTVEC           0x305
+#define CSR_MCOUNTEREN      0x306
+#define CSR_MSCRATCH        0x340
+#define CSR_MEPC            0x341
+#define CSR_MCAUSE          0x342
+#define CSR_MTVAL           0x343
+#define CSR_MIP             0x344
+#define CSR_MHARTID         0xf14
+#define CSR_MCYCLE          0xb00
+#define CSR_MINSTRET        0xb02
+#define CSR_CYCLE           0xc00
+#define CSR_TIME            0xc01
+#define CSR_INSTRET         0xc02
+#define CSR_VL              0xc20
+#define CSR_VTYPE           0xc21
+#define CSR_VLENB           0xc22
+
+/* Bits of mcounteren and scounteren */
+#define COUNTEREN_CY        (1 << 0)
+#define COUNTEREN_TM        (1 << 1)
+#define COUNTEREN_IR        (1 << 2)
+
+#define MSTATUS_SIE         (1ULL << 1)
+#define MSTATUS_MIE         (1ULL << 3)
+#define MSTATUS_SPIE        (1ULL << 5)
+#define MSTATUS_MPIE        (1ULL << 7)
+#define MSTATUS_SPP         (1ULL << 8)
+#define MSTATUS_VS          (3ULL << 9)
+#define MSTATUS_MPP         (3ULL << 11)
+#define MSTATUS_FS          (3ULL << 13)
+#define MSTATUS_MPRV        (1ULL << 17)
+#define MSTATUS_SUM         (1ULL << 18)
+#define MSTATUS_MXR         (1ULL << 19)
+#define MSTATUS_TW          (1ULL << 21)
+#define MSTATUS_SD          (1ULL << 63)
+
+/* Values of the VS and FS fields */
+#define MSTATUS_VS_OFF      (0ULL << 9)
+#define MSTATUS_VS_DIRTY    (3ULL << 9)
+#define MSTATUS_FS_OFF      (0ULL << 13)
+#define MSTATUS_FS_DIRTY    (3ULL << 13)
+
+#define MSTATUS_WRITABLE    (MSTATUS_SIE | MSTATUS_MIE | MSTATUS_SPIE | MSTATUS_MPIE | MSTATUS_SPP | MSTATUS_MPP | MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR | MSTATUS_TW | MSTATUS_VS | MSTATUS_FS)
+#define SSTATUS_MASK        (MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_SUM | MSTATUS_MXR | MSTATUS_VS | MSTATUS_FS)
+
+#define MIP_SSIP            (1ULL << 1)
+#define MIP_MSIP            (1ULL << 3)
+#define MIP_STIP            (1ULL << 5)
+#define MIP_MTIP            (1ULL << 7)
+#define MIP_SEIP            (1ULL << 9)
+#define MIP_MEIP            (1ULL << 11)
+
+/* The machine-level bits of mip are controlled by the CLINT and PLIC */
+#define MIP_WRITABLE        (MIP_SSIP | MIP_STIP | MIP_SEIP)
+#define MIE_WRITABLE        (MIP_SSIP | MIP_MSIP | MIP_STIP | MIP_MTIP | MIP_SEIP | MIP_MEIP)
+
+/* Only supervisor interrupts can be delegated, and only the exceptions
+   that can happen below machine mode */
+#define MIDELEG_WRITABLE    (MIP_SSIP | MIP_STIP | MIP_SEIP)
+#define MEDELEG_WRITABLE    0xb3ff
+
+/* RV64 with A, C, D, F, I, M, S, U and V */
+#define MISA_VALUE          (2ULL << 62 | 1 << 0 | 1 << 2 | 1 << 3 | 1 << 5 | 1 << 8 | 1 << 12 | 1 << 18 | 1 << 20 | 1 << 21)
+
+/* The low bits of mtvec and stvec select direct or vectored mode */
+#define TVEC_VECTORED       1
+
+/* Changing any of these changes how addresses are translated, and so
+   does MPP while MPRV is set */
+#define MSTATUS_MMU_BITS    (MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR)
+
+#define SATP_MODE_SHIFT     60
+#define SATP_MODE_BARE      0x0
+#define SATP_MODE_SV39      0x8
+#define SATP_MODE_SV48      0x9
+#define SATP_PPN_MASK       ((1ULL << 44) - 1)
+
+/* Both return false if the CSR doesn't exist or can't be accessed from the
+   current privilege level */
+bool csr_read(CPU *cpu, int csr, uint64_t *value);
+bool csr_write(CPU *cpu, int csr, uint64_t value);
+
+#endif
@@ -0,0 +1,728 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "decode.h"
+#include "insn.h"
+#include "mmu.h"
+#include "bus.h"
+#include "smp.h"
+#include "amo.h"
+#include "muldiv.h"
+#include "vector.h"
+#include "fpu.h"
+#include "rvc.h"
+#include "profile.h"
+#include "trace.h"
+#include "trap.h"
+
+#define DCACHE_PAGE_SIZE    (1 << DCACHE_PAGE_SHIFT)
+
+/* A decoded page that machines sharing code can all use, with the bytes it
+   is decoded from and whether it has fences. Pages are found by a hash of
+   their bytes, and stay in the pool until the last machine given one goes
+   away: a machine that unshared a page may still have harts running from
+   it, so it only lets go of it when it is destroyed. */
+#define SHARED_HASH_BITS    12
+
+typedef struct SharedPage SharedPage;
+struct SharedPage {
+    DecodedPage page;
+    SharedPage *next;
+    uint64_t hash;
+    bool fences;
+    int refs;
+    uint8_t code[DCACHE_PAGE_SIZE];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    SharedPage *hash[1 << SHARED_HASH_BITS];
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void init_page(DecodedPage *page, bool shared);
+
+bool dcache_init(Machine *m, uint64_t ram_size) {
+    m->dcache_num_pages = ram_size >> DCACHE_PAGE_SHIFT;
+    m->dcache_pages = calloc(m->dcache_num_pages, sizeof(DecodedPage *));
+    return m->dcache_pages != NULL;
+}
+
+bool dcache_share(Machine *m) {
+    m->dcache_shared = calloc(m->dcache_num_pages, sizeof(SharedPage *));
+    return m->dcache_shared != NULL;
+}
+
+static void release_page(SharedPage *s) {
+    pthread_mutex_lock(&pool.lock);
+    if(--s->refs == 0) {
+        SharedPage **p = &pool.hash[s->hash & ((1 << SHARED_HASH_BITS) - 1)];
+        while(*p != s) {
+            p = &(*p)->next;
+        }
+        *p = s->next;
+        free(s);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void dcache_free(Machine *m) {
+    for(uint64_t i = 0; m->dcache_pages && i < m->dcache_num_pages; i++) {
+        if(m->dcache_pages[i] && !m->dcache_pages[i]->shared) {
+            free(m->dcache_pages[i]);
+        }
+        if(m->dcache_shared && m->dcache_shared[i]) {
+            release_page(m->dcache_shared[i]);
+        }
+    }
+    free(m->dcache_pages);
+    free(m->dcache_shared);
+}
+
+static uint64_t hash_page(const uint8_t *code) {
+    uint64_t hash = 0;
+    for(int i = 0; i < DCACHE_PAGE_SIZE; i += 8) {
+        uint64_t word;
+        memcpy(&word, code + i, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/* Gives the machine's page `index` the shared page for its contents,
+   adding one to the pool if there is none yet. Returns NULL if the page
+   can't be shared after all, and it then gets a private page as usual. */
+static DecodedPage *share_page(Machine *m, uint64_t index) {
+
+    const uint8_t *code = m->ram + (index << DCACHE_PAGE_SHIFT);
+    uint64_t hash = hash_page(code);
+    bool fences = m->num_harts > 1;
+
+    pthread_mutex_lock(&pool.lock);
+    SharedPage **bucket = &pool.hash[hash & ((1 << SHARED_HASH_BITS) - 1)], *s;
+    for(s = *bucket; s; s = s->next) {
+        if(s->hash == hash && s->fences == fences && !memcmp(s->code, code, DCACHE_PAGE_SIZE)) {
+            break;
+        }
+    }
+    if(!s && (s = malloc(sizeof(SharedPage)))) {
+        init_page(&s->page, true);
+        s->hash = hash;
+        s->fences = fences;
+        s->refs = 0;
+        memcpy(s->code, code, DCACHE_PAGE_SIZE);
+        s->next = *bucket;
+        *bucket = s;
+    }
+    if(s) {
+        s->refs++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if(!s) {
+        return NULL;
+    }
+
+    /* Another hart may have got there first */
+    SharedPage *none = NULL;
+    if(!__atomic_compare_exchange_n(&m->dcache_shared[index], &none, s, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        release_page(s);
+        return NULL;
+    }
+    DecodedPage *expected = NULL;
+    if(!__atomic_compare_exchange_n(&m->dcache_pages[index], &expected, &s->page, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return expected;
+    }
+    /* A store that came in since the comparison found no page to
+       invalidate, so the bytes are compared again now that there is one */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(memcmp(s->code, code, DCACHE_PAGE_SIZE)) {
+        dcache_unshare(m, index, &s->page);
+        return NULL;
+    }
+    return &s->page;
+
+}
+
+void dcache_unshare(Machine *m, uint64_t index, DecodedPage *page) {
+    /* Its blocks came from the page, so they go too */
+    if(__atomic_compare_exchange_n(&m->dcache_pages[index], &page, NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        block_invalidate_all(m);
+    }
+}
+
+/* Takes a trap raised by the instruction at PC, which then doesn't retire.
+   dcache_exec() counts every instruction it runs, so that is undone here. */
+static void take_trap(CPU *cpu) {
+    trap_take(cpu, cpu->pc);
+    cpu->instret--;
+}
+
+/* Handlers are generated from ops.inc. Each one executes a single instruction
+   and leaves PC pointing at the next one, or at the trap handler. */
+#define RD      cpu->regs[d->rd]
+#define RS1     cpu->regs[d->rs1]
+#define RS2     cpu->regs[d->rs2]
+#define IMM     d->imm
+#define RAW     d->raw
+#define PC      cpu->pc
+
+#define TRAP                        { take_trap(cpu); return; }
+#define LOAD(vaddr, size)           MMU_LOAD(cpu, vaddr, size, TRAP)
+#define STORE(vaddr, value, size)   MMU_STORE(cpu, vaddr, value, size, TRAP)
+#define CHECK(call)                 TRAP_CHECK(cpu, call, TRAP)
+
+#define OP(name, ...) \
+    static void op_##name(CPU *cpu, DecodedInsn *d) { \
+        (void)d; \
+        __VA_ARGS__; \
+        cpu->pc += d->length; \
+    }
+#define BRANCH(name, cond) \
+    static void op_##name(CPU *cpu, DecodedInsn *d) { \
+        cpu->pc += (cond) ? IMM : d->length; \
+    }
+
+#include "ops.inc"
+
+#undef OP
+#undef BRANCH
+
+/* Jump targets can't be misaligned: every immediate is even, JALR clears
+   bit 0, and compressed instructions only need 2-byte alignment. The
+   decoder uses J when there is no link register. */
+static void op_J(CPU *cpu, DecodedInsn *d) {
+    cpu->pc += IMM;
+}
+
+static void op_JAL(CPU *cpu, DecodedInsn *d) {
+    RD = PC + d->length;
+    cpu->pc += IMM;
+}
+
+static void op_JALR(CPU *cpu, DecodedInsn *d) {
+    uint64_t target = (RS1 + IMM) & ~(uint64_t)1;
+    RD = PC + d->length;
+    cpu->pc = target;
+}
+
+/* Anything the decoder doesn't handle itself, including illegal encodings,
+   goes through the reference interpreter. */
+static void op_EXEC32(CPU *cpu, DecodedInsn *d) {
+    exec_insn(d->raw, cpu);
+    if(cpu->trap_pending) {
+        take_trap(cpu);
+    }
+}
+
+/* Stops in front of the instruction, which doesn't retire. dcache_exec()
+   counts it anyway, so that is undone here. */
+static void op_BREAK(CPU *cpu, DecodedInsn *d) {
+    (void)d;
+    cpu->instret--;
+    atomic_fetch_or_explicit(&cpu->exit_request, EXIT_BREAKPOINT, memory_order_relaxed);
+}
+
+static const InsnHandler handlers[DOP_COUNT] = {
+#define OP(name, ...) [DOP_##name] = op_##name,
+#define BRANCH(name, cond) [DOP_##name] = op_##name,
+#include "ops.inc"
+#undef OP
+#undef BRANCH
+    [DOP_J] = op_J,
+    [DOP_JAL] = op_JAL,
+    [DOP_JALR] = op_JALR,
+    [DOP_EXEC32] = op_EXEC32,
+    [DOP_BREAK] = op_BREAK
+};
+
+/* Atomics by funct5, for W and D */
+static const uint8_t amo_ops[2][32] = {
+    {
+        [AMO_LR] = DOP_LR_W, [AMO_SC] = DOP_SC_W, [AMO_SWAP] = DOP_AMOSWAP_W,
+        [AMO_ADD] = DOP_AMOADD_W, [AMO_XOR] = DOP_AMOXOR_W, [AMO_AND] = DOP_AMOAND_W,
+        [AMO_OR] = DOP_AMOOR_W, [AMO_MIN] = DOP_AMOMIN_W, [AMO_MAX] = DOP_AMOMAX_W,
+        [AMO_MINU] = DOP_AMOMINU_W, [AMO_MAXU] = DOP_AMOMAXU_W
+    },
+    {
+        [AMO_LR] = DOP_LR_D, [AMO_SC] = DOP_SC_D, [AMO_SWAP] = DOP_AMOSWAP_D,
+        [AMO_ADD] = DOP_AMOADD_D, [AMO_XOR] = DOP_AMOXOR_D, [AMO_AND] = DOP_AMOAND_D,
+        [AMO_OR] = DOP_AMOOR_D, [AMO_MIN] = DOP_AMOMIN_D, [AMO_MAX] = DOP_AMOMAX_D,
+        [AMO_MINU] = DOP_AMOMINU_D, [AMO_MAXU] = DOP_AMOMAXU_D
+    }
+};
+
+void decode_insn(const Machine *m, uint32_t raw, DecodedInsn *d) {
+
+    d->raw = raw;
+    d->length = insn_length(raw);
+    uint32_t insn = d->length == 2 ? rvc_expand(raw) : raw;
+
+    int opcode = insn & 0x7f,
+        funct3 = (insn >> 12) & 0x7,
+        funct7 = insn >> 25;
+
+    d->rd = (insn >> 7) & 0x1f;
+    d->rs1 = (insn >> 15) & 0x1f;
+    d->rs2 = (insn >> 20) & 0x1f;
+    d->imm = 0;
+    d->op = DOP_EXEC32;
+
+    /* Set for operations whose only effect is writing rd, which can be
+       dropped entirely when rd is x0 */
+    bool pure = false;
+
+    switch(opcode) {
+        case OP_LUI:
+            d->imm = decode_immediate_U(insn);
+            d->op = DOP_LUI;
+            pure = true;
+            break;
+        case OP_AUIPC:
+            d->imm = decode_immediate_U(insn);
+            d->op = DOP_AUIPC;
+            pure = true;
+            break;
+        case OP_JAL:
+            d->imm = decode_immediate_J(insn);
+            d->op = d->rd ? DOP_JAL : DOP_J;
+            break;
+        case OP_JALR:
+            d->imm = decode_immediate_I(insn);
+            d->op = DOP_JALR;
+            break;
+        case OP_BRANCH:
+            d->imm = decode_immediate_B(insn);
+            switch(funct3) {
+                case BRANCH_FUNCT3_BEQ: d->op = DOP_BEQ; break;
+                case BRANCH_FUNCT3_BNE: d->op = DOP_BNE; break;
+                case BRANCH_FUNCT3_BLT: d->op = DOP_BLT; break;
+                case BRANCH_FUNCT3_BGE: d->op = DOP_BGE; break;
+                case BRANCH_FUNCT3_BLTU: d->op = DOP_BLTU; break;
+                case BRANCH_FUNCT3_BGEU: d->op = DOP_BGEU; break;
+            }
+            break;
+        case OP_LOAD:
+            d->imm = decode_immediate_I(insn);
+            switch(funct3) {
+                case LOAD_FUNCT3_LB: d->op = DOP_LB; break;
+                case LOAD_FUNCT3_LH: d->op = DOP_LH; break;
+                case LOAD_FUNCT3_LW: d->op = DOP_LW; break;
+                case LOAD_FUNCT3_LBU: d->op = DOP_LBU; break;
+                case LOAD_FUNCT3_LHU: d->op = DOP_LHU; break;
+                case LOAD_FUNCT3_LWU: d->op = DOP_LWU; break;
+                case LOAD_FUNCT3_LD: d->op = DOP_LD; break;
+            }
+            break;
+        case OP_STORE:
+            d->imm = decode_immediate_S(insn);
+            switch(funct3) {
+                case STORE_FUNCT3_SB: d->op = DOP_SB; break;
+                case STORE_FUNCT3_SH: d->op = DOP_SH; break;
+                case STORE_FUNCT3_SW: d->op = DOP_SW; break;
+                case STORE_FUNCT3_SD: d->op = DOP_SD; break;
+            }
+            break;
+        case OP_IMM:
+            d->imm = decode_immediate_I(insn);
+            pure = true;
+            switch(funct3) {
+                case OP_IMM_FUNCT3_ADDI: d->op = DOP_ADDI; break;
+                case OP_IMM_FUNCT3_SLTI: d->op = DOP_SLTI; break;
+                case OP_IMM_FUNCT3_SLTIU: d->op = DOP_SLTIU; break;
+                case OP_IMM_FUNCT3_XORI: d->op = DOP_XORI; break;
+                case OP_IMM_FUNCT3_ORI: d->op = DOP_ORI; break;
+                case OP_IMM_FUNCT3_ANDI: d->op = DOP_ANDI; break;
+                case OP_IMM_FUNCT3_SLLI:
+                    if((d->imm & 0xfc0) == 0)
+                        d->op = DOP_SLLI;
+                    break;
+                case OP_IMM_FUNCT3_SRLI_SRAI:
+                    if((d->imm & 0xfc0) == 0)
+                        d->op = DOP_SRLI;
+                    else if((d->imm & 0xfc0) == 0x400)
+                        d->op = DOP_SRAI;
+                    break;
+            }
+            if(funct3 == OP_IMM_FUNCT3_SLLI || funct3 == OP_IMM_FUNCT3_SRLI_SRAI) {
+                d->imm &= 0x3f;
+            }
+            break;
+        case OP_OP:
+            pure = true;
+            if(funct7 == 0x20) {
+                switch(funct3) {
+                    case OP_FUNCT3_ADD_SUB: d->op = DOP_SUB; break;
+                    case OP_FUNCT3_SRL_SRA: d->op = DOP_SRA; break;
+                }
+            } else if(funct7 == 0) {
+                switch(funct3) {
+                    case OP_FUNCT3_ADD_SUB: d->op = DOP_ADD; break;
+                    case OP_FUNCT3_SLL: d->op = DOP_SLL; break;
+                    case OP_FUNCT3_SLT: d->op = DOP_SLT; break;
+                    case OP_FUNCT3_SLTU: d->op = DOP_SLTU; break;
+                    case OP_FUNCT3_XOR: d->op = DOP_XOR; break;
+                    case OP_FUNCT3_SRL_SRA: d->op = DOP_SRL; break;
+                    case OP_FUNCT3_OR: d->op = DOP_OR; break;
+                    case OP_FUNCT3_AND: d->op = DOP_AND; break;
+                }
+            } else if(funct7 == FUNCT7_MULDIV) {
+                static const uint8_t muldiv_ops[8] = {
+                    DOP_MUL, DOP_MULH, DOP_MULHSU, DOP_MULHU, DOP_DIV, DOP_DIVU, DOP_REM, DOP_REMU
+                };
+                d->op = muldiv_ops[funct3];
+            }
+            break;
+        case OP_IMM32:
+            d->imm = decode_immediate_I(insn);
+            pure = true;
+            switch(funct3) {
+                case OP_IMM32_FUNCT3_ADDIW:
+                    d->op = DOP_ADDIW;
+                    break;
+                case OP_IMM32_FUNCT3_SLLIW:
+                    if((d->imm & 0xfe0) == 0)
+                        d->op = DOP_SLLIW;
+                    d->imm &= 0x1f;
+                    break;
+                case OP_IMM32_FUNCT3_SRLIW_SRAIW:
+                    if((d->imm & 0xfe0) == 0)
+                        d->op = DOP_SRLIW;
+                    else if((d->imm & 0xfe0) == 0x400)
+                        d->op = DOP_SRAIW;
+                    d->imm &= 0x1f;
+                    break;
+            }
+            break;
+        case OP_OP32:
+            pure = true;
+            if(funct7 == 0x20) {
+                switch(funct3) {
+                    case OP32_FUNCT3_ADDW_SUBW: d->op = DOP_SUBW; break;
+                    case OP32_FUNCT3_SRLW_SRAW: d->op = DOP_SRAW; break;
+                }
+            } else if(funct7 == 0) {
+                switch(funct3) {
+                    case OP32_FUNCT3_ADDW_SUBW: d->op = DOP_ADDW; break;
+                    case OP32_FUNCT3_SLLW: d->op = DOP_SLLW; break;
+                    case OP32_FUNCT3_SRLW_SRAW: d->op = DOP_SRLW; break;
+                }
+            } else if(funct7 == FUNCT7_MULDIV) {
+                switch(funct3) {
+                    case MULDIV_FUNCT3_MUL: d->op = DOP_MULW; break;
+                    case MULDIV_FUNCT3_DIV: d->op = DOP_DIVW; break;
+                    case MULDIV_FUNCT3_DIVU: d->op = DOP_DIVUW; break;
+                    case MULDIV_FUNCT3_REM: d->op = DOP_REMW; break;
+                    case MULDIV_FUNCT3_REMU: d->op = DOP_REMUW; break;
+                }
+            }
+            break;
+        case OP_LOAD_FP:
+        case OP_STORE_FP:
+        case OP_V:
+        case OP_MADD:
+        case OP_MSUB:
+        case OP_NMSUB:
+        case OP_NMADD:
+        case OP_FP:
+            if(vector_insn(insn)) {
+                d->op = DOP_VECTOR;
+            } else if(fpu_insn(insn)) {
+                d->op = DOP_FPU;
+            }
+            break;
+        case OP_MISC_MEM:
+            /* A single hart always observes its own accesses in order */
+            if(funct3 == MISC_MEM_FUNCT3_FENCE) {
+                d->op = m->num_harts == 1 ? DOP_NOP : fence_orders_store_load(insn) ? DOP_FENCE_SC : DOP_FENCE;
+            }
+            break;
+        case OP_AMO:
+            /* Same as loads: x0 may not be written in the middle of a block,
+               so a discarded result is left to exec32(). 0 is DOP_NOP, which
+               marks unused encodings. */
+            if((funct3 == AMO_FUNCT3_W || funct3 == AMO_FUNCT3_D) && d->rd != 0) {
+                int funct5 = funct7 >> 2;
+                if(amo_ops[funct3 - AMO_FUNCT3_W][funct5] != DOP_NOP && (funct5 != AMO_LR || d->rs2 == 0)) {
+                    d->op = amo_ops[funct3 - AMO_FUNCT3_W][funct5];
+                }
+            }
+            break;
+    }
+
+    if(pure && d->rd == 0 && d->op != DOP_EXEC32) {
+        d->op = DOP_NOP;
+    }
+
+    /* A load into x0 still has to access memory, but engines are allowed to
+       assume x0 is never written in the middle of a block, so leave these
+       to exec32() */
+    if(opcode == OP_LOAD && d->rd == 0) {
+        d->op = DOP_EXEC32;
+    }
+
+    d->handler = handlers[d->op];
+
+}
+
+/* The handler of a slot another thread is filling, which waits for it */
+static void dcache_busy(CPU *cpu, DecodedInsn *d) {
+    InsnHandler handler;
+    while((handler = __atomic_load_n(&d->handler, __ATOMIC_ACQUIRE)) == dcache_busy) {
+    }
+    handler(cpu, d);
+}
+
+/* Slots are shared by all harts, and by the harts of other machines when
+   the page is shared between them, so a slot is claimed for filling it and
+   its handler published after the rest of it; whoever finds it claimed
+   waits. A store from another hart may reset the slot while it is being
+   filled, so with several harts the instruction is read again afterwards
+   and the slot reset if it changed. The second half of a 32-bit
+   instruction is only read once the first says it is there, which
+   dcache_slot() guarantees is on the same page. */
+static void dcache_fill(const Machine *m, DecodedInsn *d, const uint8_t *host) {
+    InsnHandler expected = dcache_decode;
+    if(!__atomic_compare_exchange_n(&d->handler, &expected, dcache_busy, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        while(expected == dcache_busy) {
+            expected = __atomic_load_n(&d->handler, __ATOMIC_ACQUIRE);
+        }
+        return;
+    }
+    uint16_t parcels[2] = {0};
+    memcpy(&parcels[0], host, 2);
+    int length = insn_length(parcels[0]);
+    if(length == 4) {
+        memcpy(&parcels[1], host + 2, 2);
+    }
+    DecodedInsn insn;
+    decode_insn(m, parcels[0] | (uint32_t)parcels[1] << 16, &insn);
+    if(__atomic_load_n(&d->flags, __ATOMIC_RELAXED) & DF_BREAKPOINT) {
+        /* Everything but the operation is kept, for stepping over it */
+        insn.op = DOP_BREAK;
+        insn.handler = op_BREAK;
+    }
+    d->imm = insn.imm;
+    d->raw = insn.raw;
+    d->op = insn.op;
+    d->rd = insn.rd;
+    d->rs1 = insn.rs1;
+    d->rs2 = insn.rs2;
+    d->length = insn.length;
+    __atomic_store_n(&d->handler, insn.handler, __ATOMIC_RELEASE);
+    if(m->num_harts > 1) {
+        smp_fence_sc();
+        if(memcmp(host, parcels, length)) {
+            __atomic_store_n(&d->handler, dcache_decode, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void dcache_decode(CPU *cpu, DecodedInsn *d) {
+    dcache_fill(cpu->machine, d, mmu_fetch(cpu, cpu->pc));
+    d->handler(cpu, d);
+}
+
+static void init_page(DecodedPage *page, bool shared) {
+    for(int i = 0; i < DCACHE_PAGE_SLOTS; i++) {
+        page->slots[i].handler = dcache_decode;
+        page->slots[i].flags = 0;
+        page->slots[i].length = 0;
+    }
+    page->shared = shared;
+}
+
+/* A page that was shared once stays private after that */
+static DecodedPage *dcache_alloc_page(Machine *m, uint64_t index, bool share) {
+    DecodedPage *page, *expected = NULL;
+    if(share && m->dcache_shared && !m->dcache_shared[index] && (page = share_page(m, index))) {
+        return page;
+    }
+    if((page = malloc(sizeof(DecodedPage)))) {
+        init_page(page, false);
+        /* Another hart may have allocated it first */
+        if(!__atomic_compare_exchange_n(&m->dcache_pages[index], &expected, page, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(page);
+            page = expected;
+        }
+    }
+    return page;
+}
+
+/* Returns the slot for the instruction at `pc`, or NULL if it can't be
+   cached. The slot may not have been decoded yet. */
+static inline DecodedInsn *dcache_slot(CPU *cpu, uint64_t pc) {
+    uint8_t *host = mmu_fetch(cpu, pc);
+    if(!host) {
+        return NULL;
+    }
+    /* Code in direct regions outside of RAM is never cached */
+    Machine *m = cpu->machine;
+    uint64_t offset = host - m->ram;
+    if((offset >> DCACHE_PAGE_SHIFT) >= m->dcache_num_pages) {
+        return NULL;
+    }
+    /* A 32-bit instruction in the last halfword of a page continues on the
+       next one, which is translated separately, so it can't be cached */
+    if((pc & (PAGE_SIZE - 1)) == PAGE_SIZE - 2 && !insn_compressed(*host)) {
+        return NULL;
+    }
+    DecodedPage *page = m->dcache_pages[offset >> DCACHE_PAGE_SHIFT];
+    if(!page && !(page = dcache_alloc_page(m, offset >> DCACHE_PAGE_SHIFT, true))) {
+        return NULL;
+    }
+    return &page->slots[(offset >> 1) % DCACHE_PAGE_SLOTS];
+}
+
+DecodedInsn *dcache_fetch(CPU *cpu, uint64_t pc) {
+    DecodedInsn *d = dcache_slot(cpu, pc);
+    if(d && __atomic_load_n(&d->handler, __ATOMIC_ACQUIRE) == dcache_decode) {
+        dcache_fill(cpu->machine, d, mmu_fetch(cpu, pc));
+    }
+    return d;
+}
+
+bool dcache_set_breakpoint(Machine *m, uint64_t offset, bool set) {
+    uint64_t index = offset >> DCACHE_PAGE_SHIFT;
+    if((offset & 1) || index >= m->dcache_num_pages) {
+        return false;
+    }
+    /* Same as in dcache_slot() */
+    if((offset & (PAGE_SIZE - 1)) == PAGE_SIZE - 2 && !insn_compressed(m->ram[offset])) {
+        return false;
+    }
+    /* Only this machine's harts may stop at it */
+    DecodedPage *page = m->dcache_pages[index];
+    if(page && page->shared) {
+        dcache_unshare(m, index, page);
+        page = NULL;
+    }
+    if(!page && !(page = dcache_alloc_page(m, index, false))) {
+        return false;
+    }
+    DecodedInsn *d = &page->slots[(offset >> 1) % DCACHE_PAGE_SLOTS];
+    if(set) {
+        d->flags |= DF_BREAKPOINT;
+    } else {
+        d->flags &= ~DF_BREAKPOINT;
+    }
+    dcache_invalidate_slot(m, d);
+    return true;
+}
+
+/* Flags in shared pages are left alone: they belong to every machine
+   using the page, and an unshared page takes its machine's blocks with it
+   whatever they say */
+void dcache_clear_flags(Machine *m, uint8_t flags) {
+    for(uint64_t i = 0; i < m->dcache_num_pages; i++) {
+        DecodedPage *page = m->dcache_pages[i];
+        if(page && !page->shared) {
+            for(int j = 0; j < DCACHE_PAGE_SLOTS; j++) {
+                page->slots[j].flags &= ~flags;
+            }
+        }
+    }
+}
+
+void dcache_invalidate_pages(Machine *m, uint64_t offset, uint64_t size) {
+    if(size == 0) {
+        return;
+    }
+    bool in_block = false;
+    uint64_t end = (offset + size - 1) >> DCACHE_PAGE_SHIFT;
+    for(uint64_t i = offset >> DCACHE_PAGE_SHIFT; i <= end && i < m->dcache_num_pages; i++) {
+        DecodedPage *page = m->dcache_pages[i];
+        if(m->dcache_shared && m->dcache_shared[i]) {
+            /* With the harts stopped nothing is running from the shared
+               page any more, so it can go, and the new contents can be
+               shared again */
+            if(page && page->shared) {
+                m->dcache_pages[i] = page = NULL;
+                in_block = true;
+            }
+            release_page(m->dcache_shared[i]);
+            m->dcache_shared[i] = NULL;
+        }
+        if(page) {
+            for(int j = 0; j < DCACHE_PAGE_SLOTS; j++) {
+                __atomic_store_n(&page->slots[j].handler, dcache_decode, __ATOMIC_RELAXED);
+                in_block |= page->slots[j].flags & DF_IN_BLOCK;
+                page->slots[j].flags &= ~DF_IN_BLOCK;
+            }
+        }
+    }
+    if(in_block) {
+        block_invalidate_all(m);
+    }
+}
+
+/* `over` executes an instruction with a breakpoint from its decoded form
+   with the operation put back */
+static inline void dcache_exec(CPU *cpu, bool over) {
+
+    DecodedInsn *d = over ? dcache_fetch(cpu, cpu->pc) : dcache_slot(cpu, cpu->pc);
+    uint32_t insn;
+#if defined(PROFILE) || defined(TRACE)
+    uint64_t pc = cpu->pc;
+#endif
+#ifdef TRACE
+    uint64_t instret = cpu->instret;
+#endif
+    if(d && over && d->op == DOP_BREAK) {
+        DecodedInsn real = *d;
+        decode_insn(cpu->machine, d->raw, &real);
+        real.handler(cpu, &real);
+        cpu->regs[0] = 0;
+        insn = d->raw;
+    } else if(d) {
+        __atomic_load_n(&d->handler, __ATOMIC_ACQUIRE)(cpu, d);
+        cpu->regs[0] = 0;
+        insn = d->raw;
+    } else if(mmu_fetch_insn(cpu, cpu->pc, &insn)) {
+        /* Code outside of RAM, or crossing a page, isn't cached */
+        exec_insn(insn, cpu);
+        if(cpu->trap_pending) {
+            take_trap(cpu);
+        }
+    } else {
+        /* Nothing to count, it never got as far as executing */
+#ifdef TRACE
+        trace_block(cpu, pc, 0);
+#endif
+        trap_take(cpu, cpu->pc);
+        return;
+    }
+
+#ifdef PROFILE
+    profile_insn(insn, 1);
+    profile_sample(pc, cpu->instret, cpu->instret + 1);
+#endif
+    cpu->instret++;
+#ifdef TRACE
+    /* Every instruction is a block of its own here, which may not have
+       retired */
+    trace_block(cpu, pc, cpu->instret - instret);
+#endif
+
+}
+
+void dcache_step(CPU *cpu) {
+    dcache_exec(cpu, false);
+}
+
+void dcache_step_over(CPU *cpu) {
+    fpu_enter(cpu);
+    dcache_exec(cpu, true);
+    fpu_leave(cpu);
+}
+
+void dcache_run(CPU *cpu, uint64_t count) {
+    fpu_enter(cpu);
+    while(count--) {
+        dcache_exec(cpu, false);
+        /* Every instruction is a boundary here */
+        if(atomic_load_explicit(&cpu->exit_request, memory_order_relaxed) && !cpu_exit_request(cpu)) {
+            break;
+        }
+    }
+    fpu_leave(cpu);
+}
@@ -0,0 +1,141 @@
+#ifndef __DECODE_H
+#define __DECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "machine.h"
+
+/* Operations produced by the decoder: one for each entry in ops.inc, plus the
+   control transfers each engine implements itself. */
+enum {
+#define OP(name, ...) DOP_##name,
+#define BRANCH(name, cond) DOP_##name,
+#include "ops.inc"
+#undef OP
+#undef BRANCH
+    DOP_J,
+    DOP_JAL,
+    DOP_JALR,
+    DOP_EXEC32,
+    DOP_BREAK,
+    DOP_COUNT
+};
+
+typedef struct DecodedInsn DecodedInsn;
+typedef void (*InsnHandler)(CPU *cpu, DecodedInsn *d);
+
+/* Instructions are decoded once into this form and then executed from the
+   decoded cache. Register indices are extracted and the immediate is stored
+   already sign-extended, so a handler never has to look at the raw bits.
+   Compressed instructions are decoded from their 32-bit expansion, so only
+   `raw` and `length` tell them apart. */
+struct DecodedInsn {
+    InsnHandler handler;
+    int64_t imm;
+    uint32_t raw;
+    uint8_t op;
+    uint8_t rd, rs1, rs2;
+    uint8_t flags;
+    uint8_t length;     // 2 for compressed instructions, 4 otherwise
+};
+
+/* Slot flags */
+#define DF_IN_BLOCK     0x1     // slot has been copied into a translated block
+#define DF_BREAKPOINT   0x2     // slot decodes to DOP_BREAK; see dcache_set_breakpoint()
+
+/* The decoded cache keeps one lazily allocated page of slots per physical
+   page of RAM, with one slot per possible instruction address, i.e. per
+   halfword. Offsets are relative to the start of RAM. */
+#define DCACHE_PAGE_SHIFT   12
+#define DCACHE_PAGE_SLOTS   (1 << (DCACHE_PAGE_SHIFT - 1))
+
+/* Pages only depend on the bytes of RAM they were decoded from and on
+   whether there are several harts, so machines that share code (see
+   machine.h) can also share a page where those are the same. A shared page
+   is never invalidated: a machine storing to it takes it out of its own
+   dcache_pages instead, and decodes into a private page of its own from
+   then on. */
+typedef struct DecodedPage {
+    DecodedInsn slots[DCACHE_PAGE_SLOTS];
+    bool shared;
+} DecodedPage;
+
+bool dcache_init(Machine *m, uint64_t ram_size);
+void dcache_free(Machine *m);
+
+/* Has the machine use shared pages for what it decodes from now on */
+bool dcache_share(Machine *m);
+
+/* Takes a compressed instruction in the low 16 bits or a 32-bit one. Leaves
+   the slot flags alone; another hart may be setting them. */
+void decode_insn(const Machine *m, uint32_t raw, DecodedInsn *d);
+DecodedInsn *dcache_fetch(CPU *cpu, uint64_t pc);
+void dcache_clear_flags(Machine *m, uint8_t flags);
+
+/* Invalidates every page overlapping [offset, offset + size), for when RAM
+   is replaced wholesale rather than stored to, with the harts stopped */
+void dcache_invalidate_pages(Machine *m, uint64_t offset, uint64_t size);
+
+/* Takes the shared `page` out of the machine's page `index`, if it is still
+   there */
+void dcache_unshare(Machine *m, uint64_t index, DecodedPage *page);
+
+/* Handler installed in slots that have not been decoded yet: decodes the
+   instruction at PC into the slot and then executes it. */
+void dcache_decode(CPU *cpu, DecodedInsn *d);
+
+void dcache_step(CPU *cpu);
+void dcache_run(CPU *cpu, uint64_t count);
+
+/* Breakpoints are part of the decoded form, so that nothing else has to
+   look for them: the slot of an instruction with one decodes to DOP_BREAK,
+   which stops the hart in front of it with EXIT_BREAKPOINT, and setting or
+   clearing one invalidates the slot and any blocks it was copied into like
+   a store would. `offset` is relative to RAM_BASE; returns false for an
+   address that can't be cached, which can't have breakpoints either. */
+bool dcache_set_breakpoint(Machine *m, uint64_t offset, bool set);
+
+/* dcache_step() for resuming from a breakpoint: executes the instruction at
+   PC as if it had none. Called from outside of the engines, so it switches
+   the FPU state itself. */
+void dcache_step_over(CPU *cpu);
+
+/* Discards the translated blocks of every thread running the machine's
+   harts; defined in block.c */
+void block_invalidate_all(Machine *m);
+
+static inline void dcache_invalidate_slot(Machine *m, DecodedInsn *d) {
+    __atomic_store_n(&d->handler, dcache_decode, __ATOMIC_RELAXED);
+    if(d->flags & DF_IN_BLOCK) {
+        d->flags &= ~DF_IN_BLOCK;
+        block_invalidate_all(m);
+    }
+}
+
+/* Called by the bus for every store to RAM; `offset` is relative to RAM_BASE.
+   Pages that never held code are skipped with a single NULL check. */
+static inline void dcache_invalidate(Machine *m, uint64_t offset, uint64_t size) {
+    uint64_t first = offset >> 1, last = (offset + size - 1) >> 1;
+    /* A 32-bit instruction starting in the halfword before the store also
+       covers its first byte. One starting at the end of the previous page
+       is never cached. */
+    uint64_t slot = first % DCACHE_PAGE_SLOTS ? first - 1 : first;
+    for(; slot <= last; slot++) {
+        DecodedPage *page = m->dcache_pages[slot / DCACHE_PAGE_SLOTS];
+        if(!page || page->shared) {
+            if(page) {
+                dcache_unshare(m, slot / DCACHE_PAGE_SLOTS, page);
+            }
+            slot |= DCACHE_PAGE_SLOTS - 1;
+            continue;
+        }
+        DecodedInsn *d = &page->slots[slot % DCACHE_PAGE_SLOTS];
+        if(slot >= first || d->length == 4) {
+            dcache_invalidate_slot(m, d);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,489 @@
+#include <fenv.h>
+#include <math.h>
+#include <string.h>
+#include "fpu.h"
+#include "csr.h"
+#include "mmu.h"
+#include "trap.h"
+
+/* This file is built with -frounding-math, so the compiler neither folds
+   nor moves operations across a rounding mode change */
+
+#define FMT_S           0x0
+#define FMT_D           0x1
+
+#define FP_FUNCT5_ADD       0x00
+#define FP_FUNCT5_SUB       0x01
+#define FP_FUNCT5_MUL       0x02
+#define FP_FUNCT5_DIV       0x03
+#define FP_FUNCT5_SGNJ      0x04
+#define FP_FUNCT5_MINMAX    0x05
+#define FP_FUNCT5_CVT_FMT   0x08
+#define FP_FUNCT5_SQRT      0x0b
+#define FP_FUNCT5_CMP       0x14
+#define FP_FUNCT5_CVT_INT   0x18    // to an integer
+#define FP_FUNCT5_CVT_FROM  0x1a    // from an integer
+#define FP_FUNCT5_MV_X      0x1c    // fmv.x.* and fclass
+#define FP_FUNCT5_MV_F      0x1e
+
+#define BOX             0xffffffff00000000ULL
+#define CANONICAL_S     0x7fc00000U
+#define CANONICAL_D     0x7ff8000000000000ULL
+
+/* The host rounding mode as a guest rm, or -1 if unknown */
+static _Thread_local int host_rm = -1;
+
+static const int host_modes[] = {
+    [FRM_RNE] = FE_TONEAREST,
+    [FRM_RTZ] = FE_TOWARDZERO,
+    [FRM_RDN] = FE_DOWNWARD,
+    [FRM_RUP] = FE_UPWARD,
+    [FRM_RMM] = FE_TONEAREST,
+};
+
+static uint8_t host_flags(void) {
+    int e = fetestexcept(FE_ALL_EXCEPT);
+    return (e & FE_INEXACT ? FFLAGS_NX : 0) | (e & FE_UNDERFLOW ? FFLAGS_UF : 0) |
+           (e & FE_OVERFLOW ? FFLAGS_OF : 0) | (e & FE_DIVBYZERO ? FFLAGS_DZ : 0) |
+           (e & FE_INVALID ? FFLAGS_NV : 0);
+}
+
+void fpu_sync_flags(CPU *cpu) {
+    cpu->fflags |= host_flags();
+    feclearexcept(FE_ALL_EXCEPT);
+}
+
+void fpu_set_flags(CPU *cpu, uint8_t flags) {
+    cpu->fflags = flags & 0x1f;
+    feclearexcept(FE_ALL_EXCEPT);
+}
+
+void fpu_enter(CPU *cpu) {
+    (void)cpu;
+    feclearexcept(FE_ALL_EXCEPT);
+    host_rm = -1;
+}
+
+void fpu_leave(CPU *cpu) {
+    fpu_sync_flags(cpu);
+    if(host_rm >= 0 && host_modes[host_rm] != FE_TONEAREST) {
+        fesetround(FE_TONEAREST);
+    }
+    host_rm = -1;
+}
+
+/* Resolves DYN and switches the host over if needed. Returns -1 for the
+   reserved modes. */
+static int rounding(CPU *cpu, int rm) {
+    if(rm == FRM_DYN) {
+        rm = cpu->frm;
+    }
+    if(rm > FRM_RMM) {
+        return -1;
+    }
+    if(rm != host_rm) {
+        if(host_rm < 0 || host_modes[rm] != host_modes[host_rm]) {
+            fesetround(host_modes[rm]);
+        }
+        host_rm = rm;
+    }
+    return rm;
+}
+
+/* ---- Registers ---- */
+
+/* A single that isn't properly NaN-boxed reads as the canonical NaN */
+static inline uint32_t get_s_bits(const CPU *cpu, int reg) {
+    uint64_t v = cpu->fregs[reg];
+    return (v & BOX) == BOX ? (uint32_t)v : CANONICAL_S;
+}
+
+static inline float get_s(const CPU *cpu, int reg) {
+    uint32_t bits = get_s_bits(cpu, reg);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline double get_d(const CPU *cpu, int reg) {
+    double d;
+    memcpy(&d, &cpu->fregs[reg], sizeof(d));
+    return d;
+}
+
+static inline void set_s_bits(CPU *cpu, int reg, uint32_t bits) {
+    cpu->fregs[reg] = BOX | bits;
+}
+
+/* Arithmetic results: every NaN comes out canonical */
+static inline void set_s(CPU *cpu, int reg, float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    set_s_bits(cpu, reg, isnan(f) ? CANONICAL_S : bits);
+}
+
+static inline void set_d(CPU *cpu, int reg, double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    cpu->fregs[reg] = isnan(d) ? CANONICAL_D : bits;
+}
+
+static inline bool signaling_s(uint32_t bits) {
+    return (bits & 0x7fc00000) == 0x7f800000 && (bits & 0x003fffff);
+}
+
+static inline bool signaling_d(uint64_t bits) {
+    return (bits & 0x7ff8000000000000ULL) == 0x7ff0000000000000ULL && (bits & 0x0007ffffffffffffULL);
+}
+
+static inline void set_x(CPU *cpu, int rd, uint64_t value) {
+    if(rd != 0) {
+        cpu->regs[rd] = value;
+    }
+}
+
+/* ---- Operations that need more than the host's semantics ---- */
+
+/* The IEEE 754-2019 minimumNumber/maximumNumber: NaNs lose to numbers and
+   -0 is below +0 */
+static double min_max(double a, double b, bool max) {
+    if(isnan(a) && isnan(b)) {
+        return NAN;
+    }
+    if(isnan(a)) {
+        return b;
+    }
+    if(isnan(b)) {
+        return a;
+    }
+    if(a == b) {
+        return signbit(a) == max ? b : a;
+    }
+    return (a < b) != max ? a : b;
+}
+
+/* Rounds to an integer in the given mode without raising anything */
+static double round_int(double x, int rm) {
+    return rm == FRM_RMM ? round(x) : nearbyint(x);
+}
+
+/* Out of range inputs and NaNs saturate and raise only NV */
+static uint64_t convert_to_int(CPU *cpu, double x, int rm, int type) {
+    double r = round_int(x, rm);
+    int64_t lo;
+    uint64_t hi;
+    double lo_limit, hi_limit;      // the range is [lo_limit, hi_limit)
+    switch(type) {
+        case 0: lo = INT32_MIN; hi = INT32_MAX; lo_limit = -0x1p31; hi_limit = 0x1p31; break;
+        case 1: lo = 0; hi = UINT32_MAX; lo_limit = 0; hi_limit = 0x1p32; break;
+        case 2: lo = INT64_MIN; hi = INT64_MAX; lo_limit = -0x1p63; hi_limit = 0x1p63; break;
+        default: lo = 0; hi = UINT64_MAX; lo_limit = 0; hi_limit = 0x1p64; break;
+    }
+    uint64_t result;
+    if(isnan(x) || r >= hi_limit) {
+        cpu->fflags |= FFLAGS_NV;
+        result = hi;
+    } else if(r < lo_limit) {
+        cpu->fflags |= FFLAGS_NV;
+        result = lo;
+    } else {
+        if(r != x) {
+            cpu->fflags |= FFLAGS_NX;
+        }
+        result = type == 0 || type == 2 ? (uint64_t)(int64_t)r : (uint64_t)r;
+    }
+    /* 32-bit results are sign-extended, even unsigned ones */
+    return type < 2 ? (uint64_t)(int64_t)(int32_t)result : result;
+}
+
+static uint64_t classify(uint64_t bits, bool dbl) {
+    int exp_bits = dbl ? 11 : 8, mant_bits = dbl ? 52 : 23;
+    bool sign = bits >> (exp_bits + mant_bits) & 1;
+    uint64_t exp = bits >> mant_bits & ((1ULL << exp_bits) - 1);
+    uint64_t mant = bits & ((1ULL << mant_bits) - 1);
+    if(exp == (1ULL << exp_bits) - 1) {
+        if(mant == 0) {
+            return sign ? 1 << 0 : 1 << 7;              // infinities
+        }
+        return mant >> (mant_bits - 1) ? 1 << 9 : 1 << 8;  // quiet, signaling
+    }
+    if(exp == 0) {
+        if(mant == 0) {
+            return sign ? 1 << 3 : 1 << 4;              // zeroes
+        }
+        return sign ? 1 << 2 : 1 << 5;                  // subnormals
+    }
+    return sign ? 1 << 1 : 1 << 6;                      // normals
+}
+
+/* ---- Execution ---- */
+
+static bool fused(CPU *cpu, uint32_t insn) {
+
+    int opcode = insn & 0x7f, rd = (insn >> 7) & 0x1f, rs1 = (insn >> 15) & 0x1f,
+        rs2 = (insn >> 20) & 0x1f, rs3 = insn >> 27, fmt = (insn >> 25) & 0x3;
+    if(fmt > FMT_D || rounding(cpu, (insn >> 12) & 0x7) < 0) {
+        return false;
+    }
+
+    /* fmsub: a * b - c, fnmsub: -(a * b) + c, fnmadd: -(a * b) - c */
+    bool negate_product = opcode == OP_NMSUB || opcode == OP_NMADD;
+    bool negate_addend = opcode == OP_MSUB || opcode == OP_NMADD;
+    if(fmt == FMT_D) {
+        double a = get_d(cpu, rs1), b = get_d(cpu, rs2), c = get_d(cpu, rs3);
+        set_d(cpu, rd, fma(negate_product ? -a : a, b, negate_addend ? -c : c));
+    } else {
+        float a = get_s(cpu, rs1), b = get_s(cpu, rs2), c = get_s(cpu, rs3);
+        set_s(cpu, rd, fmaf(negate_product ? -a : a, b, negate_addend ? -c : c));
+    }
+    return true;
+
+}
+
+static bool arith_s(CPU *cpu, uint32_t insn) {
+
+    int rd = (insn >> 7) & 0x1f, rm = (insn >> 12) & 0x7, rs1 = (insn >> 15) & 0x1f,
+        rs2 = (insn >> 20) & 0x1f, funct5 = insn >> 27;
+    float a = get_s(cpu, rs1), b = get_s(cpu, rs2);
+    uint32_t abits = get_s_bits(cpu, rs1), bbits = get_s_bits(cpu, rs2);
+
+    switch(funct5) {
+        case FP_FUNCT5_ADD:
+        case FP_FUNCT5_SUB:
+        case FP_FUNCT5_MUL:
+        case FP_FUNCT5_DIV:
+            if(rounding(cpu, rm) < 0) {
+                return false;
+            }
+            set_s(cpu, rd, funct5 == FP_FUNCT5_ADD ? a + b : funct5 == FP_FUNCT5_SUB ? a - b :
+                           funct5 == FP_FUNCT5_MUL ? a * b : a / b);
+            return true;
+        case FP_FUNCT5_SQRT:
+            if(rs2 != 0 || rounding(cpu, rm) < 0) {
+                return false;
+            }
+            set_s(cpu, rd, sqrtf(a));
+            return true;
+        case FP_FUNCT5_SGNJ:
+            switch(rm) {
+                case 0: set_s_bits(cpu, rd, (abits & 0x7fffffff) | (bbits & 0x80000000)); return true;
+                case 1: set_s_bits(cpu, rd, (abits & 0x7fffffff) | (~bbits & 0x80000000)); return true;
+                case 2: set_s_bits(cpu, rd, abits ^ (bbits & 0x80000000)); return true;
+                default: return false;
+            }
+        case FP_FUNCT5_MINMAX:
+            if(rm > 1) {
+                return false;
+            }
+            if(signaling_s(abits) || signaling_s(bbits)) {
+                cpu->fflags |= FFLAGS_NV;
+            }
+            set_s(cpu, rd, min_max(a, b, rm));
+            return true;
+        case FP_FUNCT5_CVT_FMT:
+            if(rs2 != 1 || rounding(cpu, rm) < 0) {
+                return false;
+            }
+            set_s(cpu, rd, (float)get_d(cpu, rs1));
+            return true;
+        case FP_FUNCT5_CMP:
+            return false;   // handled together with D
+        case FP_FUNCT5_CVT_INT:
+            if(rs2 > 3 || (rm = rounding(cpu, rm)) < 0) {
+                return false;
+            }
+            set_x(cpu, rd, convert_to_int(cpu, a, rm, rs2));
+            return true;
+        case FP_FUNCT5_CVT_FROM:
+            if(rs2 > 3 || rounding(cpu, rm) < 0) {
+                return false;
+            }
+            switch(rs2) {
+                case 0: set_s(cpu, rd, (float)(int32_t)cpu->regs[rs1]); break;
+                case 1: set_s(cpu, rd, (float)(uint32_t)cpu->regs[rs1]); break;
+                case 2: set_s(cpu, rd, (float)(int64_t)cpu->regs[rs1]); break;
+                default: set_s(cpu, rd, (float)cpu->regs[rs1]); break;
+            }
+            return true;
+        case FP_FUNCT5_MV_X:
+            if(rs2 != 0 || rm > 1) {
+                return false;
+            }
+            /* fmv.x.w moves the raw bits, boxed or not */
+            set_x(cpu, rd, rm ? classify(abits, false) : (uint64_t)(int64_t)(int32_t)cpu->fregs[rs1]);
+            return true;
+        case FP_FUNCT5_MV_F:
+            if(rs2 != 0 || rm != 0) {
+                return false;
+            }
+            set_s_bits(cpu, rd, cpu->regs[rs1]);
+            return true;
+        default:
+            return false;
+    }
+
+}
+
+static bool arith_d(CPU *cpu, uint32_t insn) {
+
+    int rd = (insn >> 7) & 0x1f, rm = (insn >> 12) & 0x7, rs1 = (insn >> 15) & 0x1f,
+        rs2 = (insn >> 20) & 0x1f, funct5 = insn >> 27;
+    double a = get_d(cpu, rs1), b = get_d(cpu, rs2);
+    uint64_t abits = cpu->fregs[rs1], bbits = cpu->fregs[rs2];
+    const uint64_t sign = 1ULL << 63;
+
+    switch(funct5) {
+        case FP_FUNCT5_ADD:
+        case FP_FUNCT5_SUB:
+        case FP_FUNCT5_MUL:
+        case FP_FUNCT5_DIV:
+            if(rounding(cpu, rm) < 0) {
+                return false;
+            }
+            set_d(cpu, rd, funct5 == FP_FUNCT5_ADD ? a + b : funct5 == FP_FUNCT5_SUB ? a - b :
+                           funct5 == FP_FUNCT5_MUL ? a * b : a / b);
+            return true;
+        case FP_FUNCT5_SQRT:
+            if(rs2 != 0 || rounding(cpu, rm) < 0) {
+                return false;
+            }
+            set_d(cpu, rd, sqrt(a));
+            return true;
+        case FP_FUNCT5_SGNJ:
+            switch(rm) {
+                case 0: cpu->fregs[rd] = (abits & ~sign) | (bbits & sign); return true;
+                case 1: cpu->fregs[rd] = (abits & ~sign) | (~bbits & sign); return true;
+                case 2: cpu->fregs[rd] = abits ^ (bbits & sign); return true;
+                default: return false;
+            }
+        case FP_FUNCT5_MINMAX:
+            if(rm > 1) {
+                return false;
+            }
+            if(signaling_d(abits) || signaling_d(bbits)) {
+                cpu->fflags |= FFLAGS_NV;
+            }
+            set_d(cpu, rd, min_max(a, b, rm));
+            return true;
+        case FP_FUNCT5_CVT_FMT:
+            if(rs2 != 0 || rounding(cpu, rm) < 0) {
+                return false;
+            }
+            set_d(cpu, rd, get_s(cpu, rs1));
+            return true;
+        case FP_FUNCT5_CVT_INT:
+            if(rs2 > 3 || (rm = rounding(cpu, rm)) < 0) {
+                return false;
+            }
+            set_x(cpu, rd, convert_to_int(cpu, a, rm, rs2));
+            return true;
+        case FP_FUNCT5_CVT_FROM:
+            if(rs2 > 3 || rounding(cpu, rm) < 0) {
+                return false;
+            }
+            switch(rs2) {
+                case 0: set_d(cpu, rd, (int32_t)cpu->regs[rs1]); break;
+                case 1: set_d(cpu, rd, (uint32_t)cpu->regs[rs1]); break;
+                case 2: set_d(cpu, rd, (double)(int64_t)cpu->regs[rs1]); break;
+                default: set_d(cpu, rd, (double)cpu->regs[rs1]); break;
+            }
+            return true;
+        case FP_FUNCT5_MV_X:
+            if(rs2 != 0 || rm > 1) {
+                return false;
+            }
+            set_x(cpu, rd, rm ? classify(abits, true) : abits);
+            return true;
+        case FP_FUNCT5_MV_F:
+            if(rs2 != 0 || rm != 0) {
+                return false;
+            }
+            cpu->fregs[rd] = cpu->regs[rs1];
+            return true;
+        default:
+            return false;
+    }
+
+}
+
+/* feq is quiet and only signals on signaling NaNs; flt and fle signal on
+   any NaN */
+static bool compare(CPU *cpu, uint32_t insn, bool dbl) {
+    int rd = (insn >> 7) & 0x1f, funct3 = (insn >> 12) & 0x7, rs1 = (insn >> 15) & 0x1f, rs2 = (insn >> 20) & 0x1f;
+    double a = dbl ? get_d(cpu, rs1) : get_s(cpu, rs1), b = dbl ? get_d(cpu, rs2) : get_s(cpu, rs2);
+    bool signaling = dbl ? signaling_d(cpu->fregs[rs1]) || signaling_d(cpu->fregs[rs2]) :
+                           signaling_s(get_s_bits(cpu, rs1)) || signaling_s(get_s_bits(cpu, rs2));
+    bool result;
+    switch(funct3) {
+        case 0: result = islessequal(a, b); break;
+        case 1: result = isless(a, b); break;
+        case 2: result = !isunordered(a, b) && a == b; break;
+        default: return false;
+    }
+    if(signaling || (funct3 != 2 && isunordered(a, b))) {
+        cpu->fflags |= FFLAGS_NV;
+    }
+    set_x(cpu, rd, result);
+    return true;
+}
+
+static bool memory(CPU *cpu, uint32_t insn, bool store) {
+    int width = (insn >> 12) & 0x7, rd = (insn >> 7) & 0x1f, rs1 = (insn >> 15) & 0x1f, rs2 = (insn >> 20) & 0x1f;
+    if(store) {
+        uint64_t vaddr = cpu->regs[rs1] + decode_immediate_S(insn);
+        mmu_store(cpu, vaddr, cpu->fregs[rs2], width == 2 ? 4 : 8);
+    } else {
+        uint64_t vaddr = cpu->regs[rs1] + decode_immediate_I(insn);
+        uint64_t value = mmu_load(cpu, vaddr, width == 2 ? 4 : 8);
+        if(!cpu->trap_pending) {
+            cpu->fregs[rd] = width == 2 ? BOX | value : value;
+        }
+    }
+    return true;
+}
+
+static bool execute(CPU *cpu, uint32_t insn) {
+
+    if(!(cpu->mstatus & MSTATUS_FS)) {
+        return false;
+    }
+
+    int opcode = insn & 0x7f, fmt = (insn >> 25) & 0x3;
+    bool ok;
+    switch(opcode) {
+        case OP_LOAD_FP:
+        case OP_STORE_FP:
+            ok = memory(cpu, insn, opcode == OP_STORE_FP);
+            /* Stores leave the FP state alone */
+            if(opcode == OP_STORE_FP) {
+                return ok;
+            }
+            break;
+        case OP_MADD:
+        case OP_MSUB:
+        case OP_NMSUB:
+        case OP_NMADD:
+            ok = fused(cpu, insn);
+            break;
+        default:
+            if(fmt > FMT_D) {
+                return false;
+            }
+            ok = (insn >> 27) == FP_FUNCT5_CMP ? compare(cpu, insn, fmt == FMT_D) :
+                 fmt == FMT_D ? arith_d(cpu, insn) : arith_s(cpu, insn);
+            break;
+    }
+    if(ok) {
+        cpu->mstatus |= MSTATUS_FS_DIRTY;
+    }
+    return ok;
+
+}
+
+bool fpu_exec(CPU *cpu, uint32_t insn) {
+    if(!execute(cpu, insn)) {
+        trap_raise(cpu, CAUSE_ILLEGAL_INSN, insn);
+        return false;
+    }
+    return true;
+}
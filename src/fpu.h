@@ -0,0 +1,65 @@
+#ifndef __FPU_H
+#define __FPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "insn.h"
+
+/* The F and D extensions, executed on the host FPU.
+
+   The host's own sticky exception flags stand in for fflags while a hart
+   runs: operations raise them as they execute, and they are only folded
+   into the hart's fflags when fflags or fcsr is read or the engine returns.
+   The host rounding mode likewise stays put until an instruction needs a
+   different one. RMM has no host equivalent; arithmetic rounds it to
+   nearest-even, conversions to integers get it right. */
+
+#define FFLAGS_NX       0x01
+#define FFLAGS_UF       0x02
+#define FFLAGS_OF       0x04
+#define FFLAGS_DZ       0x08
+#define FFLAGS_NV       0x10
+
+#define FRM_RNE         0x0
+#define FRM_RTZ         0x1
+#define FRM_RDN         0x2
+#define FRM_RUP         0x3
+#define FRM_RMM         0x4
+#define FRM_DYN         0x7
+
+/* True for instructions fpu_exec() is responsible for */
+static inline bool fpu_insn(uint32_t insn) {
+    int opcode = insn & 0x7f, width = (insn >> 12) & 0x7;
+    switch(opcode) {
+        case OP_LOAD_FP:
+        case OP_STORE_FP:
+            return width == 2 || width == 3;
+        case OP_MADD:
+        case OP_MSUB:
+        case OP_NMSUB:
+        case OP_NMADD:
+        case OP_FP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Executes a floating-point instruction without touching PC. Returns false
+   for illegal instructions, including all of them while mstatus.FS is off,
+   after raising the exception. Never writes x0. */
+bool fpu_exec(CPU *cpu, uint32_t insn);
+
+/* Called by the engines when a hart starts and stops running on the calling
+   thread, so that flags raised on the host end up in the right hart */
+void fpu_enter(CPU *cpu);
+void fpu_leave(CPU *cpu);
+
+/* Folds the host flags into fflags, ahead of reading it */
+void fpu_sync_flags(CPU *cpu);
+
+/* Replaces fflags, dropping whatever the host has accrued */
+void fpu_set_flags(CPU *cpu, uint8_t flags);
+
+#endif
@@ -0,0 +1,725 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "gdbstub.h"
+#include "block.h"
+#include "bus.h"
+#include "csr.h"
+#include "decode.h"
+#include "mmu.h"
+#include "smp.h"
+
+#define PACKET_SIZE         4096
+#define MAX_BREAKPOINTS     256
+
+/* Register numbers as GDB has them for RISC-V */
+#define REG_PC              32
+#define REG_FIRST_FP        33
+#define REG_FIRST_CSR       65
+#define REG_PRIV            (REG_FIRST_CSR + 4096)
+
+/* Registers in the 'g' packet: x0-x31 and pc */
+#define NUM_G_REGS          33
+
+typedef struct {
+    uint64_t vaddr;
+    uint64_t offset;        // in RAM, where the decoded cache has it
+} Breakpoint;
+
+/* There is only ever one debugger, for one machine */
+static struct {
+    Machine *machine;
+    CPU *harts;
+    int num_harts;
+    uint64_t limit[SMP_MAX_HARTS];  // instret at which a hart has run its count
+
+    int fd;
+    uint8_t in[PACKET_SIZE];
+    int in_pos, in_len;
+
+    int general;            // hart selected by Hg
+    int cont;               // hart selected by Hc, -1 for all of them
+    Breakpoint breakpoints[MAX_BREAKPOINTS];
+    int num_breakpoints;
+
+    /* The harts run on threads that live as long as the session, so that
+       their blocks and translated code survive stops */
+    pthread_t threads[SMP_MAX_HARTS];
+    pthread_mutex_t lock;
+    pthread_cond_t go, done;
+    uint64_t generation;    // bumped to start the harts in run[]
+    bool run[SMP_MAX_HARTS];
+    bool step, quit;
+    int running;
+    int first;              // the first hart to stop, -1 while none has
+    int stopped;            // eventfd written by every hart that stops
+} gdb;
+
+/* ---- Connection ---- */
+
+/* Returns the next byte from GDB, or -1 once it is gone */
+static int get_char(void) {
+    if(gdb.in_pos == gdb.in_len) {
+        ssize_t n;
+        while((n = read(gdb.fd, gdb.in, sizeof(gdb.in))) < 0 && errno == EINTR) {
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        gdb.in_pos = 0;
+        gdb.in_len = n;
+    }
+    return gdb.in[gdb.in_pos++];
+}
+
+static bool put_all(const char *data, size_t len) {
+    while(len) {
+        ssize_t n = write(gdb.fd, data, len);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static int hex_digit(int c) {
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Reads the next packet into `buf`, which holds PACKET_SIZE characters and
+   a terminating NUL, acknowledging it. Returns its length, or -1 once GDB
+   is gone. */
+static int get_packet(char *buf) {
+    for(;;) {
+        int c;
+        while((c = get_char()) != '$') {
+            if(c < 0) {
+                return -1;
+            }
+        }
+        int len = 0;
+        uint8_t sum = 0;
+        while((c = get_char()) != '#') {
+            if(c < 0) {
+                return -1;
+            }
+            if(len < PACKET_SIZE) {
+                buf[len++] = c;
+            }
+            sum += c;
+        }
+        int high = hex_digit(get_char()), low = hex_digit(get_char());
+        buf[len] = '\0';
+        bool ok = high >= 0 && low >= 0 && (high << 4 | low) == sum;
+        if(!put_all(ok ? "+" : "-", 1)) {
+            return -1;
+        }
+        if(ok) {
+            return len;
+        }
+    }
+}
+
+/* Sends a packet and waits for GDB to acknowledge it */
+static bool put_packet(const char *data) {
+    static char out[2 * PACKET_SIZE + 4];
+    uint8_t sum = 0;
+    size_t len = strlen(data);
+    for(size_t i = 0; i < len; i++) {
+        sum += data[i];
+    }
+    out[0] = '$';
+    memcpy(out + 1, data, len);
+    snprintf(out + 1 + len, 4, "#%02x", sum);
+    for(;;) {
+        if(!put_all(out, len + 4)) {
+            return false;
+        }
+        int c;
+        while((c = get_char()) != '+' && c != '-') {
+            if(c < 0) {
+                return false;
+            }
+        }
+        if(c == '+') {
+            return true;
+        }
+    }
+}
+
+static void put_hex(char *out, const uint8_t *bytes, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    for(size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[bytes[i] >> 4];
+        out[2 * i + 1] = digits[bytes[i] & 0xf];
+    }
+    out[2 * len] = '\0';
+}
+
+/* Returns the number of bytes decoded, stopping at the first non-digit */
+static size_t get_hex(const char *in, uint8_t *bytes, size_t len) {
+    size_t i;
+    for(i = 0; i < len; i++) {
+        int high = hex_digit(in[2 * i]), low = high >= 0 ? hex_digit(in[2 * i + 1]) : -1;
+        if(low < 0) {
+            break;
+        }
+        bytes[i] = high << 4 | low;
+    }
+    return i;
+}
+
+/* Registers travel as target-endian hex, i.e. little-endian */
+static void put_reg(char *out, uint64_t value) {
+    uint8_t bytes[8];
+    memcpy(bytes, &value, 8);
+    put_hex(out, bytes, 8);
+}
+
+static bool get_reg(const char *in, uint64_t *value) {
+    uint8_t bytes[8];
+    if(get_hex(in, bytes, 8) != 8) {
+        return false;
+    }
+    memcpy(value, bytes, 8);
+    return true;
+}
+
+/* Numbers in packets are big-endian hex. Thread IDs may also be -1, for all
+   of them. */
+static uint64_t get_number(const char **p) {
+    uint64_t value = 0;
+    bool negative = **p == '-';
+    *p += negative;
+    for(int digit; (digit = hex_digit(**p)) >= 0; (*p)++) {
+        value = value << 4 | digit;
+    }
+    return negative ? -value : value;
+}
+
+/* ---- Harts ---- */
+
+/* A hart that resumes at a breakpoint executes the instruction under it */
+static void resume(CPU *cpu, uint64_t limit, bool step) {
+    if(cpu->instret >= limit) {
+        return;
+    }
+    dcache_step_over(cpu);
+    if(atomic_load_explicit(&cpu->exit_request, memory_order_relaxed) && !cpu_exit_request(cpu)) {
+        return;
+    }
+    if(!step && cpu->instret < limit) {
+        block_run(cpu, limit - cpu->instret);
+    }
+}
+
+static void *hart_thread(void *arg) {
+    int i = (int)(intptr_t)arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&gdb.lock);
+    for(;;) {
+        while(gdb.generation == seen && !gdb.quit) {
+            pthread_cond_wait(&gdb.go, &gdb.lock);
+        }
+        if(gdb.quit) {
+            break;
+        }
+        seen = gdb.generation;
+        if(!gdb.run[i]) {
+            continue;
+        }
+        bool step = gdb.step;
+        pthread_mutex_unlock(&gdb.lock);
+
+        resume(&gdb.harts[i], gdb.limit[i], step);
+
+        pthread_mutex_lock(&gdb.lock);
+        if(gdb.first < 0) {
+            gdb.first = i;
+        }
+        if(--gdb.running == 0) {
+            pthread_cond_signal(&gdb.done);
+        }
+        uint64_t one = 1;
+        if(write(gdb.stopped, &one, sizeof(one)) < 0) {
+            // the counter is already nonzero
+        }
+    }
+    pthread_mutex_unlock(&gdb.lock);
+    block_thread_exit();
+    return NULL;
+}
+
+static void stop_all(void) {
+    for(int i = 0; i < gdb.num_harts; i++) {
+        smp_request_exit(&gdb.harts[i], EXIT_STOP);
+    }
+}
+
+static void wait_all(void) {
+    pthread_mutex_lock(&gdb.lock);
+    while(gdb.running) {
+        pthread_cond_wait(&gdb.done, &gdb.lock);
+    }
+    pthread_mutex_unlock(&gdb.lock);
+    uint64_t count;
+    if(read(gdb.stopped, &count, sizeof(count)) < 0) {
+        // every hart that ran wrote it
+    }
+}
+
+/* Which harts ran and what stopped them */
+enum { RUN_STOPPED, RUN_EXITED, RUN_GONE };
+
+/* Runs one hart for a single instruction or all of them until one stops,
+   and then stops the others. GDB may interrupt them with ^C. With `detached`
+   they just run until they are done. */
+static int run_harts(bool step, int hart, bool detached) {
+
+    pthread_mutex_lock(&gdb.lock);
+    gdb.running = 0;
+    for(int i = 0; i < gdb.num_harts; i++) {
+        /* Left over from the last stop */
+        atomic_fetch_and(&gdb.harts[i].exit_request, ~(uint32_t)(EXIT_STOP | EXIT_BREAKPOINT));
+        gdb.run[i] = (!step || i == hart) && gdb.harts[i].instret < gdb.limit[i];
+        gdb.running += gdb.run[i];
+    }
+    if(!gdb.running) {
+        pthread_mutex_unlock(&gdb.lock);
+        return RUN_EXITED;
+    }
+    gdb.step = step;
+    gdb.first = -1;
+    gdb.generation++;
+    pthread_cond_broadcast(&gdb.go);
+    pthread_mutex_unlock(&gdb.lock);
+
+    int result = RUN_STOPPED;
+    while(!detached) {
+        struct pollfd fds[2] = {{.fd = gdb.fd, .events = POLLIN}, {.fd = gdb.stopped, .events = POLLIN}};
+        if(gdb.in_pos == gdb.in_len && poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        if(gdb.in_pos < gdb.in_len || (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            int c = get_char();
+            if(c < 0) {
+                result = RUN_GONE;
+                break;
+            }
+            if(c == 0x03) {
+                break;
+            }
+        } else if(fds[1].revents & POLLIN) {
+            break;
+        }
+    }
+    if(!detached) {
+        stop_all();
+    }
+    wait_all();
+
+    bool exited = true;
+    for(int i = 0; i < gdb.num_harts; i++) {
+        exited &= gdb.harts[i].instret >= gdb.limit[i];
+    }
+    if(result == RUN_STOPPED && exited) {
+        return RUN_EXITED;
+    }
+    if(gdb.first >= 0) {
+        gdb.general = gdb.first;
+    }
+    return result;
+
+}
+
+/* ---- Memory and registers ---- */
+
+/* Debugger accesses to guest memory never fault and never reach devices */
+static bool access_memory(CPU *cpu, uint64_t vaddr, uint8_t *buf, uint64_t len, bool write) {
+    for(uint64_t i = 0; i < len; i++) {
+        uint64_t paddr;
+        if(!mmu_translate(cpu, vaddr + i, ACCESS_READ, &paddr) && !mmu_translate(cpu, vaddr + i, ACCESS_EXEC, &paddr)) {
+            return false;
+        }
+        if(write) {
+            if(!bus_ram_ptr(cpu->machine, paddr)) {
+                return false;
+            }
+            bus_store(cpu->machine, paddr, buf[i], 1);
+        } else {
+            uint8_t *host = bus_direct_ptr(cpu->machine, paddr);
+            if(!host) {
+                return false;
+            }
+            buf[i] = *host;
+        }
+    }
+    return true;
+}
+
+/* CSRs are accessed from machine mode, whatever the hart is in */
+static bool access_csr(CPU *cpu, int csr, uint64_t *value, bool write) {
+    int priv = cpu->priv;
+    cpu->priv = PL_MACHINE;
+    bool ok = write ? csr_write(cpu, csr, *value) : csr_read(cpu, csr, value);
+    cpu->priv = priv;
+    return ok;
+}
+
+static bool read_reg(CPU *cpu, uint64_t reg, uint64_t *value) {
+    if(reg < 32) {
+        *value = cpu->regs[reg];
+    } else if(reg == REG_PC) {
+        *value = cpu->pc;
+    } else if(reg < REG_FIRST_CSR) {
+        *value = cpu->fregs[reg - REG_FIRST_FP];
+    } else if(reg < REG_PRIV) {
+        return access_csr(cpu, reg - REG_FIRST_CSR, value, false);
+    } else if(reg == REG_PRIV) {
+        *value = cpu->priv;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool write_reg(CPU *cpu, uint64_t reg, uint64_t value) {
+    if(reg < 32) {
+        if(reg) {
+            cpu->regs[reg] = value;
+        }
+    } else if(reg == REG_PC) {
+        cpu->pc = value;
+    } else if(reg < REG_FIRST_CSR) {
+        cpu->fregs[reg - REG_FIRST_FP] = value;
+    } else if(reg < REG_PRIV) {
+        return access_csr(cpu, reg - REG_FIRST_CSR, &value, true);
+    } else if(reg == REG_PRIV) {
+        if(value != PL_USER && value != PL_SUPERVISOR && value != PL_MACHINE) {
+            return false;
+        }
+        cpu->priv = value;
+        tlb_flush(cpu);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* ---- Breakpoints ---- */
+
+static Breakpoint *find_breakpoint(uint64_t vaddr) {
+    for(int i = 0; i < gdb.num_breakpoints; i++) {
+        if(gdb.breakpoints[i].vaddr == vaddr) {
+            return &gdb.breakpoints[i];
+        }
+    }
+    return NULL;
+}
+
+static bool insert_breakpoint(CPU *cpu, uint64_t vaddr) {
+    uint64_t paddr;
+    if(find_breakpoint(vaddr)) {
+        return true;
+    }
+    if(gdb.num_breakpoints == MAX_BREAKPOINTS || !mmu_translate(cpu, vaddr, ACCESS_EXEC, &paddr) ||
+       !dcache_set_breakpoint(gdb.machine, paddr - RAM_BASE, true)) {
+        return false;
+    }
+    gdb.breakpoints[gdb.num_breakpoints++] = (Breakpoint){vaddr, paddr - RAM_BASE};
+    return true;
+}
+
+static bool remove_breakpoint(uint64_t vaddr) {
+    Breakpoint *bp = find_breakpoint(vaddr);
+    if(!bp) {
+        return false;
+    }
+    /* Another one may be on the same instruction through another mapping */
+    uint64_t offset = bp->offset;
+    *bp = gdb.breakpoints[--gdb.num_breakpoints];
+    for(int i = 0; i < gdb.num_breakpoints; i++) {
+        if(gdb.breakpoints[i].offset == offset) {
+            return true;
+        }
+    }
+    dcache_set_breakpoint(gdb.machine, offset, false);
+    return true;
+}
+
+static void remove_all_breakpoints(void) {
+    while(gdb.num_breakpoints) {
+        remove_breakpoint(gdb.breakpoints[0].vaddr);
+    }
+}
+
+/* ---- Packets ---- */
+
+static int thread_hart(uint64_t thread) {
+    return thread >= 1 && thread <= (uint64_t)gdb.num_harts ? (int)thread - 1 : -1;
+}
+
+static void stop_reply(char *out) {
+    sprintf(out, "T05thread:%x;", gdb.general + 1);
+}
+
+/* Handles one packet from `in`, leaving the reply in `out`. Returns the
+   outcome of running the harts for the packets that do, or -1. */
+static int handle(char *in, char *out) {
+
+    CPU *cpu = &gdb.harts[gdb.general];
+    const char *p = in + 1;
+    uint64_t addr, len, value;
+    *out = '\0';
+
+    switch(in[0]) {
+        case '?':
+            stop_reply(out);
+            break;
+        case 'g':
+            for(int i = 0; i < NUM_G_REGS; i++) {
+                read_reg(cpu, i, &value);
+                put_reg(out + 16 * i, value);
+            }
+            break;
+        case 'G':
+            for(int i = 0; i < NUM_G_REGS && get_reg(p + 16 * i, &value); i++) {
+                write_reg(cpu, i, value);
+            }
+            strcpy(out, "OK");
+            break;
+        case 'p':
+            if(read_reg(cpu, get_number(&p), &value)) {
+                put_reg(out, value);
+            } else {
+                strcpy(out, "E01");
+            }
+            break;
+        case 'P':
+            addr = get_number(&p);
+            strcpy(out, *p == '=' && get_reg(p + 1, &value) && write_reg(cpu, addr, value) ? "OK" : "E01");
+            break;
+        case 'm': {
+            static uint8_t buf[PACKET_SIZE / 2];
+            addr = get_number(&p);
+            p += *p == ',';
+            len = get_number(&p);
+            if(len > sizeof(buf) - 1) {
+                len = sizeof(buf) - 1;
+            }
+            if(access_memory(cpu, addr, buf, len, false)) {
+                put_hex(out, buf, len);
+            } else {
+                strcpy(out, "E01");
+            }
+            break;
+        }
+        case 'M': {
+            static uint8_t buf[PACKET_SIZE / 2];
+            addr = get_number(&p);
+            p += *p == ',';
+            len = get_number(&p);
+            bool ok = *p == ':' && len <= sizeof(buf) && get_hex(p + 1, buf, len) == len;
+            strcpy(out, ok && access_memory(cpu, addr, buf, len, true) ? "OK" : "E01");
+            break;
+        }
+        case 'c':
+        case 's': {
+            /* Hc may have picked the hart to step */
+            int hart = in[0] == 's' && gdb.cont >= 0 ? gdb.cont : gdb.general;
+            if(*p) {
+                gdb.harts[hart].pc = get_number(&p);
+            }
+            return run_harts(in[0] == 's', hart, false);
+        }
+        case 'Z':
+        case 'z':
+            /* Software and hardware breakpoints are the same thing here */
+            if(*p == '0' || *p == '1') {
+                p += 1 + (p[1] == ',');
+                addr = get_number(&p);
+                bool ok = in[0] == 'Z' ? insert_breakpoint(cpu, addr) : remove_breakpoint(addr);
+                strcpy(out, ok ? "OK" : "E01");
+            }
+            break;
+        case 'H': {
+            /* 0 and -1 stand for any hart and all of them */
+            p = in + 2;
+            uint64_t thread = get_number(&p);
+            bool any = thread == 0 || thread == (uint64_t)-1;
+            int hart = any ? -1 : thread_hart(thread);
+            if((in[1] != 'g' && in[1] != 'c') || (!any && hart < 0)) {
+                strcpy(out, "E01");
+            } else {
+                if(in[1] == 'c') {
+                    gdb.cont = hart;
+                } else if(!any) {
+                    gdb.general = hart;
+                }
+                strcpy(out, "OK");
+            }
+            break;
+        }
+        case 'T':
+            strcpy(out, thread_hart(get_number(&p)) >= 0 ? "OK" : "E01");
+            break;
+        case 'q':
+            if(!strncmp(in, "qSupported", 10)) {
+                sprintf(out, "PacketSize=%x", PACKET_SIZE);
+            } else if(!strcmp(in, "qAttached")) {
+                strcpy(out, "1");
+            } else if(!strcmp(in, "qC")) {
+                sprintf(out, "QC%x", gdb.general + 1);
+            } else if(!strcmp(in, "qfThreadInfo")) {
+                char *o = out + sprintf(out, "m");
+                for(int i = 0; i < gdb.num_harts; i++) {
+                    o += sprintf(o, i ? ",%x" : "%x", i + 1);
+                }
+            } else if(!strcmp(in, "qsThreadInfo")) {
+                strcpy(out, "l");
+            } else if(!strncmp(in, "qThreadExtraInfo,", 17)) {
+                p = in + 17;
+                int hart = thread_hart(get_number(&p));
+                char name[32];
+                int n = snprintf(name, sizeof(name), "hart %d", hart);
+                put_hex(out, (const uint8_t *)name, n);
+            }
+            break;
+    }
+    return -1;
+
+}
+
+/* ---- Session ---- */
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Serves packets until GDB kills, detaches or goes away */
+static bool serve(void) {
+
+    static char in[PACKET_SIZE + 1], out[2 * PACKET_SIZE];
+    for(;;) {
+        if(get_packet(in) < 0) {
+            return false;
+        }
+        if(in[0] == 'k') {
+            return true;
+        }
+        if(in[0] == 'D') {
+            put_packet("OK");
+            remove_all_breakpoints();
+            run_harts(false, 0, true);
+            return true;
+        }
+        switch(handle(in, out)) {
+            case RUN_STOPPED:
+                stop_reply(out);
+                break;
+            case RUN_EXITED:
+                put_packet("W00");
+                return true;
+            case RUN_GONE:
+                return false;
+        }
+        if(!put_packet(out)) {
+            return false;
+        }
+    }
+
+}
+
+bool gdb_run(Machine *m, uint64_t count, int port) {
+
+    CPU *harts = m->harts;
+    int num_harts = m->num_harts;
+
+    int listener = listen_on(port);
+    if(listener < 0) {
+        return false;
+    }
+    fprintf(stderr, "waiting for gdb on port %d\n", port);
+    gdb.fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    close(listener);
+    if(gdb.fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(gdb.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    gdb.machine = m;
+    gdb.harts = harts;
+    gdb.num_harts = num_harts;
+    gdb.cont = -1;
+    for(int i = 0; i < num_harts; i++) {
+        gdb.limit[i] = harts[i].instret + count < count ? UINT64_MAX : harts[i].instret + count;
+    }
+    pthread_mutex_init(&gdb.lock, NULL);
+    pthread_cond_init(&gdb.go, NULL);
+    pthread_cond_init(&gdb.done, NULL);
+    gdb.stopped = eventfd(0, EFD_CLOEXEC);
+
+    int started = 0;
+    while(gdb.stopped >= 0 && started < num_harts &&
+          pthread_create(&gdb.threads[started], NULL, hart_thread, (void *)(intptr_t)started) == 0) {
+        started++;
+    }
+    bool ok = started == num_harts && serve();
+
+    /* Breakpoints are gone once GDB is */
+    remove_all_breakpoints();
+    pthread_mutex_lock(&gdb.lock);
+    gdb.quit = true;
+    pthread_cond_broadcast(&gdb.go);
+    pthread_mutex_unlock(&gdb.lock);
+    for(int i = 0; i < started; i++) {
+        pthread_join(gdb.threads[i], NULL);
+    }
+    if(gdb.stopped >= 0) {
+        close(gdb.stopped);
+    }
+    close(gdb.fd);
+    return ok;
+
+}
@@ -0,0 +1,20 @@
+#ifndef __GDBSTUB_H
+#define __GDBSTUB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "machine.h"
+
+/* A GDB remote serial protocol server. Harts are GDB threads, numbered from
+   1, and all of them stop whenever one does. Breakpoints go into the decoded
+   cache (see dcache_set_breakpoint()), so harts run at full speed between
+   them, translated code included. They are set on the physical address the
+   selected hart translates them to at the time, like memory accesses from
+   the debugger, which also set accessed bits as the hart's own would. */
+
+/* Waits for GDB to connect on localhost:`port` and then runs the machine's
+   harts as smp_run() would, under its control. Returns false if nobody
+   could connect or GDB went away without killing or detaching. */
+bool gdb_run(Machine *m, uint64_t count, int port);
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef __INSN_H
+#define __INSN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OP_LUI                      0x37
+#define OP_AUIPC                    0x17
+#define OP_JAL                      0x6f
+#define OP_JALR                     0x67
+#define OP_BRANCH                   0x63
+#define OP_LOAD                     0x3
+#define OP_LOAD_FP                  0x7
+#define OP_STORE                    0x23
+#define OP_STORE_FP                 0x27
+#define OP_IMM                      0x13
+#define OP_IMM32                    0x1b
+#define OP_OP                       0x33
+#define OP_OP32                     0x3b
+#define OP_MISC_MEM                 0xf
+#define OP_SYSTEM                   0x73
+#define OP_AMO                      0x2f
+#define OP_V                        0x57
+#define OP_MADD                     0x43
+#define OP_MSUB                     0x47
+#define OP_NMSUB                    0x4b
+#define OP_NMADD                    0x4f
+#define OP_FP                       0x53
+
+#define LOAD_FUNCT3_LB              0x0
+#define LOAD_FUNCT3_LH              0x1
+#define LOAD_FUNCT3_LW              0x2
+#define LOAD_FUNCT3_LBU             0x4
+#define LOAD_FUNCT3_LHU             0x5
+#define LOAD_FUNCT3_LWU             0x6
+#define LOAD_FUNCT3_LD              0x3
+
+#define STORE_FUNCT3_SB             0x0
+#define STORE_FUNCT3_SH             0x1
+#define STORE_FUNCT3_SW             0x2
+#define STORE_FUNCT3_SD             0x3
+
+#define BRANCH_FUNCT3_BEQ           0x0
+#define BRANCH_FUNCT3_BNE           0x1
+#define BRANCH_FUNCT3_BLT           0x4
+#define BRANCH_FUNCT3_BGE           0x5
+#define BRANCH_FUNCT3_BLTU          0x6
+#define BRANCH_FUNCT3_BGEU          0x7
+
+#define OP_IMM_FUNCT3_ADDI          0x0
+#define OP_IMM_FUNCT3_SLLI          0x1
+#define OP_IMM_FUNCT3_SLTI          0x2 
+#define OP_IMM_FUNCT3_SLTIU         0x3
+#define OP_IMM_FUNCT3_XORI          0x4
+#define OP_IMM_FUNCT3_SRLI_SRAI     0x5
+#define OP_IMM_FUNCT3_ORI           0x6
+#define OP_IMM_FUNCT3_ANDI          0x7
+
+#define OP_IMM32_FUNCT3_ADDIW       0x0
+#define OP_IMM32_FUNCT3_SLLIW       0x1
+#define OP_IMM32_FUNCT3_SRLIW_SRAIW 0x5
+
+#define OP_FUNCT3_ADD_SUB           0x0
+#define OP_FUNCT3_SLL               0x1
+#define OP_FUNCT3_SLT               0x2
+#define OP_FUNCT3_SLTU              0x3
+#define OP_FUNCT3_XOR               0x4
+#define OP_FUNCT3_SRL_SRA           0x5
+#define OP_FUNCT3_OR                0x6
+#define OP_FUNCT3_AND               0x7
+
+#define OP32_FUNCT3_ADDW_SUBW       0x0
+#define OP32_FUNCT3_SLLW            0x1
+#define OP32_FUNCT3_SRLW_SRAW       0x5
+
+/* funct7 of the M extension under OP and OP-32 */
+#define FUNCT7_MULDIV               0x01
+
+#define MULDIV_FUNCT3_MUL           0x0
+#define MULDIV_FUNCT3_MULH          0x1
+#define MULDIV_FUNCT3_MULHSU        0x2
+#define MULDIV_FUNCT3_MULHU         0x3
+#define MULDIV_FUNCT3_DIV           0x4
+#define MULDIV_FUNCT3_DIVU          0x5
+#define MULDIV_FUNCT3_REM           0x6
+#define MULDIV_FUNCT3_REMU          0x7
+
+#define AMO_FUNCT3_W                0x2
+#define AMO_FUNCT3_D                0x3
+
+#define MISC_MEM_FUNCT3_FENCE       0x0
+#define MISC_MEM_FUNCT3_FENCE_I     0x1
+
+#define SYSTEM_FUNCT3_ECALL_EBREAK  0x0
+#define SYSTEM_FUNCT3_CSRRW         0x1
+#define SYSTEM_FUNCT3_CSRRS         0x2
+#define SYSTEM_FUNCT3_CSRRC         0x3
+#define SYSTEM_FUNCT3_CSRRWI        0x5
+#define SYSTEM_FUNCT3_CSRRSI        0x6
+#define SYSTEM_FUNCT3_CSRRCI        0x7
+
+#define SYSTEM_FUNCT7_SFENCE_VMA    0x9
+
+#define SYSTEM_FUNCT12_ECALL        0x000
+#define SYSTEM_FUNCT12_EBREAK       0x001
+#define SYSTEM_FUNCT12_SRET         0x102
+#define SYSTEM_FUNCT12_WFI          0x105
+#define SYSTEM_FUNCT12_MRET         0x302
+
+// Fence modes
+#define FENCE_MODE_NORMAL           0x0
+#define FENCE_MODE_TSO              0x8
+
+// Fence predecessor/successor sets
+#define FENCE_W                     0x1
+#define FENCE_R                     0x2
+#define FENCE_O                     0x4
+#define FENCE_I                     0x8
+
+/* True if the fence orders earlier stores (or device output) before later
+   loads (or device input), which is the one ordering TSO doesn't provide.
+   FENCE.TSO orders everything else by definition. */
+static inline bool fence_orders_store_load(uint32_t insn) {
+    int mode = insn >> 28, pred = (insn >> 24) & 0xf, succ = (insn >> 20) & 0xf;
+    return mode != FENCE_MODE_TSO && (pred & (FENCE_W | FENCE_O)) && (succ & (FENCE_R | FENCE_I));
+}
+
+/* With compressed instructions, targets only need to be 2-byte aligned */
+static inline bool address_misaligned(uint64_t addr) {
+    return addr & 0x1;
+}
+
+/* Immediate operands in instructions may be stored in one of five formats and
+   are always sign-extended, which we accomplish using struct bitfields. */
+static inline int64_t decode_immediate_I(uint32_t insn) {
+    struct { signed int x: 12; } s;
+    s.x = insn >> 20;
+    return s.x;
+}
+
+static inline int64_t decode_immediate_S(uint32_t insn) {
+    struct { signed int x: 12; } s;
+    s.x = (insn & 0xf80) >> 7 | (insn & 0xfe000000) >> 20;
+    return s.x;
+}
+
+static inline int64_t decode_immediate_B(uint32_t insn) {
+    struct { signed int x: 13; } s;
+    s.x = (insn & 0x80) << 4 | (insn & 0xf00) >> 7 | (insn & 0x7e000000) >> 20 | (insn & 0x80000000) >> 19;
+    return s.x;
+}
+
+static inline int64_t decode_immediate_U(uint32_t insn) {
+    return (int32_t)(insn & 0xfffff000);
+}
+
+static inline int64_t decode_immediate_J(uint32_t insn) {
+    struct { signed int x: 21; } s;
+    s.x = (insn & 0xff000) | (insn & 0x100000) >> 9 | (insn & 0x7fe00000) >> 20 | (insn & 0x80000000) >> 11;
+    return s.x;
+}
+
+#endif
\ No newline at end of file
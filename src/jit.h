@@ -0,0 +1,32 @@
+#ifndef __JIT_H
+#define __JIT_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "block.h"
+
+/* Blocks are translated to host code after this many executions */
+#define JIT_THRESHOLD       64
+#define JIT_BUFFER_SIZE     (16 * 1024 * 1024)
+
+#if defined(__x86_64__)
+
+/* Returns NULL if the block can't be translated; it then keeps running on
+   the threaded interpreter. The code only works for the harts of `m`. */
+JitFn jit_compile(const Block *b, Machine *m);
+
+/* Discards all translated code; called whenever blocks are freed */
+void jit_reset(void);
+
+/* Unmaps the calling thread's code buffer */
+void jit_free(void);
+
+#else
+
+static inline JitFn jit_compile(const Block *b, Machine *m) { (void)b; (void)m; return NULL; }
+static inline void jit_reset(void) {}
+static inline void jit_free(void) {}
+
+#endif
+
+#endif
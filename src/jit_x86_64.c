@@ -0,0 +1,841 @@
+#if defined(__x86_64__)
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "jit.h"
+#include "mmu.h"
+#include "amo.h"
+#include "vector.h"
+#include "fpu.h"
+#include "rvc.h"
+
+/* Translation is a single pass over the block. The most used guest registers
+   live in callee-saved host registers for the duration of the block and
+   everything else stays in CPU.regs. Loads and stores do the TLB lookup
+   inline and only call into C on a miss; anything unusual is handed back to
+   exec32(). Only calls into C can raise a trap, so each is followed by a
+   check that branches to an out-of-line stub at the end of the block,
+   which returns the instruction's index with JIT_EXIT_TRAP. */
+
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/* R15 always holds the CPU pointer */
+#define REG_CPU         R15
+
+static const int mapped_host_regs[] = {RBX, RBP, R12, R13, R14};
+#define NUM_MAPPED      (int)(sizeof(mapped_host_regs) / sizeof(mapped_host_regs[0]))
+
+/* Upper bounds on the host code emitted for one guest instruction and for
+   the prologue and block exits, used to check for space before starting on a
+   block */
+#define MAX_INSN_BYTES  256
+#define MAX_EXTRA_BYTES 1024
+
+/* Each thread translates into its own buffer. It is mapped twice, writable
+   where the code is emitted and executable where it runs, so that no page
+   is ever both and a stray host write can't turn into code; the jumps in
+   the code are all relative to the block and everything else is called by
+   its absolute address, so the code runs the same at either address. */
+static _Thread_local uint8_t *code_buf, *code_ptr, *exec_buf;
+
+/* Host register holding each guest register, or -1 */
+static _Thread_local int host_reg[32];
+
+/* The instruction being translated, and the trap checks emitted so far:
+   the jump to patch to each one's stub and the instruction it belongs to */
+static _Thread_local uint32_t current_insn;
+static _Thread_local uint8_t *trap_jumps[BLOCK_MAX_INSNS + 1];
+static _Thread_local uint32_t trap_insns[BLOCK_MAX_INSNS + 1];
+static _Thread_local int num_traps;
+
+/* The machine whose RAM and decoded cache the code addresses directly */
+static _Thread_local Machine *machine;
+
+static bool jit_init(void) {
+    if(code_buf) {
+        return true;
+    }
+    int fd = memfd_create("r5-jit", MFD_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    void *buf = MAP_FAILED, *exec = MAP_FAILED;
+    if(ftruncate(fd, JIT_BUFFER_SIZE) == 0) {
+        buf = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        exec = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    }
+    /* The mappings keep the memory */
+    close(fd);
+    if(buf == MAP_FAILED || exec == MAP_FAILED) {
+        if(buf != MAP_FAILED) {
+            munmap(buf, JIT_BUFFER_SIZE);
+        }
+        if(exec != MAP_FAILED) {
+            munmap(exec, JIT_BUFFER_SIZE);
+        }
+        return false;
+    }
+    code_buf = code_ptr = buf;
+    exec_buf = exec;
+    return true;
+}
+
+void jit_reset(void) {
+    code_ptr = code_buf;
+}
+
+void jit_free(void) {
+    if(code_buf) {
+        munmap(code_buf, JIT_BUFFER_SIZE);
+        munmap(exec_buf, JIT_BUFFER_SIZE);
+        code_buf = code_ptr = exec_buf = NULL;
+    }
+}
+
+/* The inline TLB lookup indexes the table with a shift */
+#define TLB_ENTRY_SHIFT 5
+_Static_assert(sizeof(TLBEntry) == 1 << TLB_ENTRY_SHIFT, "TLBEntry size");
+
+static void helper_invalidate(uint8_t *host, uint64_t size, Machine *m) {
+    dcache_invalidate(m, host - m->ram, size);
+}
+
+/* ---- Instruction encoding ---- */
+
+static void emit8(uint8_t value) {
+    *code_ptr++ = value;
+}
+
+static void emit32(uint32_t value) {
+    for(int i = 0; i < 4; i++) {
+        emit8(value >> (i * 8));
+    }
+}
+
+static void emit64(uint64_t value) {
+    emit32(value);
+    emit32(value >> 32);
+}
+
+static void emit_rex(bool wide, int reg, int rm) {
+    uint8_t rex = 0x40 | wide << 3 | (reg & 8) >> 1 | (rm & 8) >> 3;
+    if(rex != 0x40) {
+        emit8(rex);
+    }
+}
+
+/* `op r/m, reg` with a register as r/m; `reg` doubles as the /digit of
+   group opcodes */
+static void emit_rr(bool wide, uint8_t op, int reg, int rm) {
+    emit_rex(wide, reg, rm);
+    emit8(op);
+    emit8(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* The same for two-byte opcodes, 0x0f `op` */
+static void emit_rr2(bool wide, uint8_t op, int reg, int rm) {
+    emit_rex(wide, reg, rm);
+    emit8(0x0f);
+    emit8(op);
+    emit8(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* `op reg, [base + disp]`; base can't be RSP or R12 */
+static void emit_rm(bool wide, uint8_t op, int reg, int base, int32_t disp) {
+    emit_rex(wide, reg, base);
+    emit8(op);
+    emit8(0x80 | (reg & 7) << 3 | (base & 7));
+    emit32(disp);
+}
+
+static void emit_rm_cpu(bool wide, uint8_t op, int reg, int32_t disp) {
+    emit_rm(wide, op, reg, REG_CPU, disp);
+}
+
+static void emit_mov_imm(int reg, uint64_t value) {
+    if((int64_t)value == (int32_t)value) {
+        emit_rr(true, 0xc7, 0, reg);
+        emit32(value);
+    } else {
+        emit_rex(true, 0, reg);
+        emit8(0xb8 + (reg & 7));
+        emit64(value);
+    }
+}
+
+static void emit_push(int reg) {
+    emit_rex(false, 0, reg);
+    emit8(0x50 + (reg & 7));
+}
+
+static void emit_pop(int reg) {
+    emit_rex(false, 0, reg);
+    emit8(0x58 + (reg & 7));
+}
+
+static void emit_call(uintptr_t fn) {
+    emit_mov_imm(RAX, fn);
+    emit_rr(false, 0xff, 2, RAX);
+}
+
+/* movsxd rax, eax */
+static void emit_sext32(void) {
+    emit_rr(true, 0x63, RAX, RAX);
+}
+
+/* setcc al; movzx eax, al */
+static void emit_setcc(uint8_t cc) {
+    emit8(0x0f);
+    emit8(0x90 | cc);
+    emit8(0xc0);
+    emit8(0x0f);
+    emit8(0xb6);
+    emit8(0xc0);
+}
+
+/* Emit a jcc/jmp with a 32-bit displacement and return where to patch it */
+static uint8_t *emit_jcc(uint8_t cc) {
+    emit8(0x0f);
+    emit8(0x80 | cc);
+    emit32(0);
+    return code_ptr - 4;
+}
+
+static uint8_t *emit_jmp(void) {
+    emit8(0xe9);
+    emit32(0);
+    return code_ptr - 4;
+}
+
+static void patch_jump(uint8_t *at) {
+    int32_t rel = code_ptr - (at + 4);
+    for(int i = 0; i < 4; i++) {
+        at[i] = rel >> (i * 8);
+    }
+}
+
+#define CC_B    0x2
+#define CC_AE   0x3
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_L    0xc
+#define CC_GE   0xd
+
+/* cmovcc dst, src */
+static void emit_cmov(bool wide, uint8_t cc, int dst, int src) {
+    emit_rr2(wide, 0x40 | cc, dst, src);
+}
+
+/* ---- Guest registers ---- */
+
+static int32_t reg_offset(int guest) {
+    return offsetof(CPU, regs) + guest * sizeof(uint64_t);
+}
+
+static void load_guest(int host, int guest) {
+    if(guest == 0) {
+        emit_rr(false, 0x31, host, host);
+    } else if(host_reg[guest] >= 0) {
+        emit_rr(true, 0x89, host_reg[guest], host);
+    } else {
+        emit_rm_cpu(true, 0x8b, host, reg_offset(guest));
+    }
+}
+
+static void store_guest(int guest, int host) {
+    if(guest == 0) {
+        return;
+    } else if(host_reg[guest] >= 0) {
+        emit_rr(true, 0x89, host, host_reg[guest]);
+    } else {
+        emit_rm_cpu(true, 0x89, host, reg_offset(guest));
+    }
+}
+
+static void write_back_mapped(void) {
+    for(int i = 1; i < 32; i++) {
+        if(host_reg[i] >= 0) {
+            emit_rm_cpu(true, 0x89, host_reg[i], reg_offset(i));
+        }
+    }
+}
+
+static void emit_prologue(void) {
+    emit_push(RBX);
+    emit_push(RBP);
+    emit_push(R12);
+    emit_push(R13);
+    emit_push(R14);
+    emit_push(R15);
+    emit_rr(true, 0x83, 5, RSP);    // sub rsp, 8 to keep calls aligned
+    emit8(8);
+    emit_rr(true, 0x89, RDI, REG_CPU);
+    for(int i = 1; i < 32; i++) {
+        if(host_reg[i] >= 0) {
+            emit_rm_cpu(true, 0x8b, host_reg[i], reg_offset(i));
+        }
+    }
+}
+
+/* Returns {rax, exit} to the dispatch loop */
+static void emit_return(int exit, bool write_back) {
+    if(write_back) {
+        write_back_mapped();
+    }
+    emit8(0xba);                    // mov edx, exit
+    emit32(exit);
+    emit_rr(true, 0x83, 0, RSP);    // add rsp, 8
+    emit8(8);
+    emit_pop(R15);
+    emit_pop(R14);
+    emit_pop(R13);
+    emit_pop(R12);
+    emit_pop(RBP);
+    emit_pop(RBX);
+    emit8(0xc3);
+}
+
+static void emit_exit(uint64_t pc, int exit) {
+    emit_mov_imm(RAX, pc);
+    emit_return(exit, true);
+}
+
+/* cmp byte [cpu + trap_pending], 0; jne to the stub */
+static void emit_trap_check(void) {
+    emit_rm_cpu(false, 0x80, 7, offsetof(CPU, trap_pending));
+    emit8(0);
+    trap_jumps[num_traps] = emit_jcc(CC_NE);
+    trap_insns[num_traps++] = current_insn;
+}
+
+/* The stubs only load the index, and share the way out. The instruction
+   didn't write rd, so the mapped registers are as good as in memory. */
+static void emit_trap_stubs(void) {
+    uint8_t *to_tail[BLOCK_MAX_INSNS + 1];
+    for(int i = 0; i < num_traps; i++) {
+        patch_jump(trap_jumps[i]);
+        emit8(0xb8);                // mov eax, index
+        emit32(trap_insns[i]);
+        to_tail[i] = emit_jmp();
+    }
+    if(num_traps) {
+        for(int i = 0; i < num_traps; i++) {
+            patch_jump(to_tail[i]);
+        }
+        emit_return(JIT_EXIT_TRAP, true);
+    }
+}
+
+/* Leaves the instruction at `pc` to exec32() and ends the block. As in the
+   interpreter, instret has to include the `retired` instructions before it
+   while exec32() runs. */
+static void emit_exec32(uint64_t pc, uint32_t raw, uint32_t retired) {
+    write_back_mapped();
+    emit_mov_imm(RAX, pc);
+    emit_rm_cpu(true, 0x89, RAX, offsetof(CPU, pc));
+    emit_rm_cpu(true, 0x81, 0, offsetof(CPU, instret));     // add instret, retired
+    emit32(retired);
+    emit8(0xbf);                    // mov edi, raw
+    emit32(raw);
+    emit_rr(true, 0x89, REG_CPU, RSI);
+    emit_call(insn_compressed(raw) ? (uintptr_t)exec16 : (uintptr_t)exec32);
+    emit_rm_cpu(true, 0x81, 5, offsetof(CPU, instret));     // sub instret, retired
+    emit32(retired);
+    emit_trap_check();
+    emit_rm_cpu(true, 0x8b, RAX, offsetof(CPU, pc));
+    emit_return(0, false);
+}
+
+/* ---- Translation ---- */
+
+static void assign_host_regs(const Block *b) {
+    int uses[32] = {0};
+    for(uint32_t i = 0; i < b->count; i++) {
+        uses[b->insns[i].d.rd]++;
+        uses[b->insns[i].d.rs1]++;
+        uses[b->insns[i].d.rs2]++;
+    }
+    uses[0] = 0;
+    for(int i = 0; i < 32; i++) {
+        host_reg[i] = -1;
+    }
+    for(int n = 0; n < NUM_MAPPED; n++) {
+        int best = 0;
+        for(int i = 1; i < 32; i++) {
+            if(uses[i] > uses[best]) {
+                best = i;
+            }
+        }
+        if(best == 0) {
+            break;
+        }
+        host_reg[best] = mapped_host_regs[n];
+        uses[best] = 0;
+    }
+}
+
+static void emit_alu_imm(const DecodedInsn *d, int digit, bool wide) {
+    load_guest(RAX, d->rs1);
+    emit_rr(wide, 0x81, digit, RAX);
+    emit32(d->imm);
+    if(!wide) {
+        emit_sext32();
+    }
+    store_guest(d->rd, RAX);
+}
+
+static void emit_shift_imm(const DecodedInsn *d, int digit, bool wide) {
+    load_guest(RAX, d->rs1);
+    emit_rr(wide, 0xc1, digit, RAX);
+    emit8(d->imm);
+    if(!wide) {
+        emit_sext32();
+    }
+    store_guest(d->rd, RAX);
+}
+
+static void emit_alu(const DecodedInsn *d, uint8_t op, bool wide) {
+    load_guest(RAX, d->rs1);
+    load_guest(RCX, d->rs2);
+    emit_rr(wide, op, RCX, RAX);
+    if(!wide) {
+        emit_sext32();
+    }
+    store_guest(d->rd, RAX);
+}
+
+static void emit_shift(const DecodedInsn *d, int digit, bool wide) {
+    load_guest(RAX, d->rs1);
+    load_guest(RCX, d->rs2);
+    emit_rr(wide, 0xd3, digit, RAX);
+    if(!wide) {
+        emit_sext32();
+    }
+    store_guest(d->rd, RAX);
+}
+
+static void emit_mul(const DecodedInsn *d, bool wide) {
+    load_guest(RAX, d->rs1);
+    load_guest(RCX, d->rs2);
+    emit_rr2(wide, 0xaf, RAX, RCX);             // imul rax, rcx
+    if(!wide) {
+        emit_sext32();
+    }
+    store_guest(d->rd, RAX);
+}
+
+/* The one-operand mul (/4) and imul (/5) leave the high half in RDX. MULHSU
+   is the unsigned product corrected for a negative rs1: subtracting rs2
+   once from the high half. */
+static void emit_mul_high(const DecodedInsn *d, bool sign, bool sign_unsigned) {
+    load_guest(RAX, d->rs1);
+    load_guest(RCX, d->rs2);
+    emit_rr(true, 0xf7, sign ? 5 : 4, RCX);
+    if(sign_unsigned) {
+        load_guest(RAX, d->rs1);
+        emit_rr(true, 0xc1, 7, RAX);            // sar rax, 63
+        emit8(63);
+        emit_rr(true, 0x21, RCX, RAX);          // and rax, rcx
+        emit_rr(true, 0x29, RAX, RDX);          // sub rdx, rax
+    }
+    store_guest(d->rd, RDX);
+}
+
+/* Branch-free like div_signed() and friends in muldiv.h: a divisor of -1
+   becomes a division of -rs1 by 1, and a divisor of 0 a division by 1
+   whose result is patched with the mask left in R10 */
+static void emit_divide(const DecodedInsn *d, bool sign, bool rem, bool wide) {
+    load_guest(RAX, d->rs1);
+    load_guest(RCX, d->rs2);
+    emit_mov_imm(R8, 1);
+    if(sign) {
+        emit_rr(wide, 0x89, RAX, RDX);          // rdx = -rax
+        emit_rr(wide, 0xf7, 3, RDX);
+        emit_rr(wide, 0x83, 7, RCX);            // cmp rcx, -1
+        emit8(0xff);
+        emit_cmov(wide, CC_E, RAX, RDX);
+        emit_cmov(wide, CC_E, RCX, R8);
+    }
+    emit_rr(wide, 0x89, RAX, R9);
+    emit_rr(wide, 0x83, 7, RCX);                // cmp rcx, 1: CF when zero
+    emit8(1);
+    emit_cmov(wide, CC_B, RCX, R8);
+    emit_rr(wide, 0x19, R10, R10);              // sbb r10, r10
+    if(sign) {
+        emit_rex(wide, 0, 0);                   // cqo
+        emit8(0x99);
+    } else {
+        emit_rr(false, 0x31, RDX, RDX);
+    }
+    emit_rr(wide, 0xf7, sign ? 7 : 6, RCX);     // idiv/div rcx
+    if(rem) {
+        emit_rr(wide, 0x21, R10, R9);           // rdx |= rs1 & mask
+        emit_rr(wide, 0x09, R9, RDX);
+        emit_rr(true, 0x89, RDX, RAX);
+    } else {
+        emit_rr(wide, 0x09, R10, RAX);          // rax |= mask
+    }
+    if(!wide) {
+        emit_sext32();
+    }
+    store_guest(d->rd, RAX);
+}
+
+static void emit_set_imm(const DecodedInsn *d, uint8_t cc) {
+    load_guest(RAX, d->rs1);
+    emit_rr(true, 0x81, 7, RAX);
+    emit32(d->imm);
+    emit_setcc(cc);
+    store_guest(d->rd, RAX);
+}
+
+static void emit_set(const DecodedInsn *d, uint8_t cc) {
+    load_guest(RAX, d->rs1);
+    load_guest(RCX, d->rs2);
+    emit_rr(true, 0x39, RCX, RAX);
+    emit_setcc(cc);
+    store_guest(d->rd, RAX);
+}
+
+static void emit_address(const DecodedInsn *d) {
+    load_guest(RDI, d->rs1);
+    emit_rr(true, 0x81, 0, RDI);
+    emit32(d->imm);
+}
+
+/* Looks up the address in RDI in the TLB (see mmu_load()). On a hit RDI is
+   turned into the host address; returns the jump to patch to the miss path. */
+static uint8_t *emit_tlb_lookup(size_t tag, int size) {
+    emit_rr(true, 0x89, RDI, RAX);
+    emit_rr(true, 0xc1, 5, RAX);                // shr rax, PAGE_SHIFT
+    emit8(PAGE_SHIFT);
+    emit_rr(false, 0x81, 4, RAX);               // and eax, TLB_SIZE - 1
+    emit32(TLB_SIZE - 1);
+    emit_rr(true, 0xc1, 4, RAX);                // shl rax, TLB_ENTRY_SHIFT
+    emit8(TLB_ENTRY_SHIFT);
+    emit_rr(true, 0x01, REG_CPU, RAX);
+    emit_rr(true, 0x89, RDI, RCX);
+    emit_rr(true, 0x81, 4, RCX);                // and rcx, tag mask
+    emit32(~(uint32_t)(PAGE_SIZE - 1) | (size - 1));
+    emit_rm(true, 0x3b, RCX, RAX, offsetof(CPU, tlb) + tag);
+    uint8_t *miss = emit_jcc(CC_NE);
+    emit_rm(true, 0x03, RDI, RAX, offsetof(CPU, tlb) + offsetof(TLBEntry, addend));
+    return miss;
+}
+
+/* Loads or extends into RAX from the r/m operand given by `modrm` */
+static void emit_extend(int size, bool sign, uint8_t modrm) {
+    switch(size) {
+        case 1:
+            emit_rex(sign, 0, 0);
+            emit8(0x0f);
+            emit8(sign ? 0xbe : 0xb6);
+            break;
+        case 2:
+            emit_rex(sign, 0, 0);
+            emit8(0x0f);
+            emit8(sign ? 0xbf : 0xb7);
+            break;
+        case 4:
+            emit_rex(sign, 0, 0);
+            emit8(sign ? 0x63 : 0x8b);
+            break;
+        default:
+            emit_rex(true, 0, 0);
+            emit8(0x8b);
+            break;
+    }
+    emit8(modrm);
+}
+
+static void emit_load(const DecodedInsn *d, int size, bool sign) {
+    emit_address(d);
+    uint8_t *miss = emit_tlb_lookup(offsetof(TLBEntry, tag_read), size);
+    emit_extend(size, sign, 0x07);              // [rdi]
+    uint8_t *done = emit_jmp();
+
+    patch_jump(miss);
+    emit_rr(true, 0x89, RDI, RSI);
+    emit_rr(true, 0x89, REG_CPU, RDI);
+    emit8(0xba);                                // mov edx, size
+    emit32(size);
+    emit_call((uintptr_t)mmu_load_slow);
+    emit_trap_check();
+    if(sign && size < 8) {
+        emit_extend(size, true, 0xc0);          // rax
+    }
+
+    patch_jump(done);
+    store_guest(d->rd, RAX);
+}
+
+static void emit_store(const DecodedInsn *d, int size) {
+    load_guest(RSI, d->rs2);
+    emit_address(d);
+    uint8_t *miss = emit_tlb_lookup(offsetof(TLBEntry, tag_write), size);
+    switch(size) {                              // mov [rdi], rsi
+        case 1: emit8(0x40); emit8(0x88); break;
+        case 2: emit8(0x66); emit8(0x89); break;
+        case 4: emit8(0x89); break;
+        default: emit8(0x48); emit8(0x89); break;
+    }
+    emit8(0x37);
+
+    /* Same check as dcache_invalidate(): is there decoded code in the page? */
+    emit_rr(true, 0x89, RDI, RAX);
+    emit_mov_imm(RCX, (uintptr_t)machine->ram);
+    emit_rr(true, 0x29, RCX, RAX);
+    emit_rr(true, 0xc1, 5, RAX);
+    emit8(DCACHE_PAGE_SHIFT);
+    emit_mov_imm(RCX, (uintptr_t)machine->dcache_pages);
+    emit8(0x48);                                // cmp qword [rcx + rax * 8], 0
+    emit8(0x83);
+    emit8(0x3c);
+    emit8(0xc1);
+    emit8(0x00);
+    uint8_t *no_code = emit_jcc(CC_E);
+    emit8(0xbe);                                // mov esi, size
+    emit32(size);
+    emit_mov_imm(RDX, (uintptr_t)machine);
+    emit_call((uintptr_t)helper_invalidate);
+    uint8_t *done = emit_jmp();
+
+    patch_jump(miss);
+    emit_rr(true, 0x89, RSI, RDX);
+    emit_rr(true, 0x89, RDI, RSI);
+    emit_rr(true, 0x89, REG_CPU, RDI);
+    emit8(0xb9);                                // mov ecx, size
+    emit32(size);
+    emit_call((uintptr_t)mmu_store_slow);
+    emit_trap_check();
+
+    patch_jump(no_code);
+    patch_jump(done);
+}
+
+static void emit_branch(const DecodedInsn *d, uint64_t pc, uint8_t cc) {
+    load_guest(RAX, d->rs1);
+    load_guest(RCX, d->rs2);
+    emit_rr(true, 0x39, RCX, RAX);
+    uint8_t *taken = emit_jcc(cc);
+    emit_exit(pc + d->length, 1);
+    patch_jump(taken);
+    emit_exit(pc + d->imm, 0);
+}
+
+static void emit_jalr(const DecodedInsn *d, uint64_t pc) {
+    load_guest(RAX, d->rs1);
+    emit_rr(true, 0x81, 0, RAX);
+    emit32(d->imm);
+    emit_rr(true, 0x83, 4, RAX);    // and rax, ~1
+    emit8(0xfe);
+    emit_mov_imm(RCX, pc + d->length);
+    store_guest(d->rd, RCX);
+    emit_return(0, true);
+}
+
+/* Atomics are a call into amo.c, which does its own TLB lookup; the locked
+   host instruction dominates the cost anyway. Mapped guest registers are
+   callee-saved, so they survive the call. */
+static void emit_amo(const DecodedInsn *d, int op, int size) {
+    load_guest(RSI, d->rs1);
+    emit_rr(true, 0x89, REG_CPU, RDI);
+    switch(op) {
+        case AMO_LR:
+            emit_mov_imm(RDX, size);
+            emit_call((uintptr_t)amo_lr);
+            break;
+        case AMO_SC:
+            load_guest(RDX, d->rs2);
+            emit_mov_imm(RCX, size);
+            emit_call((uintptr_t)amo_sc);
+            break;
+        default:
+            load_guest(RDX, d->rs2);
+            emit_mov_imm(RCX, op);
+            emit_mov_imm(R8, size);
+            emit_call((uintptr_t)amo_rmw);
+            break;
+    }
+    emit_trap_check();
+    store_guest(d->rd, RAX);
+}
+
+/* Vector and floating-point instructions are a call into vector.c or fpu.c,
+   which take the raw instruction. They read the scalar operands from the CPU
+   and may write rd, so those go through memory. */
+static void emit_raw_call(const DecodedInsn *d, uintptr_t fn) {
+    int regs[3] = {d->rd, d->rs1, d->rs2};
+    for(int i = 0; i < 3; i++) {
+        if(regs[i] && host_reg[regs[i]] >= 0) {
+            emit_rm_cpu(true, 0x89, host_reg[regs[i]], reg_offset(regs[i]));
+        }
+    }
+    emit_rr(true, 0x89, REG_CPU, RDI);
+    emit8(0xbe);                    // mov esi, raw
+    emit32(d->raw);
+    emit_call(fn);
+    if(d->rd && host_reg[d->rd] >= 0) {
+        emit_rm_cpu(true, 0x8b, host_reg[d->rd], reg_offset(d->rd));
+    }
+    emit_trap_check();
+}
+
+JitFn jit_compile(const Block *b, Machine *m) {
+
+    if(!jit_init()) {
+        return NULL;
+    }
+    machine = m;
+
+    if(code_buf + JIT_BUFFER_SIZE - code_ptr < (ptrdiff_t)(b->length * MAX_INSN_BYTES + MAX_EXTRA_BYTES)) {
+        /* Out of space: start over with an empty buffer once the current
+           blocks have been thrown away */
+        block_invalidate_local();
+        return NULL;
+    }
+
+    uint8_t *start = code_ptr;
+    assign_host_regs(b);
+    num_traps = 0;
+    emit_prologue();
+
+    for(uint32_t i = 0; i < b->length; i++) {
+        const DecodedInsn *d = &b->insns[i].d;
+        current_insn = i;
+        uint64_t pc = b->pc + b->insns[i].pc_off;
+        switch(d->op) {
+            case DOP_NOP:
+            case DOP_J:
+            case DOP_FENCE:
+                /* x86 never reorders loads, or stores with each other */
+                break;
+            case DOP_FENCE_SC:
+                /* mfence */
+                emit8(0x0f);
+                emit8(0xae);
+                emit8(0xf0);
+                break;
+            case DOP_LUI:
+                emit_mov_imm(RAX, d->imm);
+                store_guest(d->rd, RAX);
+                break;
+            case DOP_AUIPC:
+                emit_mov_imm(RAX, pc + d->imm);
+                store_guest(d->rd, RAX);
+                break;
+            case DOP_JAL:
+                emit_mov_imm(RAX, pc + d->length);
+                store_guest(d->rd, RAX);
+                break;
+            case DOP_ADDI: emit_alu_imm(d, 0, true); break;
+            case DOP_XORI: emit_alu_imm(d, 6, true); break;
+            case DOP_ORI: emit_alu_imm(d, 1, true); break;
+            case DOP_ANDI: emit_alu_imm(d, 4, true); break;
+            case DOP_SLTI: emit_set_imm(d, CC_L); break;
+            case DOP_SLTIU: emit_set_imm(d, CC_B); break;
+            case DOP_SLLI: emit_shift_imm(d, 4, true); break;
+            case DOP_SRLI: emit_shift_imm(d, 5, true); break;
+            case DOP_SRAI: emit_shift_imm(d, 7, true); break;
+            case DOP_ADD: emit_alu(d, 0x01, true); break;
+            case DOP_SUB: emit_alu(d, 0x29, true); break;
+            case DOP_XOR: emit_alu(d, 0x31, true); break;
+            case DOP_OR: emit_alu(d, 0x09, true); break;
+            case DOP_AND: emit_alu(d, 0x21, true); break;
+            case DOP_SLT: emit_set(d, CC_L); break;
+            case DOP_SLTU: emit_set(d, CC_B); break;
+            case DOP_SLL: emit_shift(d, 4, true); break;
+            case DOP_SRL: emit_shift(d, 5, true); break;
+            case DOP_SRA: emit_shift(d, 7, true); break;
+            case DOP_ADDIW: emit_alu_imm(d, 0, false); break;
+            case DOP_SLLIW: emit_shift_imm(d, 4, false); break;
+            case DOP_SRLIW: emit_shift_imm(d, 5, false); break;
+            case DOP_SRAIW: emit_shift_imm(d, 7, false); break;
+            case DOP_ADDW: emit_alu(d, 0x01, false); break;
+            case DOP_SUBW: emit_alu(d, 0x29, false); break;
+            case DOP_SLLW: emit_shift(d, 4, false); break;
+            case DOP_SRLW: emit_shift(d, 5, false); break;
+            case DOP_SRAW: emit_shift(d, 7, false); break;
+            case DOP_MUL: emit_mul(d, true); break;
+            case DOP_MULH: emit_mul_high(d, true, false); break;
+            case DOP_MULHSU: emit_mul_high(d, false, true); break;
+            case DOP_MULHU: emit_mul_high(d, false, false); break;
+            case DOP_DIV: emit_divide(d, true, false, true); break;
+            case DOP_DIVU: emit_divide(d, false, false, true); break;
+            case DOP_REM: emit_divide(d, true, true, true); break;
+            case DOP_REMU: emit_divide(d, false, true, true); break;
+            case DOP_MULW: emit_mul(d, false); break;
+            case DOP_DIVW: emit_divide(d, true, false, false); break;
+            case DOP_DIVUW: emit_divide(d, false, false, false); break;
+            case DOP_REMW: emit_divide(d, true, true, false); break;
+            case DOP_REMUW: emit_divide(d, false, true, false); break;
+            case DOP_LB: emit_load(d, 1, true); break;
+            case DOP_LH: emit_load(d, 2, true); break;
+            case DOP_LW: emit_load(d, 4, true); break;
+            case DOP_LBU: emit_load(d, 1, false); break;
+            case DOP_LHU: emit_load(d, 2, false); break;
+            case DOP_LWU: emit_load(d, 4, false); break;
+            case DOP_LD: emit_load(d, 8, false); break;
+            case DOP_SB: emit_store(d, 1); break;
+            case DOP_SH: emit_store(d, 2); break;
+            case DOP_SW: emit_store(d, 4); break;
+            case DOP_SD: emit_store(d, 8); break;
+            case DOP_LR_W: emit_amo(d, AMO_LR, 4); break;
+            case DOP_LR_D: emit_amo(d, AMO_LR, 8); break;
+            case DOP_SC_W: emit_amo(d, AMO_SC, 4); break;
+            case DOP_SC_D: emit_amo(d, AMO_SC, 8); break;
+            case DOP_AMOSWAP_W: emit_amo(d, AMO_SWAP, 4); break;
+            case DOP_AMOADD_W: emit_amo(d, AMO_ADD, 4); break;
+            case DOP_AMOXOR_W: emit_amo(d, AMO_XOR, 4); break;
+            case DOP_AMOAND_W: emit_amo(d, AMO_AND, 4); break;
+            case DOP_AMOOR_W: emit_amo(d, AMO_OR, 4); break;
+            case DOP_AMOMIN_W: emit_amo(d, AMO_MIN, 4); break;
+            case DOP_AMOMAX_W: emit_amo(d, AMO_MAX, 4); break;
+            case DOP_AMOMINU_W: emit_amo(d, AMO_MINU, 4); break;
+            case DOP_AMOMAXU_W: emit_amo(d, AMO_MAXU, 4); break;
+            case DOP_AMOSWAP_D: emit_amo(d, AMO_SWAP, 8); break;
+            case DOP_AMOADD_D: emit_amo(d, AMO_ADD, 8); break;
+            case DOP_AMOXOR_D: emit_amo(d, AMO_XOR, 8); break;
+            case DOP_AMOAND_D: emit_amo(d, AMO_AND, 8); break;
+            case DOP_AMOOR_D: emit_amo(d, AMO_OR, 8); break;
+            case DOP_AMOMIN_D: emit_amo(d, AMO_MIN, 8); break;
+            case DOP_AMOMAX_D: emit_amo(d, AMO_MAX, 8); break;
+            case DOP_AMOMINU_D: emit_amo(d, AMO_MINU, 8); break;
+            case DOP_AMOMAXU_D: emit_amo(d, AMO_MAXU, 8); break;
+            case DOP_BEQ: emit_branch(d, pc, CC_E); break;
+            case DOP_BNE: emit_branch(d, pc, CC_NE); break;
+            case DOP_BLT: emit_branch(d, pc, CC_L); break;
+            case DOP_BGE: emit_branch(d, pc, CC_GE); break;
+            case DOP_BLTU: emit_branch(d, pc, CC_B); break;
+            case DOP_BGEU: emit_branch(d, pc, CC_AE); break;
+            case DOP_VECTOR: emit_raw_call(d, (uintptr_t)vector_exec); break;
+            case DOP_FPU: emit_raw_call(d, (uintptr_t)fpu_exec); break;
+            case DOP_JALR: emit_jalr(d, pc); break;
+            case DOP_EXEC32: emit_exec32(pc, d->raw, b->count - 1); break;
+            case BLOCK_END: emit_exit(pc, 1); break;
+            default:
+                /* Not supported by the JIT; leave the block to the
+                   interpreter */
+                code_ptr = start;
+                return NULL;
+        }
+    }
+    emit_trap_stubs();
+
+    /* Data and function pointers share a representation on every x86-64 ABI
+       we care about */
+    uint8_t *entry = exec_buf + (start - code_buf);
+    JitFn fn;
+    memcpy(&fn, &entry, sizeof(fn));
+    return fn;
+
+}
+
+#endif
@@ -0,0 +1,143 @@
+#define _DEFAULT_SOURCE
+#include <elf.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "loader.h"
+#include "bus.h"
+#include "mmu.h"
+
+#ifndef EM_RISCV
+#define EM_RISCV    243
+#endif
+
+static inline bool ram_range(const Machine *m, uint64_t paddr, uint64_t size) {
+    uint64_t offset = paddr - RAM_BASE;
+    return paddr >= RAM_BASE && offset <= m->ram_size && m->ram_size - offset >= size;
+}
+
+static bool read_at(int fd, uint8_t *dst, uint64_t offset, uint64_t size) {
+    while(size) {
+        ssize_t n = pread(fd, dst, size, offset);
+        if(n <= 0) {
+            return false;
+        }
+        dst += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool load_fd(Machine *m, int fd, uint64_t offset, uint64_t paddr, uint64_t size, uint64_t zero) {
+
+    if(!ram_range(m, paddr, size + zero)) {
+        return false;
+    }
+    uint64_t ram_offset = paddr - RAM_BASE;
+    uint8_t *dst = m->ram + ram_offset;
+
+    /* Whatever was decoded from the old contents is gone */
+    dcache_invalidate_pages(m, ram_offset, size + zero);
+
+    /* mmap needs the file offset and the guest address to agree on their
+       position within a page; RAM itself is page aligned. Only the pages
+       wholly inside the data are mapped, since the partial ones at either
+       end may hold another segment, and they are read into instead. RAM
+       in huge pages would be split up into base pages, so it is always
+       read into. */
+    uint64_t head = ram_offset & (PAGE_SIZE - 1);
+    bool small = m->ram_pages == BUS_PAGES_SMALL;
+    if(size && small && (offset & (PAGE_SIZE - 1)) == head) {
+        uint64_t first = head ? PAGE_SIZE - head : 0;
+        first = first < size ? first : size;
+        uint64_t whole = (size - first) & ~(uint64_t)(PAGE_SIZE - 1);
+        if(!read_at(fd, dst, offset, first) ||
+           (whole && mmap(dst + first, whole, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset + first) == MAP_FAILED) ||
+           !read_at(fd, dst + first + whole, offset + first + whole, size - first - whole)) {
+            return false;
+        }
+    } else if(!read_at(fd, dst, offset, size)) {
+        return false;
+    }
+    dst += size;
+
+    /* Whole pages of zeroes go back to being anonymous memory, or are
+       handed back to the kernel when they are huge */
+    uint64_t page_size = m->ram_page_size;
+    uint8_t *page = (uint8_t *)(((uintptr_t)dst + page_size - 1) & ~(uintptr_t)(page_size - 1));
+    uint8_t *end = dst + zero;
+    if(page < end) {
+        memset(dst, 0, page - dst);
+        uint64_t pages = (end - page) & ~(page_size - 1);
+        if(pages && small && mmap(page, pages, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+            return false;
+        }
+        if(pages && !small && madvise(page, pages, MADV_DONTNEED) != 0) {
+            memset(page, 0, pages);
+        }
+        memset(page + pages, 0, end - page - pages);
+    } else {
+        memset(dst, 0, zero);
+    }
+    return true;
+
+}
+
+bool is_elf(const char *path) {
+    int fd = open(path, O_RDONLY);
+    unsigned char ident[SELFMAG];
+    bool elf = fd >= 0 && read_at(fd, ident, 0, SELFMAG) && !memcmp(ident, ELFMAG, SELFMAG);
+    if(fd >= 0) {
+        close(fd);
+    }
+    return elf;
+}
+
+bool load_elf(Machine *m, const char *path, uint64_t *entry) {
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+
+    Elf64_Ehdr eh;
+    bool ok = read_at(fd, (uint8_t *)&eh, 0, sizeof(eh)) &&
+              !memcmp(eh.e_ident, ELFMAG, SELFMAG) &&
+              eh.e_ident[EI_CLASS] == ELFCLASS64 &&
+              eh.e_ident[EI_DATA] == ELFDATA2LSB &&
+              eh.e_machine == EM_RISCV &&
+              eh.e_phentsize == sizeof(Elf64_Phdr);
+
+    for(int i = 0; ok && i < eh.e_phnum; i++) {
+        Elf64_Phdr ph;
+        ok = read_at(fd, (uint8_t *)&ph, eh.e_phoff + i * sizeof(ph), sizeof(ph));
+        if(ok && ph.p_type == PT_LOAD && ph.p_memsz) {
+            ok = ph.p_filesz <= ph.p_memsz && load_fd(m, fd, ph.p_offset, ph.p_paddr, ph.p_filesz, ph.p_memsz - ph.p_filesz);
+        }
+    }
+
+    /* The mappings keep their own reference to the file */
+    close(fd);
+    if(ok) {
+        *entry = eh.e_entry;
+    }
+    return ok;
+
+}
+
+bool load_raw(Machine *m, const char *path, uint64_t paddr, uint64_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0) {
+        return false;
+    }
+    bool ok = fstat(fd, &st) == 0 && load_fd(m, fd, 0, paddr, st.st_size, 0);
+    close(fd);
+    if(ok) {
+        *size = st.st_size;
+    }
+    return ok;
+}
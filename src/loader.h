@@ -0,0 +1,29 @@
+#ifndef __LOADER_H
+#define __LOADER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "machine.h"
+
+/* Images are mapped into guest RAM with mmap(MAP_PRIVATE) wherever the file
+   layout allows it, so loading costs a few system calls, pages are only
+   read from the file when the guest touches them, and every emulator
+   running the same image shares the host page cache. Guest stores only
+   copy the pages they modify. Anything that can't be mapped (RAM not page
+   aligned to the file) is read instead. */
+
+/* Loads the PT_LOAD segments of a RISC-V ELF64 executable at their physical
+   addresses in the machine's RAM. Returns false if the file isn't one or doesn't fit in RAM. */
+bool load_elf(Machine *m, const char *path, uint64_t *entry);
+
+/* Loads a whole file at `paddr`; `size` receives its length */
+bool load_raw(Machine *m, const char *path, uint64_t paddr, uint64_t *size);
+
+/* Places `size` bytes of the file at `offset` into RAM at `paddr` and zeroes
+   the `zero` bytes after them */
+bool load_fd(Machine *m, int fd, uint64_t offset, uint64_t paddr, uint64_t size, uint64_t zero);
+
+/* True if the file starts with the ELF magic */
+bool is_elf(const char *path);
+
+#endif
@@ -0,0 +1,223 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "lockstep.h"
+#include "block.h"
+#include "bus.h"
+#include "clint.h"
+#include "decode.h"
+#include "fpu.h"
+#include "mmu.h"
+#include "trap.h"
+
+/* The architectural state of a hart, as it is compared: everything but
+   what the engines keep for themselves (TLB, exit requests, parking) and
+   what only exists in mid-instruction (a pending trap) */
+typedef struct {
+    const char *name;
+    size_t offset, size, element;   // element is the size of one array entry
+} Field;
+
+#define FIELD(f)    {#f, offsetof(CPU, f), sizeof(((CPU *)0)->f), sizeof(((CPU *)0)->f)}
+#define ARRAY(f)    {#f, offsetof(CPU, f), sizeof(((CPU *)0)->f), sizeof(((CPU *)0)->f[0])}
+
+static const Field fields[] = {
+    ARRAY(regs), FIELD(pc), FIELD(priv), FIELD(hartid), FIELD(instret),
+    FIELD(mstatus), FIELD(satp), FIELD(mie), FIELD(mip), FIELD(cycle_offset),
+    FIELD(mcounteren), FIELD(scounteren),
+    FIELD(mtvec), FIELD(mepc), FIELD(mcause), FIELD(mtval), FIELD(mscratch),
+    FIELD(stvec), FIELD(sepc), FIELD(scause), FIELD(stval), FIELD(sscratch),
+    FIELD(medeleg), FIELD(mideleg),
+    ARRAY(fregs), FIELD(frm), FIELD(fflags),
+    FIELD(vl), FIELD(vtype), FIELD(vstart), FIELD(vxrm), FIELD(vxsat), ARRAY(vregs),
+    FIELD(reservation_value),
+};
+
+#define NUM_FIELDS      (int)(sizeof(fields) / sizeof(fields[0]))
+
+static uint64_t mix(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ hash >> 29;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *p, size_t size) {
+    for(; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = mix(hash, word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, size);
+    return mix(hash, tail);
+}
+
+/* Where a reservation is, as an offset into RAM that is the same in both
+   machines */
+static uint64_t reservation(const CPU *cpu) {
+    return cpu->reservation ? (uint64_t)(cpu->reservation - cpu->machine->ram) : UINT64_MAX;
+}
+
+uint64_t lockstep_hash_hart(const CPU *cpu) {
+    uint64_t hash = 0;
+    for(int i = 0; i < NUM_FIELDS; i++) {
+        hash = hash_bytes(hash, (const uint8_t *)cpu + fields[i].offset, fields[i].size);
+    }
+    return mix(hash, reservation(cpu));
+}
+
+/* Stores through the TLB only note their page while it has no write tag,
+   so the TLBs go with every new start */
+static bool track_writes(Machine *m) {
+    for(int i = 0; i < m->num_harts; i++) {
+        tlb_flush(&m->harts[i]);
+    }
+    return bus_track_begin(m);
+}
+
+static uint64_t hash_written(const Machine *m) {
+    uint64_t hash = 0;
+    if(m->ram_page_state) {
+        /* Summed, since the engines may write the pages in another order */
+        for(uint64_t i = 0; i < m->num_dirty; i++) {
+            uint64_t page = m->dirty_pages[i];
+            hash += mix(hash_bytes(page, m->ram + (page << BUS_DIRTY_SHIFT), BUS_DIRTY_SIZE), page);
+        }
+    }
+    return hash;
+}
+
+uint64_t lockstep_hash_ram(Machine *m) {
+    uint64_t hash = hash_written(m);
+    track_writes(m);
+    return hash;
+}
+
+/* One step of the reference, which like the decoded cache has a boundary
+   after every instruction */
+static void reference_step(CPU *cpu) {
+    uint32_t insn;
+    if(!mmu_fetch_insn(cpu, cpu->pc, &insn)) {
+        trap_take(cpu, cpu->pc);
+    } else {
+        exec_insn(insn, cpu);
+        if(cpu->trap_pending) {
+            trap_take(cpu, cpu->pc);
+        } else {
+            cpu->instret++;
+        }
+    }
+    if(atomic_load_explicit(&cpu->exit_request, memory_order_relaxed)) {
+        cpu_exit_request(cpu);
+    }
+}
+
+/* Names what differs between the harts, and the first byte of each page
+   either machine wrote that differs */
+static void describe(const CPU *cpu, const CPU *ref) {
+
+    for(int i = 0; i < NUM_FIELDS; i++) {
+        const Field *f = &fields[i];
+        for(size_t at = 0; at < f->size; at += f->element) {
+            const uint8_t *a = (const uint8_t *)cpu + f->offset + at, *b = (const uint8_t *)ref + f->offset + at;
+            if(memcmp(a, b, f->element)) {
+                uint64_t va = 0, vb = 0;
+                memcpy(&va, a, f->element < 8 ? f->element : 8);
+                memcpy(&vb, b, f->element < 8 ? f->element : 8);
+                if(f->element == f->size) {
+                    fprintf(stderr, "  %s: %#" PRIx64 ", reference %#" PRIx64 "\n", f->name, va, vb);
+                } else {
+                    fprintf(stderr, "  %s[%zu]: %#" PRIx64 ", reference %#" PRIx64 "\n", f->name, at / f->element, va, vb);
+                }
+            }
+        }
+    }
+    if(reservation(cpu) != reservation(ref)) {
+        fprintf(stderr, "  reservation: %#" PRIx64 ", reference %#" PRIx64 "\n", reservation(cpu), reservation(ref));
+    }
+
+    const Machine *ms[2] = {cpu->machine, ref->machine};
+    for(int k = 0; k < 2; k++) {
+        for(uint64_t i = 0; i < ms[k]->num_dirty; i++) {
+            uint64_t page = ms[k]->dirty_pages[i], offset = page << BUS_DIRTY_SHIFT;
+            const uint8_t *a = ms[0]->ram + offset, *b = ms[1]->ram + offset;
+            uint64_t at = 0;
+            while(at < BUS_DIRTY_SIZE && a[at] == b[at]) {
+                at++;
+            }
+            if(at < BUS_DIRTY_SIZE) {
+                /* Listed once, by the first machine that has it */
+                if(k == 0 || !(ms[0]->ram_page_state[page] & BUS_PAGE_DIRTY)) {
+                    fprintf(stderr, "  RAM at %#" PRIx64 ": %#x, reference %#x\n", RAM_BASE + offset + at, a[at], b[at]);
+                }
+            } else if(!(ms[1 - k]->ram_page_state[page] & BUS_PAGE_DIRTY)) {
+                fprintf(stderr, "  RAM page at %#" PRIx64 ": only written by the %s\n", RAM_BASE + offset, k ? "reference" : "engine");
+            }
+        }
+    }
+
+}
+
+bool lockstep_run(Machine *m, Machine *ref, int engine, uint64_t count, uint64_t interval) {
+
+    CPU *cpu = &m->harts[0], *ref_cpu = &ref->harts[0];
+    if(!track_writes(m) || !track_writes(ref)) {
+        return false;
+    }
+
+    for(uint64_t done = 0; done < count;) {
+
+        uint64_t start = cpu->instret, start_pc = cpu->pc;
+        uint64_t n = count - done < interval ? count - done : interval;
+        if(engine == LOCKSTEP_DCACHE) {
+            dcache_run(cpu, n);
+        } else {
+            block_run(cpu, n);
+        }
+
+        fpu_enter(ref_cpu);
+        while(ref_cpu->instret < cpu->instret) {
+            reference_step(ref_cpu);
+        }
+        fpu_leave(ref_cpu);
+
+        /* The engine may leave a request for its next boundary that the
+           reference dealt with after the last instruction, and may have
+           taken a trap the reference hasn't got to yet, as neither
+           retires */
+        if(atomic_load_explicit(&cpu->exit_request, memory_order_relaxed)) {
+            cpu_exit_request(cpu);
+        }
+        if(ref_cpu->instret == cpu->instret && ref_cpu->pc != cpu->pc) {
+            fpu_enter(ref_cpu);
+            reference_step(ref_cpu);
+            fpu_leave(ref_cpu);
+        }
+
+        if(lockstep_hash_hart(cpu) != lockstep_hash_hart(ref_cpu) || hash_written(m) != hash_written(ref)) {
+            fprintf(stderr, "lockstep: the engine and the reference differ at instret %" PRIu64 ", in the %" PRIu64
+                            " instructions from PC %#" PRIx64 "\n", cpu->instret, cpu->instret - start, start_pc);
+            describe(cpu, ref_cpu);
+            return false;
+        }
+        if(!track_writes(m) || !track_writes(ref)) {
+            return false;
+        }
+
+        /* Time moves on for both, which may raise timer interrupts that
+           they then take at the same point */
+        uint64_t retired = cpu->instret - start;
+        clint_set_mtime(&m->clint, clint_mtime(&m->clint) + retired);
+        clint_set_mtime(&ref->clint, clint_mtime(&ref->clint) + retired);
+        if(atomic_load_explicit(&cpu->exit_request, memory_order_relaxed)) {
+            cpu_exit_request(cpu);
+        }
+        if(atomic_load_explicit(&ref_cpu->exit_request, memory_order_relaxed)) {
+            cpu_exit_request(ref_cpu);
+        }
+        done += retired ? retired : 1;
+
+    }
+    return true;
+
+}
@@ -0,0 +1,40 @@
+#ifndef __LOCKSTEP_H
+#define __LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "machine.h"
+
+/* Lockstep testing of an execution engine against the reference
+   interpreter (exec_insn()), for running the decoded cache, the block
+   engine and the JIT over billions of instructions without comparing every
+   one. The engine runs a machine at full speed for an interval, a second
+   machine booted the same way is stepped through the same instructions
+   with the reference, and the two are compared by digests of the harts'
+   architectural state and of the RAM written during the interval.
+
+   Both machines need one hart, a manual clock and no devices, so that
+   nothing happens to them that isn't decided by the instructions: mtime
+   moves on by one tick per retired instruction at the end of each
+   interval, where timer interrupts are raised. Interrupts the harts raise
+   for themselves through the CLINT in mid-interval may be taken a few
+   instructions apart, which is allowed but shows up as a difference. */
+
+#define LOCKSTEP_BLOCK      0   // block_run(): threaded code, the JIT, bulk loops
+#define LOCKSTEP_DCACHE     1   // dcache_run()
+
+/* A digest of everything architectural about a hart, which two harts only
+   share if neither engine got anything wrong */
+uint64_t lockstep_hash_hart(const CPU *cpu);
+
+/* A digest of the RAM pages written since the last call, which only
+   depends on which pages they are and what they hold. The first call
+   starts tracking the writes. */
+uint64_t lockstep_hash_ram(Machine *m);
+
+/* Runs at least `count` instructions on `m` with `engine`, and on `ref`
+   with the reference, comparing them every `interval`. Returns false at
+   the first difference, after describing it on stderr. */
+bool lockstep_run(Machine *m, Machine *ref, int engine, uint64_t count, uint64_t interval);
+
+#endif
@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+#include "machine.h"
+#include "block.h"
+#include "bus.h"
+#include "decode.h"
+#include "smp.h"
+#include "virtio_blk.h"
+#include "virtio_net.h"
+
+static atomic_uint_fast64_t next_id = 1;
+
+Machine *machine_create(const MachineConfig *config) {
+
+    if(config->num_harts < 1 || config->num_harts > SMP_MAX_HARTS ||
+       config->ram_pages < BUS_PAGES_SMALL || config->ram_pages > BUS_PAGES_1G) {
+        return NULL;
+    }
+    Machine *m = calloc(1, sizeof(Machine));
+    if(!m) {
+        return NULL;
+    }
+    m->id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+    m->num_harts = config->num_harts;
+    if(!(m->harts = aligned_alloc(_Alignof(CPU), m->num_harts * sizeof(CPU)))) {
+        free(m);
+        return NULL;
+    }
+    memset(m->harts, 0, m->num_harts * sizeof(CPU));
+    for(int i = 0; i < m->num_harts; i++) {
+        m->harts[i].machine = m;
+    }
+
+    if(!bus_init(m, config) || (config->share_code && !dcache_share(m))) {
+        machine_destroy(m);
+        return NULL;
+    }
+    smp_init(m->harts, m->num_harts);
+    if(!clint_init(&m->clint, m, config->manual_time) || !plic_init(&m->plic, m)) {
+        machine_destroy(m);
+        return NULL;
+    }
+    return m;
+
+}
+
+void machine_destroy(Machine *m) {
+    if(m->blk) {
+        virtio_blk_destroy(m->blk);
+    }
+    if(m->net) {
+        virtio_net_destroy(m->net);
+    }
+    clint_destroy(&m->clint);
+    block_release(m);
+    bus_free(m);
+    free(m->harts);
+    free(m->saved_harts);
+    free(m);
+}
+
+bool machine_add_disk(Machine *m, const char *path) {
+    return !m->blk && (m->blk = virtio_blk_create(m, path, 0)) != NULL;
+}
+
+bool machine_add_tap(Machine *m, const char *name) {
+    return !m->net && (m->net = virtio_net_create(m, name, 1)) != NULL;
+}
+
+bool machine_run(Machine *m, uint64_t count) {
+    return smp_run(m->harts, m->num_harts, count);
+}
+
+void machine_stop(Machine *m) {
+    for(int i = 0; i < m->num_harts; i++) {
+        smp_request_exit(&m->harts[i], EXIT_STOP);
+    }
+}
+
+void machine_thread_exit(void) {
+    block_thread_exit();
+}
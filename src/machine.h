@@ -0,0 +1,141 @@
+#ifndef __MACHINE_H
+#define __MACHINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "clint.h"
+#include "plic.h"
+
+/* libr5, the emulator as a library: a Machine owns its RAM, its devices and
+   its harts, and any number of them can live in one process. Nothing on
+   the execution path is global; each hart reaches everything through
+   cpu->machine.
+
+   Harts run on whatever thread calls machine_run(), a single hart on the
+   calling one, so a thread pool can take turns running machines. A thread
+   keeps its translated blocks for the machine it ran last, and throws them
+   away when it moves on to another one; machine_thread_exit() frees them
+   for good.
+
+   Machines created with `share_code` also decode into a pool shared by all
+   of them: a page of RAM with the same contents as a page another machine
+   already runs code from uses the same decoded page, so a fleet booting the
+   same kernel decodes it once. The first store to such a page gives the
+   storing machine a private copy again, for good (see decode.h).
+
+   Profiles, coverage and execution traces are still per process. */
+
+#define BUS_MAX_REGIONS     32
+
+/* Device callbacks receive the offset of the access into their window */
+typedef uint64_t (*MMIORead)(void *opaque, uint64_t offset, int size);
+typedef void (*MMIOWrite)(void *opaque, uint64_t offset, uint64_t value, int size);
+
+/* Everything outside of RAM is described by a table of non-overlapping
+   regions sorted by base address. A region either forwards accesses to a
+   device, or is direct: backed by host memory that the TLB can map like
+   RAM (e.g. a boot ROM). */
+typedef struct {
+    uint64_t base, size;
+    uint8_t *host;
+    MMIORead read;
+    MMIOWrite write;
+    void *opaque;
+} BusRegion;
+
+struct DecodedPage;
+struct SharedPage;
+struct BlockCache;
+struct VirtioBlk;
+struct VirtioNet;
+
+typedef struct Machine Machine;
+struct Machine {
+    uint64_t id;            // never reused, unlike the address
+
+    /* Guest RAM is one contiguous host mapping starting at RAM_BASE; see
+       bus.h for the dirty tracking */
+    uint8_t *ram;
+    uint64_t ram_size;
+    int ram_pages;          // BUS_PAGES_*, what RAM actually got
+    uint64_t ram_page_size; // and the size of those
+    uint64_t numa_nodes;
+    _Atomic uint8_t *ram_page_state;
+    uint8_t *ram_shadow;
+    uint32_t *dirty_pages;
+    uint64_t num_dirty;
+    pthread_mutex_t dirty_lock;
+
+    BusRegion regions[BUS_MAX_REGIONS];
+    int num_regions;
+    BusRegion *last_region; // device accesses tend to hit the same region; atomic
+
+    /* One decoded page per page of RAM, and the shared page each one was
+       first given, if sharing; see decode.h */
+    struct DecodedPage **dcache_pages;
+    uint64_t dcache_num_pages;
+    struct SharedPage **dcache_shared;
+
+    /* The caches of the threads that ran the harts; see block.c */
+    struct BlockCache *caches;
+    atomic_int num_caches;
+
+    /* The decoder only emits host fences when there is more than one hart,
+       so this is fixed for the machine's lifetime */
+    CPU *harts;
+    int num_harts;
+
+    Clint clint;
+    Plic plic;
+    struct VirtioBlk *blk;
+    struct VirtioNet *net;
+
+    /* What reset_machine() returns to; see reset.h */
+    CPU *saved_harts;
+    uint64_t saved_mtimecmp[SMP_MAX_HARTS];
+    uint64_t saved_mtime;
+};
+
+typedef struct {
+    uint64_t ram_size;
+    int num_harts;
+    bool share_code;
+
+    /* How RAM is backed by host memory (BUS_PAGES_* in bus.h), and the host
+       NUMA nodes it and the harts' threads go on, if any (see numa.h) */
+    int ram_pages;
+    uint64_t numa_nodes;
+
+    /* mtime only moves when set, for runs that must be repeatable (see
+       clint.h) */
+    bool manual_time;
+} MachineConfig;
+
+/* Allocates RAM, resets the harts and maps the CLINT and the PLIC. RAM is
+   empty; load_elf() and load_raw() put an image into it, and the harts
+   start at RAM_BASE. Returns NULL if anything couldn't be set up. */
+Machine *machine_create(const MachineConfig *config);
+
+/* The harts must be stopped. Also closes the devices. */
+void machine_destroy(Machine *m);
+
+/* Attaches a disk image as a virtio-blk device in the first virtio-mmio
+   slot, or a host tap interface as a virtio-net device in the second */
+bool machine_add_disk(Machine *m, const char *path);
+bool machine_add_tap(Machine *m, const char *name);
+
+/* Runs at least `count` instructions on each hart, as smp_run() does */
+bool machine_run(Machine *m, uint64_t count);
+
+/* Has machine_run() return at the harts' next block boundaries; safe to
+   call from any thread */
+void machine_stop(Machine *m);
+
+/* Frees the calling thread's translated blocks, for threads that won't run
+   harts again */
+void machine_thread_exit(void);
+
+#endif
@@ -0,0 +1,247 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "machine.h"
+#include "bus.h"
+#include "mmu.h"
+#include "smp.h"
+#include "loader.h"
+#include "numa.h"
+#include "snapshot.h"
+#include "gdbstub.h"
+#include "lockstep.h"
+#ifdef TRACE
+#include "trace.h"
+#endif
+
+/* usage: r5 [-m MiB] [-p harts] [-n instructions] [-i initrd] [-d dtb]
+             [-b disk] [-t tap] [-g port] [-T trace] [-w snapshot] [-s]
+             [-H thp|2m|1g] [-N nodes] [-l interval] [-L block|dcache]
+             image | -r snapshot
+
+   The image is loaded as an ELF executable if it is one, and as a flat
+   binary at the start of RAM otherwise. The device tree goes at the top of
+   RAM with the initrd right below it; like other boot loaders, every hart
+   starts with its hartid in a0 and the device tree address in a1.
+
+   -r resumes from a snapshot instead of booting an image, and -w saves one
+   when the harts stop, so a job can boot once with -n and -w and then start
+   any number of runs from that point.
+
+   -b attaches a disk image as a virtio-blk device in the first virtio-mmio
+   slot, and -t a host tap interface as a virtio-net device in the second,
+   both interrupting through the PLIC. Device state isn't part of
+   snapshots, so they are only taken with the devices idle.
+
+   -g waits for GDB to connect on a localhost port before anything runs,
+   and then runs the harts under its control.
+
+   -T records an execution trace into a file (see trace.h), in builds made
+   with TRACE=1.
+
+   -s decodes into the pool shared with other machines in the process (see
+   machine.h), which only makes a difference to programs embedding libr5
+   but is useful to check that sharing leaves a guest's behaviour alone.
+
+   -H backs guest RAM with huge pages: transparent ones, or 2 MiB or 1 GiB
+   ones reserved in hugetlbfs, and -N puts RAM on a list of host NUMA nodes
+   such as 0,2-3, interleaved if there are several, with the harts'
+   threads going round the nodes' CPUs. Either reports the host page size
+   RAM ended up in when the harts stop.
+
+   -l runs the machine in lockstep with a second one stepped by the
+   reference interpreter, comparing the two every `interval` instructions
+   (see lockstep.h), and fails at the first difference. -L picks the engine
+   being checked, the block engine with its JIT by default. Lockstep needs
+   a single hart and no devices or debugger, and gives the guest a clock
+   that only moves with the instructions. */
+
+#define DTB_MAX_SIZE    (1024 * 1024)
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-m MiB] [-p harts] [-n instructions] [-i initrd] [-d dtb]\n"
+                    "          [-b disk] [-t tap] [-g port] [-T trace] [-w snapshot] [-s]\n"
+                    "          [-H thp|2m|1g] [-N nodes] [-l interval] [-L block|dcache]\n"
+                    "          image | -r snapshot\n", name);
+    exit(1);
+}
+
+static int parse_pages(const char *name) {
+    static const char *const names[] = {"thp", "2m", "1g"};
+    for(int i = 0; i < 3; i++) {
+        if(!strcmp(name, names[i])) {
+            return BUS_PAGES_THP + i;
+        }
+    }
+    return -1;
+}
+
+/* What -H and -N got */
+static void report_pages(const Machine *m) {
+    uint64_t huge, page_size = bus_page_size(m, &huge);
+    if(page_size) {
+        fprintf(stderr, "guest RAM: %" PRIu64 " kB pages, %" PRIu64 " of %" PRIu64 " MiB in huge pages\n",
+                page_size >> 10, huge >> 20, m->ram_size >> 20);
+    }
+}
+
+/* Loads the image and the blobs that go with it and points the harts at it */
+static bool boot(Machine *m, const char *image, const char *initrd, const char *dtb) {
+
+    uint64_t entry = RAM_BASE, size;
+    if(is_elf(image) ? !load_elf(m, image, &entry) : !load_raw(m, image, RAM_BASE, &size)) {
+        fprintf(stderr, "can't load %s\n", image);
+        return false;
+    }
+
+    uint64_t top = RAM_BASE + m->ram_size, dtb_addr = 0;
+    if(dtb) {
+        dtb_addr = top - DTB_MAX_SIZE;
+        if(!load_raw(m, dtb, dtb_addr, &size) || size > DTB_MAX_SIZE) {
+            fprintf(stderr, "can't load %s\n", dtb);
+            return false;
+        }
+        top = dtb_addr;
+    }
+    if(initrd) {
+        /* Its placement depends on its size */
+        struct stat st;
+        uint64_t base = 0;
+        if(stat(initrd, &st) == 0 && (uint64_t)st.st_size <= top - RAM_BASE) {
+            base = (top - st.st_size) & ~(uint64_t)(PAGE_SIZE - 1);
+        }
+        if(!base || !load_raw(m, initrd, base, &size)) {
+            fprintf(stderr, "can't load %s\n", initrd);
+            return false;
+        }
+    }
+
+    for(int i = 0; i < m->num_harts; i++) {
+        CPU *cpu = &m->harts[i];
+        cpu->pc = entry;
+        cpu->regs[10] = cpu->hartid;
+        cpu->regs[11] = dtb_addr;
+    }
+    return true;
+
+}
+
+int main(int argc, char **argv) {
+
+    uint64_t ram_mib = RAM_SIZE_DEFAULT >> 20;
+    uint64_t count = UINT64_MAX;
+    int num_harts = 1, gdb_port = 0;
+    bool share_code = false;
+    int ram_pages = BUS_PAGES_SMALL;
+    uint64_t numa_nodes = 0, lockstep = 0;
+    int engine = LOCKSTEP_BLOCK;
+    const char *initrd = NULL, *dtb = NULL, *disk = NULL, *tap = NULL, *restore = NULL, *save = NULL, *trace = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "m:p:n:i:d:b:t:g:T:r:w:sH:N:l:L:")) != -1) {
+        switch(opt) {
+            case 'm': ram_mib = strtoull(optarg, NULL, 0); break;
+            case 'p': num_harts = atoi(optarg); break;
+            case 'n': count = strtoull(optarg, NULL, 0); break;
+            case 'i': initrd = optarg; break;
+            case 'd': dtb = optarg; break;
+            case 'b': disk = optarg; break;
+            case 't': tap = optarg; break;
+            case 'g': gdb_port = atoi(optarg); break;
+            case 'T': trace = optarg; break;
+            case 'r': restore = optarg; break;
+            case 'w': save = optarg; break;
+            case 's': share_code = true; break;
+            case 'H': if((ram_pages = parse_pages(optarg)) < 0) usage(argv[0]); break;
+            case 'N': if(!numa_parse_nodes(optarg, &numa_nodes)) usage(argv[0]); break;
+            case 'l': lockstep = strtoull(optarg, NULL, 0); break;
+            case 'L': engine = !strcmp(optarg, "dcache") ? LOCKSTEP_DCACHE : strcmp(optarg, "block") ? -1 : LOCKSTEP_BLOCK; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - !restore || num_harts < 1 || num_harts > SMP_MAX_HARTS || ram_mib < 4 || engine < 0) {
+        usage(argv[0]);
+    }
+    if(lockstep && (num_harts != 1 || disk || tap || gdb_port)) {
+        fprintf(stderr, "lockstep needs a single hart, and no devices or debugger\n");
+        return 1;
+    }
+
+    MachineConfig config = {ram_mib << 20, num_harts, share_code, ram_pages, numa_nodes, lockstep != 0};
+    Machine *m = machine_create(&config), *ref = NULL;
+    if(!m) {
+        fprintf(stderr, "can't set up a machine with %" PRIu64 " MiB of guest RAM\n", ram_mib);
+        return 1;
+    }
+    if(disk && !machine_add_disk(m, disk)) {
+        fprintf(stderr, "can't open %s\n", disk);
+        return 1;
+    }
+    if(tap && !machine_add_tap(m, tap)) {
+        fprintf(stderr, "can't attach to %s\n", tap);
+        return 1;
+    }
+
+    if(lockstep && !(ref = machine_create(&config))) {
+        fprintf(stderr, "can't set up the reference machine\n");
+        return 1;
+    }
+
+    /* The reference starts out the same way */
+    Machine *machines[2] = {m, ref};
+    for(int i = 0; i < 2 && machines[i]; i++) {
+        if(restore) {
+            if(!snapshot_restore(restore, machines[i])) {
+                fprintf(stderr, "can't restore %s\n", restore);
+                return 1;
+            }
+        } else if(!boot(machines[i], argv[optind], initrd, dtb)) {
+            return 1;
+        }
+    }
+
+#ifdef TRACE
+    if(trace && !trace_start(trace, m->harts, m->num_harts)) {
+        fprintf(stderr, "can't record a trace into %s\n", trace);
+        return 1;
+    }
+#else
+    if(trace) {
+        fprintf(stderr, "tracing needs a build with TRACE=1\n");
+        return 1;
+    }
+#endif
+
+    bool ok;
+    if(lockstep) {
+        ok = lockstep_run(m, ref, engine, count, lockstep);
+    } else if(gdb_port) {
+        if(!(ok = gdb_run(m, count, gdb_port))) {
+            fprintf(stderr, "gdb session on port %d failed\n", gdb_port);
+        }
+    } else {
+        ok = machine_run(m, count);
+    }
+#ifdef TRACE
+    if(trace && !trace_stop()) {
+        fprintf(stderr, "can't write %s\n", trace);
+        ok = false;
+    }
+#endif
+    if(ram_pages != BUS_PAGES_SMALL || numa_nodes) {
+        report_pages(m);
+    }
+    if(save && !snapshot_save(save, m)) {
+        fprintf(stderr, "can't save %s\n", save);
+        ok = false;
+    }
+    if(ref) {
+        machine_destroy(ref);
+    }
+    machine_destroy(m);
+    return ok ? 0 : 1;
+
+}
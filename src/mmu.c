@@ -0,0 +1,285 @@
+#include "mmu.h"
+#include "block.h"
+#include "csr.h"
+#include "rvc.h"
+#include "trap.h"
+
+#define PTE_V           (1 << 0)
+#define PTE_R           (1 << 1)
+#define PTE_W           (1 << 2)
+#define PTE_X           (1 << 3)
+#define PTE_U           (1 << 4)
+#define PTE_A           (1 << 6)
+#define PTE_D           (1 << 7)
+#define PTE_PPN_SHIFT   10
+#define PTE_PPN_MASK    ((1ULL << 44) - 1)
+
+void tlb_flush(CPU *cpu) {
+    for(int i = 0; i < TLB_SIZE; i++) {
+        cpu->tlb[i].tag_read = cpu->tlb[i].tag_write = cpu->tlb[i].tag_exec = TLB_INVALID;
+    }
+}
+
+void mmu_flush(CPU *cpu) {
+    tlb_flush(cpu);
+
+    /* Blocks are looked up by virtual address, but only this hart's
+       translation changed */
+    block_revalidate_local();
+}
+
+static bool pte_allows(CPU *cpu, uint64_t pte, int access, int priv) {
+
+    if(access == ACCESS_EXEC) {
+        /* Supervisor mode can never execute user pages */
+        return (pte & PTE_X) && (priv == PL_USER) == !!(pte & PTE_U);
+    }
+
+    if(pte & PTE_U) {
+        if(priv == PL_SUPERVISOR && !(cpu->mstatus & MSTATUS_SUM)) {
+            return false;
+        }
+    } else if(priv == PL_USER) {
+        return false;
+    }
+
+    if(access == ACCESS_WRITE) {
+        return pte & PTE_W;
+    }
+    return (pte & PTE_R) || ((pte & PTE_X) && (cpu->mstatus & MSTATUS_MXR));
+
+}
+
+bool mmu_translate(CPU *cpu, uint64_t vaddr, int access, uint64_t *paddr) {
+
+    /* MPRV makes machine mode loads and stores use the privilege in MPP */
+    int priv = cpu->priv;
+    if(access != ACCESS_EXEC && priv == PL_MACHINE && (cpu->mstatus & MSTATUS_MPRV)) {
+        priv = (cpu->mstatus & MSTATUS_MPP) >> 11;
+    }
+
+    int mode = cpu->satp >> SATP_MODE_SHIFT;
+    if(priv == PL_MACHINE || mode == SATP_MODE_BARE) {
+        *paddr = vaddr;
+        return true;
+    }
+
+    /* Sv39 and Sv48 only differ in the number of levels, and the unused upper
+       bits of the address must be copies of the highest used one */
+    int levels = mode == SATP_MODE_SV39 ? 3 : 4;
+    int va_bits = PAGE_SHIFT + 9 * levels;
+    if((int64_t)(vaddr << (64 - va_bits)) >> (64 - va_bits) != (int64_t)vaddr) {
+        return false;
+    }
+
+    uint64_t table = (cpu->satp & SATP_PPN_MASK) << PAGE_SHIFT;
+    for(int level = levels - 1; level >= 0; level--) {
+
+        /* Page tables outside of RAM aren't supported */
+        uint8_t *pte_ptr = bus_ram_ptr(cpu->machine, table + ((vaddr >> (PAGE_SHIFT + 9 * level)) & 0x1ff) * 8);
+        if(!pte_ptr) {
+            return false;
+        }
+
+        uint64_t pte;
+        memcpy(&pte, pte_ptr, sizeof(pte));
+        if(!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W))) {
+            return false;
+        }
+
+        uint64_t ppn = (pte >> PTE_PPN_SHIFT) & PTE_PPN_MASK;
+        if(!(pte & (PTE_R | PTE_X))) {
+            table = ppn << PAGE_SHIFT;
+            continue;
+        }
+
+        /* Superpages must be aligned to their size */
+        uint64_t offset_mask = (1ULL << (PAGE_SHIFT + 9 * level)) - 1;
+        if(!pte_allows(cpu, pte, access, priv) || ((ppn << PAGE_SHIFT) & offset_mask)) {
+            return false;
+        }
+
+        /* We update A and D ourselves instead of faulting. Other harts may
+           be walking or updating the same entry, so the update has to be a
+           single atomic OR. */
+        uint64_t update = PTE_A | (access == ACCESS_WRITE ? PTE_D : 0);
+        if((pte & update) != update) {
+            Machine *m = cpu->machine;
+            bus_note_write(m, pte_ptr - m->ram, sizeof(pte));
+            __atomic_fetch_or((uint64_t *)pte_ptr, update, __ATOMIC_RELAXED);
+            dcache_invalidate(m, pte_ptr - m->ram, sizeof(pte));
+        }
+
+        *paddr = (ppn << PAGE_SHIFT) | (vaddr & offset_mask);
+        return true;
+
+    }
+
+    return false;
+
+}
+
+/* Caches the translation of the page containing `vaddr` for one kind of
+   access. The other kinds are kept if they refer to the same page. */
+static void tlb_fill(CPU *cpu, uint64_t vaddr, uint8_t *host, int access) {
+
+    TLBEntry *e = tlb_entry(cpu, vaddr);
+    uint64_t page = vaddr & ~(uint64_t)(PAGE_SIZE - 1);
+
+    if(e->tag_read != page) e->tag_read = TLB_INVALID;
+    if(e->tag_write != page) e->tag_write = TLB_INVALID;
+    if(e->tag_exec != page) e->tag_exec = TLB_INVALID;
+
+    e->addend = (uintptr_t)host - vaddr;
+    switch(access) {
+        case ACCESS_READ: e->tag_read = page; break;
+        case ACCESS_WRITE: e->tag_write = page; break;
+        case ACCESS_EXEC: e->tag_exec = page; break;
+    }
+
+}
+
+static inline bool crosses_page(uint64_t vaddr, int size) {
+    return (vaddr & (PAGE_SIZE - 1)) + size > PAGE_SIZE;
+}
+
+uint64_t mmu_load_slow(CPU *cpu, uint64_t vaddr, int size) {
+
+    /* Accesses crossing a page are split into bytes; each half may be
+       translated differently */
+    if(crosses_page(vaddr, size)) {
+        uint64_t value = 0;
+        for(int i = 0; i < size; i++) {
+            value |= mmu_load(cpu, vaddr + i, 1) << (i * 8);
+        }
+        return value;
+    }
+
+    uint64_t paddr;
+    if(!mmu_translate(cpu, vaddr, ACCESS_READ, &paddr)) {
+        trap_raise(cpu, CAUSE_LOAD_PAGE_FAULT, vaddr);
+        return 0;
+    }
+
+    uint8_t *host = bus_direct_ptr(cpu->machine, paddr);
+    if(!host) {
+        if(!bus_find_region(cpu->machine, paddr, size)) {
+            trap_raise(cpu, CAUSE_LOAD_ACCESS, vaddr);
+            return 0;
+        }
+        return bus_mmio_load(cpu->machine, paddr, size);
+    }
+
+    tlb_fill(cpu, vaddr, host, ACCESS_READ);
+    uint64_t value = 0;
+    memcpy(&value, host, size);
+    return value;
+
+}
+
+void mmu_store_slow(CPU *cpu, uint64_t vaddr, uint64_t value, int size) {
+
+    if(crosses_page(vaddr, size)) {
+        for(int i = 0; i < size; i++) {
+            mmu_store(cpu, vaddr + i, value >> (i * 8), 1);
+        }
+        return;
+    }
+
+    uint64_t paddr;
+    if(!mmu_translate(cpu, vaddr, ACCESS_WRITE, &paddr)) {
+        trap_raise(cpu, CAUSE_STORE_PAGE_FAULT, vaddr);
+        return;
+    }
+
+    uint8_t *host = bus_ram_ptr(cpu->machine, paddr);
+    if(!host) {
+        /* Direct regions outside of RAM aren't covered by the decoded cache,
+           so they never get write tags and every store ends up here */
+        if(!bus_find_region(cpu->machine, paddr, size)) {
+            trap_raise(cpu, CAUSE_STORE_ACCESS, vaddr);
+            return;
+        }
+        bus_mmio_store(cpu->machine, paddr, value, size);
+        return;
+    }
+
+    /* The write tag lets later stores skip this, so it has to be done
+       before the page is written at all */
+    Machine *m = cpu->machine;
+    bus_note_write(m, host - m->ram, size);
+    tlb_fill(cpu, vaddr, host, ACCESS_WRITE);
+    memcpy(host, &value, size);
+    dcache_invalidate(m, host - m->ram, size);
+
+}
+
+uint8_t *mmu_fetch_slow(CPU *cpu, uint64_t vaddr) {
+    uint64_t paddr;
+    uint8_t *host;
+    if(!mmu_translate(cpu, vaddr, ACCESS_EXEC, &paddr) || !(host = bus_direct_ptr(cpu->machine, paddr))) {
+        return NULL;
+    }
+    tlb_fill(cpu, vaddr, host, ACCESS_EXEC);
+    return host;
+}
+
+uint8_t *mmu_atomic_slow(CPU *cpu, uint64_t vaddr, int size, int access) {
+    uint64_t paddr;
+    uint8_t *host;
+    if((vaddr & (size - 1)) || !mmu_translate(cpu, vaddr, access, &paddr) || !(host = bus_ram_ptr(cpu->machine, paddr))) {
+        return NULL;
+    }
+    if(access == ACCESS_WRITE) {
+        bus_note_write(cpu->machine, host - cpu->machine->ram, size);
+    }
+    tlb_fill(cpu, vaddr, host, access);
+    return host;
+}
+
+void mmu_atomic_fault(CPU *cpu, uint64_t vaddr, int size, int access) {
+    bool load = access == ACCESS_READ;
+    uint64_t paddr;
+    if(vaddr & (size - 1)) {
+        trap_raise(cpu, load ? CAUSE_MISALIGNED_LOAD : CAUSE_MISALIGNED_STORE, vaddr);
+    } else if(!mmu_translate(cpu, vaddr, access, &paddr)) {
+        trap_raise(cpu, load ? CAUSE_LOAD_PAGE_FAULT : CAUSE_STORE_PAGE_FAULT, vaddr);
+    } else {
+        trap_raise(cpu, load ? CAUSE_LOAD_ACCESS : CAUSE_STORE_ACCESS, vaddr);
+    }
+}
+
+static bool fetch_parcel(CPU *cpu, uint64_t vaddr, uint16_t *parcel) {
+    uint8_t *host = mmu_fetch(cpu, vaddr);
+    if(host) {
+        memcpy(parcel, host, sizeof(*parcel));
+        return true;
+    }
+    uint64_t paddr;
+    if(!mmu_translate(cpu, vaddr, ACCESS_EXEC, &paddr)) {
+        trap_raise(cpu, CAUSE_FETCH_PAGE_FAULT, vaddr);
+        return false;
+    }
+    if(!bus_find_region(cpu->machine, paddr, 2)) {
+        trap_raise(cpu, CAUSE_FETCH_ACCESS, vaddr);
+        return false;
+    }
+    *parcel = bus_mmio_load(cpu->machine, paddr, 2);
+    return true;
+}
+
+bool mmu_fetch_insn(CPU *cpu, uint64_t vaddr, uint32_t *insn) {
+    uint16_t low, high;
+    if(!fetch_parcel(cpu, vaddr, &low)) {
+        return false;
+    }
+    if(insn_compressed(low)) {
+        *insn = low;
+        return true;
+    }
+    if(!fetch_parcel(cpu, vaddr + 2, &high)) {
+        return false;
+    }
+    *insn = low | (uint32_t)high << 16;
+    return true;
+}
@@ -0,0 +1,162 @@
+#ifndef __MMU_H
+#define __MMU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+#include "csr.h"
+#include "bus.h"
+#include "decode.h"
+#include "trace.h"
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1 << PAGE_SHIFT)
+
+#define ACCESS_READ     0
+#define ACCESS_WRITE    1
+#define ACCESS_EXEC     2
+
+/* Every guest load and store goes through the functions and macros below,
+   so that is where they are traced */
+#ifdef TRACE
+#define MMU_TRACE(cpu, vaddr, size, kind)   trace_access(cpu, vaddr, size, kind)
+#else
+#define MMU_TRACE(cpu, vaddr, size, kind)   ((void)0)
+#endif
+
+void tlb_flush(CPU *cpu);
+
+/* Identifies how instructions are fetched: 0 where addresses are physical,
+   and otherwise the page tables together with whether the fetch is checked
+   as a user one. satp only ever selects Sv39 or Sv48 there, which both
+   leave bit 62 clear. */
+static inline uint64_t mmu_fetch_context(const CPU *cpu) {
+    if(cpu->priv == PL_MACHINE || (cpu->satp >> SATP_MODE_SHIFT) == SATP_MODE_BARE) {
+        return 0;
+    }
+    return cpu->satp | (uint64_t)(cpu->priv == PL_USER) << 62;
+}
+
+/* Invalidates the TLB and everything derived from guest virtual addresses:
+   what SFENCE.VMA does. Blocks are tagged with satp and the privilege level
+   (see block_get()), so a change of those, or of the MMU bits of mstatus,
+   only needs the TLB flushed. */
+void mmu_flush(CPU *cpu);
+
+/* Translates a guest virtual address, walking the page tables if needed.
+   Returns false on a page fault. */
+bool mmu_translate(CPU *cpu, uint64_t vaddr, int access, uint64_t *paddr);
+
+uint64_t mmu_load_slow(CPU *cpu, uint64_t vaddr, int size);
+void mmu_store_slow(CPU *cpu, uint64_t vaddr, uint64_t value, int size);
+uint8_t *mmu_fetch_slow(CPU *cpu, uint64_t vaddr);
+uint8_t *mmu_atomic_slow(CPU *cpu, uint64_t vaddr, int size, int access);
+
+/* The slow paths raise the exception for an access that faults (see
+   trap.h), except mmu_fetch_slow() and mmu_atomic_slow(), which only tell
+   whether the fast path can be used. mmu_atomic_fault() then raises it for
+   an atomic that can't. */
+void mmu_atomic_fault(CPU *cpu, uint64_t vaddr, int size, int access);
+
+/* Fetches an instruction from anywhere, including outside of RAM: a
+   compressed one in the low 16 bits, or a 32-bit one whose halves may come
+   from different pages. Returns false after raising a fetch fault. */
+bool mmu_fetch_insn(CPU *cpu, uint64_t vaddr, uint32_t *insn);
+
+static inline TLBEntry *tlb_entry(CPU *cpu, uint64_t vaddr) {
+    return &cpu->tlb[(vaddr >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+}
+
+/* Keeps the low bits of a misaligned address so that its tag never matches
+   and it always takes the slow path */
+static inline uint64_t tlb_tag(uint64_t vaddr, int size) {
+    return vaddr & (~(uint64_t)(PAGE_SIZE - 1) | (size - 1));
+}
+
+/* The fast path for RAM is a tag compare and a host memory access; page
+   walks, MMIO and unaligned accesses are left to the slow path. */
+static inline uint64_t mmu_load(CPU *cpu, uint64_t vaddr, int size) {
+    MMU_TRACE(cpu, vaddr, size, TRACE_LOAD);
+    TLBEntry *e = tlb_entry(cpu, vaddr);
+    if(e->tag_read == tlb_tag(vaddr, size)) {
+        uint64_t value = 0;
+        memcpy(&value, (void *)(uintptr_t)(vaddr + e->addend), size);
+        return value;
+    }
+    return mmu_load_slow(cpu, vaddr, size);
+}
+
+static inline void mmu_store(CPU *cpu, uint64_t vaddr, uint64_t value, int size) {
+    MMU_TRACE(cpu, vaddr, size, TRACE_STORE);
+    TLBEntry *e = tlb_entry(cpu, vaddr);
+    if(e->tag_write == tlb_tag(vaddr, size)) {
+        uint8_t *host = (uint8_t *)(uintptr_t)(vaddr + e->addend);
+        memcpy(host, &value, size);
+        dcache_invalidate(cpu->machine, host - cpu->machine->ram, size);
+        return;
+    }
+    mmu_store_slow(cpu, vaddr, value, size);
+}
+
+/* mmu_load() and mmu_store() for ops.inc, which leave the instruction as
+   soon as it raises a trap: `on_trap` only runs after the slow path, and
+   only if the access faulted there. The _TRACE forms record the access
+   with `trace` in place of MMU_TRACE, for engines instantiated for traced
+   and untraced harts (see block_run.inc). */
+#define MMU_LOAD(cpu, vaddr, size, on_trap)         MMU_LOAD_TRACE(cpu, vaddr, size, on_trap, MMU_TRACE)
+#define MMU_STORE(cpu, vaddr, value, size, on_trap) MMU_STORE_TRACE(cpu, vaddr, value, size, on_trap, MMU_TRACE)
+
+#define MMU_LOAD_TRACE(cpu, vaddr, size, on_trap, trace) __extension__ ({ \
+        uint64_t vaddr_ = (vaddr), value_ = 0; \
+        trace(cpu, vaddr_, size, TRACE_LOAD); \
+        TLBEntry *e_ = tlb_entry(cpu, vaddr_); \
+        if(e_->tag_read == tlb_tag(vaddr_, size)) { \
+            memcpy(&value_, (void *)(uintptr_t)(vaddr_ + e_->addend), size); \
+        } else { \
+            value_ = mmu_load_slow(cpu, vaddr_, size); \
+            if((cpu)->trap_pending) { \
+                on_trap; \
+            } \
+        } \
+        value_; \
+    })
+
+#define MMU_STORE_TRACE(cpu, vaddr, value, size, on_trap, trace) do { \
+        uint64_t vaddr_ = (vaddr), value_ = (value); \
+        trace(cpu, vaddr_, size, TRACE_STORE); \
+        TLBEntry *e_ = tlb_entry(cpu, vaddr_); \
+        if(e_->tag_write == tlb_tag(vaddr_, size)) { \
+            uint8_t *host_ = (uint8_t *)(uintptr_t)(vaddr_ + e_->addend); \
+            memcpy(host_, &value_, size); \
+            dcache_invalidate((cpu)->machine, host_ - (cpu)->machine->ram, size); \
+        } else { \
+            mmu_store_slow(cpu, vaddr_, value_, size); \
+            if((cpu)->trap_pending) { \
+                on_trap; \
+            } \
+        } \
+    } while(0)
+
+/* Returns the host address of the instruction at `vaddr`, or NULL if it
+   isn't in RAM. Only its first halfword is known to be on the page. */
+static inline uint8_t *mmu_fetch(CPU *cpu, uint64_t vaddr) {
+    TLBEntry *e = tlb_entry(cpu, vaddr);
+    if(e->tag_exec == tlb_tag(vaddr, 2)) {
+        return (uint8_t *)(uintptr_t)(vaddr + e->addend);
+    }
+    return mmu_fetch_slow(cpu, vaddr);
+}
+
+/* Returns the host address for an atomic access to RAM, or NULL if the
+   access is misaligned, faults or isn't in RAM. LR only needs to read;
+   every other atomic needs write permission. */
+static inline uint8_t *mmu_atomic(CPU *cpu, uint64_t vaddr, int size, int access) {
+    TLBEntry *e = tlb_entry(cpu, vaddr);
+    if((access == ACCESS_WRITE ? e->tag_write : e->tag_read) == tlb_tag(vaddr, size)) {
+        return (uint8_t *)(uintptr_t)(vaddr + e->addend);
+    }
+    return mmu_atomic_slow(cpu, vaddr, size, access);
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __MULDIV_H
+#define __MULDIV_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The M extension. The high multiplies use the host's 128-bit product.
+   Division never traps: dividing by zero gives all ones and leaves the
+   dividend as the remainder, and the one overflowing signed division,
+   MIN / -1, gives MIN with a remainder of 0. Both cases are folded in with
+   masks rather than branches, so the common path is a single host divide.
+
+   The 32-bit variants take the low halves of their operands and return
+   their result sign-extended, like every W instruction. */
+
+__extension__ typedef __int128 muldiv_int128;
+__extension__ typedef unsigned __int128 muldiv_uint128;
+
+static inline uint64_t mul_high(uint64_t a, uint64_t b) {
+    return (muldiv_int128)(int64_t)a * (int64_t)b >> 64;
+}
+
+static inline uint64_t mul_high_su(uint64_t a, uint64_t b) {
+    return (muldiv_int128)(int64_t)a * (muldiv_int128)b >> 64;
+}
+
+static inline uint64_t mul_high_u(uint64_t a, uint64_t b) {
+    return (muldiv_uint128)a * b >> 64;
+}
+
+/* Dividing by -1 is negation, which wraps for MIN as required; it is done
+   as a division of -a by 1 so the host can't trap. A zero divisor is also
+   replaced by 1, and its result patched in afterwards. */
+static inline uint64_t divide_signed(int64_t a, int64_t b, bool rem) {
+    uint64_t minus_one = -(uint64_t)(b == -1), zero = -(uint64_t)(b == 0), one = minus_one | zero;
+    a = ((uint64_t)a & ~minus_one) | (-(uint64_t)a & minus_one);
+    b = ((uint64_t)b & ~one) | (1 & one);
+    return rem ? (uint64_t)(a % b) | ((uint64_t)a & zero) : (uint64_t)(a / b) | zero;
+}
+
+static inline uint64_t divide_unsigned(uint64_t a, uint64_t b, bool rem) {
+    uint64_t zero = -(uint64_t)(b == 0);
+    b |= zero & 1;
+    return rem ? a % b | (a & zero) : a / b | zero;
+}
+
+static inline uint32_t divide_signed32(int32_t a, int32_t b, bool rem) {
+    uint32_t minus_one = -(uint32_t)(b == -1), zero = -(uint32_t)(b == 0), one = minus_one | zero;
+    a = ((uint32_t)a & ~minus_one) | (-(uint32_t)a & minus_one);
+    b = ((uint32_t)b & ~one) | (1 & one);
+    return rem ? (uint32_t)(a % b) | ((uint32_t)a & zero) : (uint32_t)(a / b) | zero;
+}
+
+static inline uint32_t divide_unsigned32(uint32_t a, uint32_t b, bool rem) {
+    uint32_t zero = -(uint32_t)(b == 0);
+    b |= zero & 1;
+    return rem ? a % b | (a & zero) : a / b | zero;
+}
+
+static inline uint64_t div_signed(uint64_t a, uint64_t b) { return divide_signed(a, b, false); }
+static inline uint64_t div_unsigned(uint64_t a, uint64_t b) { return divide_unsigned(a, b, false); }
+static inline uint64_t rem_signed(uint64_t a, uint64_t b) { return divide_signed(a, b, true); }
+static inline uint64_t rem_unsigned(uint64_t a, uint64_t b) { return divide_unsigned(a, b, true); }
+
+static inline uint64_t div_signed32(uint64_t a, uint64_t b) { return (int32_t)divide_signed32(a, b, false); }
+static inline uint64_t div_unsigned32(uint64_t a, uint64_t b) { return (int32_t)divide_unsigned32(a, b, false); }
+static inline uint64_t rem_signed32(uint64_t a, uint64_t b) { return (int32_t)divide_signed32(a, b, true); }
+static inline uint64_t rem_unsigned32(uint64_t a, uint64_t b) { return (int32_t)divide_unsigned32(a, b, true); }
+
+#endif
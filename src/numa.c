@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "numa.h"
+
+/* From <numaif.h>, which comes with libnuma */
+#define MPOL_BIND           2
+#define MPOL_INTERLEAVE     3
+
+/* Reads a list of ranges like "0-3,8,10-11" into `mask`, for numbers below
+   `limit`. Returns the end of the list. */
+static const char *parse_list(const char *s, uint64_t *mask, int limit, cpu_set_t *cpus) {
+    do {
+        char *end;
+        long first = strtol(s, &end, 10), last = first;
+        if(end == s || first < 0) {
+            return NULL;
+        }
+        if(*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if(end == s || last < first) {
+                return NULL;
+            }
+        }
+        if(last >= limit) {
+            return NULL;
+        }
+        for(long i = first; i <= last; i++) {
+            if(mask) {
+                *mask |= 1ull << i;
+            } else {
+                CPU_SET(i, cpus);
+            }
+        }
+        s = end;
+    } while(*s == ',' && *++s);
+    return s;
+}
+
+bool numa_parse_nodes(const char *list, uint64_t *nodes) {
+    *nodes = 0;
+    const char *end = parse_list(list, nodes, NUMA_MAX_NODES, NULL);
+    return end && !*end;
+}
+
+bool numa_bind(void *addr, uint64_t size, uint64_t nodes) {
+    int mode = nodes & (nodes - 1) ? MPOL_INTERLEAVE : MPOL_BIND;
+    unsigned long mask = nodes;
+    return syscall(SYS_mbind, addr, size, mode, &mask, NUMA_MAX_NODES + 1, 0) == 0;
+}
+
+bool numa_hart_cpus(uint64_t nodes, int index, cpu_set_t *cpus) {
+
+    int node = -1;
+    for(int skip = index % __builtin_popcountll(nodes); skip >= 0; skip--) {
+        node = __builtin_ctzll(nodes);
+        nodes &= nodes - 1;
+    }
+
+    char path[64], list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        return false;
+    }
+    bool ok = fgets(list, sizeof(list), f) != NULL;
+    fclose(f);
+
+    CPU_ZERO(cpus);
+    const char *end = ok ? parse_list(list, NULL, CPU_SETSIZE, cpus) : NULL;
+    return end && (*end == '\n' || !*end) && CPU_COUNT(cpus);
+
+}
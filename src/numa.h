@@ -0,0 +1,25 @@
+#ifndef __NUMA_H
+#define __NUMA_H
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Host NUMA placement, straight from the kernel's interfaces rather than
+   libnuma. Nodes are given as a mask of node numbers. cpu_set_t needs
+   _GNU_SOURCE. */
+
+#define NUMA_MAX_NODES      64
+
+/* Parses a node list such as "0" or "0,2-3" */
+bool numa_parse_nodes(const char *list, uint64_t *nodes);
+
+/* Places the pages of a mapping that nothing has touched yet on `nodes`:
+   all on the one node, or interleaved when there are several */
+bool numa_bind(void *addr, uint64_t size, uint64_t nodes);
+
+/* The CPUs of the node that hart `index` goes on; harts take the nodes in
+   turn, in order */
+bool numa_hart_cpus(uint64_t nodes, int index, cpu_set_t *cpus);
+
+#endif
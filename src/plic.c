@@ -0,0 +1,130 @@
+#include <string.h>
+#include "plic.h"
+#include "bus.h"
+#include "csr.h"
+
+/* The source a claim from `context` would get, or 0 */
+static int best_source(Plic *plic, int context) {
+    uint32_t candidates = plic->pending & plic->enable[context];
+    int best = 0;
+    uint32_t best_priority = plic->threshold[context];
+    for(; candidates; candidates &= candidates - 1) {
+        int irq = __builtin_ctz(candidates);
+        if(plic->priority[irq] > best_priority) {
+            best = irq;
+            best_priority = plic->priority[irq];
+        }
+    }
+    return best;
+}
+
+/* MEIP and SEIP follow whether each context has something to claim. Called
+   with the lock held. */
+static void update(Plic *plic) {
+    for(int context = 0; context < 2 * plic->num_harts; context++) {
+        CPU *cpu = &plic->harts[context / 2];
+        uint64_t bit = context & 1 ? MIP_SEIP : MIP_MEIP;
+        smp_set_pending(cpu, bit, best_source(plic, context));
+    }
+}
+
+/* A line only becomes pending again once its last claim is completed */
+static void gateway(Plic *plic) {
+    plic->pending = (plic->pending | (plic->level & ~plic->claimed)) & plic->level;
+}
+
+void plic_set_irq(Plic *plic, int irq, bool level) {
+    if(irq <= 0 || irq >= PLIC_NUM_SOURCES) {
+        return;
+    }
+    pthread_mutex_lock(&plic->lock);
+    uint32_t old = plic->level;
+    plic->level = level ? old | 1U << irq : old & ~(1U << irq);
+    if(plic->level != old) {
+        gateway(plic);
+        update(plic);
+    }
+    pthread_mutex_unlock(&plic->lock);
+}
+
+static uint64_t plic_read(void *opaque, uint64_t offset, int size) {
+
+    Plic *plic = opaque;
+    uint64_t value = 0;
+    (void)size;
+
+    pthread_mutex_lock(&plic->lock);
+    if(offset < PLIC_PRIORITY + 4 * PLIC_NUM_SOURCES) {
+        value = plic->priority[offset / 4];
+    } else if(offset == PLIC_PENDING) {
+        value = plic->pending;
+    } else if(offset >= PLIC_ENABLE && offset < PLIC_ENABLE + PLIC_ENABLE_STRIDE * 2 * (uint64_t)plic->num_harts) {
+        if(offset % PLIC_ENABLE_STRIDE == 0) {
+            value = plic->enable[(offset - PLIC_ENABLE) / PLIC_ENABLE_STRIDE];
+        }
+    } else if(offset >= PLIC_CONTEXT && offset < PLIC_CONTEXT + PLIC_CONTEXT_STRIDE * 2 * (uint64_t)plic->num_harts) {
+        int context = (offset - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+        switch(offset % PLIC_CONTEXT_STRIDE) {
+            case PLIC_THRESHOLD:
+                value = plic->threshold[context];
+                break;
+            case PLIC_CLAIM:
+                value = best_source(plic, context);
+                if(value) {
+                    plic->pending &= ~(1U << value);
+                    plic->claimed |= 1U << value;
+                    update(plic);
+                }
+                break;
+        }
+    }
+    pthread_mutex_unlock(&plic->lock);
+
+    return value;
+
+}
+
+static void plic_write(void *opaque, uint64_t offset, uint64_t value, int size) {
+
+    Plic *plic = opaque;
+    (void)size;
+
+    pthread_mutex_lock(&plic->lock);
+    if(offset < PLIC_PRIORITY + 4 * PLIC_NUM_SOURCES) {
+        if(offset != 0) {
+            plic->priority[offset / 4] = value & PLIC_MAX_PRIORITY;
+        }
+    } else if(offset >= PLIC_ENABLE && offset < PLIC_ENABLE + PLIC_ENABLE_STRIDE * 2 * (uint64_t)plic->num_harts) {
+        if(offset % PLIC_ENABLE_STRIDE == 0) {
+            plic->enable[(offset - PLIC_ENABLE) / PLIC_ENABLE_STRIDE] = value & ~1U;
+        }
+    } else if(offset >= PLIC_CONTEXT && offset < PLIC_CONTEXT + PLIC_CONTEXT_STRIDE * 2 * (uint64_t)plic->num_harts) {
+        int context = (offset - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+        switch(offset % PLIC_CONTEXT_STRIDE) {
+            case PLIC_THRESHOLD:
+                plic->threshold[context] = value & PLIC_MAX_PRIORITY;
+                break;
+            case PLIC_CLAIM:
+                /* Completing a source that isn't enabled is ignored */
+                if(value < PLIC_NUM_SOURCES && (plic->enable[context] & (1U << value))) {
+                    plic->claimed &= ~(1U << value);
+                    gateway(plic);
+                }
+                break;
+        }
+    }
+    update(plic);
+    pthread_mutex_unlock(&plic->lock);
+
+}
+
+bool plic_init(Plic *plic, Machine *m) {
+    if(m->num_harts > SMP_MAX_HARTS) {
+        return false;
+    }
+    memset(plic, 0, sizeof(*plic));
+    pthread_mutex_init(&plic->lock, NULL);
+    plic->harts = m->harts;
+    plic->num_harts = m->num_harts;
+    return bus_register_mmio(m, PLIC_BASE, PLIC_SIZE, plic_read, plic_write, plic);
+}
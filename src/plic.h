@@ -0,0 +1,51 @@
+#ifndef __PLIC_H
+#define __PLIC_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "smp.h"
+
+/* Platform-level interrupt controller, with the register layout of QEMU's
+   virt machine: every hart has a machine-mode context 2 * hartid and a
+   supervisor-mode context 2 * hartid + 1. Sources are level-triggered. */
+#define PLIC_BASE           0xc000000
+#define PLIC_SIZE           0x4000000
+#define PLIC_PRIORITY       0x0
+#define PLIC_PENDING        0x1000
+#define PLIC_ENABLE         0x2000
+#define PLIC_ENABLE_STRIDE  0x80
+#define PLIC_CONTEXT        0x200000
+#define PLIC_CONTEXT_STRIDE 0x1000
+#define PLIC_THRESHOLD      0x0
+#define PLIC_CLAIM          0x4
+
+/* Source 0 doesn't exist */
+#define PLIC_NUM_SOURCES    32
+#define PLIC_MAX_PRIORITY   7
+
+#define PLIC_NUM_CONTEXTS   (2 * SMP_MAX_HARTS)
+
+typedef struct Plic {
+    CPU *harts;
+    int num_harts;
+    /* Devices raise their lines from their own threads */
+    pthread_mutex_t lock;
+    uint32_t priority[PLIC_NUM_SOURCES];
+    uint32_t level;         // lines being asserted
+    uint32_t pending;
+    uint32_t claimed;       // claimed but not completed yet
+    uint32_t enable[PLIC_NUM_CONTEXTS];
+    uint32_t threshold[PLIC_NUM_CONTEXTS];
+} Plic;
+
+struct Machine;
+
+/* Maps the PLIC for the machine's harts into its bus */
+bool plic_init(Plic *plic, struct Machine *m);
+
+/* Sets the level of an interrupt line; safe to call from any thread */
+void plic_set_irq(Plic *plic, int irq, bool level);
+
+#endif
@@ -0,0 +1,95 @@
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "profile.h"
+
+/* Harts update the tables with relaxed atomics; the profiler is allowed to
+   be slow, but not to lose counts */
+static uint64_t histogram[128][8];
+static uint64_t total;
+
+typedef struct {
+    uint64_t pc;
+    uint64_t samples;
+} HotSpot;
+
+static HotSpot hot[1 << PROFILE_HOT_BITS];
+static uint64_t hot_dropped;
+
+static struct timespec start;
+
+static double seconds_since(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+static int compare_hot(const void *a, const void *b) {
+    const HotSpot *x = a, *y = b;
+    return (x->samples < y->samples) - (x->samples > y->samples);
+}
+
+static void profile_report(void) {
+
+    double elapsed = seconds_since(&start);
+    fprintf(stderr, "\n%" PRIu64 " instructions in %.3f s: %.1f MIPS\n", total, elapsed, total / elapsed / 1e6);
+
+    fprintf(stderr, "\nopcode funct3      count       %%\n");
+    for(int op = 0; op < 128; op++) {
+        for(int f = 0; f < 8; f++) {
+            if(histogram[op][f]) {
+                fprintf(stderr, "  0x%02x      %d %10" PRIu64 "  %5.2f\n", op, f, histogram[op][f], 100.0 * histogram[op][f] / total);
+            }
+        }
+    }
+
+    /* Sorting in place is fine, nothing runs after this */
+    qsort(hot, 1 << PROFILE_HOT_BITS, sizeof(HotSpot), compare_hot);
+    fprintf(stderr, "\nhot spots (block start, samples)\n");
+    for(int i = 0; i < PROFILE_HOT_REPORT && hot[i].samples; i++) {
+        fprintf(stderr, "  0x%016" PRIx64 " %8" PRIu64 "\n", hot[i].pc, hot[i].samples);
+    }
+    if(hot_dropped) {
+        fprintf(stderr, "  (%" PRIu64 " samples dropped, table full)\n", hot_dropped);
+    }
+
+}
+
+/* Starts the clock the first time anything is counted */
+static void profile_start(void) {
+    static atomic_flag started = ATOMIC_FLAG_INIT;
+    if(!atomic_flag_test_and_set(&started)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        atexit(profile_report);
+    }
+}
+
+void profile_insn(uint32_t insn, uint64_t count) {
+    profile_start();
+    __atomic_fetch_add(&histogram[insn & 0x7f][(insn >> 12) & 0x7], count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total, count, __ATOMIC_RELAXED);
+}
+
+void profile_sample(uint64_t pc, uint64_t before, uint64_t after) {
+
+    if(before / PROFILE_SAMPLE_PERIOD == after / PROFILE_SAMPLE_PERIOD) {
+        return;
+    }
+
+    /* Open addressing; entries are claimed with a CAS on the PC, which is
+       never 0 for code in RAM */
+    uint64_t mask = (1 << PROFILE_HOT_BITS) - 1;
+    for(uint64_t i = (pc >> 2) & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+        uint64_t expected = 0;
+        if(__atomic_load_n(&hot[i].pc, __ATOMIC_RELAXED) == pc || __atomic_compare_exchange_n(&hot[i].pc, &expected, pc, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) || expected == pc) {
+            __atomic_fetch_add(&hot[i].samples, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_fetch_add(&hot_dropped, 1, __ATOMIC_RELAXED);
+
+}
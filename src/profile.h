@@ -0,0 +1,21 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stdint.h>
+
+/* The profiler is only built with -DPROFILE (make PROFILE=1). It histograms
+   executed instructions by opcode and funct3, samples the PC of the running
+   block every PROFILE_SAMPLE_PERIOD instructions, and prints both along with
+   the overall MIPS when the process exits. */
+#define PROFILE_SAMPLE_PERIOD   10000
+#define PROFILE_HOT_BITS        12
+#define PROFILE_HOT_REPORT      20
+
+/* Accounts for `count` executions of `insn` */
+void profile_insn(uint32_t insn, uint64_t count);
+
+/* Called after instructions retire, with the hart's instret before and
+   after; samples `pc` whenever a period boundary was crossed */
+void profile_sample(uint64_t pc, uint64_t before, uint64_t after);
+
+#endif
@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include <string.h>
+#include "reset.h"
+#include "bus.h"
+#include "block.h"
+#include "mmu.h"
+#include "smp.h"
+#include "coverage.h"
+
+bool reset_point(Machine *m) {
+
+    CPU *harts = m->harts;
+    int num_harts = m->num_harts;
+    if(!m->saved_harts && !(m->saved_harts = aligned_alloc(_Alignof(CPU), num_harts * sizeof(CPU)))) {
+        return false;
+    }
+    if(!bus_track_begin(m)) {
+        return false;
+    }
+
+    /* Pages that are already writable through a TLB would be written
+       without being tracked */
+    for(int i = 0; i < num_harts; i++) {
+        tlb_flush(&harts[i]);
+        harts[i].reservation = NULL;
+    }
+    memcpy(m->saved_harts, harts, num_harts * sizeof(CPU));
+    for(int i = 0; i < num_harts; i++) {
+        m->saved_mtimecmp[i] = clint_mtimecmp(&m->clint, i);
+    }
+    m->saved_mtime = clint_mtime(&m->clint);
+    return true;
+
+}
+
+uint64_t reset_machine(Machine *m) {
+
+    uint64_t pages = bus_track_reset(m);
+
+    /* The saved harts have empty TLBs, which also takes away the write tags
+       that let stores skip the dirty tracking */
+    memcpy(m->harts, m->saved_harts, m->num_harts * sizeof(CPU));
+    /* and the page tables may be back to what they were too */
+    block_revalidate_all(m);
+    for(int i = 0; i < m->num_harts; i++) {
+        clint_set_mtimecmp(&m->clint, i, m->saved_mtimecmp[i]);
+    }
+    clint_set_mtime(&m->clint, m->saved_mtime);
+#ifdef COVERAGE
+    coverage_restart();
+#endif
+    return pages;
+
+}
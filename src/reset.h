@@ -0,0 +1,23 @@
+#ifndef __RESET_H
+#define __RESET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "machine.h"
+
+/* In-process machine reset, for running many short executions (fuzzing
+   inputs, tests) from one starting point. Instead of forking, the harts
+   and the CLINT are copied once, and RAM is restored from the bus's dirty
+   page tracking, so a reset costs in proportion to the pages the last run
+   wrote rather than to the size of RAM.
+
+   The harts must be stopped for both operations. */
+
+/* Makes the current state the one reset_machine() returns to */
+bool reset_point(Machine *m);
+
+/* Returns the number of RAM pages that had to be restored */
+uint64_t reset_machine(Machine *m);
+
+#endif
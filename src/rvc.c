@@ -0,0 +1,165 @@
+#include "rvc.h"
+#include "insn.h"
+
+/* Fields of compressed instructions. Registers marked ' are 3 bits wide and
+   refer to x8-x15. */
+#define RD_RS1(c)       (((c) >> 7) & 0x1f)
+#define RS2(c)          (((c) >> 2) & 0x1f)
+#define RD_RS1_P(c)     ((((c) >> 7) & 0x7) + 8)
+#define RS2_P(c)        ((((c) >> 2) & 0x7) + 8)
+
+/* Moves `width` bits from `from` in the compressed instruction to `to` in
+   the immediate */
+static inline uint32_t bits(uint16_t c, int from, int width, int to) {
+    return ((c >> from) & ((1 << width) - 1)) << to;
+}
+
+static inline int32_t sign_extend(uint32_t value, int width) {
+    return (int32_t)(value << (32 - width)) >> (32 - width);
+}
+
+/* 32-bit encodings */
+static inline uint32_t enc_r(int funct7, int rs2, int rs1, int funct3, int rd, int opcode) {
+    return (uint32_t)funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+static inline uint32_t enc_i(int32_t imm, int rs1, int funct3, int rd, int opcode) {
+    return (uint32_t)imm << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+static inline uint32_t enc_s(int32_t imm, int rs2, int rs1, int funct3, int opcode) {
+    return ((uint32_t)imm >> 5) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (imm & 0x1f) << 7 | opcode;
+}
+
+static inline uint32_t enc_b(int32_t imm, int rs2, int rs1, int funct3) {
+    uint32_t u = imm;
+    return ((u >> 12) & 1) << 31 | ((u >> 5) & 0x3f) << 25 | rs2 << 20 | rs1 << 15 |
+           funct3 << 12 | ((u >> 1) & 0xf) << 8 | ((u >> 11) & 1) << 7 | OP_BRANCH;
+}
+
+static inline uint32_t enc_j(int32_t imm, int rd) {
+    uint32_t u = imm;
+    return ((u >> 20) & 1) << 31 | ((u >> 1) & 0x3ff) << 21 | ((u >> 11) & 1) << 20 |
+           ((u >> 12) & 0xff) << 12 | rd << 7 | OP_JAL;
+}
+
+/* Immediates shared by several formats */
+static inline int32_t imm_ci(uint16_t c) {
+    return sign_extend(bits(c, 12, 1, 5) | bits(c, 2, 5, 0), 6);
+}
+
+static inline int32_t imm_cj(uint16_t c) {
+    return sign_extend(bits(c, 12, 1, 11) | bits(c, 11, 1, 4) | bits(c, 9, 2, 8) | bits(c, 8, 1, 10) |
+                       bits(c, 7, 1, 6) | bits(c, 6, 1, 7) | bits(c, 3, 3, 1) | bits(c, 2, 1, 5), 12);
+}
+
+static inline int32_t imm_cb(uint16_t c) {
+    return sign_extend(bits(c, 12, 1, 8) | bits(c, 10, 2, 3) | bits(c, 5, 2, 6) | bits(c, 3, 2, 1) | bits(c, 2, 1, 5), 9);
+}
+
+/* Offsets of word and doubleword accesses through a 3-bit register */
+static inline uint32_t uimm_w(uint16_t c) {
+    return bits(c, 10, 3, 3) | bits(c, 6, 1, 2) | bits(c, 5, 1, 6);
+}
+
+static inline uint32_t uimm_d(uint16_t c) {
+    return bits(c, 10, 3, 3) | bits(c, 5, 2, 6);
+}
+
+static uint32_t expand_quadrant0(uint16_t c) {
+    int rd = RS2_P(c), rs1 = RD_RS1_P(c);
+    switch(c >> 13) {
+        case 0: {   // C.ADDI4SPN
+            uint32_t imm = bits(c, 11, 2, 4) | bits(c, 7, 4, 6) | bits(c, 6, 1, 2) | bits(c, 5, 1, 3);
+            return imm ? enc_i(imm, 2, OP_IMM_FUNCT3_ADDI, rd, OP_IMM) : 0;
+        }
+        case 1: return enc_i(uimm_d(c), rs1, LOAD_FUNCT3_LD, rd, OP_LOAD_FP);      // C.FLD
+        case 2: return enc_i(uimm_w(c), rs1, LOAD_FUNCT3_LW, rd, OP_LOAD);         // C.LW
+        case 3: return enc_i(uimm_d(c), rs1, LOAD_FUNCT3_LD, rd, OP_LOAD);         // C.LD
+        case 5: return enc_s(uimm_d(c), rd, rs1, STORE_FUNCT3_SD, OP_STORE_FP);    // C.FSD
+        case 6: return enc_s(uimm_w(c), rd, rs1, STORE_FUNCT3_SW, OP_STORE);       // C.SW
+        case 7: return enc_s(uimm_d(c), rd, rs1, STORE_FUNCT3_SD, OP_STORE);       // C.SD
+    }
+    return 0;
+}
+
+static uint32_t expand_quadrant1(uint16_t c) {
+    int rd = RD_RS1(c), rd_p = RD_RS1_P(c), rs2_p = RS2_P(c);
+    switch(c >> 13) {
+        case 0: return enc_i(imm_ci(c), rd, OP_IMM_FUNCT3_ADDI, rd, OP_IMM);       // C.ADDI
+        case 1: return rd ? enc_i(imm_ci(c), rd, OP_IMM32_FUNCT3_ADDIW, rd, OP_IMM32) : 0;  // C.ADDIW
+        case 2: return enc_i(imm_ci(c), 0, OP_IMM_FUNCT3_ADDI, rd, OP_IMM);        // C.LI
+        case 3:
+            if(rd == 2) {   // C.ADDI16SP
+                int32_t imm = sign_extend(bits(c, 12, 1, 9) | bits(c, 6, 1, 4) | bits(c, 5, 1, 6) |
+                                          bits(c, 3, 2, 7) | bits(c, 2, 1, 5), 10);
+                return imm ? enc_i(imm, 2, OP_IMM_FUNCT3_ADDI, 2, OP_IMM) : 0;
+            } else {        // C.LUI
+                int32_t imm = imm_ci(c);
+                return imm ? (uint32_t)imm << 12 | rd << 7 | OP_LUI : 0;
+            }
+        case 4:
+            switch((c >> 10) & 0x3) {
+                case 0: return enc_i(bits(c, 12, 1, 5) | bits(c, 2, 5, 0), rd_p, OP_IMM_FUNCT3_SRLI_SRAI, rd_p, OP_IMM);          // C.SRLI
+                case 1: return enc_i(0x400 | bits(c, 12, 1, 5) | bits(c, 2, 5, 0), rd_p, OP_IMM_FUNCT3_SRLI_SRAI, rd_p, OP_IMM);  // C.SRAI
+                case 2: return enc_i(imm_ci(c), rd_p, OP_IMM_FUNCT3_ANDI, rd_p, OP_IMM);                                  // C.ANDI
+            }
+            switch((c >> 12) & 0x1) {
+                case 0:
+                    switch((c >> 5) & 0x3) {
+                        case 0: return enc_r(0x20, rs2_p, rd_p, OP_FUNCT3_ADD_SUB, rd_p, OP_OP);   // C.SUB
+                        case 1: return enc_r(0, rs2_p, rd_p, OP_FUNCT3_XOR, rd_p, OP_OP);          // C.XOR
+                        case 2: return enc_r(0, rs2_p, rd_p, OP_FUNCT3_OR, rd_p, OP_OP);           // C.OR
+                        case 3: return enc_r(0, rs2_p, rd_p, OP_FUNCT3_AND, rd_p, OP_OP);          // C.AND
+                    }
+                    break;
+                case 1:
+                    switch((c >> 5) & 0x3) {
+                        case 0: return enc_r(0x20, rs2_p, rd_p, OP32_FUNCT3_ADDW_SUBW, rd_p, OP_OP32);  // C.SUBW
+                        case 1: return enc_r(0, rs2_p, rd_p, OP32_FUNCT3_ADDW_SUBW, rd_p, OP_OP32);     // C.ADDW
+                    }
+                    break;
+            }
+            return 0;
+        case 5: return enc_j(imm_cj(c), 0);                                         // C.J
+        case 6: return enc_b(imm_cb(c), 0, rd_p, BRANCH_FUNCT3_BEQ);                // C.BEQZ
+        case 7: return enc_b(imm_cb(c), 0, rd_p, BRANCH_FUNCT3_BNE);                // C.BNEZ
+    }
+    return 0;
+}
+
+static uint32_t expand_quadrant2(uint16_t c) {
+    int rd = RD_RS1(c), rs2 = RS2(c);
+    switch(c >> 13) {
+        case 0: return enc_i(bits(c, 12, 1, 5) | bits(c, 2, 5, 0), rd, OP_IMM_FUNCT3_SLLI, rd, OP_IMM);  // C.SLLI
+        case 1: return enc_i(bits(c, 12, 1, 5) | bits(c, 5, 2, 3) | bits(c, 2, 3, 6), 2, LOAD_FUNCT3_LD, rd, OP_LOAD_FP);  // C.FLDSP
+        case 2:     // C.LWSP
+            return rd ? enc_i(bits(c, 12, 1, 5) | bits(c, 4, 3, 2) | bits(c, 2, 2, 6), 2, LOAD_FUNCT3_LW, rd, OP_LOAD) : 0;
+        case 3:     // C.LDSP
+            return rd ? enc_i(bits(c, 12, 1, 5) | bits(c, 5, 2, 3) | bits(c, 2, 3, 6), 2, LOAD_FUNCT3_LD, rd, OP_LOAD) : 0;
+        case 4:
+            if(!(c & 0x1000)) {
+                if(rs2 == 0) {  // C.JR
+                    return rd ? enc_i(0, rd, 0, 0, OP_JALR) : 0;
+                }
+                return enc_r(0, rs2, 0, OP_FUNCT3_ADD_SUB, rd, OP_OP);             // C.MV
+            }
+            if(rs2 == 0) {
+                return rd ? enc_i(0, rd, 0, 1, OP_JALR) : 0x00100073;              // C.JALR, C.EBREAK
+            }
+            return enc_r(0, rs2, rd, OP_FUNCT3_ADD_SUB, rd, OP_OP);                // C.ADD
+        case 5: return enc_s(bits(c, 10, 3, 3) | bits(c, 7, 3, 6), rs2, 2, STORE_FUNCT3_SD, OP_STORE_FP);  // C.FSDSP
+        case 6: return enc_s(bits(c, 9, 4, 2) | bits(c, 7, 2, 6), rs2, 2, STORE_FUNCT3_SW, OP_STORE);      // C.SWSP
+        case 7: return enc_s(bits(c, 10, 3, 3) | bits(c, 7, 3, 6), rs2, 2, STORE_FUNCT3_SD, OP_STORE);     // C.SDSP
+    }
+    return 0;
+}
+
+uint32_t rvc_expand(uint16_t insn) {
+    switch(insn & 0x3) {
+        case 0: return expand_quadrant0(insn);
+        case 1: return expand_quadrant1(insn);
+        case 2: return expand_quadrant2(insn);
+    }
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef __RVC_H
+#define __RVC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Instructions whose low two bits aren't both set are 16 bits long */
+static inline bool insn_compressed(uint32_t insn) {
+    return (insn & 0x3) != 0x3;
+}
+
+static inline int insn_length(uint32_t insn) {
+    return insn_compressed(insn) ? 2 : 4;
+}
+
+/* Every RV64C instruction is a shorter encoding of a 32-bit one. Returns
+   that instruction, or 0 (which is illegal in both encodings) for reserved
+   and illegal ones. */
+uint32_t rvc_expand(uint16_t insn);
+
+#endif
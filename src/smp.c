@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "smp.h"
+#include "block.h"
+#include "machine.h"
+#include "numa.h"
+
+void smp_init(CPU *harts, int num_harts) {
+    for(int i = 0; i < num_harts; i++) {
+        cpu_reset(&harts[i]);
+        harts[i].hartid = i;
+    }
+}
+
+/* A parked hart sleeps on its wakeup count, which only moves while it is
+   parked, so that waking is free for harts that are running. Both sides
+   write their half before reading the other's: a hart that parks after an
+   interrupt became pending sees it in mip, and one that parked before is
+   seen parked. */
+void smp_set_pending(CPU *cpu, uint64_t bits, bool pending) {
+    if(!pending) {
+        atomic_fetch_and(&cpu->mip, ~bits);
+    } else if(~atomic_fetch_or(&cpu->mip, bits) & bits) {
+        smp_request_exit(cpu, EXIT_INTERRUPT);
+    }
+}
+
+void smp_request_exit(CPU *cpu, uint32_t reasons) {
+    atomic_fetch_or(&cpu->exit_request, reasons);
+    smp_kick(cpu);
+}
+
+void smp_kick(CPU *cpu) {
+    if(atomic_load(&cpu->parked)) {
+        atomic_fetch_add(&cpu->wakeups, 1);
+        syscall(SYS_futex, &cpu->wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+void smp_park(CPU *cpu, const struct timespec *deadline) {
+    uint32_t wakeups = atomic_load(&cpu->wakeups);
+    atomic_store(&cpu->parked, true);
+    if(!(atomic_load(&cpu->mip) & cpu->mie) && !(atomic_load(&cpu->exit_request) & EXIT_STOP)) {
+        /* The bitset form takes an absolute CLOCK_MONOTONIC deadline */
+        syscall(SYS_futex, &cpu->wakeups, FUTEX_WAIT_BITSET_PRIVATE, wakeups, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    }
+    atomic_store(&cpu->parked, false);
+}
+
+typedef struct {
+    CPU *cpu;
+    uint64_t count;
+} HartThread;
+
+static void *hart_thread(void *arg) {
+    HartThread *t = arg;
+    block_run(t->cpu, t->count);
+    block_thread_exit();
+    return NULL;
+}
+
+bool smp_run(CPU *harts, int num_harts, uint64_t count) {
+
+    if(num_harts == 1) {
+        block_run(harts, count);
+        return true;
+    }
+
+    /* With NUMA nodes, each hart's thread is kept on the CPUs of its own */
+    uint64_t nodes = harts[0].machine->numa_nodes;
+    pthread_t threads[SMP_MAX_HARTS];
+    HartThread args[SMP_MAX_HARTS];
+    int started = 0;
+    while(started < num_harts && started < SMP_MAX_HARTS) {
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+        pthread_attr_init(&attr);
+        if(nodes && numa_hart_cpus(nodes, started, &cpus)) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        args[started] = (HartThread){&harts[started], count};
+        int error = pthread_create(&threads[started], &attr, hart_thread, &args[started]);
+        pthread_attr_destroy(&attr);
+        if(error) {
+            break;
+        }
+        started++;
+    }
+
+    for(int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return started == num_harts;
+
+}
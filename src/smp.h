@@ -0,0 +1,49 @@
+#ifndef __SMP_H
+#define __SMP_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "cpu.h"
+
+#define SMP_MAX_HARTS       64
+
+/* Resets every hart, numbering them from 0. How many harts share guest
+   memory is the machine's num_harts. */
+void smp_init(CPU *harts, int num_harts);
+
+/* Runs at least `count` instructions on each hart. Every hart gets its own
+   host thread, except for a single hart which runs on the calling one. */
+bool smp_run(CPU *harts, int num_harts, uint64_t count);
+
+/* Sets or clears pending bits in a hart's mip from any thread. Something
+   newly pending makes the hart look at its interrupts at its next block
+   boundary, and wakes it if it is parked in WFI. */
+void smp_set_pending(CPU *cpu, uint64_t bits, bool pending);
+
+/* Asks a hart to leave straight-line execution for EXIT_* `reasons`, from
+   any thread. A parked hart is woken. */
+void smp_request_exit(CPU *cpu, uint32_t reasons);
+
+/* Wakes a parked hart to have another look at its interrupts */
+void smp_kick(CPU *cpu);
+
+/* Parks the calling hart's thread until an interrupt enabled in mie is
+   pending, the hart is asked to stop, another thread kicks it, or
+   CLOCK_MONOTONIC reaches `deadline` if there is one. It can also come
+   back early, like WFI. */
+void smp_park(CPU *cpu, const struct timespec *deadline);
+
+/* Guest loads and stores are plain host accesses, so RVWMO is enforced with
+   host fences. A TSO host only needs real work for ordering stores before
+   later loads; everything else is a compiler barrier there. */
+static inline void smp_fence(void) {
+    atomic_thread_fence(memory_order_acq_rel);
+}
+
+static inline void smp_fence_sc(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+#endif
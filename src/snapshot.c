@@ -0,0 +1,230 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "bus.h"
+#include "block.h"
+#include "mmu.h"
+#include "loader.h"
+
+static bool write_all(int fd, const void *src, uint64_t size, uint64_t offset) {
+    const uint8_t *p = src;
+    while(size) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if(n <= 0) {
+            return false;
+        }
+        p += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool page_is_zero(const uint8_t *page) {
+    const uint64_t *words = (const uint64_t *)page;
+    for(int i = 0; i < PAGE_SIZE / 8; i++) {
+        if(words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Writes runs of non-zero pages, skipping over the rest */
+static bool save_ram(const Machine *m, int fd, uint64_t offset) {
+    uint64_t run = 0;
+    for(uint64_t page = 0; page <= m->ram_size; page += PAGE_SIZE) {
+        if(page < m->ram_size && !page_is_zero(m->ram + page)) {
+            continue;
+        }
+        if(run < page && !write_all(fd, m->ram + run, page - run, offset + run)) {
+            return false;
+        }
+        run = page + PAGE_SIZE;
+    }
+    return ftruncate(fd, offset + m->ram_size) == 0;
+}
+
+bool snapshot_save(const char *path, Machine *m) {
+
+    CPU *harts = m->harts;
+    int num_harts = m->num_harts;
+    Clint *clint = &m->clint;
+
+    /* RAM may itself be mapped from the file being replaced, so the new
+       snapshot is written next to it and renamed over it at the end */
+    char tmp[PATH_MAX];
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return false;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+
+    SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .num_harts = num_harts,
+        .ram_size = m->ram_size,
+        .mtime = clint ? clint_mtime(clint) : 0,
+    };
+    uint64_t harts_size = num_harts * sizeof(SnapshotHart);
+    header.ram_offset = (sizeof(header) + harts_size + sizeof(SnapshotPlic) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    bool ok = write_all(fd, &header, sizeof(header), 0);
+
+    for(int i = 0; ok && i < num_harts; i++) {
+        CPU *cpu = &harts[i];
+        SnapshotHart hart = {
+            .pc = cpu->pc,
+            .priv = cpu->priv,
+            .instret = cpu->instret,
+            .mstatus = cpu->mstatus,
+            .satp = cpu->satp,
+            .mie = cpu->mie,
+            .mip = atomic_load(&cpu->mip),
+            .cycle_offset = cpu->cycle_offset,
+            .mcounteren = cpu->mcounteren,
+            .scounteren = cpu->scounteren,
+            .mtvec = cpu->mtvec,
+            .mepc = cpu->mepc,
+            .mcause = cpu->mcause,
+            .mtval = cpu->mtval,
+            .mscratch = cpu->mscratch,
+            .stvec = cpu->stvec,
+            .sepc = cpu->sepc,
+            .scause = cpu->scause,
+            .stval = cpu->stval,
+            .sscratch = cpu->sscratch,
+            .medeleg = cpu->medeleg,
+            .mideleg = cpu->mideleg,
+            .mtimecmp = clint ? clint_mtimecmp(clint, i) : ~(uint64_t)0,
+            .frm = cpu->frm,
+            .fflags = cpu->fflags,
+            .vl = cpu->vl,
+            .vtype = cpu->vtype,
+            .vstart = cpu->vstart,
+            .vxrm = cpu->vxrm,
+            .vxsat = cpu->vxsat,
+        };
+        memcpy(hart.regs, cpu->regs, sizeof(hart.regs));
+        memcpy(hart.fregs, cpu->fregs, sizeof(hart.fregs));
+        memcpy(hart.vregs, cpu->vregs, sizeof(hart.vregs));
+        ok = write_all(fd, &hart, sizeof(hart), sizeof(header) + i * sizeof(hart));
+    }
+
+    Plic *plic = &m->plic;
+    SnapshotPlic plic_state;
+    pthread_mutex_lock(&plic->lock);
+    memcpy(plic_state.priority, plic->priority, sizeof(plic_state.priority));
+    plic_state.pending = plic->pending;
+    plic_state.claimed = plic->claimed;
+    memcpy(plic_state.enable, plic->enable, sizeof(plic_state.enable));
+    memcpy(plic_state.threshold, plic->threshold, sizeof(plic_state.threshold));
+    pthread_mutex_unlock(&plic->lock);
+    ok = ok && write_all(fd, &plic_state, sizeof(plic_state), sizeof(header) + harts_size);
+
+    ok = ok && save_ram(m, fd, header.ram_offset);
+    ok = !close(fd) && ok && !rename(tmp, path);
+    if(!ok) {
+        unlink(tmp);
+    }
+    return ok;
+
+}
+
+bool snapshot_restore(const char *path, Machine *m) {
+
+    CPU *harts = m->harts;
+    int num_harts = m->num_harts;
+    Clint *clint = &m->clint;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+
+    SnapshotHeader header;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 &&
+              pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+              !memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) &&
+              header.version == SNAPSHOT_VERSION &&
+              header.num_harts == (uint32_t)num_harts &&
+              header.ram_size == m->ram_size &&
+              (uint64_t)st.st_size >= header.ram_offset + m->ram_size;
+
+    for(int i = 0; ok && i < num_harts; i++) {
+        SnapshotHart hart;
+        ok = pread(fd, &hart, sizeof(hart), sizeof(header) + i * sizeof(hart)) == sizeof(hart);
+        if(!ok) {
+            break;
+        }
+        CPU *cpu = &harts[i];
+        memcpy(cpu->regs, hart.regs, sizeof(cpu->regs));
+        cpu->pc = hart.pc;
+        cpu->priv = hart.priv;
+        cpu->instret = hart.instret;
+        cpu->mstatus = hart.mstatus;
+        cpu->satp = hart.satp;
+        cpu->mie = hart.mie;
+        atomic_store(&cpu->mip, hart.mip);
+        cpu->cycle_offset = hart.cycle_offset;
+        cpu->mcounteren = hart.mcounteren;
+        cpu->scounteren = hart.scounteren;
+        cpu->mtvec = hart.mtvec;
+        cpu->mepc = hart.mepc;
+        cpu->mcause = hart.mcause;
+        cpu->mtval = hart.mtval;
+        cpu->mscratch = hart.mscratch;
+        cpu->stvec = hart.stvec;
+        cpu->sepc = hart.sepc;
+        cpu->scause = hart.scause;
+        cpu->stval = hart.stval;
+        cpu->sscratch = hart.sscratch;
+        cpu->medeleg = hart.medeleg;
+        cpu->mideleg = hart.mideleg;
+        memcpy(cpu->fregs, hart.fregs, sizeof(cpu->fregs));
+        cpu->frm = hart.frm;
+        cpu->fflags = hart.fflags;
+        cpu->vl = hart.vl;
+        cpu->vtype = hart.vtype;
+        cpu->vstart = hart.vstart;
+        cpu->vxrm = hart.vxrm;
+        cpu->vxsat = hart.vxsat;
+        memcpy(cpu->vregs, hart.vregs, sizeof(cpu->vregs));
+        cpu->reservation = NULL;
+        tlb_flush(cpu);
+        if(clint) {
+            clint_set_mtimecmp(clint, i, hart.mtimecmp);
+        }
+    }
+    if(ok && clint) {
+        clint_set_mtime(clint, header.mtime);
+    }
+    block_revalidate_all(m);
+
+    /* MEIP and SEIP came back with mip */
+    SnapshotPlic plic_state;
+    ok = ok && pread(fd, &plic_state, sizeof(plic_state), sizeof(header) + num_harts * sizeof(SnapshotHart)) == sizeof(plic_state);
+    if(ok) {
+        Plic *plic = &m->plic;
+        pthread_mutex_lock(&plic->lock);
+        memcpy(plic->priority, plic_state.priority, sizeof(plic->priority));
+        plic->pending = plic_state.pending;
+        plic->claimed = plic_state.claimed;
+        memcpy(plic->enable, plic_state.enable, sizeof(plic->enable));
+        memcpy(plic->threshold, plic_state.threshold, sizeof(plic->threshold));
+        pthread_mutex_unlock(&plic->lock);
+    }
+
+    ok = ok && load_fd(m, fd, header.ram_offset, RAM_BASE, m->ram_size, 0);
+    close(fd);
+    return ok;
+
+}
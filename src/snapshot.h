@@ -0,0 +1,63 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "machine.h"
+
+/* Machine checkpoints. A snapshot holds every hart, the CLINT, the PLIC
+   and all of RAM; RAM starts on a page boundary in the file, so restoring maps it
+   copy-on-write instead of reading it and is cheap however large RAM is.
+   All-zero pages are left as holes, which keeps the file sparse.
+
+   The harts must be stopped for both operations. LR reservations are not
+   saved, so an SC right after a restore fails. */
+
+#define SNAPSHOT_MAGIC      "R5SNAP\0\0"
+#define SNAPSHOT_VERSION    5
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_harts;
+    uint64_t ram_size;
+    uint64_t ram_offset;    // file offset of RAM, page aligned
+    uint64_t mtime;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t regs[32];
+    uint64_t pc;
+    uint64_t priv;
+    uint64_t instret;
+    uint64_t mstatus, satp, mie, mip;
+    uint64_t cycle_offset;
+    uint32_t mcounteren, scounteren;
+    uint64_t mtvec, mepc, mcause, mtval, mscratch;
+    uint64_t stvec, sepc, scause, stval, sscratch;
+    uint64_t medeleg, mideleg;
+    uint64_t mtimecmp;
+    uint64_t fregs[32];
+    uint32_t frm, fflags;
+    uint64_t vl, vtype, vstart;
+    uint32_t vxrm, vxsat;
+    uint8_t vregs[32][VLENB];
+} SnapshotHart;
+
+/* Follows the harts. The levels of the lines belong to the devices, which
+   raise them again. */
+typedef struct {
+    uint32_t priority[PLIC_NUM_SOURCES];
+    uint32_t pending, claimed;
+    uint32_t enable[PLIC_NUM_CONTEXTS];
+    uint32_t threshold[PLIC_NUM_CONTEXTS];
+} SnapshotPlic;
+
+bool snapshot_save(const char *path, Machine *m);
+
+/* Fails unless the snapshot was taken with the same number of harts and
+   the same amount of RAM */
+bool snapshot_restore(const char *path, Machine *m);
+
+#endif
@@ -0,0 +1,157 @@
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#include "smp.h"
+
+/* Records encoded per chunk, and the most bytes they can take: 10 for the
+   address varint of 68 bits and 10 for a count */
+#define CHUNK_RECORDS       4096
+#define MAX_RECORD_BYTES    20
+
+/* How long the recorder sleeps once every ring is empty */
+#define IDLE_NS             200000
+
+__extension__ typedef unsigned __int128 trace_uint128;
+
+static struct {
+    FILE *file;
+    CPU *harts;
+    int num_harts;
+    TraceRing rings[SMP_MAX_HARTS];
+    uint64_t prev[SMP_MAX_HARTS][4];    // previous address of each kind
+    pthread_t thread;
+    atomic_bool stopping;
+    bool failed;
+    uint8_t chunk[2 * 10 + CHUNK_RECORDS * MAX_RECORD_BYTES];
+} recorder;
+
+void trace_wait(TraceRing *ring) {
+    atomic_store_explicit(&ring->tail, ring->pos, memory_order_release);
+    for(;;) {
+        ring->limit = atomic_load_explicit(&ring->head, memory_order_acquire) + TRACE_RING_SIZE;
+        if(ring->pos != ring->limit) {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+static uint8_t *put_varint(uint8_t *p, trace_uint128 value) {
+    do {
+        *p = value & 0x7f;
+        value >>= 7;
+        *p++ |= value ? 0x80 : 0;
+    } while(value);
+    return p;
+}
+
+static uint8_t *put_record(uint8_t *p, uint64_t *prev, const TraceEntry *e) {
+    int kind = e->info & 3;
+    uint64_t delta = e->addr - prev[kind];
+    uint64_t zigzag = delta << 1 ^ -(delta >> 63);
+    int size_log2 = kind == TRACE_BLOCK ? 0 : __builtin_ctzll(e->info >> 2);
+    prev[kind] = e->addr;
+    p = put_varint(p, (trace_uint128)zigzag << 4 | size_log2 << 2 | kind);
+    if(kind == TRACE_BLOCK) {
+        p = put_varint(p, e->info >> 2);
+    }
+    return p;
+}
+
+/* Writes out one chunk of what `hart` has handed over. Returns the number
+   of records in it. */
+static uint64_t drain(int hart) {
+
+    TraceRing *ring = &recorder.rings[hart];
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint64_t n = tail - head < CHUNK_RECORDS ? tail - head : CHUNK_RECORDS;
+    if(!n) {
+        return 0;
+    }
+
+    /* The records go after the room left for the chunk's header */
+    uint8_t *start = recorder.chunk + 2 * 10, *p = start;
+    for(uint64_t i = 0; i < n; i++) {
+        p = put_record(p, recorder.prev[hart], &ring->entries[(head + i) & (TRACE_RING_SIZE - 1)]);
+    }
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+
+    uint8_t header[2 * 10];
+    uint8_t *h = put_varint(put_varint(header, hart), p - start);
+    start -= h - header;
+    memcpy(start, header, h - header);
+    if(fwrite(start, 1, p - start, recorder.file) != (size_t)(p - start)) {
+        recorder.failed = true;
+    }
+    return n;
+
+}
+
+static uint64_t drain_all(void) {
+    uint64_t n = 0;
+    for(int i = 0; i < recorder.num_harts; i++) {
+        n += drain(i);
+    }
+    return n;
+}
+
+static void *thread(void *arg) {
+    (void)arg;
+    while(!atomic_load_explicit(&recorder.stopping, memory_order_relaxed)) {
+        if(!drain_all()) {
+            nanosleep(&(struct timespec){0, IDLE_NS}, NULL);
+        }
+    }
+    return NULL;
+}
+
+bool trace_start(const char *path, CPU *harts, int num_harts) {
+
+    recorder.file = fopen(path, "wb");
+    if(!recorder.file) {
+        return false;
+    }
+    TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, num_harts};
+    bool ok = fwrite(&header, sizeof(header), 1, recorder.file) == 1;
+
+    recorder.harts = harts;
+    recorder.num_harts = num_harts;
+    for(int i = 0; ok && i < num_harts; i++) {
+        TraceRing *ring = &recorder.rings[i];
+        ok = (ring->entries = malloc(TRACE_RING_SIZE * sizeof(TraceEntry))) != NULL;
+        ring->limit = TRACE_RING_SIZE;
+    }
+    if(ok && pthread_create(&recorder.thread, NULL, thread, NULL) == 0) {
+        for(int i = 0; i < num_harts; i++) {
+            harts[i].trace = &recorder.rings[i];
+        }
+        return true;
+    }
+
+    for(int i = 0; i < num_harts; i++) {
+        free(recorder.rings[i].entries);
+    }
+    fclose(recorder.file);
+    return false;
+
+}
+
+bool trace_stop(void) {
+    atomic_store_explicit(&recorder.stopping, true, memory_order_relaxed);
+    pthread_join(recorder.thread, NULL);
+    while(drain_all()) {
+    }
+    for(int i = 0; i < recorder.num_harts; i++) {
+        recorder.harts[i].trace = NULL;
+        free(recorder.rings[i].entries);
+    }
+    bool ok = !recorder.failed;
+    ok &= fclose(recorder.file) == 0;
+    return ok;
+}
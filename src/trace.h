@@ -0,0 +1,109 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/* The execution trace recorder is only built with -DTRACE (make TRACE=1),
+   and records once trace_start() has been called. Each hart appends to a
+   ring of its own that only it writes and only the recorder's thread reads,
+   so neither side takes a lock:
+
+   - every block that ran adds its PC and the number of instructions that
+     retired in it, after its memory accesses;
+   - every guest load, store and atomic adds its virtual address, size and
+     kind, as it is attempted, so the one that faulted is the last before
+     its block.
+
+   Traced harts run an instance of the block engine of their own (see
+   block_run.inc), which leaves blocks that touch memory to the threaded
+   interpreter and doesn't match bulk loops, since neither would see the
+   accesses, while the others keep all of it. Which one a hart runs is
+   decided as block_run() starts, so tracing only starts or stops while the
+   harts are stopped. A hart that gets a whole ring ahead of the recorder
+   waits for it rather than dropping records.
+
+   The file starts with a TraceHeader, followed by chunks of one hart's
+   records: the hart ID and the length of the chunk in bytes, both as
+   LEB128 varints, and then the records. A record is one varint holding the
+   kind in bits 0-1, log2 of the access size in bits 2-3 and the zigzag-
+   encoded difference from the hart's previous address of the same kind in
+   the bits above, which can take up to 68 bits; a block is followed by
+   another varint with its instruction count. The previous addresses start
+   out at 0 and carry across chunks. */
+
+#define TRACE_MAGIC         "R5TRACE\0"
+#define TRACE_VERSION       1
+
+#define TRACE_BLOCK         0
+#define TRACE_LOAD          1
+#define TRACE_STORE         2
+#define TRACE_ATOMIC        3
+
+/* Records per hart */
+#define TRACE_RING_BITS     20
+#define TRACE_RING_SIZE     (1 << TRACE_RING_BITS)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_harts;
+} TraceHeader;
+
+/* addr is the PC or the accessed address. info has the kind in bits 0-1
+   and the count or the size above them. */
+typedef struct {
+    uint64_t addr;
+    uint64_t info;
+} TraceEntry;
+
+typedef struct TraceRing {
+    TraceEntry *entries;
+    _Atomic uint64_t head;  // next record to drain, written by the recorder
+    _Atomic uint64_t tail;  // end of the records handed to the recorder
+
+    /* The hart's own: where it writes next, which runs ahead of tail until
+       the end of the block, and how far it may go before looking at head
+       again */
+    uint64_t pos, limit;
+} TraceRing;
+
+/* Opens `path` and starts recording the harts' execution into it */
+bool trace_start(const char *path, CPU *harts, int num_harts);
+
+/* Writes out what is left once the harts have stopped, and closes the
+   file. Returns false if anything couldn't be written. */
+bool trace_stop(void);
+
+/* Publishes what the hart has written and waits for room */
+void trace_wait(TraceRing *ring);
+
+static inline void trace_push(TraceRing *ring, uint64_t addr, uint64_t info) {
+    if(ring->pos == ring->limit) {
+        trace_wait(ring);
+    }
+    ring->entries[ring->pos & (TRACE_RING_SIZE - 1)] = (TraceEntry){addr, info};
+    ring->pos++;
+}
+
+static inline void trace_access(CPU *cpu, uint64_t vaddr, int size, int kind) {
+    if(cpu->trace) {
+        trace_push(cpu->trace, vaddr, (uint64_t)size << 2 | kind);
+    }
+}
+
+/* Ends a block that started at `pc`, handing its records to the recorder */
+static inline void trace_push_block(TraceRing *ring, uint64_t pc, uint64_t count) {
+    trace_push(ring, pc, count << 2 | TRACE_BLOCK);
+    atomic_store_explicit(&ring->tail, ring->pos, memory_order_release);
+}
+
+static inline void trace_block(CPU *cpu, uint64_t pc, uint64_t count) {
+    if(cpu->trace) {
+        trace_push_block(cpu->trace, pc, count);
+    }
+}
+
+#endif
@@ -0,0 +1,118 @@
+#include "trap.h"
+#include "csr.h"
+#include "mmu.h"
+
+/* Interrupts in the order they are taken when several are pending */
+static const int interrupt_priority[] = {11, 3, 7, 9, 1, 5};
+
+/* The privilege level changes, and with it the permissions the TLB was
+   filled with if pages are translated at all. Blocks are kept for the
+   context they were fetched in (see block_get()). */
+static void set_priv(CPU *cpu, int priv) {
+    if(priv != cpu->priv || (cpu->mstatus & MSTATUS_MPRV)) {
+        cpu->priv = priv;
+        if((cpu->satp >> SATP_MODE_SHIFT) != SATP_MODE_BARE) {
+            tlb_flush(cpu);
+        }
+    }
+}
+
+static void enter(CPU *cpu, uint64_t cause, uint64_t tval, uint64_t pc) {
+
+    uint64_t code = cause & ~CAUSE_INTERRUPT;
+    uint64_t deleg = cause & CAUSE_INTERRUPT ? cpu->mideleg : cpu->medeleg;
+    int from = cpu->priv;
+    uint64_t tvec;
+
+    /* Delegation never moves a trap to a less privileged level than the one
+       it came from */
+    if(from <= PL_SUPERVISOR && ((deleg >> code) & 1)) {
+        cpu->sepc = pc;
+        cpu->scause = cause;
+        cpu->stval = tval;
+        cpu->mstatus &= ~(MSTATUS_SPIE | MSTATUS_SPP);
+        cpu->mstatus |= (cpu->mstatus & MSTATUS_SIE ? MSTATUS_SPIE : 0) | (from == PL_SUPERVISOR ? MSTATUS_SPP : 0);
+        cpu->mstatus &= ~MSTATUS_SIE;
+        tvec = cpu->stvec;
+        set_priv(cpu, PL_SUPERVISOR);
+    } else {
+        cpu->mepc = pc;
+        cpu->mcause = cause;
+        cpu->mtval = tval;
+        cpu->mstatus &= ~(MSTATUS_MPIE | MSTATUS_MPP);
+        cpu->mstatus |= (cpu->mstatus & MSTATUS_MIE ? MSTATUS_MPIE : 0) | (uint64_t)from << 11;
+        cpu->mstatus &= ~MSTATUS_MIE;
+        tvec = cpu->mtvec;
+        set_priv(cpu, PL_MACHINE);
+    }
+
+    /* Vectored mode sends interrupts to BASE + 4 * cause */
+    cpu->pc = (tvec & ~(uint64_t)3) + ((tvec & TVEC_VECTORED) && (cause & CAUSE_INTERRUPT) ? 4 * code : 0);
+
+    /* The handler runs from a fresh reservation */
+    cpu->reservation = NULL;
+
+}
+
+void trap_take(CPU *cpu, uint64_t pc) {
+    cpu->trap_pending = false;
+    enter(cpu, cpu->trap_cause, cpu->trap_tval, pc);
+}
+
+bool trap_interrupt(CPU *cpu) {
+
+    uint64_t pending = atomic_load_explicit(&cpu->mip, memory_order_acquire) & cpu->mie;
+    if(!pending) {
+        return false;
+    }
+
+    /* Interrupts for a level are always enabled below it, and by xIE at
+       it. Those delegated to supervisor mode are never taken in machine
+       mode. */
+    bool m_enabled = cpu->priv < PL_MACHINE || (cpu->mstatus & MSTATUS_MIE);
+    bool s_enabled = cpu->priv < PL_SUPERVISOR || (cpu->priv == PL_SUPERVISOR && (cpu->mstatus & MSTATUS_SIE));
+    uint64_t enabled = (m_enabled ? pending & ~cpu->mideleg : 0);
+    if(!enabled) {
+        enabled = s_enabled ? pending & cpu->mideleg : 0;
+    }
+    if(!enabled) {
+        return false;
+    }
+
+    for(int i = 0; ; i++) {
+        int code = interrupt_priority[i];
+        if(enabled & (1ULL << code)) {
+            enter(cpu, CAUSE_INTERRUPT | code, 0, cpu->pc);
+            return true;
+        }
+    }
+
+}
+
+void trap_return(CPU *cpu, int priv) {
+
+    int to;
+    if(priv == PL_MACHINE) {
+        to = (cpu->mstatus & MSTATUS_MPP) >> 11;
+        cpu->mstatus &= ~(MSTATUS_MIE | MSTATUS_MPP);
+        cpu->mstatus |= (cpu->mstatus & MSTATUS_MPIE ? MSTATUS_MIE : 0) | MSTATUS_MPIE;
+        cpu->pc = cpu->mepc;
+    } else {
+        to = cpu->mstatus & MSTATUS_SPP ? PL_SUPERVISOR : PL_USER;
+        cpu->mstatus &= ~(MSTATUS_SIE | MSTATUS_SPP);
+        cpu->mstatus |= (cpu->mstatus & MSTATUS_SPIE ? MSTATUS_SIE : 0) | MSTATUS_SPIE;
+        cpu->pc = cpu->sepc;
+    }
+
+    /* MPRV only applies to machine mode, and is cleared on the way out */
+    if(to != PL_MACHINE && (cpu->mstatus & MSTATUS_MPRV)) {
+        cpu->mstatus &= ~MSTATUS_MPRV;
+        tlb_flush(cpu);
+    }
+    set_priv(cpu, to);
+
+    /* Interrupts that were pending may be enabled now. xRET ends its
+       block, so the hart takes them right away. */
+    atomic_fetch_or_explicit(&cpu->exit_request, EXIT_INTERRUPT, memory_order_relaxed);
+
+}
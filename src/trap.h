@@ -0,0 +1,72 @@
+#ifndef __TRAP_H
+#define __TRAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+
+/* Exception codes, as found in mcause and scause */
+#define CAUSE_MISALIGNED_FETCH      0
+#define CAUSE_FETCH_ACCESS          1
+#define CAUSE_ILLEGAL_INSN          2
+#define CAUSE_BREAKPOINT            3
+#define CAUSE_MISALIGNED_LOAD       4
+#define CAUSE_LOAD_ACCESS           5
+#define CAUSE_MISALIGNED_STORE      6
+#define CAUSE_STORE_ACCESS          7
+#define CAUSE_ECALL_U               8
+#define CAUSE_ECALL_S               9
+#define CAUSE_ECALL_M               11
+#define CAUSE_FETCH_PAGE_FAULT      12
+#define CAUSE_LOAD_PAGE_FAULT       13
+#define CAUSE_STORE_PAGE_FAULT      15
+
+/* Set in the cause of interrupts, whose codes are the bit numbers in mip */
+#define CAUSE_INTERRUPT             (1ULL << 63)
+
+/* Synchronous exceptions are raised and taken in two steps, so that nothing
+   on the fast path has to look for them:
+
+   - whatever finds the fault (the slow paths of the MMU, the atomics, the
+     FPU and vector unit, the reference interpreter) records it with
+     trap_raise() and returns as if nothing happened, leaving rd and PC
+     alone;
+   - the engine only checks trap_pending after those calls, leaves the
+     block at the instruction that raised it, and calls trap_take() with
+     the instruction's address, which it gets from the block's instruction
+     offsets the same way it gets PC.
+
+   Instructions before it in the block have retired, it and those after it
+   haven't. */
+static inline void trap_raise(CPU *cpu, uint64_t cause, uint64_t tval) {
+    /* An access split into bytes reports the first one that faulted */
+    if(!cpu->trap_pending) {
+        cpu->trap_pending = true;
+        cpu->trap_cause = cause;
+        cpu->trap_tval = tval;
+    }
+}
+
+/* For ops.inc: evaluates a call that may raise an exception and runs
+   `on_trap` if it did */
+#define TRAP_CHECK(cpu, expr, on_trap) __extension__ ({ \
+        __typeof__(expr) result_ = (expr); \
+        if((cpu)->trap_pending) { \
+            on_trap; \
+        } \
+        result_; \
+    })
+
+/* Takes the exception raised by the instruction at `pc`: the privilege
+   level handling it gets its xEPC, xCAUSE and xTVAL, and PC moves to its
+   trap vector. */
+void trap_take(CPU *cpu, uint64_t pc);
+
+/* Takes the highest-priority interrupt that is pending and enabled, if any,
+   before the instruction at PC. Returns true if there was one. */
+bool trap_interrupt(CPU *cpu);
+
+/* MRET and SRET, from a privilege level allowed to execute them */
+void trap_return(CPU *cpu, int priv);
+
+#endif
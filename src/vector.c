@@ -0,0 +1,575 @@
+#include <stddef.h>
+#include <string.h>
+#include "vector.h"
+#include "csr.h"
+#include "mmu.h"
+#include "trap.h"
+
+/* Generic vector types one register wide, for the kernels */
+typedef uint8_t vu8 __attribute__((vector_size(VLENB)));
+typedef uint16_t vu16 __attribute__((vector_size(VLENB)));
+typedef uint32_t vu32 __attribute__((vector_size(VLENB)));
+typedef uint64_t vu64 __attribute__((vector_size(VLENB)));
+typedef int8_t vs8 __attribute__((vector_size(VLENB)));
+typedef int16_t vs16 __attribute__((vector_size(VLENB)));
+typedef int32_t vs32 __attribute__((vector_size(VLENB)));
+typedef int64_t vs64 __attribute__((vector_size(VLENB)));
+
+typedef void (*VectorKernel)(uint8_t *d, const uint8_t *a, const uint8_t *b, size_t n);
+
+enum {
+    K_ADD, K_SUB, K_AND, K_OR, K_XOR,
+    K_MINU, K_MAXU, K_MIN, K_MAX,
+    K_SLL, K_SRL, K_SRA, K_MUL,
+    K_SEQ, K_SNE, K_SLTU, K_SLT,
+    K_SLEU, K_SLE, K_SGTU, K_SGT,
+    K_COUNT
+};
+
+#define ISA generic
+#define ISA_TARGET
+#include "vector_kernels.inc"
+#undef ISA
+#undef ISA_TARGET
+
+#if defined(__x86_64__)
+#define ISA avx2
+#define ISA_TARGET __attribute__((target("avx2")))
+#include "vector_kernels.inc"
+#undef ISA
+#undef ISA_TARGET
+#endif
+
+/* Baseline SSE2 or NEON unless the host has something better */
+static const VectorKernel (*kernels)[4] = generic_kernels;
+
+__attribute__((constructor))
+static void vector_select_kernels(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernels = avx2_kernels;
+    }
+#endif
+}
+
+/* ---- Encoding ---- */
+
+#define FUNCT3_OPIVV    0x0
+#define FUNCT3_OPMVV    0x2
+#define FUNCT3_OPIVI    0x3
+#define FUNCT3_OPIVX    0x4
+#define FUNCT3_OPMVX    0x6
+#define FUNCT3_OPCFG    0x7
+
+#define MOP_UNIT        0x0
+#define MOP_STRIDED     0x2
+
+#define LUMOP_UNIT      0x00
+#define LUMOP_WHOLE     0x08
+#define LUMOP_MASK      0x0b
+#define LUMOP_FIRST     0x10    // fault-only-first
+
+/* Operand forms an OPI/OPM instruction exists in */
+#define FORM_V          0x1
+#define FORM_X          0x2
+#define FORM_I          0x4
+
+/* What an arithmetic funct6 does */
+enum {
+    A_NONE,
+    A_KERNEL,       // vd = kernel(vs2, operand)
+    A_RSUB,         // vd = operand - vs2
+    A_COMPARE,      // mask bits from a comparison kernel
+    A_MERGE,        // vmerge, or vmv.v when unmasked
+    A_REDUCE,       // vd[0] = reduction of vs1[0] and vs2
+    A_MOVE,         // vmv.x.s and vmv.s.x
+    A_MACC,         // vd = +-(operand * vs2) + vd
+    A_MADD          // vd = +-(operand * vd) + vs2
+};
+
+typedef struct {
+    uint8_t action;
+    uint8_t kernel;
+    uint8_t forms;
+    bool negate;    // multiply-adds that subtract the product
+} Arith;
+
+static const Arith opi[64] = {
+    [0x00] = {A_KERNEL, K_ADD, FORM_V | FORM_X | FORM_I},
+    [0x02] = {A_KERNEL, K_SUB, FORM_V | FORM_X},
+    [0x03] = {A_RSUB, K_SUB, FORM_X | FORM_I},
+    [0x04] = {A_KERNEL, K_MINU, FORM_V | FORM_X},
+    [0x05] = {A_KERNEL, K_MIN, FORM_V | FORM_X},
+    [0x06] = {A_KERNEL, K_MAXU, FORM_V | FORM_X},
+    [0x07] = {A_KERNEL, K_MAX, FORM_V | FORM_X},
+    [0x09] = {A_KERNEL, K_AND, FORM_V | FORM_X | FORM_I},
+    [0x0a] = {A_KERNEL, K_OR, FORM_V | FORM_X | FORM_I},
+    [0x0b] = {A_KERNEL, K_XOR, FORM_V | FORM_X | FORM_I},
+    [0x17] = {A_MERGE, 0, FORM_V | FORM_X | FORM_I},
+    [0x18] = {A_COMPARE, K_SEQ, FORM_V | FORM_X | FORM_I},
+    [0x19] = {A_COMPARE, K_SNE, FORM_V | FORM_X | FORM_I},
+    [0x1a] = {A_COMPARE, K_SLTU, FORM_V | FORM_X},
+    [0x1b] = {A_COMPARE, K_SLT, FORM_V | FORM_X},
+    [0x1c] = {A_COMPARE, K_SLEU, FORM_V | FORM_X | FORM_I},
+    [0x1d] = {A_COMPARE, K_SLE, FORM_V | FORM_X | FORM_I},
+    [0x1e] = {A_COMPARE, K_SGTU, FORM_X | FORM_I},
+    [0x1f] = {A_COMPARE, K_SGT, FORM_X | FORM_I},
+    [0x25] = {A_KERNEL, K_SLL, FORM_V | FORM_X | FORM_I},
+    [0x28] = {A_KERNEL, K_SRL, FORM_V | FORM_X | FORM_I},
+    [0x29] = {A_KERNEL, K_SRA, FORM_V | FORM_X | FORM_I},
+};
+
+static const Arith opm[64] = {
+    [0x00] = {A_REDUCE, K_ADD, FORM_V},
+    [0x01] = {A_REDUCE, K_AND, FORM_V},
+    [0x02] = {A_REDUCE, K_OR, FORM_V},
+    [0x03] = {A_REDUCE, K_XOR, FORM_V},
+    [0x04] = {A_REDUCE, K_MINU, FORM_V},
+    [0x05] = {A_REDUCE, K_MIN, FORM_V},
+    [0x06] = {A_REDUCE, K_MAXU, FORM_V},
+    [0x07] = {A_REDUCE, K_MAX, FORM_V},
+    [0x10] = {A_MOVE, 0, FORM_V | FORM_X},
+    [0x25] = {A_KERNEL, K_MUL, FORM_V | FORM_X},
+    [0x29] = {A_MADD, K_MUL, FORM_V | FORM_X, false},
+    [0x2b] = {A_MADD, K_MUL, FORM_V | FORM_X, true},
+    [0x2d] = {A_MACC, K_MUL, FORM_V | FORM_X, false},
+    [0x2f] = {A_MACC, K_MUL, FORM_V | FORM_X, true},
+};
+
+/* ---- vtype ---- */
+
+static inline int vtype_sew_log(uint64_t vtype) {
+    return 3 + ((vtype >> 3) & 0x7);
+}
+
+/* log2(LMUL), from -3 to 3 */
+static inline int vtype_lmul_log(uint64_t vtype) {
+    int vlmul = vtype & 0x7;
+    return vlmul < 4 ? vlmul : vlmul - 8;
+}
+
+static bool vtype_valid(uint64_t vtype) {
+    /* Only vma, vta, vsew and vlmul are defined; vlmul = 4 is reserved,
+       and SEW may not exceed ELEN * LMUL */
+    return !(vtype & ~(uint64_t)0xff) && (vtype & 0x7) != 4 && vtype_sew_log(vtype) <= 6 &&
+           vtype_sew_log(vtype) <= 6 + vtype_lmul_log(vtype);
+}
+
+static inline uint64_t vlmax(int sew_log, int lmul_log) {
+    int shift = lmul_log - sew_log;
+    return shift >= 0 ? (uint64_t)VLEN << shift : (uint64_t)VLEN >> -shift;
+}
+
+static bool vset(CPU *cpu, uint32_t insn) {
+
+    int rd = (insn >> 7) & 0x1f, rs1 = (insn >> 15) & 0x1f, rs2 = (insn >> 20) & 0x1f;
+    uint64_t vtype, avl;
+    if(!(insn >> 31)) {
+        vtype = (insn >> 20) & 0x7ff;               // vsetvli
+    } else if((insn >> 30) == 0x3) {
+        vtype = (insn >> 20) & 0x3ff;               // vsetivli
+    } else if((insn >> 25) == 0x40) {
+        vtype = cpu->regs[rs2];                     // vsetvl
+    } else {
+        return false;
+    }
+
+    if((insn >> 30) == 0x3) {
+        avl = rs1;
+    } else if(rs1 != 0) {
+        avl = cpu->regs[rs1];
+    } else {
+        /* rd = x0 keeps vl, otherwise this asks for VLMAX */
+        avl = rd != 0 ? UINT64_MAX : cpu->vl;
+    }
+
+    if(vtype_valid(vtype)) {
+        uint64_t max = vlmax(vtype_sew_log(vtype), vtype_lmul_log(vtype));
+        cpu->vtype = vtype;
+        cpu->vl = avl < max ? avl : max;
+    } else {
+        cpu->vtype = VTYPE_VILL;
+        cpu->vl = 0;
+    }
+    if(rd != 0) {
+        cpu->regs[rd] = cpu->vl;
+    }
+    return true;
+
+}
+
+/* ---- Register groups and masks ---- */
+
+/* Register groups start at a multiple of their size */
+static inline bool group_aligned(int reg, int lmul_log) {
+    return lmul_log <= 0 || !(reg & ((1 << lmul_log) - 1));
+}
+
+static inline bool mask_bit(const CPU *cpu, int reg, uint64_t i) {
+    return (cpu->vregs[reg][i >> 3] >> (i & 7)) & 1;
+}
+
+static inline void set_mask_bit(CPU *cpu, int reg, uint64_t i, bool value) {
+    uint8_t *byte = &cpu->vregs[reg][i >> 3];
+    *byte = (*byte & ~(1 << (i & 7))) | (uint8_t)value << (i & 7);
+}
+
+/* Whole registers covering the first `elements` elements */
+static inline size_t group_bytes(uint64_t elements, int esz) {
+    return (elements * esz + VLENB - 1) & ~(size_t)(VLENB - 1);
+}
+
+/* Copies the body elements of `result` into the group at `vd`: all of them,
+   or only the active ones under a mask */
+static void commit(CPU *cpu, int vd, const uint8_t *result, int esz, bool masked) {
+    uint8_t *dst = cpu->vregs[vd];
+    uint64_t start = cpu->vstart, end = cpu->vl;
+    if(start >= end) {
+        return;
+    }
+    if(!masked) {
+        memcpy(dst + start * esz, result + start * esz, (end - start) * esz);
+        return;
+    }
+    for(uint64_t i = start; i < end; i++) {
+        if(mask_bit(cpu, 0, i)) {
+            memcpy(dst + i * esz, result + i * esz, esz);
+        }
+    }
+}
+
+/* Fills the first `bytes` of `buf` with the low `esz` bytes of `value` */
+static void splat(uint8_t *buf, uint64_t value, int esz, size_t bytes) {
+    for(size_t i = 0; i < bytes; i += esz) {
+        memcpy(buf + i, &value, esz);
+    }
+}
+
+/* ---- Arithmetic ---- */
+
+/* The identity of each reduction, so inactive elements can be included */
+static uint64_t reduce_identity(int kernel, int sew) {
+    uint64_t sign = (uint64_t)1 << (sew - 1);
+    switch(kernel) {
+        case K_AND:
+        case K_MINU: return UINT64_MAX;
+        case K_MIN: return sign - 1;
+        case K_MAX: return sign;
+        default: return 0;
+    }
+}
+
+static void reduce(CPU *cpu, VectorKernel k, int kernel, int vd, int vs1, int vs2, int esz, bool masked) {
+
+    /* vd[0] is only written when there is at least one element */
+    if(cpu->vl == 0) {
+        return;
+    }
+
+    _Alignas(VLENB) uint8_t elements[8 * VLENB], acc[VLENB], other[VLENB] = {0};
+    size_t bytes = group_bytes(cpu->vl, esz);
+    uint64_t identity = reduce_identity(kernel, esz * 8);
+    memcpy(elements, cpu->vregs[vs2], bytes);
+    for(uint64_t i = 0; i < bytes / esz; i++) {
+        if(i >= cpu->vl || (masked && !mask_bit(cpu, 0, i))) {
+            memcpy(elements + i * esz, &identity, esz);
+        }
+    }
+
+    /* Combine the registers of the group, then fold the lanes in halves */
+    memcpy(acc, elements, VLENB);
+    for(size_t i = VLENB; i < bytes; i += VLENB) {
+        k(acc, acc, elements + i, VLENB);
+    }
+    for(int width = VLENB / 2; width >= esz; width /= 2) {
+        memcpy(other, acc + width, width);
+        k(acc, acc, other, VLENB);
+    }
+    memcpy(other, cpu->vregs[vs1], esz);
+    k(acc, acc, other, VLENB);
+    memcpy(cpu->vregs[vd], acc, esz);
+
+}
+
+static bool arith(CPU *cpu, uint32_t insn) {
+
+    int funct3 = (insn >> 12) & 0x7, funct6 = insn >> 26;
+    int vd = (insn >> 7) & 0x1f, vs1 = (insn >> 15) & 0x1f, vs2 = (insn >> 20) & 0x1f;
+    bool masked = !((insn >> 25) & 1);
+
+    const Arith *a;
+    int form;
+    switch(funct3) {
+        case FUNCT3_OPIVV: a = &opi[funct6]; form = FORM_V; break;
+        case FUNCT3_OPIVX: a = &opi[funct6]; form = FORM_X; break;
+        case FUNCT3_OPIVI: a = &opi[funct6]; form = FORM_I; break;
+        case FUNCT3_OPMVV: a = &opm[funct6]; form = FORM_V; break;
+        case FUNCT3_OPMVX: a = &opm[funct6]; form = FORM_X; break;
+        default: return false;      // floating point
+    }
+    if(a->action == A_NONE || !(a->forms & form) || (cpu->vtype & VTYPE_VILL)) {
+        return false;
+    }
+
+    int sew_log = vtype_sew_log(cpu->vtype), lmul_log = vtype_lmul_log(cpu->vtype);
+    int esz = 1 << (sew_log - 3);
+    VectorKernel k = kernels[a->kernel][sew_log - 3];
+
+    if(a->action == A_MOVE) {
+        /* vmv.x.s and vmv.s.x ignore LMUL and, for the former, vl */
+        if(form == FORM_V && vs1 == 0 && !masked) {
+            uint64_t value = 0;
+            memcpy(&value, cpu->vregs[vs2], esz);
+            if(vd != 0) {
+                int shift = 64 - 8 * esz;
+                cpu->regs[vd] = (int64_t)(value << shift) >> shift;
+            }
+            return true;
+        }
+        if(form == FORM_X && vs2 == 0 && !masked) {
+            if(cpu->vstart < cpu->vl) {
+                memcpy(cpu->vregs[vd], &cpu->regs[vs1], esz);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    /* Reductions take scalars in vs1 and vd; a mask result is a single
+       register; every other operand is a group */
+    if(a->action == A_REDUCE) {
+        if(cpu->vstart != 0 || !group_aligned(vs2, lmul_log)) {
+            return false;
+        }
+        reduce(cpu, k, a->kernel, vd, vs1, vs2, esz, masked);
+        return true;
+    }
+    bool mask_result = a->action == A_COMPARE;
+    if((!mask_result && !group_aligned(vd, lmul_log)) || !group_aligned(vs2, lmul_log) ||
+       (form == FORM_V && !group_aligned(vs1, lmul_log)) || (masked && !mask_result && vd == 0)) {
+        return false;
+    }
+
+    size_t bytes = group_bytes(cpu->vl, esz);
+    _Alignas(VLENB) uint8_t scalar[8 * VLENB], result[8 * VLENB], product[8 * VLENB];
+    const uint8_t *operand = cpu->vregs[vs1];
+    if(form != FORM_V) {
+        /* Shifts take the immediate unsigned, everything else signed */
+        uint64_t value = form == FORM_X ? cpu->regs[vs1] :
+                         a->kernel == K_SLL || a->kernel == K_SRL || a->kernel == K_SRA ? (uint64_t)vs1 :
+                         (uint64_t)(((int64_t)vs1 << 59) >> 59);
+        splat(scalar, value, esz, bytes);
+        operand = scalar;
+    }
+    const uint8_t *src2 = cpu->vregs[vs2], *dest = cpu->vregs[vd];
+
+    switch(a->action) {
+        case A_KERNEL:
+            k(result, src2, operand, bytes);
+            break;
+        case A_RSUB:
+            k(result, operand, src2, bytes);
+            break;
+        case A_MACC:
+        case A_MADD:
+            k(product, operand, a->action == A_MACC ? src2 : dest, bytes);
+            kernels[a->negate ? K_SUB : K_ADD][sew_log - 3](result, a->action == A_MACC ? dest : src2, product, bytes);
+            break;
+        case A_MERGE:
+            /* vmv.v.* requires vs2 = v0 and takes everything from the
+               operand; vmerge takes vs2 where the mask is clear */
+            if(!masked && vs2 != 0) {
+                return false;
+            }
+            memcpy(result, operand, bytes);
+            for(uint64_t i = cpu->vstart; masked && i < cpu->vl; i++) {
+                if(!mask_bit(cpu, 0, i)) {
+                    memcpy(result + i * esz, src2 + i * esz, esz);
+                }
+            }
+            masked = false;
+            break;
+        case A_COMPARE:
+            k(result, src2, operand, bytes);
+            for(uint64_t i = cpu->vstart; i < cpu->vl; i++) {
+                if(!masked || mask_bit(cpu, 0, i)) {
+                    set_mask_bit(cpu, vd, i, result[i * esz]);
+                }
+            }
+            return true;
+    }
+    commit(cpu, vd, result, esz, masked);
+    return true;
+
+}
+
+/* ---- Loads and stores ---- */
+
+/* Moves `size` bytes between guest memory and `buf`, a page at a time while
+   the pages are RAM. Anything else, like MMIO, is accessed one element at a
+   time from there on, starting over at the element the last page ended in,
+   which is also where faults are raised. `size` is a multiple of `esz`.
+   Returns the number of bytes moved before the element that faulted. */
+static uint64_t transfer(CPU *cpu, uint64_t vaddr, uint8_t *buf, uint64_t size, int esz, bool store) {
+    uint64_t moved = 0;
+    while(moved < size) {
+        uint64_t chunk = PAGE_SIZE - (vaddr & (PAGE_SIZE - 1));
+        chunk = chunk < size - moved ? chunk : size - moved;
+        uint8_t *host = mmu_atomic(cpu, vaddr, 1, store ? ACCESS_WRITE : ACCESS_READ);
+        if(!host) {
+            break;
+        }
+#ifdef TRACE
+        /* Elements are recorded in the chunk they end in */
+        for(uint64_t i = moved / esz * esz; i + esz <= moved + chunk; i += esz) {
+            trace_access(cpu, vaddr - moved + i, esz, store ? TRACE_STORE : TRACE_LOAD);
+        }
+#endif
+        if(store) {
+            memcpy(host, buf, chunk);
+            dcache_invalidate(cpu->machine, host - cpu->machine->ram, chunk);
+        } else {
+            memcpy(buf, host, chunk);
+        }
+        vaddr += chunk;
+        buf += chunk;
+        moved += chunk;
+    }
+    uint64_t partial = moved % esz;
+    vaddr -= partial;
+    buf -= partial;
+    moved -= partial;
+    for(; moved < size && !cpu->trap_pending; vaddr += esz, buf += esz, moved += esz) {
+        if(store) {
+            uint64_t value = 0;
+            memcpy(&value, buf, esz);
+            mmu_store(cpu, vaddr, value, esz);
+        } else {
+            uint64_t value = mmu_load(cpu, vaddr, esz);
+            if(!cpu->trap_pending) {
+                memcpy(buf, &value, esz);
+            }
+        }
+    }
+    return cpu->trap_pending ? moved - esz : moved;
+}
+
+static bool memory(CPU *cpu, uint32_t insn, bool store) {
+
+    int width = (insn >> 12) & 0x7, vd = (insn >> 7) & 0x1f, rs1 = (insn >> 15) & 0x1f, rs2 = (insn >> 20) & 0x1f;
+    int mop = (insn >> 26) & 0x3, nf = insn >> 29;
+    bool masked = !((insn >> 25) & 1);
+    int eew_log = width == 0 ? 3 : width - 1;
+    int esz = 1 << (eew_log - 3);
+    uint64_t base = cpu->regs[rs1];
+
+    if((insn >> 28) & 1) {
+        return false;               // mew, for EEW above 64
+    }
+
+    /* Whole registers ignore vtype and vl altogether */
+    if(mop == MOP_UNIT && rs2 == LUMOP_WHOLE) {
+        int regs = nf + 1;
+        if(masked || (regs & (regs - 1)) || !group_aligned(vd, __builtin_ctz(regs))) {
+            return false;
+        }
+        uint64_t start = cpu->vstart * esz;
+        if(start < (uint64_t)regs * VLENB) {
+            cpu->vstart += transfer(cpu, base + start, cpu->vregs[vd] + start, (uint64_t)regs * VLENB - start, esz, store) / esz;
+        }
+        return true;
+    }
+
+    if(cpu->vtype & VTYPE_VILL) {
+        return false;
+    }
+    if(nf != 0) {
+        return false;               // segment loads and stores aren't supported
+    }
+
+    /* Masks are ceil(vl / 8) bytes, loaded like vle8 */
+    if(mop == MOP_UNIT && rs2 == LUMOP_MASK) {
+        uint64_t bytes = (cpu->vl + 7) / 8;
+        if(masked || width != 0) {
+            return false;
+        }
+        if(cpu->vstart < bytes) {
+            cpu->vstart += transfer(cpu, base + cpu->vstart, cpu->vregs[vd] + cpu->vstart, bytes - cpu->vstart, 1, store);
+        }
+        return true;
+    }
+
+    /* The register group scales with EEW / SEW */
+    int emul_log = eew_log - vtype_sew_log(cpu->vtype) + vtype_lmul_log(cpu->vtype);
+    if(emul_log < -3 || emul_log > 3 || !group_aligned(vd, emul_log) || (masked && vd == 0)) {
+        return false;
+    }
+
+    uint64_t stride;
+    if(mop == MOP_UNIT && (rs2 == LUMOP_UNIT || (rs2 == LUMOP_FIRST && !store))) {
+        stride = esz;
+    } else if(mop == MOP_STRIDED) {
+        stride = cpu->regs[rs2];
+    } else {
+        return false;               // indexed loads and stores aren't supported
+    }
+
+    uint8_t *reg = cpu->vregs[vd];
+    if(!masked && stride == (uint64_t)esz) {
+        if(cpu->vstart < cpu->vl) {
+            cpu->vstart += transfer(cpu, base + cpu->vstart * esz, reg + cpu->vstart * esz, (cpu->vl - cpu->vstart) * esz, esz, store) / esz;
+        }
+    } else {
+        for(; cpu->vstart < cpu->vl; cpu->vstart++) {
+            uint64_t i = cpu->vstart;
+            if(!masked || mask_bit(cpu, 0, i)) {
+                uint64_t value = 0, vaddr = base + i * stride;
+                if(store) {
+                    memcpy(&value, reg + i * esz, esz);
+                    mmu_store(cpu, vaddr, value, esz);
+                } else {
+                    value = mmu_load(cpu, vaddr, esz);
+                }
+                if(cpu->trap_pending) {
+                    break;
+                }
+                if(!store) {
+                    memcpy(reg + i * esz, &value, esz);
+                }
+            }
+        }
+    }
+
+    /* Only element 0 of a fault-only-first load traps; a fault further on
+       ends the vector in front of the element instead */
+    if(mop == MOP_UNIT && rs2 == LUMOP_FIRST && cpu->trap_pending && cpu->vstart > 0) {
+        cpu->trap_pending = false;
+        cpu->vl = cpu->vstart;
+    }
+    return true;
+
+}
+
+bool vector_exec(CPU *cpu, uint32_t insn) {
+
+    bool ok = false;
+    if((cpu->mstatus & MSTATUS_VS) != MSTATUS_VS_OFF) {
+        switch(insn & 0x7f) {
+            case OP_LOAD_FP: ok = memory(cpu, insn, false); break;
+            case OP_STORE_FP: ok = memory(cpu, insn, true); break;
+            default: ok = ((insn >> 12) & 0x7) == FUNCT3_OPCFG ? vset(cpu, insn) : arith(cpu, insn); break;
+        }
+    }
+    if(!ok) {
+        trap_raise(cpu, CAUSE_ILLEGAL_INSN, insn);
+        return false;
+    }
+    /* A fault leaves vstart at the element that raised it */
+    if(!cpu->trap_pending) {
+        cpu->vstart = 0;
+    }
+    cpu->mstatus |= MSTATUS_VS_DIRTY;
+    return true;
+
+}
@@ -0,0 +1,38 @@
+#ifndef __VECTOR_H
+#define __VECTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "insn.h"
+
+/* The V extension, with VLEN = 256 and ELEN = 64. Supported are vset{i}vl{i},
+   unit-stride, strided, mask and whole-register loads and stores, and the
+   integer add, sub, logic, shift, min/max, compare, merge, multiply(-add)
+   and single-width reduction instructions. Elementwise operations run as
+   SIMD kernels over whole registers, picked for the host CPU at startup;
+   only masked elements are handled one at a time.
+
+   Tail and masked-off elements are always left undisturbed, which both
+   policies allow. */
+
+#define VTYPE_VILL      (1ULL << 63)
+
+/* True for instructions vector_exec() is responsible for: anything under
+   OP-V, and loads and stores under LOAD-FP/STORE-FP with a vector width */
+static inline bool vector_insn(uint32_t insn) {
+    int opcode = insn & 0x7f, width = (insn >> 12) & 0x7;
+    if(opcode == OP_V) {
+        return true;
+    }
+    return (opcode == OP_LOAD_FP || opcode == OP_STORE_FP) && (width == 0 || width >= 5);
+}
+
+/* Executes a vector instruction without touching PC. Returns false for
+   illegal instructions, including every vector instruction while
+   mstatus.VS is off, after raising the exception. A faulting load or store
+   stops at the element that faulted and leaves its index in vstart. Never
+   writes x0. */
+bool vector_exec(CPU *cpu, uint32_t insn);
+
+#endif
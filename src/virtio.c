@@ -0,0 +1,315 @@
+#include <string.h>
+#include "virtio.h"
+#include "bus.h"
+
+/* Layout of the rings in guest memory */
+#define DESC_SIZE           16
+#define AVAIL_RING          4
+#define USED_RING           4
+#define USED_ELEM_SIZE      8
+
+uint8_t *virtio_host(const VirtioDevice *dev, uint64_t paddr, uint64_t len) {
+    Machine *m = dev->machine;
+    uint64_t offset = paddr - RAM_BASE;
+    return offset < m->ram_size && m->ram_size - offset >= len ? m->ram + offset : NULL;
+}
+
+/* Device writes to RAM, bracketed the same way as a store */
+static void note_write(VirtioDevice *dev, const uint8_t *host, uint64_t len) {
+    bus_note_write(dev->machine, host - dev->machine->ram, len);
+}
+
+static void invalidate(VirtioDevice *dev, const uint8_t *host, uint64_t len) {
+    if(len) {
+        dcache_invalidate(dev->machine, host - dev->machine->ram, len);
+    }
+}
+
+void virtio_prepare_write(VirtioDevice *dev, const VirtioChain *chain) {
+    for(int i = 0; i < chain->count; i++) {
+        if(chain->buffers[i].write) {
+            note_write(dev, chain->buffers[i].host, chain->buffers[i].len);
+        }
+    }
+}
+
+void virtio_finish_write(VirtioDevice *dev, const VirtioChain *chain) {
+    for(int i = 0; i < chain->count; i++) {
+        if(chain->buffers[i].write) {
+            invalidate(dev, chain->buffers[i].host, chain->buffers[i].len);
+        }
+    }
+}
+
+/* Walks the chain starting at `head`; false if it is malformed */
+static bool read_chain(const VirtioDevice *dev, const VirtQueue *q, uint16_t head, VirtioChain *chain) {
+    const uint8_t *table = virtio_host(dev, q->desc, (uint64_t)q->num * DESC_SIZE);
+    if(!table) {
+        return false;
+    }
+    chain->head = head;
+    chain->count = 0;
+    for(uint32_t i = head;;) {
+        if(i >= q->num || chain->count == VIRTIO_MAX_CHAIN) {
+            return false;
+        }
+        uint64_t addr;
+        uint32_t len;
+        uint16_t flags, next;
+        memcpy(&addr, table + i * DESC_SIZE, 8);
+        memcpy(&len, table + i * DESC_SIZE + 8, 4);
+        memcpy(&flags, table + i * DESC_SIZE + 12, 2);
+        memcpy(&next, table + i * DESC_SIZE + 14, 2);
+        uint8_t *host = virtio_host(dev, addr, len);
+        if(!host) {
+            return false;
+        }
+        chain->buffers[chain->count++] = (VirtioBuffer){host, len, flags & VIRTQ_DESC_F_WRITE};
+        if(!(flags & VIRTQ_DESC_F_NEXT)) {
+            return true;
+        }
+        i = next;
+    }
+}
+
+/* The available ring's index, or last_avail if the queue has no entries
+   or the ring isn't in RAM, so that it looks empty */
+static uint16_t avail_idx(const VirtioDevice *dev, const VirtQueue *q) {
+    uint8_t *avail = virtio_host(dev, q->avail, AVAIL_RING + 2 * (uint64_t)q->num);
+    if(!avail || !q->num) {
+        return q->last_avail;
+    }
+    /* The index is published after the ring entries it covers */
+    return atomic_load_explicit((_Atomic uint16_t *)(avail + 2), memory_order_acquire);
+}
+
+bool virtio_pop(VirtioDevice *dev, int queue, VirtioChain *chain) {
+    VirtQueue *q = &dev->queues[queue];
+    for(;;) {
+        if(!q->ready || !(dev->status & VIRTIO_STATUS_DRIVER_OK) || avail_idx(dev, q) == q->last_avail) {
+            return false;
+        }
+        const uint8_t *ring = virtio_host(dev, q->avail, AVAIL_RING + 2 * (uint64_t)q->num) + AVAIL_RING;
+        uint16_t head;
+        memcpy(&head, ring + 2 * (q->last_avail % q->num), 2);
+        q->last_avail++;
+        if(read_chain(dev, q, head, chain)) {
+            return true;
+        }
+        virtio_push(dev, queue, head, 0);
+    }
+}
+
+void virtio_unpop(VirtioDevice *dev, int queue) {
+    dev->queues[queue].last_avail--;
+}
+
+void virtio_put(VirtioDevice *dev, int queue, uint16_t head, uint32_t written) {
+    pthread_mutex_lock(&dev->lock);
+    VirtQueue *q = &dev->queues[queue];
+    uint8_t *used = virtio_host(dev, q->used, USED_RING + USED_ELEM_SIZE * (uint64_t)q->num);
+    if(used && q->num) {
+        uint8_t *elem = used + USED_RING + USED_ELEM_SIZE * (q->used_idx % q->num);
+        uint32_t id = head;
+        note_write(dev, elem, USED_ELEM_SIZE);
+        note_write(dev, used + 2, 2);
+        memcpy(elem, &id, 4);
+        memcpy(elem + 4, &written, 4);
+        invalidate(dev, elem, USED_ELEM_SIZE);
+        q->used_idx++;
+        atomic_store_explicit((_Atomic uint16_t *)(used + 2), q->used_idx, memory_order_release);
+        invalidate(dev, used + 2, 2);
+    }
+    pthread_mutex_unlock(&dev->lock);
+}
+
+void virtio_interrupt(VirtioDevice *dev, int queue) {
+    VirtQueue *q = &dev->queues[queue];
+    uint8_t *avail = virtio_host(dev, q->avail, AVAIL_RING);
+    uint16_t flags = 0;
+    if(avail) {
+        flags = atomic_load_explicit((_Atomic uint16_t *)avail, memory_order_relaxed);
+    }
+    if(flags & VIRTQ_AVAIL_F_NO_INTERRUPT) {
+        return;
+    }
+    pthread_mutex_lock(&dev->lock);
+    atomic_fetch_or_explicit(&dev->interrupt_status, VIRTIO_INT_USED_RING, memory_order_relaxed);
+    plic_set_irq(dev->plic, dev->irq, true);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+void virtio_push(VirtioDevice *dev, int queue, uint16_t head, uint32_t written) {
+    virtio_put(dev, queue, head, written);
+    virtio_interrupt(dev, queue);
+}
+
+static void set_used_flags(VirtioDevice *dev, VirtQueue *q, uint16_t flags) {
+    uint8_t *used = virtio_host(dev, q->used, USED_RING);
+    if(used) {
+        note_write(dev, used, 2);
+        atomic_store_explicit((_Atomic uint16_t *)used, flags, memory_order_relaxed);
+        invalidate(dev, used, 2);
+    }
+}
+
+void virtio_disable_notify(VirtioDevice *dev, int queue) {
+    set_used_flags(dev, &dev->queues[queue], VIRTQ_USED_F_NO_NOTIFY);
+}
+
+bool virtio_enable_notify(VirtioDevice *dev, int queue) {
+    VirtQueue *q = &dev->queues[queue];
+    set_used_flags(dev, q, 0);
+    /* The driver checks the flag after publishing its index, so one of the
+       two sides sees the other's write */
+    atomic_thread_fence(memory_order_seq_cst);
+    return q->ready && (dev->status & VIRTIO_STATUS_DRIVER_OK) && avail_idx(dev, q) != q->last_avail;
+}
+
+/* ---- Registers ---- */
+
+static uint64_t virtio_read(void *opaque, uint64_t offset, int size) {
+
+    VirtioDevice *dev = opaque;
+
+    if(offset >= VIRTIO_MMIO_CONFIG) {
+        return dev->config_read ? dev->config_read(dev, offset - VIRTIO_MMIO_CONFIG, size) : 0;
+    }
+    if(size != 4) {
+        return 0;
+    }
+
+    VirtQueue *q = dev->queue_sel < (uint32_t)dev->num_queues ? &dev->queues[dev->queue_sel] : NULL;
+    switch(offset) {
+        case VIRTIO_MMIO_MAGIC_VALUE: return VIRTIO_MAGIC;
+        case VIRTIO_MMIO_VERSION: return 2;
+        case VIRTIO_MMIO_DEVICE_ID: return dev->device_id;
+        case VIRTIO_MMIO_VENDOR_ID: return VIRTIO_VENDOR;
+        case VIRTIO_MMIO_DEVICE_FEATURES:
+            return dev->device_features_sel < 2 ? (uint32_t)(dev->features >> (32 * dev->device_features_sel)) : 0;
+        case VIRTIO_MMIO_QUEUE_NUM_MAX: return q ? VIRTIO_QUEUE_SIZE : 0;
+        case VIRTIO_MMIO_QUEUE_READY: return q && q->ready;
+        case VIRTIO_MMIO_INTERRUPT_STATUS: return atomic_load_explicit(&dev->interrupt_status, memory_order_relaxed);
+        case VIRTIO_MMIO_STATUS: return dev->status;
+        case VIRTIO_MMIO_CONFIG_GENERATION: return 0;
+        default: return 0;
+    }
+
+}
+
+/* Puts the device back the way it was at power-on. Clearing the status
+   first stops virtio_pop() from taking more chains while the device winds
+   down what it has. */
+static void reset(VirtioDevice *dev) {
+    dev->status = 0;
+    if(dev->reset) {
+        dev->reset(dev);
+    }
+    pthread_mutex_lock(&dev->lock);
+    dev->driver_features = 0;
+    dev->device_features_sel = dev->driver_features_sel = dev->queue_sel = 0;
+    memset(dev->queues, 0, sizeof(dev->queues));
+    atomic_store_explicit(&dev->interrupt_status, 0, memory_order_relaxed);
+    plic_set_irq(dev->plic, dev->irq, false);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+/* Replaces half of a 64-bit address */
+static void set_half(uint64_t *addr, uint64_t value, bool high) {
+    *addr = high ? (*addr & 0xffffffff) | value << 32 : (*addr & ~0xffffffffULL) | value;
+}
+
+static void virtio_write(void *opaque, uint64_t offset, uint64_t value, int size) {
+
+    VirtioDevice *dev = opaque;
+
+    if(size != 4 || offset >= VIRTIO_MMIO_CONFIG) {
+        return;
+    }
+    value &= 0xffffffff;
+
+    /* Queue registers act on the selected queue */
+    VirtQueue *q = dev->queue_sel < (uint32_t)dev->num_queues ? &dev->queues[dev->queue_sel] : NULL;
+    switch(offset) {
+        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+            dev->device_features_sel = value;
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES:
+            if(dev->driver_features_sel < 2) {
+                set_half(&dev->driver_features, value, dev->driver_features_sel);
+                dev->driver_features &= dev->features;
+            }
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+            dev->driver_features_sel = value;
+            break;
+        case VIRTIO_MMIO_QUEUE_SEL:
+            dev->queue_sel = value;
+            break;
+        case VIRTIO_MMIO_QUEUE_NUM:
+            /* Split queues can be any size up to the maximum */
+            if(q && value && value <= VIRTIO_QUEUE_SIZE) {
+                q->num = value;
+            }
+            break;
+        case VIRTIO_MMIO_QUEUE_READY:
+            /* A queue without entries never becomes ready */
+            if(q) {
+                q->ready = (value & 1) && q->num;
+            }
+            break;
+        case VIRTIO_MMIO_QUEUE_NOTIFY:
+            if(value < (uint64_t)dev->num_queues && dev->notify) {
+                dev->notify(dev, value);
+            }
+            break;
+        case VIRTIO_MMIO_INTERRUPT_ACK:
+            pthread_mutex_lock(&dev->lock);
+            if(!(atomic_fetch_and_explicit(&dev->interrupt_status, ~value, memory_order_relaxed) & ~value)) {
+                plic_set_irq(dev->plic, dev->irq, false);
+            }
+            pthread_mutex_unlock(&dev->lock);
+            break;
+        case VIRTIO_MMIO_STATUS:
+            if(value == 0) {
+                reset(dev);
+            } else {
+                dev->status = value;
+            }
+            break;
+        case VIRTIO_MMIO_QUEUE_DESC_LOW:
+        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+            if(q) {
+                set_half(&q->desc, value, offset == VIRTIO_MMIO_QUEUE_DESC_HIGH);
+            }
+            break;
+        case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+        case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+            if(q) {
+                set_half(&q->avail, value, offset == VIRTIO_MMIO_QUEUE_DRIVER_HIGH);
+            }
+            break;
+        case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+        case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+            if(q) {
+                set_half(&q->used, value, offset == VIRTIO_MMIO_QUEUE_DEVICE_HIGH);
+            }
+            break;
+    }
+
+}
+
+bool virtio_init(VirtioDevice *dev, Machine *m, int slot) {
+    if(slot < 0 || slot >= VIRTIO_MAX_SLOTS) {
+        return false;
+    }
+    pthread_mutex_init(&dev->lock, NULL);
+    dev->machine = m;
+    dev->plic = &m->plic;
+    dev->irq = VIRTIO_IRQ_BASE + slot;
+    dev->driver_features = 0;
+    dev->status = 0;
+    memset(dev->queues, 0, sizeof(dev->queues));
+    atomic_init(&dev->interrupt_status, 0);
+    return bus_register_mmio(m, VIRTIO_MMIO_BASE + slot * VIRTIO_MMIO_SIZE, VIRTIO_MMIO_SIZE, virtio_read, virtio_write, dev);
+}
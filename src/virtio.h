@@ -0,0 +1,161 @@
+#ifndef __VIRTIO_H
+#define __VIRTIO_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "plic.h"
+#include "machine.h"
+
+/* The virtio-mmio transport (version 2) with split virtqueues, shared by
+   the virtio devices. Slots follow QEMU's virt machine: slot i is at
+   VIRTIO_MMIO_BASE + i * VIRTIO_MMIO_SIZE and raises PLIC source
+   VIRTIO_IRQ_BASE + i.
+
+   Register accesses come from hart threads and never wait for a device.
+   Devices take requests off their queues and complete them on threads of
+   their own; everything they write to guest memory goes through the dirty
+   tracking and invalidates decoded instructions, like a store would. */
+#define VIRTIO_MMIO_BASE        0x10001000
+#define VIRTIO_MMIO_SIZE        0x1000
+#define VIRTIO_IRQ_BASE         1
+#define VIRTIO_MAX_SLOTS        8
+
+#define VIRTIO_MMIO_MAGIC_VALUE         0x000
+#define VIRTIO_MMIO_VERSION             0x004
+#define VIRTIO_MMIO_DEVICE_ID           0x008
+#define VIRTIO_MMIO_VENDOR_ID           0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_READY         0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW    0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH   0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW    0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH   0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION   0x0fc
+#define VIRTIO_MMIO_CONFIG              0x100
+
+#define VIRTIO_MAGIC            0x74726976
+#define VIRTIO_VENDOR           0x554d4551      // "QEMU"
+
+#define VIRTIO_ID_NET           1
+#define VIRTIO_ID_BLOCK         2
+
+#define VIRTIO_F_VERSION_1      (1ULL << 32)
+
+#define VIRTIO_STATUS_DRIVER_OK 0x4
+#define VIRTIO_STATUS_NEEDS_RESET 0x40
+
+#define VIRTIO_INT_USED_RING    0x1
+
+#define VIRTQ_DESC_F_NEXT       0x1
+#define VIRTQ_DESC_F_WRITE      0x2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 0x1
+#define VIRTQ_USED_F_NO_NOTIFY  0x1
+
+#define VIRTIO_MAX_QUEUES       2
+#define VIRTIO_QUEUE_SIZE       256
+
+/* Longest descriptor chain a device accepts */
+#define VIRTIO_MAX_CHAIN        128
+
+typedef struct {
+    uint32_t num;
+    bool ready;
+    uint64_t desc, avail, used;     // guest physical addresses
+    uint16_t last_avail;            // next available entry to take
+    uint16_t used_idx;
+} VirtQueue;
+
+/* One buffer of a chain, already translated to host memory */
+typedef struct {
+    uint8_t *host;
+    uint32_t len;
+    bool write;                     // device-writable
+} VirtioBuffer;
+
+typedef struct {
+    uint16_t head;
+    int count;
+    VirtioBuffer buffers[VIRTIO_MAX_CHAIN];
+} VirtioChain;
+
+typedef struct VirtioDevice VirtioDevice;
+
+struct VirtioDevice {
+    uint32_t device_id;
+    uint64_t features;              // offered to the driver
+    int num_queues;
+
+    /* How the device fills in the transport. notify() runs on the hart
+       thread that wrote QueueNotify; reset() must wait for requests in
+       flight. */
+    uint64_t (*config_read)(VirtioDevice *dev, uint64_t offset, int size);
+    void (*notify)(VirtioDevice *dev, int queue);
+    void (*reset)(VirtioDevice *dev);
+
+    /* Transport state, written by hart threads */
+    uint64_t driver_features;
+    uint32_t device_features_sel, driver_features_sel;
+    uint32_t queue_sel;
+    uint32_t status;
+    VirtQueue queues[VIRTIO_MAX_QUEUES];
+
+    /* Completions come from device threads */
+    pthread_mutex_t lock;
+    _Atomic uint32_t interrupt_status;
+    Machine *machine;
+    Plic *plic;
+    int irq;
+};
+
+/* Fills in the transport state and maps the device into its slot of the
+   machine, interrupting through the machine's PLIC */
+bool virtio_init(VirtioDevice *dev, Machine *m, int slot);
+
+/* Host address of a range of guest physical memory, if it is all RAM */
+uint8_t *virtio_host(const VirtioDevice *dev, uint64_t paddr, uint64_t len);
+
+/* Takes the next chain the driver made available, or returns false once the
+   queue is empty. Malformed chains are handed back unused and skipped.
+   Only one thread may take chains from a queue. */
+bool virtio_pop(VirtioDevice *dev, int queue, VirtioChain *chain);
+
+/* Hands the last chain taken back to the queue, for a device that turns out
+   to have nothing to put in it yet */
+void virtio_unpop(VirtioDevice *dev, int queue);
+
+/* Bracket the device writing into a chain's device-writable buffers */
+void virtio_prepare_write(VirtioDevice *dev, const VirtioChain *chain);
+void virtio_finish_write(VirtioDevice *dev, const VirtioChain *chain);
+
+/* Returns a chain to the driver with the number of bytes written to it and
+   interrupts. Safe to call from any thread. */
+void virtio_push(VirtioDevice *dev, int queue, uint16_t head, uint32_t written);
+
+/* The two halves of virtio_push(), for devices completing chains in batches
+   with one interrupt at the end. The interrupt is left out if the driver
+   asked for none. */
+void virtio_put(VirtioDevice *dev, int queue, uint16_t head, uint32_t written);
+void virtio_interrupt(VirtioDevice *dev, int queue);
+
+/* Asks the driver not to write QueueNotify while the device is busy with a
+   queue anyway. Enabling notifications again returns true if chains were
+   made available in the meantime, and the device must then carry on with
+   them, since the driver may not have notified. */
+void virtio_disable_notify(VirtioDevice *dev, int queue);
+bool virtio_enable_notify(VirtioDevice *dev, int queue);
+
+#endif
@@ -0,0 +1,274 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "virtio_blk.h"
+
+#define HEADER_SIZE     16
+
+/* One per descriptor head, which the driver can't reuse before the request
+   is completed */
+typedef struct {
+    AioRequest aio;
+    struct VirtioBlk *blk;
+    VirtioChain chain;
+    struct iovec iov[VIRTIO_MAX_CHAIN];
+    uint8_t *status;
+    uint64_t len;           // bytes of data
+    uint32_t written;       // bytes written to the chain, once done
+    bool busy;
+} BlkRequest;
+
+struct VirtioBlk {
+    VirtioDevice dev;
+    int fd;
+    uint64_t capacity;      // in sectors
+    Aio *aio;
+    BlkRequest requests[VIRTIO_QUEUE_SIZE];
+
+    /* Notifications from harts */
+    pthread_t worker;
+    pthread_mutex_t kick_lock;
+    pthread_cond_t kick;
+    bool kicked, stopping;
+
+    /* Held by the worker while it starts requests */
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int inflight;
+};
+
+static void complete(BlkRequest *req, uint8_t status) {
+    *req->status = status;
+    virtio_finish_write(&req->blk->dev, &req->chain);
+    req->busy = false;
+    virtio_push(&req->blk->dev, 0, req->chain.head, req->written);
+}
+
+static void done(AioRequest *aio, int64_t result) {
+    BlkRequest *req = (BlkRequest *)aio;
+    VirtioBlk *blk = req->blk;
+    complete(req, result == (int64_t)(aio->op == AIO_FLUSH ? 0 : req->len) ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+    pthread_mutex_lock(&blk->lock);
+    if(--blk->inflight == 0) {
+        pthread_cond_broadcast(&blk->idle);
+    }
+    pthread_mutex_unlock(&blk->lock);
+}
+
+/* Parses a request and hands it to aio. The header comes first and the
+   status byte last; everything in between is data. */
+static void start(VirtioBlk *blk, const VirtioChain *chain) {
+
+    const VirtioBuffer *header = &chain->buffers[0], *status = &chain->buffers[chain->count - 1];
+    if(chain->count < 2 || header->write || header->len < HEADER_SIZE || !status->write || !status->len ||
+       blk->requests[chain->head].busy) {
+        virtio_push(&blk->dev, 0, chain->head, 0);
+        return;
+    }
+
+    BlkRequest *req = &blk->requests[chain->head];
+    memcpy(&req->chain, chain, sizeof(*chain));
+    req->busy = true;
+    req->status = status->host + status->len - 1;
+    req->len = 0;
+    req->written = 1;
+
+    uint32_t type;
+    uint64_t sector;
+    memcpy(&type, header->host, 4);
+    memcpy(&sector, header->host + 8, 8);
+
+    /* Data buffers must all go the same way */
+    bool reading = type == VIRTIO_BLK_T_IN, consistent = true;
+    int data = chain->count - 2;
+    for(int i = 0; i < data; i++) {
+        const VirtioBuffer *buf = &chain->buffers[i + 1];
+        req->iov[i] = (struct iovec){buf->host, buf->len};
+        req->len += buf->len;
+        consistent &= buf->write == reading;
+    }
+
+    virtio_prepare_write(&req->blk->dev, &req->chain);
+    switch(type) {
+        case VIRTIO_BLK_T_IN:
+        case VIRTIO_BLK_T_OUT:
+            if(!consistent || (!reading && (blk->dev.features & VIRTIO_BLK_F_RO)) ||
+               sector > blk->capacity || req->len > (blk->capacity - sector) * VIRTIO_BLK_SECTOR_SIZE) {
+                complete(req, VIRTIO_BLK_S_IOERR);
+                return;
+            }
+            if(reading) {
+                req->written += req->len;
+            }
+            req->aio = (AioRequest){
+                .op = reading ? AIO_READ : AIO_WRITE,
+                .fd = blk->fd,
+                .offset = sector * VIRTIO_BLK_SECTOR_SIZE,
+                .iov = req->iov,
+                .iovcnt = data,
+                .done = done,
+            };
+            break;
+        case VIRTIO_BLK_T_FLUSH:
+            req->aio = (AioRequest){.op = AIO_FLUSH, .fd = blk->fd, .done = done};
+            break;
+        case VIRTIO_BLK_T_GET_ID:
+            if(data >= 1 && chain->buffers[1].write) {
+                static const char id[VIRTIO_BLK_ID_BYTES] = "r5-virtio-blk";
+                uint32_t n = chain->buffers[1].len < VIRTIO_BLK_ID_BYTES ? chain->buffers[1].len : VIRTIO_BLK_ID_BYTES;
+                memcpy(chain->buffers[1].host, id, n);
+                req->written += n;
+                complete(req, VIRTIO_BLK_S_OK);
+            } else {
+                complete(req, VIRTIO_BLK_S_IOERR);
+            }
+            return;
+        default:
+            complete(req, VIRTIO_BLK_S_UNSUPP);
+            return;
+    }
+
+    blk->inflight++;
+    if(!aio_submit(blk->aio, &req->aio)) {
+        blk->inflight--;
+        req->written = 1;
+        complete(req, VIRTIO_BLK_S_IOERR);
+    }
+
+}
+
+static void *worker(void *arg) {
+    VirtioBlk *blk = arg;
+    VirtioChain chain;
+    pthread_mutex_lock(&blk->kick_lock);
+    while(!blk->stopping) {
+        if(!blk->kicked) {
+            pthread_cond_wait(&blk->kick, &blk->kick_lock);
+            continue;
+        }
+        blk->kicked = false;
+        pthread_mutex_unlock(&blk->kick_lock);
+
+        pthread_mutex_lock(&blk->lock);
+        while(virtio_pop(&blk->dev, 0, &chain)) {
+            start(blk, &chain);
+        }
+        pthread_mutex_unlock(&blk->lock);
+
+        pthread_mutex_lock(&blk->kick_lock);
+    }
+    pthread_mutex_unlock(&blk->kick_lock);
+    return NULL;
+}
+
+/* ---- Transport callbacks ---- */
+
+static uint64_t blk_config_read(VirtioDevice *dev, uint64_t offset, int size) {
+    VirtioBlk *blk = (VirtioBlk *)dev;
+    uint8_t config[24] = {0};
+    uint32_t seg_max = VIRTIO_MAX_CHAIN - 2;
+    memcpy(config, &blk->capacity, 8);
+    memcpy(config + 12, &seg_max, 4);
+    uint64_t value = 0;
+    if(offset < sizeof(config) && sizeof(config) - offset >= (uint64_t)size) {
+        memcpy(&value, config + offset, size);
+    }
+    return value;
+}
+
+/* Runs on a hart thread, so all it does is wake the worker */
+static void blk_notify(VirtioDevice *dev, int queue) {
+    VirtioBlk *blk = (VirtioBlk *)dev;
+    (void)queue;
+    pthread_mutex_lock(&blk->kick_lock);
+    blk->kicked = true;
+    pthread_cond_signal(&blk->kick);
+    pthread_mutex_unlock(&blk->kick_lock);
+}
+
+static void drain(VirtioBlk *blk) {
+    pthread_mutex_lock(&blk->lock);
+    while(blk->inflight) {
+        pthread_cond_wait(&blk->idle, &blk->lock);
+    }
+    pthread_mutex_unlock(&blk->lock);
+}
+
+static void blk_reset(VirtioDevice *dev) {
+    drain((VirtioBlk *)dev);
+}
+
+/* ---- Interface ---- */
+
+VirtioBlk *virtio_blk_create(Machine *m, const char *path, int slot) {
+
+    VirtioBlk *blk = calloc(1, sizeof(VirtioBlk));
+    if(!blk) {
+        return NULL;
+    }
+    bool read_only = false;
+    blk->fd = open(path, O_RDWR);
+    if(blk->fd < 0) {
+        blk->fd = open(path, O_RDONLY);
+        read_only = true;
+    }
+    struct stat st;
+    if(blk->fd < 0 || fstat(blk->fd, &st) != 0 || !(blk->aio = aio_create())) {
+        if(blk->fd >= 0) {
+            close(blk->fd);
+        }
+        free(blk);
+        return NULL;
+    }
+
+    blk->capacity = st.st_size / VIRTIO_BLK_SECTOR_SIZE;
+    for(int i = 0; i < VIRTIO_QUEUE_SIZE; i++) {
+        blk->requests[i].blk = blk;
+    }
+    pthread_mutex_init(&blk->kick_lock, NULL);
+    pthread_cond_init(&blk->kick, NULL);
+    pthread_mutex_init(&blk->lock, NULL);
+    pthread_cond_init(&blk->idle, NULL);
+
+    VirtioDevice *dev = &blk->dev;
+    dev->device_id = VIRTIO_ID_BLOCK;
+    dev->features = VIRTIO_F_VERSION_1 | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_FLUSH | (read_only ? VIRTIO_BLK_F_RO : 0);
+    dev->num_queues = 1;
+    dev->config_read = blk_config_read;
+    dev->notify = blk_notify;
+    dev->reset = blk_reset;
+
+    /* The worker goes through the transport, so it is set up first */
+    if(!virtio_init(dev, m, slot)) {
+        aio_destroy(blk->aio);
+        close(blk->fd);
+        free(blk);
+        return NULL;
+    }
+    if(pthread_create(&blk->worker, NULL, worker, blk) != 0) {
+        /* The slot can't be unmapped, so the device stays behind it, but
+           with no queues for the driver to set up */
+        dev->num_queues = 0;
+        return NULL;
+    }
+    return blk;
+
+}
+
+void virtio_blk_destroy(VirtioBlk *blk) {
+    pthread_mutex_lock(&blk->kick_lock);
+    blk->stopping = true;
+    pthread_cond_signal(&blk->kick);
+    pthread_mutex_unlock(&blk->kick_lock);
+    pthread_join(blk->worker, NULL);
+    drain(blk);
+    aio_destroy(blk->aio);
+    close(blk->fd);
+    free(blk);
+}
+
+const char *virtio_blk_backend(const VirtioBlk *blk) {
+    return aio_backend(blk->aio);
+}
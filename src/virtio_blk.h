@@ -0,0 +1,44 @@
+#ifndef __VIRTIO_BLK_H
+#define __VIRTIO_BLK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "virtio.h"
+#include "aio.h"
+
+/* virtio-blk backed by an image file. Requests are picked up by a worker
+   thread as soon as the driver notifies, and read or written straight
+   between the file and guest memory through aio.h; a hart only ever wakes
+   the worker. Completions interrupt through the PLIC from the I/O threads.
+   The image is opened read-only if it can't be written, and the device
+   then says so. */
+
+#define VIRTIO_BLK_SECTOR_SIZE  512
+
+#define VIRTIO_BLK_F_SEG_MAX    (1ULL << 2)
+#define VIRTIO_BLK_F_RO         (1ULL << 5)
+#define VIRTIO_BLK_F_FLUSH      (1ULL << 9)
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_GET_ID     8
+
+#define VIRTIO_BLK_S_OK         0
+#define VIRTIO_BLK_S_IOERR      1
+#define VIRTIO_BLK_S_UNSUPP     2
+
+#define VIRTIO_BLK_ID_BYTES     20
+
+typedef struct VirtioBlk VirtioBlk;
+
+VirtioBlk *virtio_blk_create(Machine *m, const char *path, int slot);
+
+/* Finishes the requests in flight first. The device stays mapped, so this
+   is only for once the harts have stopped. */
+void virtio_blk_destroy(VirtioBlk *blk);
+
+/* Which aio backend the device ended up with */
+const char *virtio_blk_backend(const VirtioBlk *blk);
+
+#endif
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/if_tun.h>
+#include "virtio_net.h"
+
+/* Packets moved per queue before the thread looks at the other one */
+#define BATCH           VIRTIO_QUEUE_SIZE
+
+static const uint8_t mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+
+struct VirtioNet {
+    VirtioDevice dev;
+    int tap;
+    int kick;               // eventfd written by notify()
+    pthread_t thread;
+    _Atomic bool stopping;
+
+    /* Held by the thread while it has chains out of the queues */
+    pthread_mutex_t lock;
+    bool rx_starved;        // the driver has no receive buffers out; thread only
+};
+
+/* Gathers one direction of a chain's buffers; false if any go the other way */
+static bool gather(const VirtioChain *chain, bool write, struct iovec *iov) {
+    for(int i = 0; i < chain->count; i++) {
+        if(chain->buffers[i].write != write) {
+            return false;
+        }
+        iov[i] = (struct iovec){chain->buffers[i].host, chain->buffers[i].len};
+    }
+    return true;
+}
+
+/* Sends what the driver has queued. Returns the number of packets sent. */
+static int transmit(VirtioNet *net) {
+    VirtioDevice *dev = &net->dev;
+    VirtioChain chain;
+    struct iovec iov[VIRTIO_MAX_CHAIN];
+    int sent = 0;
+    virtio_disable_notify(dev, VIRTIO_NET_TX);
+    do {
+        while(sent < BATCH && virtio_pop(dev, VIRTIO_NET_TX, &chain)) {
+            /* The tap takes the header as it is. A packet it won't take is
+               dropped, as on a real link. */
+            if(gather(&chain, false, iov)) {
+                while(writev(net->tap, iov, chain.count) < 0 && errno == EINTR) {
+                }
+            }
+            virtio_put(dev, VIRTIO_NET_TX, chain.head, 0);
+            sent++;
+        }
+    } while(sent < BATCH && virtio_enable_notify(dev, VIRTIO_NET_TX));
+    return sent;
+}
+
+/* Sets num_buffers, which the tap leaves alone, wherever the header ended up */
+static void set_num_buffers(const VirtioChain *chain) {
+    static const uint8_t one[2] = {1, 0};
+    uint32_t offset = VIRTIO_NET_HDR_SIZE - 2;
+    for(int i = 0, n = 0; i < chain->count && n < 2; i++) {
+        const VirtioBuffer *buf = &chain->buffers[i];
+        for(; n < 2 && offset < buf->len; n++) {
+            buf->host[offset++] = one[n];
+        }
+        offset -= buf->len;
+    }
+}
+
+/* Fills receive buffers with what the tap has waiting. Returns the number
+   of packets received, and notes whether the driver ran out of buffers. */
+static int receive(VirtioNet *net) {
+    VirtioDevice *dev = &net->dev;
+    VirtioChain chain;
+    struct iovec iov[VIRTIO_MAX_CHAIN];
+    int received = 0;
+    net->rx_starved = false;
+    virtio_disable_notify(dev, VIRTIO_NET_RX);
+    while(received < BATCH) {
+        if(!virtio_pop(dev, VIRTIO_NET_RX, &chain)) {
+            /* Waiting for the driver, whose notification brings back the
+               thread */
+            if(!virtio_enable_notify(dev, VIRTIO_NET_RX)) {
+                net->rx_starved = true;
+                return received;
+            }
+            continue;
+        }
+        if(!gather(&chain, true, iov)) {
+            virtio_put(dev, VIRTIO_NET_RX, chain.head, 0);
+            received++;
+            continue;
+        }
+        virtio_prepare_write(dev, &chain);
+        ssize_t n = readv(net->tap, iov, chain.count);
+        if(n >= VIRTIO_NET_HDR_SIZE) {
+            set_num_buffers(&chain);
+        }
+        virtio_finish_write(dev, &chain);
+        if(n < VIRTIO_NET_HDR_SIZE) {
+            virtio_unpop(dev, VIRTIO_NET_RX);
+            break;
+        }
+        virtio_put(dev, VIRTIO_NET_RX, chain.head, n);
+        received++;
+    }
+    /* Notifications only matter once the buffers run out */
+    return received;
+}
+
+static void *thread(void *arg) {
+    VirtioNet *net = arg;
+    bool tx_more = false;
+    while(!atomic_load_explicit(&net->stopping, memory_order_relaxed)) {
+        /* Packets stay in the tap while there is nowhere to put them. The
+           driver doesn't notify for a transmit queue left mid-batch. */
+        struct pollfd fds[2] = {{.fd = net->kick, .events = POLLIN}, {.fd = net->tap, .events = net->rx_starved ? 0 : POLLIN}};
+        if(poll(fds, 2, tx_more ? 0 : -1) < 0) {
+            continue;
+        }
+        if(fds[0].revents & POLLIN) {
+            uint64_t count;
+            if(read(net->kick, &count, sizeof(count)) < 0) {
+                continue;
+            }
+            /* Either queue may have been notified */
+            net->rx_starved = false;
+        }
+        pthread_mutex_lock(&net->lock);
+        int sent = transmit(net);
+        if(sent) {
+            virtio_interrupt(&net->dev, VIRTIO_NET_TX);
+        }
+        tx_more = sent == BATCH;
+        if(!net->rx_starved && receive(net)) {
+            virtio_interrupt(&net->dev, VIRTIO_NET_RX);
+        }
+        pthread_mutex_unlock(&net->lock);
+    }
+    return NULL;
+}
+
+/* ---- Transport callbacks ---- */
+
+static uint64_t net_config_read(VirtioDevice *dev, uint64_t offset, int size) {
+    uint8_t config[8] = {0};
+    uint16_t status = VIRTIO_NET_S_LINK_UP;
+    (void)dev;
+    memcpy(config, mac, 6);
+    memcpy(config + 6, &status, 2);
+    uint64_t value = 0;
+    if(offset < sizeof(config) && sizeof(config) - offset >= (uint64_t)size) {
+        memcpy(&value, config + offset, size);
+    }
+    return value;
+}
+
+/* Runs on a hart thread, so all it does is wake the device's */
+static void net_notify(VirtioDevice *dev, int queue) {
+    VirtioNet *net = (VirtioNet *)dev;
+    uint64_t one = 1;
+    (void)queue;
+    if(write(net->kick, &one, sizeof(one)) < 0) {
+        // the counter is already nonzero, so the thread is on its way
+    }
+}
+
+/* The thread never holds on to a chain outside the lock */
+static void net_reset(VirtioDevice *dev) {
+    VirtioNet *net = (VirtioNet *)dev;
+    pthread_mutex_lock(&net->lock);
+    pthread_mutex_unlock(&net->lock);
+}
+
+/* ---- Interface ---- */
+
+static int open_tap(const char *name) {
+    int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0) {
+        return -1;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    int hdr_size = VIRTIO_NET_HDR_SIZE;
+    if(ioctl(fd, TUNSETIFF, &ifr) < 0 || ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+VirtioNet *virtio_net_create(Machine *m, const char *name, int slot) {
+
+    VirtioNet *net = calloc(1, sizeof(VirtioNet));
+    if(!net) {
+        return NULL;
+    }
+    net->tap = open_tap(name);
+    net->kick = eventfd(0, EFD_CLOEXEC);
+    if(net->tap < 0 || net->kick < 0) {
+        if(net->tap >= 0) {
+            close(net->tap);
+        }
+        if(net->kick >= 0) {
+            close(net->kick);
+        }
+        free(net);
+        return NULL;
+    }
+    pthread_mutex_init(&net->lock, NULL);
+
+    VirtioDevice *dev = &net->dev;
+    dev->device_id = VIRTIO_ID_NET;
+    dev->features = VIRTIO_F_VERSION_1 | VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS;
+    dev->num_queues = 2;
+    dev->config_read = net_config_read;
+    dev->notify = net_notify;
+    dev->reset = net_reset;
+
+    /* The thread may find packets waiting in the tap straight away, so the
+       transport is set up before it starts */
+    if(!virtio_init(dev, m, slot)) {
+        close(net->tap);
+        close(net->kick);
+        pthread_mutex_destroy(&net->lock);
+        free(net);
+        return NULL;
+    }
+    if(pthread_create(&net->thread, NULL, thread, net) != 0) {
+        /* The slot can't be unmapped, so the device stays behind it, but
+           with no queues for the driver to set up */
+        dev->num_queues = 0;
+        return NULL;
+    }
+    return net;
+
+}
+
+void virtio_net_destroy(VirtioNet *net) {
+    atomic_store_explicit(&net->stopping, true, memory_order_relaxed);
+    net_notify(&net->dev, 0);
+    pthread_join(net->thread, NULL);
+    close(net->tap);
+    close(net->kick);
+    free(net);
+}
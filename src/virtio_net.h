@@ -0,0 +1,35 @@
+#ifndef __VIRTIO_NET_H
+#define __VIRTIO_NET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "virtio.h"
+
+/* virtio-net attached to a host tap interface. A thread of the device's own
+   moves packets in batches: everything the driver has queued for sending
+   goes out per wakeup, and everything the tap has waiting comes in, with
+   one interrupt per batch and the driver asked not to notify while the
+   thread is at it. Packets go straight between the guest's buffers and the
+   tap, virtio-net header included, without being copied in between. */
+
+#define VIRTIO_NET_F_MAC        (1ULL << 5)
+#define VIRTIO_NET_F_STATUS     (1ULL << 16)
+
+#define VIRTIO_NET_S_LINK_UP    1
+
+/* The header in front of every packet, with num_buffers */
+#define VIRTIO_NET_HDR_SIZE     12
+
+#define VIRTIO_NET_RX           0
+#define VIRTIO_NET_TX           1
+
+typedef struct VirtioNet VirtioNet;
+
+/* Attaches to the tap interface `name`, creating it if need be */
+VirtioNet *virtio_net_create(Machine *m, const char *name, int slot);
+
+/* The device stays mapped, so this is only for once the harts have
+   stopped */
+void virtio_net_destroy(VirtioNet *net);
+
+#endif